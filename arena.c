@@ -0,0 +1,177 @@
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// One block of an arena, with its space right after. Only the thread filling
+// it touches anything but next.
+typedef struct block {
+  struct block* next;  //< in the list of every block of the arena
+  size_t size;         //< bytes of space
+  size_t used;         //< bytes of space handed out
+  size_t allocs;       //< allocations handed out of it
+  size_t bytes;        //< bytes asked for by them
+  max_align_t space[];
+} block_t;
+
+struct arena {
+  uint64_t id;           //< never the same for two arenas, even once freed
+  pthread_mutex_t lock;  //< protects everything below
+  block_t* blocks;       //< every block, most recent first
+  size_t num_blocks;     //< number of them
+  size_t held;           //< bytes in them
+};
+
+// The blocks this thread is filling for one arena. Every thread allocating
+// from an arena fills blocks of its own, so it only needs the lock to start a
+// new one.
+static _Thread_local struct {
+  uint64_t arena;    //< id of the arena they're from, or 0 for none
+  block_t* nodes;    //< block aligned allocations come from, or NULL
+  block_t* strings;  //< block strings are packed into, or NULL
+} chunk;
+
+// Source of arena ids
+static atomic_uint_fast64_t next_id = 1;
+
+// What every arena has handed out, for arena_totals
+static atomic_size_t total_allocs = 0;
+static atomic_size_t total_bytes = 0;
+static atomic_size_t total_blocks = 0;
+static atomic_size_t total_held = 0;
+
+arena_t* arena_create() {
+  arena_t* arena = malloc(sizeof(arena_t));
+  if (arena == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&arena->lock, NULL);
+  arena->id = atomic_fetch_add(&next_id, 1);
+  arena->blocks = NULL;
+  arena->num_blocks = 0;
+  arena->held = 0;
+  return arena;
+}
+
+/**
+ * Make this thread's blocks the ones it fills for an arena, dropping whatever
+ * it was filling for another. What was left in those stays with their arena.
+ */
+static void claim(arena_t* arena) {
+  if (chunk.arena != arena->id) {
+    chunk.arena = arena->id;
+    chunk.nodes = NULL;
+    chunk.strings = NULL;
+  }
+}
+
+/**
+ * Hand out space from the end of one of this thread's blocks, starting a new
+ * one if it doesn't fit. Only starting a block takes the lock.
+ *
+ * \param arena    Arena to allocate from, claimed by this thread
+ * \param current  This thread's block to allocate from, or NULL. Set to the
+ *                 new block if one is started for it.
+ * \param size     Number of bytes
+ * \param align    Alignment of the space, a power of two
+ * \return         The space, or NULL if out of memory
+ */
+static void* bump(arena_t* arena, block_t** current, size_t size, size_t align) {
+  if (size > SIZE_MAX / 2) {
+    return NULL;
+  }
+  block_t* block = *current;
+  size_t start = block != NULL ? (block->used + align - 1) & ~(align - 1) : 0;
+  if (block == NULL || start + size > block->size) {
+    // Big allocations get a block to themselves, so the current one keeps
+    // whatever room it has left
+    bool own = size > ARENA_BLOCK_SIZE / 4;
+    size_t space = own ? size : ARENA_BLOCK_SIZE;
+    block_t* fresh = malloc(sizeof(block_t) + space);
+    if (fresh == NULL) {
+      return NULL;
+    }
+    fresh->size = space;
+    fresh->used = 0;
+    fresh->allocs = 0;
+    fresh->bytes = 0;
+
+    pthread_mutex_lock(&arena->lock);
+    fresh->next = arena->blocks;
+    arena->blocks = fresh;
+    arena->num_blocks++;
+    arena->held += sizeof(block_t) + space;
+    pthread_mutex_unlock(&arena->lock);
+    atomic_fetch_add(&total_blocks, 1);
+    atomic_fetch_add(&total_held, sizeof(block_t) + space);
+
+    if (!own) {
+      *current = fresh;
+    }
+    block = fresh;
+    start = 0;
+  }
+
+  block->used = start + size;
+  block->allocs++;
+  block->bytes += size;
+  return (uint8_t*)block->space + start;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+  claim(arena);
+  void* space = bump(arena, &chunk.nodes, size, alignof(max_align_t));
+  if (space != NULL) {
+    memset(space, 0, size);
+  }
+  return space;
+}
+
+char* arena_string(arena_t* arena, size_t len) {
+  claim(arena);
+  return bump(arena, &chunk.strings, len + 1, 1);
+}
+
+char* arena_strdup(arena_t* arena, const char* str) {
+  size_t len = strlen(str);
+  char* copy = arena_string(arena, len);
+  if (copy != NULL) {
+    memcpy(copy, str, len + 1);
+  }
+  return copy;
+}
+
+void arena_stats(arena_t* arena, arena_stats_t* stats) {
+  pthread_mutex_lock(&arena->lock);
+  *stats = (arena_stats_t){.blocks = arena->num_blocks, .held = arena->held};
+  for (block_t* block = arena->blocks; block != NULL; block = block->next) {
+    stats->allocs += block->allocs;
+    stats->bytes += block->bytes;
+  }
+  pthread_mutex_unlock(&arena->lock);
+}
+
+void arena_totals(arena_stats_t* stats) {
+  stats->allocs = atomic_load(&total_allocs);
+  stats->bytes = atomic_load(&total_bytes);
+  stats->blocks = atomic_load(&total_blocks);
+  stats->held = atomic_load(&total_held);
+}
+
+void arena_destroy(arena_t* arena) {
+  block_t* block = arena->blocks;
+  while (block != NULL) {
+    block_t* next = block->next;
+    atomic_fetch_add(&total_allocs, block->allocs);
+    atomic_fetch_add(&total_bytes, block->bytes);
+    free(block);
+    block = next;
+  }
+  pthread_mutex_destroy(&arena->lock);
+  free(arena);
+}
@@ -0,0 +1,90 @@
+/**
+ * arena.h
+ *
+ * Allocate the many small pieces of a file tree (entries, lists of entries,
+ * names and paths) out of large blocks, so a tree of any size takes a handful
+ * of mallocs and is freed all at once. Strings are packed together in blocks
+ * of their own, away from the entries that point to them.
+ */
+
+#pragma once
+
+#include <stdlib.h>
+
+// Size of the blocks an arena allocates from. Anything bigger than a quarter
+// of this gets a block of its own.
+#define ARENA_BLOCK_SIZE 0x40000
+
+typedef struct arena arena_t;
+
+// Counts of what arenas have handed out
+typedef struct {
+  size_t allocs;  //< allocations made
+  size_t bytes;   //< bytes asked for
+  size_t blocks;  //< blocks malloc'd to hold them
+  size_t held;    //< bytes in those blocks
+} arena_stats_t;
+
+/**
+ * Create an empty arena. Nothing is allocated until it's used.
+ *
+ * \return  The new arena, or NULL if out of memory
+ */
+arena_t* arena_create();
+
+/**
+ * Allocate zeroed space from an arena, aligned for any type. Safe to call from
+ * several threads at once: each one fills blocks of its own, and only takes a
+ * lock to start a new one.
+ *
+ * \param arena  Arena to allocate from
+ * \param size   Number of bytes
+ * \return       The space, valid until the arena is destroyed, or NULL if out
+ *               of memory
+ */
+void* arena_alloc(arena_t* arena, size_t size);
+
+/**
+ * Allocate space for a string from an arena, packed in with other strings.
+ * Safe to call from several threads at once.
+ *
+ * \param arena  Arena to allocate from
+ * \param len    Length of the string, not counting the terminator
+ * \return       Space for len + 1 chars, or NULL if out of memory
+ */
+char* arena_string(arena_t* arena, size_t len);
+
+/**
+ * Copy a string into an arena.
+ *
+ * \param arena  Arena to allocate from
+ * \param str    String to copy
+ * \return       The copy, or NULL if out of memory
+ */
+char* arena_strdup(arena_t* arena, const char* str);
+
+/**
+ * Get what one arena has handed out so far. Allocations other threads are
+ * making at the same time may or may not be counted, so call it once they're
+ * done.
+ *
+ * \param arena  Arena to look at
+ * \param stats  Set to its counts
+ */
+void arena_stats(arena_t* arena, arena_stats_t* stats);
+
+/**
+ * Get what every arena in this process has handed out so far. Blocks are
+ * counted as soon as they're made, and allocations once the arena they're
+ * from is destroyed.
+ *
+ * \param stats  Set to the totals
+ */
+void arena_totals(arena_stats_t* stats);
+
+/**
+ * Free an arena and everything allocated from it.
+ *
+ * \param arena  Arena to destroy
+ */
+void arena_destroy(arena_t* arena);
@@ -0,0 +1,944 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "compress.h"
+#include "filereader.h"
+#include "message.h"
+#include "pool.h"
+#include "socket.h"
+#include "transfer.h"
+#include "uring.h"
+#include "utils.h"
+
+// Transfers made from start to finish for each shape, which the percentiles of
+// the time to the first file are taken over
+#define BENCH_DEFAULT_RUNS 5
+
+// Microseconds between looks for the first file of a transfer on disk
+#define FIRST_FILE_POLL_US 100
+
+// Sizes of the trees at a scale of 1. Everything but the deep tree fits in
+// the give's memory limit, so it can be read whole like a give without -s.
+#define HUGE_SIZE 0xc000000   //< one file of 192MB
+#define TINY_FILES 100000     //< files of 1 to 256 bytes
+#define TINY_PER_DIR 1000     //< in directories of this many
+#define DEEP_LEVELS 256       //< directories, each inside the last
+#define DEEP_PER_LEVEL 8      //< files of 1 to 16KB in each of them
+#define MIXED_FILES 4000      //< files of every size, in a tree of any shape
+#define MIXED_MAX_DEPTH 8
+
+// Space contents are generated in before they're written
+#define GEN_BUFFER_SIZE 0x100000
+
+// Bytes of contents generated for the tree being measured
+static size_t generated_bytes = 0;
+
+// State of the generator behind every tree, so the same options always make
+// the same trees
+typedef struct {
+  uint64_t state;
+} rng_t;
+
+/**
+ * Get the next 64 random bits, with xorshift64*.
+ */
+static uint64_t rng_next(rng_t* rng) {
+  rng->state ^= rng->state >> 12;
+  rng->state ^= rng->state << 25;
+  rng->state ^= rng->state >> 27;
+  return rng->state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Get a random number from lo to hi, both included.
+ */
+static size_t rng_range(rng_t* rng, size_t lo, size_t hi) {
+  return lo + rng_next(rng) % (hi - lo + 1);
+}
+
+// What text files are made of
+static const char* words[] = {
+    "give", "take",  "file",   "directory", "chunk", "socket", "the",   "of",
+    "and",  "a",     "stream", "transfer",  "port",  "user",   "bytes", "checksum",
+};
+
+/**
+ * Fill space with what a file might hold: words that compress well, or bytes
+ * that don't compress at all.
+ *
+ * \param rng   Generator to use
+ * \param buf   Space to fill
+ * \param len   Number of bytes
+ * \param text  Whether to fill it with text
+ */
+static void fill_contents(rng_t* rng, uint8_t* buf, size_t len, bool text) {
+  size_t filled = 0;
+  while (filled < len) {
+    uint64_t bits = rng_next(rng);
+    if (!text) {
+      size_t n = len - filled < sizeof(bits) ? len - filled : sizeof(bits);
+      memcpy(buf + filled, &bits, n);
+      filled += n;
+      continue;
+    }
+    const char* word = words[bits % (sizeof(words) / sizeof(words[0]))];
+    size_t n = strlen(word);
+    n = len - filled < n ? len - filled : n;
+    memcpy(buf + filled, word, n);
+    filled += n;
+    if (filled < len) {
+      buf[filled++] = (bits >> 32) % 12 == 0 ? '\n' : ' ';
+    }
+  }
+}
+
+/**
+ * Create a file and fill it with generated contents. The same seed, size and
+ * kind always give the same contents.
+ *
+ * \param path  Path of the file to create
+ * \param seed  Seed of its contents
+ * \param size  Size of the file
+ * \param text  Whether it holds text
+ * \param buf   Space of GEN_BUFFER_SIZE bytes to generate contents in
+ * \return      0 if there were no errors, -1 otherwise
+ */
+static int make_file(char* path, uint64_t seed, size_t size, bool text, uint8_t* buf) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  rng_t rng = {seed | 1};
+  size_t written = 0;
+  while (written < size) {
+    size_t len = size - written < GEN_BUFFER_SIZE ? size - written : GEN_BUFFER_SIZE;
+    fill_contents(&rng, buf, len, text);
+    if (write_all(fd, buf, len) == -1) {
+      close(fd);
+      return -1;
+    }
+    written += len;
+  }
+  generated_bytes += size;
+  return close(fd);
+}
+
+/**
+ * Generate one file of HUGE_SIZE random bytes.
+ */
+static int generate_huge(char* dir, double scale, rng_t* rng, uint8_t* buf) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/huge.bin", dir);
+  return make_file(path, rng_next(rng), HUGE_SIZE * scale, false, buf);
+}
+
+/**
+ * Generate TINY_FILES files of up to 256 bytes, TINY_PER_DIR to a directory.
+ */
+static int generate_tiny(char* dir, double scale, rng_t* rng, uint8_t* buf) {
+  size_t count = TINY_FILES * scale;
+  char path[PATH_MAX];
+  for (size_t i = 0; i < count; i++) {
+    if (i % TINY_PER_DIR == 0) {
+      snprintf(path, sizeof(path), "%s/%04zu", dir, i / TINY_PER_DIR);
+      if (mkdir(path, 0755) == -1) {
+        return -1;
+      }
+    }
+    snprintf(path, sizeof(path), "%s/%04zu/%06zu.txt", dir, i / TINY_PER_DIR, i);
+    if (make_file(path, rng_next(rng), rng_range(rng, 1, 256), true, buf) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Generate DEEP_LEVELS directories nested inside each other, with
+ * DEEP_PER_LEVEL files of up to 16KB in each.
+ */
+static int generate_deep(char* dir, double scale, rng_t* rng, uint8_t* buf) {
+  size_t per_level = DEEP_PER_LEVEL * scale > 1 ? DEEP_PER_LEVEL * scale : 1;
+  char path[PATH_MAX];
+  char file_path[PATH_MAX + 32];
+  snprintf(path, sizeof(path), "%s", dir);
+  for (size_t level = 0; level < DEEP_LEVELS; level++) {
+    for (size_t i = 0; i < per_level; i++) {
+      snprintf(file_path, sizeof(file_path), "%s/f%zu", path, i);
+      bool text = rng_next(rng) % 2 == 0;
+      if (make_file(file_path, rng_next(rng), rng_range(rng, 1, 0x4000), text, buf) == -1) {
+        return -1;
+      }
+    }
+    size_t len = strlen(path);
+    if (len + 3 >= sizeof(path)) {
+      break;
+    }
+    strcpy(path + len, "/d");
+    if (mkdir(path, 0755) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Generate MIXED_FILES files with sizes spread like a real home directory:
+ * mostly small, some of a few hundred KB, and a handful of several MB. Half
+ * are text, a few repeat an earlier file, and they sit in a tree of
+ * directories of random shape.
+ */
+static int generate_mixed(char* dir, double scale, rng_t* rng, uint8_t* buf) {
+  size_t count = MIXED_FILES * scale;
+  typedef struct {
+    uint64_t seed;
+    size_t size;
+    bool text;
+  } made_t;
+  made_t* made = malloc((count + 1) * sizeof(made_t));
+  char** dirs = malloc((count + 1) * sizeof(char*));
+  size_t* depths = malloc((count + 1) * sizeof(size_t));
+  if (made == NULL || dirs == NULL || depths == NULL) {
+    free(made);
+    free(dirs);
+    free(depths);
+    return -1;
+  }
+  dirs[0] = strdup(dir);
+  depths[0] = 0;
+  size_t num_dirs = dirs[0] != NULL ? 1 : 0;
+
+  int rc = num_dirs == 1 ? 0 : -1;
+  char path[PATH_MAX];
+  for (size_t i = 0; i < count && rc == 0; i++) {
+    // Now and then, start a new directory inside one there is
+    size_t parent = rng_range(rng, 0, num_dirs - 1);
+    if (rng_next(rng) % 10 == 0 && depths[parent] < MIXED_MAX_DEPTH) {
+      snprintf(path, sizeof(path), "%s/dir%zu", dirs[parent], num_dirs);
+      if (mkdir(path, 0755) == -1 || (dirs[num_dirs] = strdup(path)) == NULL) {
+        rc = -1;
+        break;
+      }
+      depths[num_dirs] = depths[parent] + 1;
+      parent = num_dirs++;
+    }
+
+    made_t* file = &made[i];
+    uint64_t pick = rng_next(rng) % 1000;
+    if (i > 0 && pick < 30) {
+      *file = made[rng_range(rng, 0, i - 1)];
+    } else {
+      pick = rng_next(rng) % 1000;
+      if (pick < 700) {
+        file->size = rng_range(rng, 0, 0x1000);
+      } else if (pick < 950) {
+        file->size = rng_range(rng, 0x1000, 0x10000);
+      } else if (pick < 998) {
+        file->size = rng_range(rng, 0x10000, 0x100000);
+      } else {
+        file->size = rng_range(rng, 0x100000, 0x800000);
+      }
+      file->seed = rng_next(rng);
+      file->text = rng_next(rng) % 2 == 0;
+    }
+    snprintf(path, sizeof(path), "%s/file%zu%s", dirs[parent], i, file->text ? ".txt" : ".bin");
+    rc = make_file(path, file->seed, file->size, file->text, buf);
+  }
+
+  for (size_t i = 0; i < num_dirs; i++) {
+    free(dirs[i]);
+  }
+  free(made);
+  free(dirs);
+  free(depths);
+  return rc;
+}
+
+// A kind of tree to measure
+typedef struct {
+  const char* name;
+  int (*generate)(char* dir, double scale, rng_t* rng, uint8_t* buf);
+} shape_t;
+
+static const shape_t shapes[] = {
+    {"huge", generate_huge},
+    {"tiny", generate_tiny},
+    {"deep", generate_deep},
+    {"mixed", generate_mixed},
+};
+#define NUM_SHAPES (sizeof(shapes) / sizeof(shapes[0]))
+
+// What one phase of the benchmark took
+typedef struct {
+  double seconds;         //< wall clock time, or the median of every run
+  double cpu_seconds;     //< user and system time of every thread
+  size_t peak_rss;        //< most memory resident at once during it, in KB
+  size_t read_syscalls;   //< reads of any kind made, from /proc/self/io
+  size_t write_syscalls;  //< writes of any kind made
+  size_t socket_reads;    //< syscalls made on the sockets, as counted by conn
+  size_t socket_writes;
+  double first_p50;  //< median seconds until the first file was on disk, or -1
+  double first_p99;
+} phase_t;
+
+// Everything measured for one shape
+typedef struct {
+  const char* shape;
+  size_t files;
+  size_t directories;
+  size_t bytes;
+  bool streamed;  //< read with -s, since it didn't fit in memory
+  phase_t read;
+  phase_t transfer;
+  phase_t write;
+  phase_t end_to_end;
+} result_t;
+
+// State of the process when a phase started
+typedef struct {
+  struct timespec start;
+  double cpu;
+  size_t syscr;
+  size_t syscw;
+} probe_t;
+
+/**
+ * Get the number of read and write syscalls this process has made.
+ */
+static void read_syscalls(size_t* syscr, size_t* syscw) {
+  *syscr = 0;
+  *syscw = 0;
+  FILE* io = fopen("/proc/self/io", "r");
+  if (io == NULL) {
+    return;
+  }
+  char line[128];
+  while (fgets(line, sizeof(line), io) != NULL) {
+    sscanf(line, "syscr: %zu", syscr);
+    sscanf(line, "syscw: %zu", syscw);
+  }
+  fclose(io);
+}
+
+/**
+ * Get the most memory this process has had resident since the peak was last
+ * reset, in KB.
+ */
+static size_t read_peak_rss() {
+  size_t peak = 0;
+  FILE* status = fopen("/proc/self/status", "r");
+  if (status == NULL) {
+    return 0;
+  }
+  char line[128];
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (sscanf(line, "VmHWM: %zu kB", &peak) == 1) {
+      break;
+    }
+  }
+  fclose(status);
+  return peak;
+}
+
+/**
+ * Get the user and system time every thread of this process has used.
+ */
+static double cpu_seconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Start measuring a phase. The peak memory is reset so it only covers the
+ * phase, where the kernel allows it.
+ */
+static void probe_start(probe_t* probe) {
+  // If it can't be reset, the peak covers everything before the phase too
+  int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (fd != -1) {
+    write(fd, "5", 1);
+    close(fd);
+  }
+  read_syscalls(&probe->syscr, &probe->syscw);
+  probe->cpu = cpu_seconds();
+  clock_gettime(CLOCK_MONOTONIC, &probe->start);
+}
+
+/**
+ * Finish measuring a phase, filling out everything but the socket counts.
+ */
+static void probe_stop(probe_t* probe, phase_t* phase) {
+  phase->seconds = seconds_since(&probe->start);
+  phase->cpu_seconds = cpu_seconds() - probe->cpu;
+  phase->peak_rss = read_peak_rss();
+  size_t syscr, syscw;
+  read_syscalls(&syscr, &syscw);
+  phase->read_syscalls = syscr - probe->syscr;
+  phase->write_syscalls = syscw - probe->syscw;
+  phase->first_p50 = -1;
+  phase->first_p99 = -1;
+}
+
+// The giving side of a transfer over loopback, run on a thread of its own
+typedef struct {
+  int listen_fd;
+  file_t* file;
+  compress_cache_t* cache;
+  uint64_t features;
+  size_t writes;  //< set to the syscalls it made on its socket
+  int rc;         //< set to what send_file returned
+} giver_t;
+
+/**
+ * Accept one taker and send it the file, like a give does once the taker has
+ * asked for it.
+ *
+ * \param arg  The giver
+ */
+static void* give_one(void* arg) {
+  giver_t* giver = arg;
+  giver->rc = -1;
+  giver->writes = 0;
+  int fd = accept4(giver->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+  conn_t conn;
+  if (conn_init(&conn, fd) == -1) {
+    close(fd);
+    return NULL;
+  }
+  resume_t start = {.give_id = 1};
+  stripe_t stripe = {0};
+  if (recv_hello(&conn) == 0) {
+    giver->rc = send_file(&conn, giver->file, giver->cache, giver->features, &start, NULL, &stripe);
+  }
+  giver->writes = conn.writes;
+  conn_free(&conn);
+  close(fd);
+  return NULL;
+}
+
+/**
+ * Connect to the giver over loopback and get past the handshake.
+ *
+ * \param port  Port the giver listens on
+ * \param conn  Connection to set up
+ * \return      0 if there were no errors, -1 otherwise
+ */
+static int connect_loopback(unsigned short port, conn_t* conn) {
+  int fd = socket_connect("127.0.0.1", port);
+  if (fd == -1) {
+    return -1;
+  }
+  if (conn_init(conn, fd) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (send_hello(conn) == -1) {
+    conn_free(conn);
+    close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+// Looks for the first regular file of a transfer on disk, in full
+typedef struct {
+  char* path;              //< where it ends up
+  size_t size;             //< how big it is
+  struct timespec* start;  //< when the transfer started
+  atomic_bool done;        //< set once the transfer is over
+  double seconds;          //< set to when it was there, or -1 if it never was
+} watch_t;
+
+/**
+ * Look for the first file until it's there or the transfer is over.
+ *
+ * \param arg  The watch
+ */
+static void* watch_first_file(void* arg) {
+  watch_t* watch = arg;
+  watch->seconds = -1;
+  while (true) {
+    // Look once more after the transfer is over, in case it was quick
+    bool done = atomic_load(&watch->done);
+    struct stat st;
+    if (stat(watch->path, &st) == 0 && st.st_size == watch->size) {
+      watch->seconds = seconds_since(watch->start);
+      return NULL;
+    }
+    if (done) {
+      return NULL;
+    }
+    usleep(FIRST_FILE_POLL_US);
+  }
+}
+
+/**
+ * Add the path of an entry of a flat tree to the end of a path, one name at a
+ * time from the top down.
+ */
+static void append_path(flat_t* flat, size_t index, char* path, size_t cap) {
+  if (index != 0) {
+    append_path(flat, flat->entries[index].parent, path, cap);
+  }
+  size_t len = strlen(path);
+  snprintf(path + len, cap - len, "/%s", flat->names + flat->entries[index].name);
+}
+
+/**
+ * Sort doubles in place, smallest first.
+ */
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Get a percentile of sorted values, by nearest rank.
+ */
+static double percentile(double* sorted, int count, int pct) {
+  int rank = (pct * count + 99) / 100;
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * Measure one shape: generate it, then time reading it, sending and receiving
+ * it into memory, writing what was received, and whole transfers to disk.
+ *
+ * \param shape    Shape to measure
+ * \param scratch  Directory to generate and write trees in
+ * \param scale    How much bigger or smaller to make the tree
+ * \param runs     Number of transfers to disk to make
+ * \param threads  Threads to read, compress and write with
+ * \param compress Whether to send compressed, like take -z
+ * \param result   Filled out with the measurements
+ * \return         0 if there were no errors, -1 otherwise (a message has been
+ *                 printed)
+ */
+static int bench_shape(const shape_t* shape, char* scratch, double scale, int runs, int threads,
+                       bool compress, result_t* result) {
+  *result = (result_t){.shape = shape->name};
+  char src[PATH_MAX + 16];
+  char out[PATH_MAX + 16];
+  snprintf(src, sizeof(src), "%s/%s", scratch, shape->name);
+  snprintf(out, sizeof(out), "%s/out/", scratch);
+
+  fprintf(stderr, "Generating %s tree\n", shape->name);
+  generated_bytes = 0;
+  uint8_t* buf = malloc(GEN_BUFFER_SIZE);
+  rng_t rng = {0x9e3779b97f4a7c15ULL};
+  for (const char* c = shape->name; *c != '\0'; c++) {
+    rng.state = (rng.state ^ *c) * 0x100000001b3ULL;
+  }
+  if (buf == NULL || mkdir(src, 0755) == -1 || shape->generate(src, scale, &rng, buf) == -1) {
+    perror("Failed to generate tree");
+    free(buf);
+    return -1;
+  }
+  free(buf);
+
+  // Read it like a give does, with -s if it doesn't fit in memory. What's
+  // received into memory counts against the same limit, so both copies have to.
+  result->streamed = generated_bytes > MAX_FILE_STORAGE / 2;
+  probe_t probe;
+  file_t* file = calloc(1, sizeof(file_t));
+  read_opts_t read_opts = {.stream = result->streamed, .threads = threads};
+  probe_start(&probe);
+  int rc = file != NULL ? read_file(src, file, &read_opts) : -1;
+  probe_stop(&probe, &result->read);
+  if (rc == -1) {
+    perror("Failed to read tree");
+    if (file != NULL) {
+      free_file(file);
+    }
+    return -1;
+  }
+  flat_t* flat = file->flat;
+  size_t first = flat->count;
+  for (size_t i = 0; i < flat->count; i++) {
+    file_t* entry = flat->entries[i].file;
+    if (entry->type == F_REG) {
+      result->files++;
+      result->bytes += entry->size;
+      first = first == flat->count ? i : first;
+    } else {
+      result->directories++;
+    }
+  }
+
+  // Chunks and their checksums are shared by every transfer, like a give's
+  const codec_t* codec = compress ? codec_for_features(FEATURE_ZLIB) : NULL;
+  compress_cache_t* cache = cache_create(file, codec, threads, compress ? COMPRESS_CACHE_MAX : 0);
+  uint64_t features = FEATURE_CRC32C | FEATURE_SPARSE | (codec != NULL ? codec->feature : 0);
+  unsigned short port = 0;
+  int listen_fd = server_socket_open(&port);
+  if (cache == NULL || listen_fd == -1 || listen(listen_fd, 1) == -1) {
+    perror("Failed to set up transfer");
+    if (cache != NULL) {
+      cache_destroy(cache);
+    }
+    if (listen_fd != -1) {
+      close(listen_fd);
+    }
+    free_file(file);
+    return -1;
+  }
+
+  // Send it and receive it into memory, the way files that fit are given
+  giver_t giver = {listen_fd, file, cache, features};
+  pthread_t thread;
+  conn_t conn;
+  file_t* received = NULL;
+  probe_start(&probe);
+  pthread_create(&thread, NULL, give_one, &giver);
+  if (connect_loopback(port, &conn) == 0) {
+    received = recv_file(&conn);
+    result->transfer.socket_reads = conn.reads;
+    conn_free(&conn);
+    close(conn.fd);
+  }
+  pthread_join(thread, NULL);
+  probe_stop(&probe, &result->transfer);
+  result->transfer.socket_writes = giver.writes;
+  if (received == NULL || giver.rc == -1) {
+    fprintf(stderr, "Failed to send %s tree\n", shape->name);
+    rc = -1;
+  }
+
+  // Then write what was received out to disk
+  write_opts_t write_opts = {.threads = threads};
+  if (rc == 0 && mkdir(out, 0755) == -1) {
+    perror("Failed to create output directory");
+    rc = -1;
+  }
+  if (rc == 0) {
+    probe_start(&probe);
+    rc = write_file(out, received, &write_opts, NULL);
+    probe_stop(&probe, &result->write);
+    if (rc == -1) {
+      perror("Failed to write tree");
+    }
+    char written[sizeof(out) + NAME_MAX];
+    snprintf(written, sizeof(written), "%s%s", out, received->name);
+    remove_file(written);
+  }
+  if (received != NULL) {
+    free_file(received);
+  }
+
+  // Last, whole transfers straight to disk like take does them, asking for
+  // what it asks for. Each one is timed, along with when its first file is
+  // all there.
+  giver.features = features | FEATURE_DEDUP;
+  double* totals = calloc(runs, sizeof(double));
+  double* firsts = calloc(runs, sizeof(double));
+  int first_count = 0;
+  char first_path[PATH_MAX + 1] = "";
+  if (first < flat->count) {
+    snprintf(first_path, sizeof(first_path), "%.*s", (int)strlen(out) - 1, out);
+    append_path(flat, first, first_path, sizeof(first_path));
+  }
+  if (totals == NULL || firsts == NULL) {
+    rc = -1;
+  }
+  phase_t* phase = &result->end_to_end;
+  for (int run = 0; run < runs && rc == 0; run++) {
+    probe_start(&probe);
+    watch_t watch = {
+        .path = first_path,
+        .size = first < flat->count ? flat->entries[first].file->size : 0,
+        .start = &probe.start,
+        .done = false,
+    };
+    pthread_t watcher;
+    bool watching = first < flat->count &&
+                    pthread_create(&watcher, NULL, watch_first_file, &watch) == 0;
+    pthread_create(&thread, NULL, give_one, &giver);
+
+    char* created = NULL;
+    resume_t resume = {0};
+    rc = -1;
+    if (connect_loopback(port, &conn) == 0) {
+      rc = recv_file_to_disk(&conn, out, NULL, &write_opts, NULL, &created, NULL, NULL, &resume,
+                             NULL);
+      phase->socket_reads += conn.reads;
+      conn_free(&conn);
+      close(conn.fd);
+    }
+    pthread_join(thread, NULL);
+    phase->socket_writes += giver.writes;
+    atomic_store(&watch.done, true);
+    if (watching) {
+      pthread_join(watcher, NULL);
+    }
+
+    // Cleaning up after the run isn't part of it
+    phase_t run_phase;
+    probe_stop(&probe, &run_phase);
+    totals[run] = run_phase.seconds;
+    phase->cpu_seconds += run_phase.cpu_seconds;
+    phase->read_syscalls += run_phase.read_syscalls;
+    phase->write_syscalls += run_phase.write_syscalls;
+    phase->peak_rss = run_phase.peak_rss > phase->peak_rss ? run_phase.peak_rss : phase->peak_rss;
+    if (watch.seconds >= 0) {
+      firsts[first_count++] = watch.seconds;
+    }
+    if (rc != 0 || giver.rc == -1) {
+      fprintf(stderr, "Failed to take %s tree\n", shape->name);
+      rc = -1;
+    }
+    if (created != NULL) {
+      remove_file(created);
+      free(created);
+    }
+  }
+
+  // Runs are summed up by their medians, and everything else per run
+  phase->first_p50 = -1;
+  phase->first_p99 = -1;
+  if (rc == 0) {
+    qsort(totals, runs, sizeof(double), compare_doubles);
+    qsort(firsts, first_count, sizeof(double), compare_doubles);
+    phase->seconds = percentile(totals, runs, 50);
+    phase->cpu_seconds /= runs;
+    phase->read_syscalls /= runs;
+    phase->write_syscalls /= runs;
+    phase->socket_reads /= runs;
+    phase->socket_writes /= runs;
+    if (first_count > 0) {
+      phase->first_p50 = percentile(firsts, first_count, 50);
+      phase->first_p99 = percentile(firsts, first_count, 99);
+    }
+  }
+  free(totals);
+  free(firsts);
+
+  close(listen_fd);
+  cache_destroy(cache);
+  free_file(file);
+  rmdir(out);
+  remove_file(src);
+  return rc;
+}
+
+/**
+ * Print one phase as a JSON object.
+ */
+static void print_phase(FILE* json, const char* name, phase_t* phase, result_t* result,
+                        bool last) {
+  double seconds = phase->seconds > 0 ? phase->seconds : 1e-9;
+  fprintf(json, "      \"%s\": {\n", name);
+  fprintf(json, "        \"seconds\": %.6f,\n", phase->seconds);
+  fprintf(json, "        \"mb_per_s\": %.3f,\n", result->bytes / 1e6 / seconds);
+  fprintf(json, "        \"files_per_s\": %.1f,\n", result->files / seconds);
+  fprintf(json, "        \"cpu_seconds\": %.6f,\n", phase->cpu_seconds);
+  fprintf(json, "        \"peak_rss_kb\": %zu,\n", phase->peak_rss);
+  fprintf(json, "        \"read_syscalls\": %zu,\n", phase->read_syscalls);
+  fprintf(json, "        \"write_syscalls\": %zu,\n", phase->write_syscalls);
+  fprintf(json, "        \"socket_reads\": %zu,\n", phase->socket_reads);
+  fprintf(json, "        \"socket_writes\": %zu", phase->socket_writes);
+  if (phase->first_p50 >= 0) {
+    fprintf(json, ",\n        \"first_file_p50_ms\": %.3f,\n", phase->first_p50 * 1e3);
+    fprintf(json, "        \"first_file_p99_ms\": %.3f", phase->first_p99 * 1e3);
+  }
+  fprintf(json, "\n      }%s\n", last ? "" : ",");
+}
+
+/**
+ * Print a line of the summary for one phase.
+ */
+static void summarize_phase(const char* shape, const char* name, phase_t* phase,
+                            result_t* result) {
+  double seconds = phase->seconds > 0 ? phase->seconds : 1e-9;
+  fprintf(stderr, "%-6s %-10s %8.3f s %10.0f files/s %9.1f MB/s %7.1f MB peak", shape, name,
+          phase->seconds, result->files / seconds, result->bytes / 1e6 / seconds,
+          phase->peak_rss / 1e3);
+  if (phase->first_p50 >= 0) {
+    fprintf(stderr, "  first file p50 %.1f ms, p99 %.1f ms", phase->first_p50 * 1e3,
+            phase->first_p99 * 1e3);
+  }
+  fprintf(stderr, "\n");
+}
+
+void print_usage(char* prog_name) {
+  fprintf(stderr,
+          "Usage: %s [-s SHAPE[,SHAPE...]] [-x SCALE] [-r RUNS] [-j THREADS] [-z] [-d DIR] "
+          "[-o FILE]\n",
+          prog_name);
+  fprintf(stderr, "Shapes: huge, tiny, deep, mixed (all by default)\n");
+}
+
+int main(int argc, char** argv) {
+  char* shape_list = NULL;
+  double scale = 1;
+  int runs = BENCH_DEFAULT_RUNS;
+  int threads = pool_default_threads();
+  bool compress = false;
+  char* scratch_parent = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+  char* output = NULL;
+
+  struct option long_options[] = {
+      {"shapes", required_argument, NULL, 's'},
+      {"scale", required_argument, NULL, 'x'},
+      {"runs", required_argument, NULL, 'r'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"compress", no_argument, NULL, 'z'},
+      {"dir", required_argument, NULL, 'd'},
+      {"output", required_argument, NULL, 'o'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:x:r:j:zd:o:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        shape_list = optarg;
+        break;
+      case 'x':
+        scale = atof(optarg);
+        if (scale <= 0) {
+          fprintf(stderr, "Scale must be more than 0\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        if (runs < 1) {
+          fprintf(stderr, "Number of runs must be at least 1\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1) {
+          fprintf(stderr, "Number of threads must be at least 1\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'z':
+        compress = true;
+        break;
+      case 'd':
+        scratch_parent = optarg;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  // Pick out the shapes asked for, in the order they were asked for
+  const shape_t* picked[NUM_SHAPES];
+  size_t num_picked = 0;
+  if (shape_list == NULL) {
+    for (size_t i = 0; i < NUM_SHAPES; i++) {
+      picked[num_picked++] = &shapes[i];
+    }
+  } else {
+    char* save;
+    for (char* name = strtok_r(shape_list, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+      size_t i = 0;
+      while (i < NUM_SHAPES && strcmp(shapes[i].name, name) != 0) {
+        i++;
+      }
+      if (i == NUM_SHAPES || num_picked == NUM_SHAPES) {
+        fprintf(stderr, "Unknown shape %s\n", name);
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+      }
+      picked[num_picked++] = &shapes[i];
+    }
+  }
+
+  FILE* json = stdout;
+  if (output != NULL && (json = fopen(output, "w")) == NULL) {
+    perror("Failed to open output file");
+    exit(EXIT_FAILURE);
+  }
+  char scratch[PATH_MAX];
+  snprintf(scratch, sizeof(scratch), "%s/give-bench-XXXXXX", scratch_parent);
+  if (mkdtemp(scratch) == NULL) {
+    perror("Failed to create scratch directory");
+    exit(EXIT_FAILURE);
+  }
+
+  // A taker that goes away shouldn't take the whole benchmark with it
+  signal(SIGPIPE, SIG_IGN);
+
+  result_t results[NUM_SHAPES];
+  size_t num_results = 0;
+  int rc = 0;
+  for (size_t i = 0; i < num_picked && rc == 0; i++) {
+    rc = bench_shape(picked[i], scratch, scale, runs, threads, compress, &results[num_results]);
+    if (rc == 0) {
+      result_t* result = &results[num_results++];
+      summarize_phase(result->shape, "read", &result->read, result);
+      summarize_phase(result->shape, "send/recv", &result->transfer, result);
+      summarize_phase(result->shape, "write", &result->write, result);
+      summarize_phase(result->shape, "take", &result->end_to_end, result);
+    }
+  }
+  remove_file(scratch);
+  if (rc != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(json, "{\n");
+  fprintf(json, "  \"protocol\": %d,\n", PROTOCOL_VERSION);
+  fprintf(json, "  \"threads\": %d,\n", threads);
+  fprintf(json, "  \"scale\": %g,\n", scale);
+  fprintf(json, "  \"runs\": %d,\n", runs);
+  fprintf(json, "  \"compress\": %s,\n", compress ? "true" : "false");
+  fprintf(json, "  \"crc32c\": \"%s\",\n", crc32c_impl());
+  fprintf(json, "  \"io_uring\": %s,\n", uring_available() ? "true" : "false");
+  fprintf(json, "  \"shapes\": [\n");
+  for (size_t i = 0; i < num_results; i++) {
+    result_t* result = &results[i];
+    fprintf(json, "    {\n");
+    fprintf(json, "      \"shape\": \"%s\",\n", result->shape);
+    fprintf(json, "      \"files\": %zu,\n", result->files);
+    fprintf(json, "      \"directories\": %zu,\n", result->directories);
+    fprintf(json, "      \"bytes\": %zu,\n", result->bytes);
+    fprintf(json, "      \"streamed\": %s,\n", result->streamed ? "true" : "false");
+    print_phase(json, "read", &result->read, result, false);
+    print_phase(json, "send_recv", &result->transfer, result, false);
+    print_phase(json, "write", &result->write, result, false);
+    print_phase(json, "take", &result->end_to_end, result, true);
+    fprintf(json, "    }%s\n", i + 1 < num_results ? "," : "");
+  }
+  fprintf(json, "  ]\n}\n");
+  if (json != stdout) {
+    fclose(json);
+  }
+  return 0;
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "broker.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Fill out the address of this user's control socket. The name starts with a
+ * NUL byte, which puts it in the abstract namespace, so there's no file to
+ * clean up after a broker that died.
+ *
+ * \param addr  Address to fill out
+ * \return      Length of the address
+ */
+static socklen_t broker_address(struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, BROKER_SOCKET_NAME "%u",
+                     (unsigned int)geteuid());
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/**
+ * Check that the other end of a Unix socket is run by the same user. Abstract
+ * sockets have no permissions, so anyone could be there.
+ *
+ * \param fd  Connected socket
+ * \return    0 if it is the same user, -1 otherwise
+ */
+static int check_peer(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+    return -1;
+  }
+  if (cred.uid != geteuid()) {
+    errno = EACCES;
+    return -1;
+  }
+  return 0;
+}
+
+int broker_listen() {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t len = broker_address(&addr);
+  if (bind(fd, (struct sockaddr*)&addr, len) == -1 || listen(fd, SOMAXCONN) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int broker_connect(conn_t* conn) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t len = broker_address(&addr);
+  if (connect(fd, (struct sockaddr*)&addr, len) == -1 || check_peer(fd) == -1 ||
+      conn_init(conn, fd) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return 0;
+}
+
+int broker_accept(int listen_fd) {
+  while (true) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1 || check_peer(fd) == 0) {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+/**
+ * Write a string with its length in front.
+ */
+static int write_string(conn_t* conn, const char* str) {
+  size_t len = strlen(str);
+  if (conn_write_varint(conn, len) == -1 || conn_write(conn, str, len) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Read a string written by write_string.
+ *
+ * \return  Malloc'd string, or NULL on error
+ */
+static char* read_string(conn_t* conn) {
+  uint64_t len;
+  if (conn_read_varint(conn, &len) == -1) {
+    return NULL;
+  }
+  if (len > PATH_MAX) {
+    errno = EPROTO;
+    return NULL;
+  }
+  char* str = malloc(len + 1);
+  if (str == NULL) {
+    return NULL;
+  }
+  if (conn_read(conn, str, len) == -1) {
+    free(str);
+    return NULL;
+  }
+  str[len] = '\0';
+  if (strlen(str) != len) {
+    free(str);
+    errno = EPROTO;
+    return NULL;
+  }
+  return str;
+}
+
+int send_registration(conn_t* conn, registration_t* reg) {
+  if (conn_write_varint(conn, BROKER_VERSION) == -1 ||
+      write_string(conn, reg->target_username) == -1 || write_string(conn, reg->path) == -1 ||
+      conn_write_varint(conn, reg->stream) == -1 || conn_write_varint(conn, reg->threads) == -1) {
+    return -1;
+  }
+  return conn_flush(conn);
+}
+
+registration_t* recv_registration(conn_t* conn) {
+  uint64_t version;
+  if (conn_read_varint(conn, &version) == -1) {
+    return NULL;
+  }
+  if (version != BROKER_VERSION) {
+    errno = EPROTO;
+    return NULL;
+  }
+
+  registration_t* reg = calloc(1, sizeof(registration_t));
+  if (reg == NULL) {
+    return NULL;
+  }
+  uint64_t stream, threads;
+  reg->target_username = read_string(conn);
+  reg->path = reg->target_username != NULL ? read_string(conn) : NULL;
+  if (reg->path == NULL || conn_read_varint(conn, &stream) == -1 ||
+      conn_read_varint(conn, &threads) == -1) {
+    int saved_errno = errno;
+    free_registration(reg);
+    errno = saved_errno;
+    return NULL;
+  }
+  if (threads < 1 || threads > 1024) {
+    free_registration(reg);
+    errno = EPROTO;
+    return NULL;
+  }
+  reg->stream = stream != 0;
+  reg->threads = threads;
+  return reg;
+}
+
+void free_registration(registration_t* reg) {
+  free(reg->target_username);
+  free(reg->path);
+  free(reg);
+}
+
+int send_registered(conn_t* conn, int error, unsigned short port, unsigned int number) {
+  if (conn_write_varint(conn, error) == -1 ||
+      (error == 0 &&
+       (conn_write_varint(conn, port) == -1 || conn_write_varint(conn, number) == -1))) {
+    return -1;
+  }
+  return conn_flush(conn);
+}
+
+int recv_registered(conn_t* conn, unsigned short* port, unsigned int* number) {
+  uint64_t error, value;
+  if (conn_read_varint(conn, &error) == -1) {
+    return -1;
+  }
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  if (conn_read_varint(conn, &value) == -1) {
+    return -1;
+  }
+  *port = value;
+  if (conn_read_varint(conn, &value) == -1) {
+    return -1;
+  }
+  *number = value;
+  return 0;
+}
@@ -0,0 +1,108 @@
+/**
+ * broker.h
+ *
+ * Talk to the broker: one give daemon per user that hosts every give started
+ * with -b on a single port. New gives are registered with it over a local
+ * socket instead of each one starting a daemon of its own, and takers pick
+ * which one they want by its number.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "conn.h"
+
+// Name of the broker's control socket in the abstract namespace, followed by
+// the uid it belongs to
+#define BROKER_SOCKET_NAME "give-broker-"
+
+// Version of the messages sent over the control socket, bumped whenever they
+// change, so a broker never misreads a newer give
+#define BROKER_VERSION 1
+
+// A give to host, as sent to the broker
+typedef struct {
+  char* target_username;  //< user allowed to take it
+  char* path;             //< absolute path to the file or directory
+  bool stream;            //< read contents at take time, like give -s
+  int threads;            //< threads to read and compress it with
+} registration_t;
+
+/**
+ * Start listening on the control socket, to become the broker of the user
+ * running this.
+ *
+ * \return  File descriptor of the listening socket, or -1 on error. errno is
+ *          EADDRINUSE if there already is a broker.
+ */
+int broker_listen();
+
+/**
+ * Connect to the control socket of the broker of the user running this, and
+ * make sure it is run by that user.
+ *
+ * \param conn  Connection to set up
+ * \return      0 if there were no errors, -1 otherwise. errno is ECONNREFUSED
+ *              if there is no broker.
+ */
+int broker_connect(conn_t* conn);
+
+/**
+ * Accept a connection on the control socket from the same user, without
+ * waiting for one. Connections from anyone else are hung up on.
+ *
+ * \param listen_fd  Listening control socket
+ * \return           File descriptor of the new non-blocking socket, or -1 on
+ *                   error. errno is EAGAIN if nobody (else) was waiting.
+ */
+int broker_accept(int listen_fd);
+
+/**
+ * Ask the broker to host a give.
+ *
+ * \param conn  Connection to the broker
+ * \param reg   Give to host
+ * \return      0 if there were no errors, -1 otherwise
+ */
+int send_registration(conn_t* conn, registration_t* reg);
+
+/**
+ * Receive a give to host, sent by send_registration.
+ *
+ * \param conn  Connection to read from
+ * \return      Malloc'd registration, to be freed with free_registration, or
+ *              NULL on error. errno is set to 0 if the other end closed the
+ *              connection early, or EPROTO if it was malformed.
+ */
+registration_t* recv_registration(conn_t* conn);
+
+/**
+ * Free a registration from recv_registration.
+ *
+ * \param reg  Registration to free
+ */
+void free_registration(registration_t* reg);
+
+/**
+ * Answer a registration.
+ *
+ * \param conn    Connection it came in on
+ * \param error   0 if the give is being hosted, otherwise the errno value of
+ *                what went wrong
+ * \param port    Port the broker listens for takers on
+ * \param number  Number takers ask for the give by
+ * \return        0 if there were no errors, -1 otherwise
+ */
+int send_registered(conn_t* conn, int error, unsigned short port, unsigned int number);
+
+/**
+ * Wait for the answer to a registration.
+ *
+ * \param conn    Connection to the broker
+ * \param port    Set to the port the broker listens for takers on
+ * \param number  Set to the number takers ask for the give by
+ * \return        0 if the give is being hosted, -1 otherwise. errno is set to
+ *                what went wrong on the broker's side, or to 0 if it hung up.
+ */
+int recv_registered(conn_t* conn, unsigned short* port, unsigned int* number);
@@ -0,0 +1,212 @@
+#include "checksum.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC32C polynomial, bit-reversed
+#define CRC32C_POLY 0x82f63b78
+
+// Tables for processing eight bytes at a time without the instruction.
+// tables[k][b] is the CRC of byte b followed by k zero bytes.
+static uint32_t tables[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+// Whether the CPU has the crc32 instruction, checked on first use
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+static bool have_sse42 = false;
+
+static void init_tables() {
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+    }
+    tables[0][b] = crc;
+  }
+  for (uint32_t b = 0; b < 256; b++) {
+    for (int k = 1; k < 8; k++) {
+      tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 0xff];
+    }
+  }
+}
+
+/**
+ * Compute a CRC32C with lookup tables, eight bytes per step.
+ */
+static uint32_t crc32c_table(uint32_t crc, const uint8_t* data, size_t len) {
+  pthread_once(&tables_once, init_tables);
+
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    word ^= crc;
+    crc = tables[7][word & 0xff] ^ tables[6][(word >> 8) & 0xff] ^
+          tables[5][(word >> 16) & 0xff] ^ tables[4][(word >> 24) & 0xff] ^
+          tables[3][(word >> 32) & 0xff] ^ tables[2][(word >> 40) & 0xff] ^
+          tables[1][(word >> 48) & 0xff] ^ tables[0][word >> 56];
+    data += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = (crc >> 8) ^ tables[0][(crc ^ *data) & 0xff];
+    data++;
+    len--;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * Compute a CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time.
+ */
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data,
+                                                               size_t len) {
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    len -= 8;
+  }
+  crc = crc64;
+  while (len > 0) {
+    crc = _mm_crc32_u8(crc, *data);
+    data++;
+    len--;
+  }
+  return crc;
+}
+#endif
+
+static void init_impl() {
+#if defined(__x86_64__)
+  have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+  pthread_once(&impl_once, init_impl);
+
+  // Both implementations work on the inverted CRC
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (have_sse42) {
+    return ~crc32c_sse42(crc, data, len);
+  }
+#endif
+  return ~crc32c_table(crc, data, len);
+}
+
+uint32_t crc32c_digest(uint32_t digest, uint32_t crc) {
+  uint8_t bytes[4] = {crc, crc >> 8, crc >> 16, crc >> 24};
+  return crc32c(digest, bytes, sizeof(bytes));
+}
+
+const char* crc32c_impl() {
+  pthread_once(&impl_once, init_impl);
+  return have_sse42 ? "sse4.2" : "table";
+}
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * Mix the bits of one half of a hash into each other.
+ */
+static uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccd;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53;
+  k ^= k >> 33;
+  return k;
+}
+
+uint64_t hash64(const void* data, size_t len) {
+  const uint8_t* bytes = data;
+  uint64_t h = 0x9e3779b97f4a7c15 ^ len;
+  while (len > 0) {
+    uint64_t word = 0;
+    size_t n = len < sizeof(word) ? len : sizeof(word);
+    memcpy(&word, bytes, n);
+    word *= 0x87c37b91114253d5;
+    word = rotl64(word, 31);
+    word *= 0x4cf5ad432745937f;
+    h ^= word;
+    h = rotl64(h, 27) * 5 + 0x52dce729;
+    bytes += n;
+    len -= n;
+  }
+  return fmix64(h);
+}
+
+void hash128(const void* data, size_t len, uint64_t out[2]) {
+  const uint8_t* bytes = data;
+  const uint64_t c1 = 0x87c37b91114253d5;
+  const uint64_t c2 = 0x4cf5ad432745937f;
+  uint64_t h1 = 0, h2 = 0;
+
+  // Sixteen bytes at a time, as two little-endian words
+  size_t blocks = len / 16;
+  for (size_t i = 0; i < blocks; i++) {
+    uint64_t k1, k2;
+    memcpy(&k1, bytes + i * 16, sizeof(k1));
+    memcpy(&k2, bytes + i * 16 + 8, sizeof(k2));
+
+    k1 *= c1;
+    k1 = rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  // Then whatever is left over
+  const uint8_t* tail = bytes + blocks * 16;
+  uint64_t k1 = 0, k2 = 0;
+  for (size_t i = len % 16; i > 8; i--) {
+    k2 |= (uint64_t)tail[i - 1] << (8 * (i - 9));
+  }
+  for (size_t i = len % 16 < 8 ? len % 16 : 8; i > 0; i--) {
+    k1 |= (uint64_t)tail[i - 1] << (8 * (i - 1));
+  }
+  if (len % 16 > 8) {
+    k2 *= c2;
+    k2 = rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+  }
+  if (len % 16 > 0) {
+    k1 *= c1;
+    k1 = rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+  }
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  out[0] = h1;
+  out[1] = h2;
+}
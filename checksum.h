@@ -0,0 +1,62 @@
+/**
+ * checksum.h
+ *
+ * CRC32C (Castagnoli) checksums of file contents. Uses the SSE4.2 crc32
+ * instruction when the CPU has it, and a table otherwise. Both give the same
+ * result. Also a 128-bit hash for telling whether files have the same contents.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Extend a CRC32C checksum over more data. Start from 0.
+ *
+ * \param crc   Checksum of the data before this
+ * \param data  Data to add
+ * \param len   Number of bytes of data
+ * \return      Checksum of everything so far
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+/**
+ * Add a checksum to a running digest of checksums, as its four bytes in
+ * little-endian order.
+ *
+ * \param digest  Digest so far. Start from 0.
+ * \param crc     Checksum to add
+ * \return        The new digest
+ */
+uint32_t crc32c_digest(uint32_t digest, uint32_t crc);
+
+/**
+ * Find out how checksums are being computed.
+ *
+ * \return  Name of the implementation in use, for reporting
+ */
+const char* crc32c_impl();
+
+/**
+ * Hash a block into 64 bits, with the same mixing as hash128 but one word at a
+ * time. Good enough that two different blocks with the same rolling checksum
+ * practically never match, though not against anyone trying to make that
+ * happen.
+ *
+ * \param data  Data to hash
+ * \param len   Number of bytes of data
+ * \return      The hash
+ */
+uint64_t hash64(const void* data, size_t len);
+
+/**
+ * Hash some data into 128 bits, with MurmurHash3. Fast, and good enough that
+ * two different files practically never hash the same, though not against
+ * anyone trying to make them.
+ *
+ * \param data  Data to hash
+ * \param len   Number of bytes of data
+ * \param out   Set to the hash
+ */
+void hash128(const void* data, size_t len, uint64_t out[2]);
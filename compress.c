@@ -0,0 +1,621 @@
+#define _GNU_SOURCE
+#include "compress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "checksum.h"
+#include "pool.h"
+
+// Bytes from the middle of a chunk that are compressed first, to see whether
+// the whole chunk is worth compressing
+#define SAMPLE_SIZE 0x1000
+
+// Chunks whose sample doesn't shrink to below this share of its size are sent
+// as they are. Already compressed data (images, archives) lands here.
+#define SAMPLE_MAX_RATIO 0.9
+
+// How far past the file being sent to compress in the background
+#define LOOKAHEAD_BYTES 0x1000000
+#define LOOKAHEAD_FILES 1024
+
+static size_t zlib_bound(size_t len) {
+  return compressBound(len);
+}
+
+static int zlib_compress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t* dst_len) {
+  uLongf out_len = *dst_len;
+  if (compress2(dst, &out_len, src, src_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    return -1;
+  }
+  *dst_len = out_len;
+  return 0;
+}
+
+static int zlib_decompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len) {
+  uLongf out_len = dst_len;
+  if (uncompress(dst, &out_len, src, src_len) != Z_OK || out_len != dst_len) {
+    return -1;
+  }
+  return 0;
+}
+
+// Every codec there is, most preferred first
+static const codec_t codecs[] = {
+    {
+        .name = "zlib",
+        .id = CODEC_ZLIB,
+        .feature = FEATURE_ZLIB,
+        .bound = zlib_bound,
+        .compress = zlib_compress,
+        .decompress = zlib_decompress,
+    },
+};
+#define NUM_CODECS (sizeof(codecs) / sizeof(codecs[0]))
+
+const codec_t* codec_for_features(uint64_t features) {
+  for (size_t i = 0; i < NUM_CODECS; i++) {
+    if (features & codecs[i].feature) {
+      return &codecs[i];
+    }
+  }
+  return NULL;
+}
+
+uint64_t codec_all_features() {
+  uint64_t features = 0;
+  for (size_t i = 0; i < NUM_CODECS; i++) {
+    features |= codecs[i].feature;
+  }
+  return features;
+}
+
+// A chunk of zeros, never written to, for checksumming holes
+static uint8_t zeros[CHUNK_SIZE];
+static uint32_t zeros_crc;
+static pthread_once_t zeros_once = PTHREAD_ONCE_INIT;
+
+// Whether the CPU has AVX2 for finding zeros, checked on first use
+static pthread_once_t zero_impl_once = PTHREAD_ONCE_INIT;
+static bool have_avx2 = false;
+
+// Where a file is in being compressed
+typedef enum {
+  ENTRY_EMPTY,    //< nothing compressed, or it was freed after sending
+  ENTRY_PENDING,  //< chunks are being compressed
+  ENTRY_READY,    //< every chunk is done
+  ENTRY_FAILED,   //< the file couldn't be read
+} entry_state_t;
+
+// The chunks of one file
+typedef struct {
+  file_t* file;
+  entry_state_t state;
+  int error;         //< errno of the failure, 0 if the file changed
+  size_t users;      //< senders between cache_get and cache_release
+  bool kept;         //< counted against the budget, so never freed
+  bool abandoned;    //< queued by senders that went away before getting it
+  size_t pending;    //< chunks still being compressed
+  size_t num_chunks;
+  chunk_t* chunks;
+} entry_t;
+
+struct compress_cache {
+  const codec_t* codec;
+  int threads;
+  pool_t* pool;  //< started the first time something is compressed
+
+  pthread_mutex_t lock;   //< protects everything below
+  pthread_cond_t ready;   //< broadcast when an entry stops being pending
+  size_t num_entries;
+  entry_t* entries;       //< regular files worth compressing, in the order sent
+  size_t* offsets;        //< total size of the files before each entry
+  size_t budget;
+  size_t kept_bytes;      //< compressed bytes in kept entries
+};
+
+// Arguments to compress one chunk on the pool
+typedef struct {
+  compress_cache_t* cache;
+  entry_t* entry;
+  chunk_t* chunk;
+} chunk_task_t;
+
+/**
+ * Check whether a regular file gets chunks of its own. Files with the same
+ * contents as an earlier one use that one's chunks.
+ */
+static bool has_entry(file_t* file) {
+  return file->size >= COMPRESS_MIN_SIZE && (file->same == NULL || file->same == file);
+}
+
+/**
+ * Go through a flat tree for the regular files that are worth compressing, in
+ * the order they are sent.
+ *
+ * \param cache  Cache to fill out the entries of, or NULL to only count them
+ * \param flat   Tree that will be sent
+ * \return       Number of files
+ */
+static size_t add_entries(compress_cache_t* cache, flat_t* flat) {
+  size_t count = 0;
+  for (size_t i = 0; i < flat->count; i++) {
+    file_t* file = flat->entries[i].file;
+    if (file->type != F_REG || !has_entry(file)) {
+      continue;
+    }
+    if (cache != NULL) {
+      cache->entries[count].file = file;
+      cache->offsets[count + 1] = cache->offsets[count] + file->size;
+    }
+    count++;
+  }
+  return count;
+}
+
+compress_cache_t* cache_create(file_t* root, const codec_t* codec, int threads, size_t budget) {
+  compress_cache_t* cache = calloc(1, sizeof(compress_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->codec = codec;
+  cache->threads = threads;
+  cache->budget = budget;
+  cache->num_entries = add_entries(NULL, root->flat);
+  cache->entries = calloc(cache->num_entries, sizeof(entry_t));
+  cache->offsets = calloc(cache->num_entries + 1, sizeof(size_t));
+  if ((cache->entries == NULL && cache->num_entries > 0) || cache->offsets == NULL) {
+    free(cache->entries);
+    free(cache->offsets);
+    free(cache);
+    return NULL;
+  }
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->ready, NULL);
+
+  add_entries(cache, root->flat);
+  return cache;
+}
+
+const codec_t* cache_codec(compress_cache_t* cache) {
+  return cache->codec;
+}
+
+/**
+ * Guess whether a chunk will compress, by compressing a sample from its middle.
+ *
+ * \return  false if the sample barely shrank
+ */
+static bool worth_compressing(const codec_t* codec, const uint8_t* data, size_t len) {
+  // Small chunks are cheap enough to just try
+  uint8_t out[SAMPLE_SIZE * 2];
+  if (len < SAMPLE_SIZE * 4 || codec->bound(SAMPLE_SIZE) > sizeof(out)) {
+    return true;
+  }
+
+  size_t out_len = sizeof(out);
+  const uint8_t* sample = data + (len - SAMPLE_SIZE) / 2;
+  if (codec->compress(sample, SAMPLE_SIZE, out, &out_len) == -1) {
+    return true;
+  }
+  return out_len < SAMPLE_SIZE * SAMPLE_MAX_RATIO;
+}
+
+static void init_zeros() {
+  zeros_crc = crc32c(0, zeros, CHUNK_SIZE);
+}
+
+uint32_t zero_crc(size_t len) {
+  if (len == CHUNK_SIZE) {
+    pthread_once(&zeros_once, init_zeros);
+    return zeros_crc;
+  }
+  return crc32c(0, zeros, len);
+}
+
+/**
+ * Check whether some bytes are all zero, eight at a time.
+ */
+static bool all_zero_words(const uint8_t* data, size_t len) {
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    if (word != 0) {
+      return false;
+    }
+    data += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    if (*data != 0) {
+      return false;
+    }
+    data++;
+    len--;
+  }
+  return true;
+}
+
+#if defined(__x86_64__)
+/**
+ * Check whether some bytes are all zero, 64 at a time with SSE2, which every
+ * x86-64 CPU has.
+ */
+static bool all_zero_sse2(const uint8_t* data, size_t len) {
+  __m128i zero = _mm_setzero_si128();
+  while (len >= 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*)data);
+    __m128i b = _mm_loadu_si128((const __m128i*)(data + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(data + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(data + 48));
+    __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xffff) {
+      return false;
+    }
+    data += 64;
+    len -= 64;
+  }
+  return all_zero_words(data, len);
+}
+
+/**
+ * Check whether some bytes are all zero, 128 at a time with AVX2.
+ */
+__attribute__((target("avx2"))) static bool all_zero_avx2(const uint8_t* data, size_t len) {
+  while (len >= 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)data);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(data + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(data + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(data + 96));
+    __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+    if (!_mm256_testz_si256(any, any)) {
+      return false;
+    }
+    data += 128;
+    len -= 128;
+  }
+  return all_zero_words(data, len);
+}
+#endif
+
+static void init_zero_impl() {
+#if defined(__x86_64__)
+  have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/**
+ * Check whether a chunk is nothing but zeros. Chunks with data in them almost
+ * always have some near the start, so this stops at the first that isn't.
+ *
+ * \param data  Contents of the chunk
+ * \param len   Number of bytes
+ * \return      true if every byte is zero
+ */
+static bool all_zero(const uint8_t* data, size_t len) {
+  pthread_once(&zero_impl_once, init_zero_impl);
+#if defined(__x86_64__)
+  return have_avx2 ? all_zero_avx2(data, len) : all_zero_sse2(data, len);
+#else
+  return all_zero_words(data, len);
+#endif
+}
+
+/**
+ * Read the bytes of a chunk from a file on disk. Chunks that lie entirely in a
+ * hole in the file aren't read at all.
+ *
+ * \param file   Streamed regular file
+ * \param chunk  Chunk with its offset and raw_len filled out
+ * \param out    Set to the malloc'd chunk contents, or NULL if the file has no
+ *               data there
+ * \return       0 if there were no errors, -1 otherwise. errno is set to 0 if
+ *               the file changed since it was given or ended too early.
+ */
+static int read_chunk(file_t* file, chunk_t* chunk, uint8_t** out) {
+  *out = NULL;
+  int fd = open_streamed(file);
+  if (fd == -1) {
+    return -1;
+  }
+
+  // The next data past the start of the chunk is after its end, or there is
+  // none. File systems that don't keep track of holes say it's right there.
+  off_t next = lseek(fd, chunk->offset, SEEK_DATA);
+  if ((next == -1 && errno == ENXIO) || (next != -1 && next >= chunk->offset + chunk->raw_len)) {
+    close(fd);
+    return 0;
+  }
+
+  uint8_t* data = malloc(chunk->raw_len);
+  if (data == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  size_t bytes_read = 0;
+  while (bytes_read < chunk->raw_len) {
+    ssize_t rc = pread(fd, data + bytes_read, chunk->raw_len - bytes_read,
+                       chunk->offset + bytes_read);
+    if (rc <= 0) {
+      if (rc == 0) {
+        errno = 0;
+      }
+      free(data);
+      close(fd);
+      return -1;
+    }
+    bytes_read += rc;
+  }
+  close(fd);
+  *out = data;
+  return 0;
+}
+
+/**
+ * Free the chunks of an entry, so it can be compressed again. Must hold the
+ * lock.
+ */
+static void reset_entry(entry_t* entry) {
+  for (size_t i = 0; i < entry->num_chunks; i++) {
+    free(entry->chunks[i].data);
+  }
+  free(entry->chunks);
+  entry->chunks = NULL;
+  entry->num_chunks = 0;
+  entry->state = ENTRY_EMPTY;
+  entry->abandoned = false;
+}
+
+/**
+ * Mark a chunk of an entry as done. Once all of them are, the entry becomes
+ * ready (or failed) and anyone waiting on it is woken up. Must hold the lock.
+ */
+static void finish_chunk(compress_cache_t* cache, entry_t* entry) {
+  entry->pending--;
+  if (entry->pending > 0) {
+    return;
+  }
+
+  if (entry->state == ENTRY_FAILED) {
+    pthread_cond_broadcast(&cache->ready);
+    return;
+  }
+
+  // Keep the chunks for later transfers if there's room for them
+  size_t bytes = 0;
+  for (size_t i = 0; i < entry->num_chunks; i++) {
+    if (entry->chunks[i].data != NULL) {
+      bytes += entry->chunks[i].wire_len;
+    }
+  }
+  if (cache->kept_bytes + bytes <= cache->budget) {
+    entry->kept = true;
+    cache->kept_bytes += bytes;
+  }
+  entry->state = ENTRY_READY;
+  pthread_cond_broadcast(&cache->ready);
+
+  // Nobody is coming for it, so don't hold on to it until the cache is freed
+  if (entry->abandoned && entry->users == 0 && !entry->kept) {
+    reset_entry(entry);
+  }
+}
+
+/**
+ * Checksum a chunk, and compress it if that makes it smaller. Chunks of nothing
+ * but zeros are only marked as such, since they're sent as holes to takers
+ * that can make them.
+ *
+ * \param codec  Codec to compress with, or NULL to only compute the checksum
+ * \param file   Regular file the chunk is from
+ * \param chunk  Chunk with its offset and raw_len filled out
+ * \return       0 if there were no errors, -1 if the file couldn't be read.
+ *               errno is set to 0 if it has changed since it was given.
+ */
+static int fill_chunk(const codec_t* codec, file_t* file, chunk_t* chunk) {
+  // Streamed files are read from disk, the rest are already in memory
+  uint8_t* buf = NULL;
+  const uint8_t* src = file->contents.data + chunk->offset;
+  if (file->path != NULL) {
+    if (read_chunk(file, chunk, &buf) == -1) {
+      return -1;
+    }
+    src = buf;
+  }
+
+  // Chunks are sent as they are unless compressing them made them smaller
+  chunk->codec = CODEC_NONE;
+  chunk->wire_len = chunk->raw_len;
+  chunk->data = NULL;
+  chunk->zero = src == NULL || all_zero(src, chunk->raw_len);
+  if (chunk->zero) {
+    chunk->crc = zero_crc(chunk->raw_len);
+    free(buf);
+    return 0;
+  }
+  chunk->crc = crc32c(0, src, chunk->raw_len);
+  if (codec != NULL && worth_compressing(codec, src, chunk->raw_len)) {
+    size_t out_len = codec->bound(chunk->raw_len);
+    uint8_t* out = malloc(out_len);
+    if (out != NULL && codec->compress(src, chunk->raw_len, out, &out_len) == 0 &&
+        out_len < chunk->raw_len) {
+      // Give back the space the output didn't use
+      uint8_t* shrunk = realloc(out, out_len);
+      chunk->data = shrunk != NULL ? shrunk : out;
+      chunk->codec = codec->id;
+      chunk->wire_len = out_len;
+    } else {
+      free(out);
+    }
+  }
+  free(buf);
+  return 0;
+}
+
+/**
+ * Compress one chunk. Run on the pool.
+ *
+ * \param arg  Malloc'd chunk_task_t, freed by this function
+ */
+static void compress_chunk(void* arg) {
+  chunk_task_t* task = (chunk_task_t*)arg;
+  compress_cache_t* cache = task->cache;
+  entry_t* entry = task->entry;
+  chunk_t* chunk = task->chunk;
+  free(task);
+
+  int error = fill_chunk(cache->codec, entry->file, chunk) == -1 ? errno : -1;
+
+  pthread_mutex_lock(&cache->lock);
+  if (error != -1) {
+    entry->state = ENTRY_FAILED;
+    entry->error = error;
+  }
+  finish_chunk(cache, entry);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Queue every chunk of an entry to be compressed. Must hold the lock.
+ */
+static void submit_entry(compress_cache_t* cache, entry_t* entry) {
+  size_t size = entry->file->size;
+  entry->num_chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  entry->chunks = calloc(entry->num_chunks, sizeof(chunk_t));
+  entry->state = ENTRY_PENDING;
+  entry->pending = entry->num_chunks;
+
+  if (cache->pool == NULL) {
+    cache->pool = pool_create(cache->threads);
+  }
+  if (entry->chunks == NULL || cache->pool == NULL) {
+    entry->state = ENTRY_FAILED;
+    entry->error = ENOMEM;
+    entry->pending = 0;
+    return;
+  }
+
+  for (size_t i = 0; i < entry->num_chunks; i++) {
+    chunk_t* chunk = &entry->chunks[i];
+    chunk->offset = i * CHUNK_SIZE;
+    chunk->raw_len = size - chunk->offset < CHUNK_SIZE ? size - chunk->offset : CHUNK_SIZE;
+
+    chunk_task_t* task = malloc(sizeof(chunk_task_t));
+    if (task != NULL) {
+      task->cache = cache;
+      task->entry = entry;
+      task->chunk = chunk;
+    }
+    if (task == NULL || pool_submit(cache->pool, compress_chunk, task) == -1) {
+      // Give up on the chunks that weren't queued
+      free(task);
+      entry->state = ENTRY_FAILED;
+      entry->error = ENOMEM;
+      for (size_t j = i; j < entry->num_chunks; j++) {
+        finish_chunk(cache, entry);
+      }
+      return;
+    }
+  }
+}
+
+chunk_t* cache_get(compress_cache_t* cache, size_t index, size_t* ahead, size_t* num_chunks) {
+  pthread_mutex_lock(&cache->lock);
+
+  // Queue this file and a window of the ones after it
+  if (*ahead < index) {
+    *ahead = index;
+  }
+  while (*ahead < cache->num_entries && *ahead - index < LOOKAHEAD_FILES &&
+         cache->offsets[*ahead] - cache->offsets[index] < LOOKAHEAD_BYTES) {
+    if (cache->entries[*ahead].state == ENTRY_EMPTY) {
+      submit_entry(cache, &cache->entries[*ahead]);
+    }
+    (*ahead)++;
+  }
+
+  // This file may have been freed since it was queued, even while waiting
+  entry_t* entry = &cache->entries[index];
+  while (entry->state == ENTRY_EMPTY || entry->pending > 0) {
+    if (entry->state == ENTRY_EMPTY) {
+      submit_entry(cache, entry);
+    } else {
+      pthread_cond_wait(&cache->ready, &cache->lock);
+    }
+  }
+
+  if (entry->state == ENTRY_FAILED) {
+    // Nobody can be using a failed entry, so let the next transfer try again
+    int error = entry->error;
+    reset_entry(entry);
+    pthread_mutex_unlock(&cache->lock);
+    errno = error;
+    return NULL;
+  }
+
+  entry->users++;
+  entry->abandoned = false;
+  *num_chunks = entry->num_chunks;
+  chunk_t* chunks = entry->chunks;
+  pthread_mutex_unlock(&cache->lock);
+  return chunks;
+}
+
+int cache_get_one(compress_cache_t* cache, size_t index, size_t offset, chunk_t* chunk) {
+  file_t* file = cache->entries[index].file;
+  chunk->offset = offset;
+  chunk->raw_len = file->size - offset < CHUNK_SIZE ? file->size - offset : CHUNK_SIZE;
+  return fill_chunk(cache->codec, file, chunk);
+}
+
+void cache_release(compress_cache_t* cache, size_t index) {
+  pthread_mutex_lock(&cache->lock);
+  entry_t* entry = &cache->entries[index];
+  entry->users--;
+  if (entry->users == 0 && !entry->kept) {
+    reset_entry(entry);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_abandon(compress_cache_t* cache, size_t index, size_t ahead) {
+  pthread_mutex_lock(&cache->lock);
+  for (size_t i = index; i < ahead && i < cache->num_entries; i++) {
+    entry_t* entry = &cache->entries[i];
+    if (entry->users > 0 || entry->kept) {
+      continue;
+    }
+    if (entry->state == ENTRY_READY) {
+      reset_entry(entry);
+    } else if (entry->state == ENTRY_PENDING) {
+      // Freed by whichever thread finishes its last chunk
+      entry->abandoned = true;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_destroy(compress_cache_t* cache) {
+  if (cache->pool != NULL) {
+    pool_wait(cache->pool);
+    pool_destroy(cache->pool);
+  }
+  // Including whatever was queued ahead and never sent, kept or not
+  for (size_t i = 0; i < cache->num_entries; i++) {
+    reset_entry(&cache->entries[i]);
+  }
+  pthread_mutex_destroy(&cache->lock);
+  pthread_cond_destroy(&cache->ready);
+  free(cache->entries);
+  free(cache->offsets);
+  free(cache);
+}
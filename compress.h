@@ -0,0 +1,196 @@
+/**
+ * compress.h
+ *
+ * Compress and checksum file contents in chunks before they are sent. Codecs
+ * are looked up in a table, so more can be added next to zlib. Chunks are
+ * compressed on a pool of threads a little ahead of being sent, and the results
+ * are kept so that every taker of the same give is sent them without
+ * compressing again.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "filereader.h"
+
+// Contents are compressed in pieces of this size, independently of each other
+#define CHUNK_SIZE 0x20000
+
+// Files smaller than this are never compressed, since they can't shrink by
+// enough to be worth it. Without checksums they're sent with no chunk headers.
+#define COMPRESS_MIN_SIZE 0x200
+
+// Codec ids sent in front of each chunk. CODEC_NONE means the chunk is sent as
+// it is, which happens whenever compressing it doesn't pay off.
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+
+// Codec id of chunks that are nothing but zeros, which are sent with no data
+// at all to takers that can leave them as holes. Kept apart from the ids of
+// real codecs.
+#define CODEC_ZERO 0x7f
+
+// Feature bits a taker asks for each codec with. Bits 0-7 are for codecs.
+#define FEATURE_ZLIB (1 << 0)
+
+// Most compressed data the cache keeps around between transfers
+#define COMPRESS_CACHE_MAX 0x10000000
+
+// A way of compressing chunks
+typedef struct {
+  const char* name;
+  uint8_t id;        //< sent in front of each chunk compressed with it
+  uint64_t feature;  //< feature bit a taker asks for this codec with
+
+  /**
+   * Get the most space compressing some data could take.
+   *
+   * \param len  Number of bytes to compress
+   * \return     Size of the output buffer compress needs
+   */
+  size_t (*bound)(size_t len);
+
+  /**
+   * Compress some data.
+   *
+   * \param src      Data to compress
+   * \param src_len  Number of bytes of data
+   * \param dst      Space for the output, at least bound(src_len) bytes
+   * \param dst_len  Size of dst. Set to the size of the output.
+   * \return         0 if there were no errors, -1 otherwise
+   */
+  int (*compress)(const uint8_t* src, size_t src_len, uint8_t* dst, size_t* dst_len);
+
+  /**
+   * Decompress data made by compress.
+   *
+   * \param src      Compressed data
+   * \param src_len  Number of bytes of compressed data
+   * \param dst      Space for the output
+   * \param dst_len  Exact size the output should have
+   * \return         0 if exactly dst_len bytes came out, -1 otherwise
+   */
+  int (*decompress)(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len);
+} codec_t;
+
+/**
+ * Pick the codec to use out of a set of feature bits.
+ *
+ * \param features  Feature bits from a request
+ * \return          The preferred codec among those asked for, or NULL if none
+ *                  were
+ */
+const codec_t* codec_for_features(uint64_t features);
+
+/**
+ * Get the feature bits of every codec there is.
+ *
+ * \return  Feature bits OR'd together
+ */
+uint64_t codec_all_features();
+
+// One chunk of a file, as it goes on the wire
+typedef struct {
+  uint8_t codec;    //< CODEC_NONE if the chunk is sent as it is
+  size_t offset;    //< where the chunk starts in the file
+  size_t raw_len;   //< size of the chunk in the file
+  size_t wire_len;  //< size of the chunk as sent
+  uint32_t crc;     //< CRC32C of the chunk as it is in the file
+  uint8_t* data;    //< compressed bytes, NULL if the chunk is sent as it is
+  bool zero;        //< every byte of the chunk is zero. Never compressed.
+} chunk_t;
+
+/**
+ * Get the checksum of a chunk of zeros, without going over them every time.
+ *
+ * \param len  Number of zero bytes, at most CHUNK_SIZE
+ * \return     Their CRC32C
+ */
+uint32_t zero_crc(size_t len);
+
+// Compressed and checksummed chunks for the files of one give
+typedef struct compress_cache compress_cache_t;
+
+/**
+ * Set up a cache of compressed chunks for a file. Nothing is compressed until
+ * it is asked for, and no threads are started until then either.
+ *
+ * \param root     File that will be sent, laid out flat. Must stay valid as long
+ *                 as the cache.
+ * \param codec    Codec to compress with, or NULL to only compute checksums
+ * \param threads  Number of threads to compress with
+ * \param budget   Most compressed bytes to keep between transfers. Chunks past
+ *                 that are freed once sent and compressed again next time.
+ * \return         The new cache, or NULL on error
+ */
+compress_cache_t* cache_create(file_t* root, const codec_t* codec, int threads, size_t budget);
+
+/**
+ * Get the codec a cache compresses with.
+ *
+ * \param cache  Cache to look at
+ * \return       Its codec, or NULL if it doesn't compress
+ */
+const codec_t* cache_codec(compress_cache_t* cache);
+
+/**
+ * Get the chunks of a file, waiting for them to be compressed if needed. Files
+ * are numbered in the order they are sent, counting only regular files of at
+ * least COMPRESS_MIN_SIZE bytes that don't have the same contents as an
+ * earlier one (see file_t.same). The files after this one are queued to be
+ * compressed in the background.
+ *
+ * \param cache       Cache to get chunks from
+ * \param index       Number of the file
+ * \param ahead       Number of the first file this sender hasn't queued yet.
+ *                    Start at 0, and pass the same variable for every file.
+ * \param num_chunks  Set to the number of chunks
+ * \return            The chunks, valid until cache_release, or NULL if the
+ *                    file couldn't be read. errno is set to 0 if it has
+ *                    changed since it was given.
+ */
+chunk_t* cache_get(compress_cache_t* cache, size_t index, size_t* ahead, size_t* num_chunks);
+
+/**
+ * Compress a single chunk of a file right away on the calling thread, without
+ * keeping it. For a file that is only partly sent, where compressing all of it
+ * ahead of time would be wasted.
+ *
+ * \param cache   Cache whose codec to compress with
+ * \param index   Number of the file, as for cache_get
+ * \param offset  Where the chunk starts in the file, a multiple of CHUNK_SIZE
+ *                less than its size
+ * \param chunk   Set to the chunk. Its data must be freed once it's sent.
+ * \return        0 if there were no errors, -1 if the file couldn't be read.
+ *                errno is set to 0 if it has changed since it was given.
+ */
+int cache_get_one(compress_cache_t* cache, size_t index, size_t offset, chunk_t* chunk);
+
+/**
+ * Say that the chunks from cache_get are no longer needed.
+ *
+ * \param cache  Cache the chunks came from
+ * \param index  Number of the file
+ */
+void cache_release(compress_cache_t* cache, size_t index);
+
+/**
+ * Let go of the files a sender queued with cache_get but never got, once its
+ * transfer is over or has failed. Those that nobody else is using and that
+ * aren't kept are freed, as soon as they are done being compressed.
+ *
+ * \param cache  Cache the sender got chunks from
+ * \param index  Number of the first file the sender didn't get
+ * \param ahead  Number of the first file the sender didn't queue
+ */
+void cache_abandon(compress_cache_t* cache, size_t index, size_t ahead);
+
+/**
+ * Wait for anything still being compressed, then free a cache.
+ *
+ * \param cache  Cache to free
+ */
+void cache_destroy(compress_cache_t* cache);
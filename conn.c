@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include "conn.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+int conn_init(conn_t* conn, int fd) {
+  conn->fd = fd;
+  conn->version = 0;
+  conn->out_len = 0;
+  conn->in_start = 0;
+  conn->in_end = 0;
+  conn->reads = 0;
+  conn->writes = 0;
+  conn->received = 0;
+  conn->buffered_only = false;
+  conn->num_fds = 0;
+  conn->tee_fd = -1;
+
+  // File descriptors can only be passed between processes on the same machine
+  int domain;
+  socklen_t domain_len = sizeof(domain);
+  conn->local = getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) == 0 &&
+                domain == AF_UNIX;
+
+  conn->out = malloc(CONN_BUFFER_SIZE);
+  conn->in = malloc(CONN_BUFFER_SIZE);
+  if (conn->out == NULL || conn->in == NULL) {
+    free(conn->out);
+    free(conn->in);
+    return -1;
+  }
+
+  zerocopy_init(fd, &conn->zc);
+  return 0;
+}
+
+void conn_free(conn_t* conn) {
+  free(conn->out);
+  free(conn->in);
+  conn->out = NULL;
+  conn->in = NULL;
+  for (size_t i = 0; i < conn->num_fds; i++) {
+    close(conn->fds[i]);
+  }
+  conn->num_fds = 0;
+}
+
+/**
+ * Copy data being sent into the tee file, if there is one. Copying stops for
+ * good if it fails.
+ *
+ * \param conn  Connection the data is sent on
+ * \param data  Data being sent
+ * \param len   Number of bytes of data
+ */
+static void tee_memory(conn_t* conn, const uint8_t* data, size_t len) {
+  if (conn->tee_fd != -1 && len > 0 && write_all(conn->tee_fd, data, len) == -1) {
+    conn->tee_fd = -1;
+  }
+}
+
+/**
+ * Send the write buffer followed by more data, in as few syscalls as possible.
+ * Empties the write buffer.
+ *
+ * \param conn  Connection to write to
+ * \param data  Data to send after the buffer, or NULL
+ * \param len   Number of bytes of data
+ * \return      0 if there were no errors, -1 otherwise
+ */
+static int send_buffered(conn_t* conn, const uint8_t* data, size_t len) {
+  tee_memory(conn, conn->out, conn->out_len);
+  tee_memory(conn, data, len);
+
+  struct iovec iov[2] = {
+      {.iov_base = conn->out, .iov_len = conn->out_len},
+      {.iov_base = (void*)data, .iov_len = len},
+  };
+  struct iovec* next = iov;
+  int count = 2;
+
+  while (count > 0) {
+    ssize_t rc = writev(conn->fd, next, count);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    } else if (rc <= 0) {
+      return -1;
+    }
+    conn->writes++;
+
+    // Skip over whatever was completely sent and trim what was partly sent
+    size_t sent = rc;
+    while (count > 0 && sent >= next->iov_len) {
+      sent -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (uint8_t*)next->iov_base + sent;
+      next->iov_len -= sent;
+    }
+  }
+
+  conn->out_len = 0;
+  return 0;
+}
+
+int conn_write(conn_t* conn, const void* data, size_t len) {
+  if (conn->out_len + len <= CONN_BUFFER_SIZE) {
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+  }
+  return send_buffered(conn, data, len);
+}
+
+int conn_flush(conn_t* conn) {
+  if (conn->out_len == 0) {
+    return 0;
+  }
+  return send_buffered(conn, NULL, 0);
+}
+
+int conn_write_fd(conn_t* conn, int fd) {
+  if (!conn->local || conn->out_len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // A file descriptor means nothing outside this connection, so there's no
+  // copying what's sent along with it
+  conn->tee_fd = -1;
+
+  // The descriptor goes with the first syscall, and the rest of the buffer
+  // after it if that one came up short
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control = {0};
+  struct iovec iov = {.iov_base = conn->out, .iov_len = conn->out_len};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t rc;
+  do {
+    rc = sendmsg(conn->fd, &msg, 0);
+  } while (rc == -1 && errno == EINTR);
+  if (rc <= 0) {
+    return -1;
+  }
+  conn->writes++;
+  memmove(conn->out, conn->out + rc, conn->out_len - rc);
+  conn->out_len -= rc;
+  return conn_flush(conn);
+}
+
+int conn_write_memory(conn_t* conn, const uint8_t* data, size_t len) {
+  // Anything that can't be sent in place goes out with the buffer
+  if (conn->out_len + len <= CONN_BUFFER_SIZE || !conn->zc.enabled || len < ZEROCOPY_MIN_SIZE) {
+    return conn_write(conn, data, len);
+  }
+
+  if (conn_flush(conn) == -1) {
+    return -1;
+  }
+  tee_memory(conn, data, len);
+  return send_from_memory(conn->fd, &conn->zc, data, len);
+}
+
+int conn_write_file(conn_t* conn, int fd, size_t len) {
+  if (len >= SPLICE_MIN_SIZE) {
+    // Big enough that keeping it out of user space is worth a syscall of its own
+    if (conn_flush(conn) == -1) {
+      return -1;
+    }
+    off_t offset = conn->tee_fd != -1 ? lseek(fd, 0, SEEK_CUR) : -1;
+    if (send_from_file(conn->fd, fd, NULL, len) == -1) {
+      return -1;
+    }
+
+    // Then again from the same place for the tee file
+    if (conn->tee_fd != -1 &&
+        (offset == -1 || send_from_file(conn->tee_fd, fd, &offset, len) == -1)) {
+      conn->tee_fd = -1;
+    }
+    return 0;
+  }
+
+  // Read small files straight into the buffer, making room first if needed
+  if (conn->out_len + len > CONN_BUFFER_SIZE && conn_flush(conn) == -1) {
+    return -1;
+  }
+  size_t bytes_read = 0;
+  while (bytes_read < len) {
+    ssize_t rc = read(fd, conn->out + conn->out_len + bytes_read, len - bytes_read);
+    if (rc == 0) {
+      errno = 0;
+      return -1;
+    } else if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    bytes_read += rc;
+  }
+  conn->out_len += len;
+  return 0;
+}
+
+int conn_wait(conn_t* conn) {
+  return zerocopy_wait(conn->fd, &conn->zc);
+}
+
+/**
+ * Read from the socket once. File descriptors passed along with the data are
+ * kept until they're taken.
+ *
+ * \return  Same as read
+ */
+static ssize_t recv_some(conn_t* conn, void* data, size_t len) {
+  if (!conn->local) {
+    return read(conn->fd, data, len);
+  }
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(CONN_MAX_FDS * sizeof(int))];
+  } control;
+  struct iovec iov = {.iov_base = data, .iov_len = len};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t rc = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+  if (rc == -1) {
+    return -1;
+  }
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (conn->num_fds < CONN_MAX_FDS) {
+        conn->fds[conn->num_fds++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  return rc;
+}
+
+/**
+ * Read from the socket into some space, retrying interrupted reads.
+ *
+ * \return  Number of bytes read, 0 at the end of the connection (with errno set
+ *          to 0), or -1 on error
+ */
+static ssize_t read_some(conn_t* conn, void* data, size_t len) {
+  if (conn->buffered_only) {
+    errno = EWOULDBLOCK;
+    return -1;
+  }
+  while (true) {
+    ssize_t rc = recv_some(conn, data, len);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    conn->reads++;
+    if (rc == 0) {
+      errno = 0;
+    } else if (rc > 0) {
+      conn->received += rc;
+    }
+    return rc;
+  }
+}
+
+int conn_read(conn_t* conn, void* data, size_t len) {
+  uint8_t* dest = data;
+
+  // Use up whatever is already buffered
+  size_t buffered = conn->in_end - conn->in_start;
+  size_t take = len < buffered ? len : buffered;
+  memcpy(dest, conn->in + conn->in_start, take);
+  conn->in_start += take;
+  dest += take;
+  len -= take;
+
+  while (len > 0) {
+    if (len >= CONN_BUFFER_SIZE) {
+      // Big reads go straight where they're wanted instead of through the buffer
+      ssize_t rc = read_some(conn, dest, len);
+      if (rc <= 0) {
+        return -1;
+      }
+      dest += rc;
+      len -= rc;
+      continue;
+    }
+
+    // Refill the buffer with as much as the socket has ready
+    ssize_t rc = read_some(conn, conn->in, CONN_BUFFER_SIZE);
+    if (rc <= 0) {
+      return -1;
+    }
+    conn->in_start = 0;
+    conn->in_end = rc;
+
+    take = len < (size_t)rc ? len : (size_t)rc;
+    memcpy(dest, conn->in, take);
+    conn->in_start = take;
+    dest += take;
+    len -= take;
+  }
+  return 0;
+}
+
+int conn_fill(conn_t* conn) {
+  memmove(conn->in, conn->in + conn->in_start, conn->in_end - conn->in_start);
+  conn->in_end -= conn->in_start;
+  conn->in_start = 0;
+
+  bool got_some = false;
+  while (conn->in_end < CONN_BUFFER_SIZE) {
+    ssize_t rc = recv_some(conn, conn->in + conn->in_end, CONN_BUFFER_SIZE - conn->in_end);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    } else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    conn->reads++;
+    if (rc == 0) {
+      // Let whatever came before the end be handled first. The end shows up
+      // again next time.
+      errno = 0;
+      return got_some ? 0 : -1;
+    } else if (rc < 0) {
+      return -1;
+    }
+    conn->in_end += rc;
+    conn->received += rc;
+    got_some = true;
+  }
+  return 0;
+}
+
+int conn_read_fd(conn_t* conn) {
+  if (conn->num_fds == 0) {
+    return -1;
+  }
+  int fd = conn->fds[0];
+  conn->num_fds--;
+  memmove(conn->fds, conn->fds + 1, conn->num_fds * sizeof(int));
+  return fd;
+}
+
+uint8_t* conn_peek(conn_t* conn, size_t len) {
+  if (conn->in_end - conn->in_start < len) {
+    if (conn->buffered_only) {
+      errno = EWOULDBLOCK;
+      return NULL;
+    }
+
+    // Move what's left to the front to make room behind it
+    memmove(conn->in, conn->in + conn->in_start, conn->in_end - conn->in_start);
+    conn->in_end -= conn->in_start;
+    conn->in_start = 0;
+
+    while (conn->in_end < len) {
+      ssize_t rc = read_some(conn, conn->in + conn->in_end, CONN_BUFFER_SIZE - conn->in_end);
+      if (rc <= 0) {
+        return NULL;
+      }
+      conn->in_end += rc;
+    }
+  }
+  return conn->in + conn->in_start;
+}
+
+// Longest possible encoding of a 64-bit varint
+#define VARINT_MAX_LEN 10
+
+int conn_write_varint(conn_t* conn, uint64_t value) {
+  uint8_t buf[VARINT_MAX_LEN];
+  size_t len = 0;
+  do {
+    buf[len] = value & 0x7f;
+    value >>= 7;
+    if (value != 0) {
+      buf[len] |= 0x80;
+    }
+    len++;
+  } while (value != 0);
+  return conn_write(conn, buf, len);
+}
+
+int conn_read_varint(conn_t* conn, uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    // Nearly every byte is already buffered, so skip the call when it is
+    uint8_t byte;
+    if (conn->in_start < conn->in_end) {
+      byte = conn->in[conn->in_start++];
+    } else if (conn_read(conn, &byte, 1) == -1) {
+      return -1;
+    }
+
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return 0;
+    }
+  }
+
+  // Ran past 64 bits without finding the last byte
+  errno = EPROTO;
+  return -1;
+}
+
+int conn_read_file(conn_t* conn, int fd, size_t len) {
+  // Whatever came in with the last header has to be written out by hand
+  size_t buffered = conn->in_end - conn->in_start;
+  size_t take = len < buffered ? len : buffered;
+  if (take > 0) {
+    if (write_all(fd, conn->in + conn->in_start, take) == -1) {
+      return -2;
+    }
+    conn->in_start += take;
+    len -= take;
+  }
+
+  // Not worth splicing the rest, or it could carry file descriptors, so read it
+  // through the buffer. Whatever comes in after it stays buffered for the next
+  // header.
+  while (len > 0 && (len < SPLICE_MIN_SIZE || conn->local)) {
+    ssize_t rc = read_some(conn, conn->in, CONN_BUFFER_SIZE);
+    if (rc <= 0) {
+      return -1;
+    }
+    conn->in_end = rc;
+
+    take = len < (size_t)rc ? len : (size_t)rc;
+    if (write_all(fd, conn->in, take) == -1) {
+      conn->in_start = rc;
+      return -2;
+    }
+    conn->in_start = take;
+    len -= take;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  int rc = recv_to_file(conn->fd, fd, len);
+  if (rc == 0) {
+    conn->received += len;
+  }
+  return rc;
+}
@@ -0,0 +1,218 @@
+/**
+ * conn.h
+ *
+ * Buffered reads and writes on a connected socket. Small writes are collected
+ * in a buffer and go out together, and reads are served from a buffer that is
+ * refilled a large piece at a time, so each message or file header doesn't
+ * cost its own syscalls.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "transfer.h"
+
+// Size of the read and write buffers of a connection
+#define CONN_BUFFER_SIZE 0x10000
+
+// Most file descriptors passed over a connection that are held until they're
+// taken. Any more are closed as they arrive.
+#define CONN_MAX_FDS 8
+
+// A socket along with its buffers
+typedef struct {
+  int fd;
+  int version;  //< wire format version spoken, 0 until a handshake picks one
+
+  uint8_t* out;    //< data written but not yet sent
+  size_t out_len;  //< number of bytes in out
+
+  uint8_t* in;       //< data received but not yet read
+  size_t in_start;   //< index of the first unread byte in in
+  size_t in_end;     //< index just past the last unread byte in in
+
+  zerocopy_t zc;  //< state of zero-copy sends on the socket
+
+  bool local;             //< over a Unix socket, so file descriptors can be passed
+  int fds[CONN_MAX_FDS];  //< passed along with what has been read, oldest first
+  size_t num_fds;
+
+  // File everything sent is copied into as well, or -1. Set back to -1 if
+  // copying fails, which doesn't fail the send itself.
+  int tee_fd;
+
+  // Whether reads only use what is already buffered. Reading past it then fails
+  // with EWOULDBLOCK instead of waiting on the socket, and leaves the buffer
+  // alone, so a caller can put in_start back and try again once conn_fill has
+  // read more.
+  bool buffered_only;
+
+  // Number of syscalls made on the socket, and bytes received, for measuring
+  size_t reads;
+  size_t writes;
+  size_t received;
+} conn_t;
+
+/**
+ * Set up a connection over an open socket.
+ *
+ * \param conn  Connection to initialize
+ * \param fd    File descriptor of a connected socket
+ * \return      0 if there were no errors, -1 otherwise
+ */
+int conn_init(conn_t* conn, int fd);
+
+/**
+ * Free the buffers of a connection, and close any file descriptors passed over
+ * it that were never taken. Does not close the socket, and drops any data that
+ * hasn't been flushed.
+ *
+ * \param conn  Connection to free
+ */
+void conn_free(conn_t* conn);
+
+/**
+ * Write data to a connection. Small writes are buffered until there is a
+ * buffer's worth of them or the connection is flushed. Anything that doesn't
+ * fit goes out in the same syscall as what was buffered before it.
+ *
+ * \param conn  Connection to write to
+ * \param data  Data to write
+ * \param len   Number of bytes to write
+ * \return      0 if there were no errors, -1 otherwise
+ */
+int conn_write(conn_t* conn, const void* data, size_t len);
+
+/**
+ * Send everything buffered on a connection.
+ *
+ * \param conn  Connection to flush
+ * \return      0 if there were no errors, -1 otherwise
+ */
+int conn_flush(conn_t* conn);
+
+/**
+ * Pass an open file descriptor over a Unix socket, along with everything
+ * buffered. It arrives no later than the last byte buffered, so the other end
+ * knows to take it once it has read that far.
+ *
+ * \param conn  Local connection to write to, with at least one byte buffered
+ * \param fd    File descriptor to pass. The caller still has to close its own.
+ * \return      0 if there were no errors, -1 otherwise
+ */
+int conn_write_fd(conn_t* conn, int fd);
+
+/**
+ * Write file contents held in memory to a connection. Large contents are sent
+ * with zero-copy, so they must not change until conn_wait returns.
+ *
+ * \param conn  Connection to write to
+ * \param data  Data to send
+ * \param len   Number of bytes to send
+ * \return      0 if there were no errors, -1 otherwise
+ */
+int conn_write_memory(conn_t* conn, const uint8_t* data, size_t len);
+
+/**
+ * Write bytes from an open file to a connection, starting at the file's
+ * current offset. Small amounts are read straight into the write buffer, large
+ * ones are sent with sendfile.
+ *
+ * \param conn  Connection to write to
+ * \param fd    File descriptor of the file to read from
+ * \param len   Number of bytes to send
+ * \return      0 if there were no errors, -1 otherwise. errno is set to 0 if
+ *              the file ended before len bytes were sent.
+ */
+int conn_write_file(conn_t* conn, int fd, size_t len);
+
+/**
+ * Wait until the kernel is done with all memory passed to conn_write_memory.
+ *
+ * \param conn  Connection to wait on
+ * \return      0 if there were no errors, -1 otherwise
+ */
+int conn_wait(conn_t* conn);
+
+/**
+ * Read an exact number of bytes from a connection.
+ *
+ * \param conn  Connection to read from
+ * \param data  Space to read into
+ * \param len   Number of bytes to read
+ * \return      0 if everything was read, -1 otherwise. errno is set to 0 if the
+ *              other end closed the connection early.
+ */
+int conn_read(conn_t* conn, void* data, size_t len);
+
+/**
+ * Take the oldest file descriptor passed over a connection along with what has
+ * been read from it so far.
+ *
+ * \param conn  Connection to take it from
+ * \return      The file descriptor, which the caller has to close, or -1 if
+ *              none was passed
+ */
+int conn_read_fd(conn_t* conn);
+
+/**
+ * Read whatever the socket has ready into the read buffer, without waiting for
+ * more. Unread data is first moved to the front of the buffer to make room.
+ * The socket should be non-blocking.
+ *
+ * \param conn  Connection to read from
+ * \return      0 if there were no errors, even if nothing was ready or the
+ *              buffer was already full, -1 otherwise. errno is set to 0 if the
+ *              other end closed the connection and nothing came before that.
+ */
+int conn_fill(conn_t* conn);
+
+/**
+ * Look at the next bytes that will be read from a connection without consuming
+ * them, waiting for them to arrive if needed.
+ *
+ * \param conn  Connection to read from
+ * \param len   Number of bytes to look at, at most CONN_BUFFER_SIZE
+ * \return      Pointer to the bytes in the read buffer, valid until the next
+ *              read, or NULL on error. errno is set to 0 if the other end
+ *              closed the connection early.
+ */
+uint8_t* conn_peek(conn_t* conn, size_t len);
+
+/**
+ * Write an unsigned integer to a connection as a LEB128 varint: seven bits per
+ * byte, least significant first, with the top bit set on every byte but the
+ * last.
+ *
+ * \param conn   Connection to write to
+ * \param value  Value to write
+ * \return       0 if there were no errors, -1 otherwise
+ */
+int conn_write_varint(conn_t* conn, uint64_t value);
+
+/**
+ * Read a LEB128 varint written by conn_write_varint.
+ *
+ * \param conn   Connection to read from
+ * \param value  Output for the value read
+ * \return       0 if there were no errors, -1 otherwise. errno is set to 0 if
+ *               the other end closed the connection early, or EPROTO if the
+ *               varint was malformed.
+ */
+int conn_read_varint(conn_t* conn, uint64_t* value);
+
+/**
+ * Read bytes from a connection into an open file, starting at the file's
+ * current offset. Anything already buffered is written first, then the rest is
+ * spliced from the socket, unless it's local. Splicing would drop any file
+ * descriptors passed along.
+ *
+ * \param conn  Connection to read from
+ * \param fd    File descriptor of the file to write to
+ * \param len   Number of bytes to receive
+ * \return      Same as recv_to_file
+ */
+int conn_read_file(conn_t* conn, int fd, size_t len);
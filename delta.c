@@ -0,0 +1,441 @@
+#include "delta.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checksum.h"
+
+// Marks the end of a chain in the table of weak checksums
+#define NO_BLOCK SIZE_MAX
+
+size_t delta_block_len(size_t size) {
+  // The smallest power of two at least the square root
+  size_t len = DELTA_MIN_BLOCK;
+  while (len < DELTA_MAX_BLOCK && len * len < size) {
+    len *= 2;
+  }
+  return len;
+}
+
+/**
+ * Compute the two halves of the rolling checksum of a block.
+ *
+ * \param data  Block to checksum
+ * \param len   Number of bytes in the block
+ * \param a     Set to the sum of the bytes
+ * \param b     Set to the sum of the bytes, each weighted by how far from the
+ *              end of the block it is
+ */
+static void weak_parts(const uint8_t* data, size_t len, uint32_t* a, uint32_t* b) {
+  *a = 0;
+  *b = 0;
+  for (size_t i = 0; i < len; i++) {
+    *a += data[i];
+    *b += (uint32_t)(len - i) * data[i];
+  }
+}
+
+/**
+ * Combine the two halves of a rolling checksum, 16 bits each.
+ */
+static uint32_t weak_sum(uint32_t a, uint32_t b) {
+  return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * Compute the signature of one regular file and add it to a set.
+ *
+ * \param path   Path to the file on disk
+ * \param rel    Path to the file relative to the top of the copy
+ * \param sigs   Signatures to add to
+ * \param cap    Number of signatures there is space for. Grown as needed.
+ * \return       0 if there were no errors, -1 otherwise
+ */
+static int sign_file(char* path, char* rel, delta_sigs_t* sigs, size_t* cap) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror("Failed to open file to compare against");
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror("Failed to stat file to compare against");
+    close(fd);
+    return -1;
+  }
+
+  // Small files are cheaper to send whole than to sign, and so are files past
+  // the limits
+  size_t block_len = delta_block_len(st.st_size);
+  size_t num_blocks = (st.st_size + block_len - 1) / block_len;
+  if (st.st_size < DELTA_MIN_SIZE || sigs->num_files >= DELTA_MAX_FILES ||
+      num_blocks > DELTA_MAX_BLOCKS - sigs->num_blocks) {
+    close(fd);
+    return 0;
+  }
+
+  if (sigs->num_files == *cap) {
+    size_t new_cap = *cap * 2 + 16;
+    delta_sig_t* files = realloc(sigs->files, new_cap * sizeof(delta_sig_t));
+    if (files == NULL) {
+      close(fd);
+      return -1;
+    }
+    sigs->files = files;
+    *cap = new_cap;
+  }
+
+  delta_sig_t* sig = &sigs->files[sigs->num_files];
+  sig->size = st.st_size;
+  sig->num_blocks = num_blocks;
+  sig->path = strdup(rel);
+  sig->blocks = malloc(sig->num_blocks * sizeof(delta_block_t));
+  uint8_t* buf = malloc(block_len);
+  if (sig->path == NULL || sig->blocks == NULL || buf == NULL) {
+    free(sig->path);
+    free(sig->blocks);
+    free(buf);
+    close(fd);
+    return -1;
+  }
+
+  int rc = 0;
+  for (size_t i = 0; i < sig->num_blocks && rc == 0; i++) {
+    size_t len = i == sig->num_blocks - 1 ? sig->size - i * block_len : block_len;
+    if (pread(fd, buf, len, i * block_len) != len) {
+      fprintf(stderr, "File %s changed while being compared against\n", path);
+      rc = -1;
+      break;
+    }
+    uint32_t a, b;
+    weak_parts(buf, len, &a, &b);
+    sig->blocks[i].weak = weak_sum(a, b);
+    sig->blocks[i].strong = hash64(buf, len);
+  }
+  free(buf);
+  close(fd);
+
+  if (rc == -1) {
+    free(sig->path);
+    free(sig->blocks);
+    return -1;
+  }
+  sigs->num_files++;
+  sigs->num_blocks += num_blocks;
+  return 0;
+}
+
+/**
+ * Compute the signatures of a file, recursing into directories.
+ *
+ * \param path  Path to the file on disk
+ * \param rel   Path to the file relative to the top of the copy
+ * \param sigs  Signatures to add to
+ * \param cap   Number of signatures there is space for. Grown as needed.
+ * \return      0 if there were no errors, -1 otherwise
+ */
+static int sign_entry(char* path, char* rel, delta_sigs_t* sigs, size_t* cap) {
+  struct stat st;
+  if (lstat(path, &st) == -1) {
+    perror("Failed to stat file to compare against");
+    return -1;
+  }
+  if (S_ISREG(st.st_mode)) {
+    return sign_file(path, rel, sigs, cap);
+  } else if (!S_ISDIR(st.st_mode)) {
+    // Nothing else gets given, so there's nothing to compare against
+    return 0;
+  }
+
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    perror("Failed to open directory to compare against");
+    return -1;
+  }
+
+  int rc = 0;
+  struct dirent* entry;
+  while (rc == 0 && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+
+    char child_path[strlen(path) + strlen(entry->d_name) + 2];
+    sprintf(child_path, "%s/%s", path, entry->d_name);
+    char child_rel[strlen(rel) + strlen(entry->d_name) + 2];
+    sprintf(child_rel, "%s%s%s", rel, rel[0] != '\0' ? "/" : "", entry->d_name);
+    if (strlen(child_rel) > PATH_MAX) {
+      continue;
+    }
+    rc = sign_entry(child_path, child_rel, sigs, cap);
+  }
+  closedir(dir);
+  return rc;
+}
+
+delta_sigs_t* delta_sign(char* path) {
+  delta_sigs_t* sigs = calloc(1, sizeof(delta_sigs_t));
+  if (sigs == NULL) {
+    return NULL;
+  }
+  size_t cap = 0;
+  if (sign_entry(path, "", sigs, &cap) == -1 || delta_sort(sigs) == -1) {
+    delta_free(sigs);
+    return NULL;
+  }
+  return sigs;
+}
+
+static int compare_sigs(const void* a, const void* b) {
+  return strcmp(((delta_sig_t*)a)->path, ((delta_sig_t*)b)->path);
+}
+
+int delta_sort(delta_sigs_t* sigs) {
+  if (sigs->num_files == 0) {
+    return 0;
+  }
+  qsort(sigs->files, sigs->num_files, sizeof(delta_sig_t), compare_sigs);
+  for (size_t i = 1; i < sigs->num_files; i++) {
+    if (strcmp(sigs->files[i - 1].path, sigs->files[i].path) == 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+delta_sig_t* delta_find(delta_sigs_t* sigs, char* path) {
+  if (sigs->num_files == 0) {
+    return NULL;
+  }
+  delta_sig_t key = {.path = path};
+  return bsearch(&key, sigs->files, sigs->num_files, sizeof(delta_sig_t), compare_sigs);
+}
+
+void delta_free(delta_sigs_t* sigs) {
+  if (sigs == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < sigs->num_files; i++) {
+    free(sigs->files[i].path);
+    free(sigs->files[i].blocks);
+  }
+  free(sigs->files);
+  free(sigs);
+}
+
+// Steps being worked out by delta_match
+typedef struct {
+  delta_op_t* ops;
+  size_t num_ops;
+  size_t cap;
+} ops_t;
+
+/**
+ * Add a step, growing the array as needed.
+ *
+ * \return  0 if there were no errors, -1 if out of memory
+ */
+static int add_op(ops_t* ops, bool copy, size_t start, size_t len) {
+  if (ops->num_ops == ops->cap) {
+    size_t new_cap = ops->cap * 2 + 16;
+    delta_op_t* grown = realloc(ops->ops, new_cap * sizeof(delta_op_t));
+    if (grown == NULL) {
+      return -1;
+    }
+    ops->ops = grown;
+    ops->cap = new_cap;
+  }
+  ops->ops[ops->num_ops++] = (delta_op_t){copy, start, len};
+  return 0;
+}
+
+/**
+ * Add the new bytes between two offsets, split into runs of at most
+ * DELTA_MAX_BLOCK bytes.
+ */
+static int add_literal(ops_t* ops, size_t from, size_t to) {
+  while (from < to) {
+    size_t len = to - from < DELTA_MAX_BLOCK ? to - from : DELTA_MAX_BLOCK;
+    if (add_op(ops, false, from, len) == -1) {
+      return -1;
+    }
+    from += len;
+  }
+  return 0;
+}
+
+/**
+ * Add a copy of one block, merged into the step before it if that copied the
+ * block right before.
+ */
+static int add_copy(ops_t* ops, size_t block) {
+  delta_op_t* last = ops->num_ops > 0 ? &ops->ops[ops->num_ops - 1] : NULL;
+  if (last != NULL && last->copy && last->start + last->len == block) {
+    last->len++;
+    return 0;
+  }
+  return add_op(ops, true, block, 1);
+}
+
+// Part of the new contents delta_match is looking at
+typedef struct {
+  delta_read_fn_t read;
+  void* arg;
+  size_t size;          //< of the whole contents
+  uint8_t* buf;         //< DELTA_WINDOW bytes to read into
+  const uint8_t* data;  //< contents from start on, or NULL before the first read
+  size_t start;
+  size_t len;
+} window_t;
+
+/**
+ * Get at some of the new contents, moving the window to start there if they
+ * aren't in it already.
+ *
+ * \param win     Window over the contents
+ * \param offset  Where in the contents to start
+ * \param len     Number of bytes needed, at most DELTA_WINDOW
+ * \return        The contents, or NULL if they couldn't be read
+ */
+static const uint8_t* window_at(window_t* win, size_t offset, size_t len) {
+  if (win->data == NULL || offset < win->start || offset + len > win->start + win->len) {
+    win->start = offset;
+    win->len = win->size - offset < DELTA_WINDOW ? win->size - offset : DELTA_WINDOW;
+    win->data = win->read(win->arg, win->start, win->len, win->buf);
+    if (win->data == NULL) {
+      return NULL;
+    }
+  }
+  return win->data + (offset - win->start);
+}
+
+delta_op_t* delta_match(delta_sig_t* sig, size_t size, delta_read_fn_t read, void* arg,
+                        size_t* num_ops) {
+  size_t block_len = delta_block_len(sig->size);
+  size_t tail_len = sig->num_blocks > 0 ? sig->size - (sig->num_blocks - 1) * block_len : 0;
+  size_t full_blocks = tail_len == block_len ? sig->num_blocks : sig->num_blocks - 1;
+
+  // Chain together the full blocks with the same rolling checksum, earliest
+  // first
+  size_t num_buckets = 16;
+  while (num_buckets < full_blocks * 2) {
+    num_buckets *= 2;
+  }
+  size_t* heads = malloc(num_buckets * sizeof(size_t));
+  size_t* next = malloc((full_blocks + 1) * sizeof(size_t));
+  window_t win = {read, arg, size, malloc(DELTA_WINDOW), NULL, 0, 0};
+  ops_t ops = {0};
+  if (heads == NULL || next == NULL || win.buf == NULL) {
+    free(heads);
+    free(next);
+    free(win.buf);
+    return NULL;
+  }
+  for (size_t i = 0; i < num_buckets; i++) {
+    heads[i] = NO_BLOCK;
+  }
+  for (size_t i = full_blocks; i-- > 0;) {
+    size_t bucket = sig->blocks[i].weak & (num_buckets - 1);
+    next[i] = heads[bucket];
+    heads[bucket] = i;
+  }
+
+  // Slide a window over the new contents. Bytes the window passes without a
+  // match are sent as they are.
+  size_t pos = 0;
+  size_t literal = 0;
+  bool have_window = false;
+  uint32_t a = 0, b = 0;
+  int rc = 0;
+  while (rc == 0 && pos + block_len <= size && full_blocks > 0) {
+    // The window and the byte after it, if there is one
+    const uint8_t* data = window_at(&win, pos, block_len + (pos + block_len < size));
+    if (data == NULL) {
+      rc = -1;
+      break;
+    }
+    if (!have_window) {
+      weak_parts(data, block_len, &a, &b);
+      have_window = true;
+    }
+
+    // Only hash the window if some block has the same rolling checksum
+    uint32_t weak = weak_sum(a, b);
+    size_t match = NO_BLOCK;
+    bool hashed = false;
+    uint64_t strong = 0;
+    for (size_t i = heads[weak & (num_buckets - 1)]; i != NO_BLOCK; i = next[i]) {
+      if (sig->blocks[i].weak != weak) {
+        continue;
+      }
+      if (!hashed) {
+        strong = hash64(data, block_len);
+        hashed = true;
+      }
+      if (sig->blocks[i].strong == strong) {
+        match = i;
+        break;
+      }
+    }
+
+    if (match != NO_BLOCK) {
+      rc = add_literal(&ops, literal, pos);
+      if (rc == 0) {
+        rc = add_copy(&ops, match);
+      }
+      pos += block_len;
+      literal = pos;
+      have_window = false;
+      continue;
+    }
+    if (pos + block_len == size) {
+      break;
+    }
+
+    // Roll the window forward a byte
+    uint8_t out = data[0];
+    uint8_t in = data[block_len];
+    a = a - out + in;
+    b = b - (uint32_t)block_len * out + a;
+    pos++;
+  }
+
+  // The last block of the old file may be shorter than the rest, in which case
+  // it can only match the very end of the new contents
+  if (rc == 0 && tail_len > 0 && tail_len < block_len && size >= literal + tail_len) {
+    const uint8_t* end = window_at(&win, size - tail_len, tail_len);
+    delta_block_t* last = &sig->blocks[sig->num_blocks - 1];
+    if (end == NULL) {
+      rc = -1;
+    } else {
+      weak_parts(end, tail_len, &a, &b);
+      if (weak_sum(a, b) == last->weak && hash64(end, tail_len) == last->strong) {
+        rc = add_literal(&ops, literal, size - tail_len);
+        if (rc == 0) {
+          rc = add_copy(&ops, sig->num_blocks - 1);
+        }
+        literal = size;
+      }
+    }
+  }
+  if (rc == 0) {
+    rc = add_literal(&ops, literal, size);
+  }
+
+  free(heads);
+  free(next);
+  free(win.buf);
+  if (rc == -1) {
+    free(ops.ops);
+    return NULL;
+  }
+
+  // Files with nothing in them have no steps, which isn't an error
+  *num_ops = ops.num_ops;
+  return ops.ops != NULL ? ops.ops : malloc(1);
+}
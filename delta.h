@@ -0,0 +1,136 @@
+/**
+ * delta.h
+ *
+ * Send only what changed in files the taker already has an older copy of. The
+ * taker splits each file of its copy into blocks and sends a signature of
+ * every block: a weak checksum that can be rolled along a byte at a time, and
+ * a stronger hash to confirm matches. The give slides a window over the new
+ * contents looking for blocks the taker already has, and sends the rest as
+ * literal bytes.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Files smaller than this are sent whole. Their signatures would cost about as
+// much as they do.
+#define DELTA_MIN_SIZE 0x400
+
+// Bounds on the size of blocks. Between them, blocks are the power of two
+// nearest above the square root of the file size, which balances the size of
+// the signature against how much around each change gets sent again.
+#define DELTA_MIN_BLOCK 0x400
+#define DELTA_MAX_BLOCK 0x20000
+
+// Most blocks, files and bytes of paths signed in one copy, which keeps the
+// signatures a give has to hold for each taker under a hundred megabytes.
+// Files past them are sent whole.
+#define DELTA_MAX_BLOCKS (1 << 21)
+#define DELTA_MAX_FILES (1 << 18)
+#define DELTA_MAX_PATH_BYTES (1 << 24)
+
+// Signature of one block of the taker's copy of a file
+typedef struct {
+  uint32_t weak;    //< rolling checksum
+  uint64_t strong;  //< hash to confirm a match of the rolling checksum
+} delta_block_t;
+
+// Signature of one file of the taker's copy
+typedef struct {
+  char* path;  //< malloc'd, relative to the top of the copy. "" for the top
+               //< itself when it's a regular file.
+  size_t size;
+  size_t num_blocks;
+  delta_block_t* blocks;  //< malloc'd
+} delta_sig_t;
+
+// Signatures of every file of the taker's copy, sorted by path
+typedef struct {
+  size_t num_files;
+  size_t num_blocks;  //< blocks in every file put together
+  delta_sig_t* files;
+} delta_sigs_t;
+
+// One step of rebuilding a file from the taker's copy
+typedef struct {
+  bool copy;     //< copy blocks of the old file, rather than send new bytes
+  size_t start;  //< first block to copy, or offset of the bytes in the new file
+  size_t len;    //< number of blocks to copy, or number of bytes to send
+} delta_op_t;
+
+// Bytes of new contents delta_match holds at once. Enough for several of the
+// largest blocks, so the window is only refilled now and then.
+#define DELTA_WINDOW (8 * DELTA_MAX_BLOCK)
+
+/**
+ * Get at part of the new contents of a file, for delta_match.
+ *
+ * \param arg     Argument passed to delta_match
+ * \param offset  Where in the contents to start
+ * \param len     Number of bytes to get, never past the end of the contents
+ * \param buf     At least len bytes the contents can be read into
+ * \return        The contents, either in buf or wherever they already are, or
+ *                NULL on error
+ */
+typedef const uint8_t* (*delta_read_fn_t)(void* arg, size_t offset, size_t len, uint8_t* buf);
+
+/**
+ * Get the size of the blocks a file is split into.
+ *
+ * \param size  Size of the file
+ * \return      Number of bytes in every block but the last
+ */
+size_t delta_block_len(size_t size);
+
+/**
+ * Compute the signatures of every regular file in a copy on disk.
+ *
+ * \param path  File or directory to sign
+ * \return      Malloc'd signatures, or NULL on error
+ */
+delta_sigs_t* delta_sign(char* path);
+
+/**
+ * Sort signatures by path so delta_find can look them up. Fails if a path
+ * shows up twice.
+ *
+ * \param sigs  Signatures to sort
+ * \return      0 if there were no errors, -1 otherwise
+ */
+int delta_sort(delta_sigs_t* sigs);
+
+/**
+ * Look up the signature of a file.
+ *
+ * \param sigs  Sorted signatures
+ * \param path  Path of the file, relative to the top of the copy
+ * \return      The signature, or NULL if there is none
+ */
+delta_sig_t* delta_find(delta_sigs_t* sigs, char* path);
+
+/**
+ * Free signatures along with everything in them.
+ *
+ * \param sigs  Signatures to free. May be NULL.
+ */
+void delta_free(delta_sigs_t* sigs);
+
+/**
+ * Work out how to build new contents out of blocks of the old file and new
+ * bytes. The new contents are read DELTA_WINDOW bytes at a time, so they don't
+ * need to be in memory all at once.
+ *
+ * \param sig       Signature of the old file
+ * \param size      Size of the new contents
+ * \param read      Called to get at the new contents
+ * \param arg       Passed to read
+ * \param num_ops   Set to the number of steps
+ * \return          Malloc'd steps, in order, or NULL if out of memory or read
+ *                  failed. Copies of consecutive blocks are merged, and literal
+ *                  runs are no longer than DELTA_MAX_BLOCK.
+ */
+delta_op_t* delta_match(delta_sig_t* sig, size_t size, delta_read_fn_t read, void* arg,
+                        size_t* num_ops);
@@ -1,57 +1,391 @@
+#define _GNU_SOURCE
 #include "filereader.h"
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "checksum.h"
+#include "pool.h"
+#include "transfer.h"
+#include "uring.h"
 #include "utils.h"
 
-// Refuse to store more than 256MB of file data
-#define MAX_FILE_STORAGE 0x10000000
-size_t file_storage_used = 0;
+atomic_size_t file_storage_used = 0;
+
+// Regular files at least this big that take up less than half their size on
+// disk are left there and streamed, even when contents are read into memory,
+// so their holes are neither read nor held
+#define SPARSE_MIN_SIZE 0x100000
+
+// Shared state of a read that is spread over a pool of threads
+typedef struct {
+  pool_t* pool;
+  read_opts_t* opts;
+  atomic_bool failed;  //< set as soon as any entry fails to read
+  atomic_int error;    //< errno of the first entry that failed
+} walk_t;
+
+// A regular file being checked for having the same contents as others
+typedef struct {
+  file_t* file;
+  size_t order;      //< position in the order files are sent
+  uint64_t hash[2];  //< hash of the contents, once computed
+} dedup_entry_t;
+
+// One directory to be read by a pool worker as part of a walk
+typedef struct {
+  walk_t* walk;
+  char* path;  //< malloc'd, ending in /. Freed once the directory has been read.
+  file_t* file;
+  arena_t* arena;
+} walk_task_t;
+
+// One entry of a directory as it is listed
+typedef struct {
+  char* name;          //< allocated from the tree's arena
+  unsigned char type;  //< DT_ type, or DT_UNKNOWN
+} listed_t;
+
+// Bytes of directory entries to ask the kernel for at once
+#define DIRENT_BUFFER_SIZE 0x10000
+
+/**
+ * Free the contents held in memory of one regular file.
+ */
+static void free_regular(file_t* file) {
+  // Contents shared with an earlier file are freed along with that one. What
+  // they took out of the storage limit is handed back, for a broker that goes
+  // on to read other gives.
+  if ((file->same == NULL || file->same == file) && file->contents.data != NULL) {
+    free(file->contents.data);
+    atomic_fetch_sub(&file_storage_used, file->size);
+  }
+}
+
+/**
+ * Free the contents held in memory of every regular file in a tree that
+ * hasn't been laid out flat.
+ */
+static void free_contents(file_t* file) {
+  if (file->type == F_REG) {
+    free_regular(file);
+  } else if (file->contents.entries != NULL) {
+    // Entries that were never filled in are still NULL
+    for (size_t i = 0; i < file->size; i++) {
+      if (file->contents.entries[i] != NULL) {
+        free_contents(file->contents.entries[i]);
+      }
+    }
+  }
+}
 
 void free_file(file_t* file) {
   if (file == NULL) {
     return;
   }
-  free(file->name);
-  switch (file->type) {
-    case F_REG:
-      // Regular files just need to have their data freed
-      free(file->contents.data);
-      break;
-    case F_DIR:
-      // For directories, we need to recursively free all the entries
-      for (size_t i = 0; i < file->size; i++) {
-        free_file(file->contents.entries[i]);
-      }
 
-      // Then, we can free where the entries are stored
-      free(file->contents.entries);
-      break;
+  // Everything else in the tree, names and paths included, goes with the arena
+  if (file->flat != NULL) {
+    for (size_t i = 0; i < file->flat->count; i++) {
+      if (file->flat->entries[i].type == F_REG) {
+        free_regular(file->flat->entries[i].file);
+      }
+    }
+  } else {
+    free_contents(file);
+  }
+  if (file->arena != NULL) {
+    arena_destroy(file->arena);
   }
   free(file);
 }
 
+// An entry waiting to be laid out flat
+typedef struct {
+  file_t* file;   //< the entry in the old tree
+  file_t** slot;  //< where to point to its copy, or NULL for the top
+  size_t parent;  //< index of the directory it is in
+} pending_t;
+
+// A tree being laid out flat by flatten_file
+typedef struct {
+  arena_t* arena;         //< new arena everything is copied into
+  flat_entry_t* entries;  //< entries laid out so far
+  size_t count;           //< number of them
+  file_t* top;            //< where the file at the top is copied to
+  file_t* nodes;          //< copies of every entry but the top, in order
+  file_t** lists;         //< lists of entries of every directory, one after another
+  size_t listed;          //< slots of lists used so far
+  char* names;            //< table every name is copied into
+  size_t names_used;      //< bytes of it used so far
+  pending_t* pending;     //< entries still to be laid out, the next one last
+  size_t num_pending;
+} flattener_t;
+
+/**
+ * Count the entries in a tree, including the file at the top, and the bytes
+ * their names take up with their terminators.
+ */
+static size_t count_tree(file_t* file, size_t* name_bytes) {
+  size_t count = 1;
+  *name_bytes += strlen(file->name) + 1;
+  if (file->type == F_DIR) {
+    for (size_t i = 0; i < file->size; i++) {
+      count += count_tree(file->contents.entries[i], name_bytes);
+    }
+  }
+  return count;
+}
+
 /**
- * Read a regular file into a pointer.
+ * Copy the next entry into the next place of a flat tree, and queue up the
+ * entries inside it to be placed right after.
  *
- * \param path  Path to the file
- * \param file  Pointer to file struct. Data will be filled out.
- * \return      0 if everything went well, -1 on error
+ * \param flat  Tree being laid out
+ * \param next  Entry to place
+ * \return      0 on success, -1 if out of memory
  */
-int read_regular(char* path, file_t* file) {
+static int place_entry(flattener_t* flat, pending_t* next) {
+  size_t index = flat->count++;
+  file_t* file = next->file;
+  file_t* copy = index == 0 ? flat->top : &flat->nodes[index - 1];
+  char* path = NULL;
+  if (file->type == F_REG && file->path != NULL &&
+      (path = arena_strdup(flat->arena, file->path)) == NULL) {
+    return -1;
+  }
+
+  size_t name_len = strlen(file->name);
+  char* name = flat->names + flat->names_used;
+  memcpy(name, file->name, name_len + 1);
+  flat->entries[index] = (flat_entry_t){
+      .file = copy,
+      .type = file->type,
+      .mode = file->mode,
+      .size = file->size,
+      .name = flat->names_used,
+      .name_len = name_len,
+      .parent = next->parent,
+      .end = index + 1,
+  };
+  flat->names_used += name_len + 1;
+
+  file_t** entries = file->contents.entries;
+  *copy = *file;
+  copy->name = name;
+  if (next->slot != NULL) {
+    *next->slot = copy;
+  }
+  if (file->type == F_REG) {
+    copy->path = path;
+    return 0;
+  }
+
+  // The entries go on last first, so they come off in order
+  file_t** list = &flat->lists[flat->listed];
+  flat->listed += file->size;
+  copy->contents.entries = list;
+  for (size_t i = file->size; i > 0; i--) {
+    flat->pending[flat->num_pending++] = (pending_t){entries[i - 1], &list[i - 1], index};
+  }
+  return 0;
+}
+
+int flatten_file(file_t* file) {
+  size_t name_bytes = 0;
+  size_t count = count_tree(file, &name_bytes);
+  flattener_t flat = {.arena = arena_create(), .top = file};
+  if (flat.arena == NULL) {
+    return -1;
+  }
+  flat_t* table = arena_alloc(flat.arena, sizeof(flat_t));
+  flat.entries = arena_alloc(flat.arena, count * sizeof(flat_entry_t));
+  flat.nodes = arena_alloc(flat.arena, (count - 1) * sizeof(file_t));
+  flat.lists = arena_alloc(flat.arena, (count - 1) * sizeof(file_t*));
+  flat.names = arena_string(flat.arena, name_bytes - 1);
+  flat.pending = malloc(count * sizeof(pending_t));
+
+  // The file at the top is copied over in place, so put it back as it was if
+  // anything fails
+  file_t top = *file;
+  int rc = -1;
+  if (table != NULL && flat.entries != NULL && flat.nodes != NULL && flat.lists != NULL &&
+      flat.names != NULL && flat.pending != NULL) {
+    flat.pending[flat.num_pending++] = (pending_t){&top, NULL, 0};
+    rc = 0;
+  }
+  while (rc == 0 && flat.num_pending > 0) {
+    rc = place_entry(&flat, &flat.pending[--flat.num_pending]);
+  }
+  free(flat.pending);
+  if (rc == -1) {
+    *file = top;
+    arena_destroy(flat.arena);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // Everything inside a directory comes after it, so going backwards, each
+  // entry's end is known by the time it's passed up to its directory
+  for (size_t i = count - 1; i > 0; i--) {
+    flat_entry_t* parent = &flat.entries[flat.entries[i].parent];
+    if (flat.entries[i].end > parent->end) {
+      parent->end = flat.entries[i].end;
+    }
+  }
+
+  *table = (flat_t){flat.entries, count, flat.names};
+  arena_destroy(top.arena);
+  file->arena = flat.arena;
+  file->flat = table;
+  return 0;
+}
+
+/**
+ * Record the metadata of a regular file without reading its contents. The
+ * path is stored so the contents can be streamed from disk when sent.
+ *
+ * \param dir       Directory the file is in, or AT_FDCWD
+ * \param dir_path  Path to that directory, ending in /, or "" for AT_FDCWD
+ * \param name      Name of the file in dir
+ * \param st        Result of stat on the file
+ * \param file      Pointer to file struct. Metadata will be filled out.
+ * \param arena     Arena to allocate the path from
+ * \return          0 if everything went well, -1 on error
+ */
+int stream_regular(int dir, char* dir_path, char* name, struct stat* st, file_t* file,
+                   arena_t* arena) {
+  // Make sure we will actually be able to read it later
+  if (faccessat(dir, name, R_OK, 0) == -1) {
+    perror("Failed to open regular file");
+    return -1;
+  }
+
+  file->size = st->st_size;
+  file->mode = st->st_mode;
+  file->mtime = st->st_mtim;
+  file->dev = st->st_dev;
+  file->ino = st->st_ino;
+
+  size_t dir_len = strlen(dir_path);
+  file->path = arena_string(arena, dir_len + strlen(name));
+  if (file->path == NULL) {
+    perror("Failed to copy file path");
+    return -1;
+  }
+  memcpy(file->path, dir_path, dir_len);
+  strcpy(file->path + dir_len, name);
+
+  return 0;
+}
+
+/**
+ * Check whether the result of stat on a streamed file still matches what was
+ * recorded when it was given.
+ */
+static bool same_as_given(file_t* file, struct stat* st) {
+  return S_ISREG(st->st_mode) && st->st_dev == file->dev && st->st_ino == file->ino &&
+         st->st_size == file->size && st->st_mtim.tv_sec == file->mtime.tv_sec &&
+         st->st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+int open_streamed(file_t* file) {
+  int fd = open(file->path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (!same_as_given(file, &st)) {
+    close(fd);
+    errno = 0;
+    return -1;
+  }
+  return fd;
+}
+
+bool streamed_changed(file_t* file) {
+  struct stat st;
+  return stat(file->path, &st) == -1 || !same_as_given(file, &st);
+}
+
+const uint8_t* read_contents(file_t* file, int fd, size_t offset, size_t len, uint8_t* buf) {
+  if (file->path == NULL) {
+    return file->contents.data + offset;
+  }
+  for (size_t done = 0; done < len;) {
+    ssize_t rc = pread(fd, buf + done, len - done, offset + done);
+    if (rc <= 0) {
+      if (rc == 0) {
+        errno = 0;
+      }
+      return NULL;
+    }
+    done += rc;
+  }
+  return buf;
+}
+
+int reserve_storage(size_t size) {
+  if (atomic_fetch_add(&file_storage_used, size) + size > MAX_FILE_STORAGE) {
+    atomic_fetch_sub(&file_storage_used, size);
+    fprintf(stderr, "File storage would exceed max of 256MB. Refusing to continue\n");
+    errno = EFBIG;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Check whether a regular file is mostly holes.
+ *
+ * \param size    Size of the file
+ * \param blocks  512-byte blocks it takes up on disk
+ * \return        true if it should be streamed rather than read
+ */
+static bool is_sparse(size_t size, size_t blocks) {
+  return size >= SPARSE_MIN_SIZE && blocks * 512 < size / 2;
+}
+
+/**
+ * Read a regular file into a pointer, or leave it on disk to be streamed if it
+ * is mostly holes.
+ *
+ * \param dir       Directory the file is in, or AT_FDCWD
+ * \param dir_path  Path to that directory, ending in /, or "" for AT_FDCWD
+ * \param name      Name of the file in dir, or its path if dir is AT_FDCWD
+ * \param file      Pointer to file struct. Data will be filled out.
+ * \param arena     Arena to allocate the path from, if it's streamed
+ * \return          0 if everything went well, -1 on error
+ */
+int read_regular(int dir, char* dir_path, char* name, file_t* file, arena_t* arena) {
   // try to open the file
-  FILE* stream = fopen(path, "r");
+  int fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+  FILE* stream = fd != -1 ? fdopen(fd, "r") : NULL;
   if (stream == NULL) {
     perror("Failed to open regular file");
+    if (fd != -1) {
+      close(fd);
+    }
     return -1;
   }
 
@@ -59,22 +393,28 @@ int read_regular(char* path, file_t* file) {
   struct stat st;
   if (fstat(fileno(stream), &st) == -1) {
     perror("Failed to stat file");
+    fclose(stream);
     return -1;
   }
   file->size = st.st_size;
   file->mode = st.st_mode;
+  if (is_sparse(st.st_size, st.st_blocks)) {
+    fclose(stream);
+    return stream_regular(dir, dir_path, name, &st, file, arena);
+  }
 
-  // Check whether storing this file puts us over self-set limit
-  if (file_storage_used + file->size > MAX_FILE_STORAGE) {
-    fprintf(stderr, "File storage would exceed max of 256MB. Refusing to continue\n");
+  // Check whether storing this file puts us over self-set limit.
+  if (reserve_storage(file->size) == -1) {
+    fclose(stream);
     return -1;
   }
 
   // Allocate space, and check that it got allocated okay
   file->contents.data = malloc(file->size);
-  file_storage_used += file->size;
   if (file->contents.data == NULL) {
     perror("Failed to malloc space for file contents");
+    atomic_fetch_sub(&file_storage_used, file->size);
+    fclose(stream);
     return -1;
   }
 
@@ -82,6 +422,9 @@ int read_regular(char* path, file_t* file) {
   if (fread(file->contents.data, 1, file->size, stream) != file->size) {
     perror("Failed to read file contents");
     free(file->contents.data);
+    file->contents.data = NULL;
+    atomic_fetch_sub(&file_storage_used, file->size);
+    fclose(stream);
     return -1;
   }
 
@@ -89,6 +432,8 @@ int read_regular(char* path, file_t* file) {
   if (fclose(stream)) {
     perror("Failed to close regular file");
     free(file->contents.data);
+    file->contents.data = NULL;
+    atomic_fetch_sub(&file_storage_used, file->size);
     return -1;
   }
 
@@ -96,111 +441,385 @@ int read_regular(char* path, file_t* file) {
   return 0;
 }
 
+static int read_directory(char* path, file_t* file, read_opts_t* opts, arena_t* arena,
+                          walk_t* walk);
+
 /**
- * Read a directory into a pointer, and all the files inside recursively.
+ * Read one directory of a walk. Runs on a pool worker.
  *
- * \param path   Path to the directory
- * \param file   Struct to read the file into
+ * \param arg  Malloc'd walk_task_t, freed here
+ */
+static void walk_directory(void* arg) {
+  walk_task_t* task = (walk_task_t*)arg;
+
+  // Once anything has failed, the rest of the walk is wasted work
+  if (!atomic_load(&task->walk->failed)) {
+    if (read_directory(task->path, task->file, task->walk->opts, task->arena, task->walk) == -1) {
+      int expected = 0;
+      atomic_compare_exchange_strong(&task->walk->error, &expected, errno);
+      atomic_store(&task->walk->failed, true);
+    }
+  }
+
+  free(task->path);
+  free(task);
+}
+
+/**
+ * Compare two listed entries by name, for qsort.
+ */
+static int compare_listed(const void* a, const void* b) {
+  return strcmp(((const listed_t*)a)->name, ((const listed_t*)b)->name);
+}
+
+/**
+ * List every entry of an open directory (except . and ..) with getdents64,
+ * many at a time.
+ *
+ * \param dir      Open directory to list
+ * \param arena    Arena to allocate the names from
+ * \param listing  Set to a malloc'd array of the entries, in no particular
+ *                 order
+ * \param count    Set to the number of entries
+ * \return         0 if everything went well, -1 on error
+ */
+static int list_directory(int dir, arena_t* arena, listed_t** listing, size_t* count) {
+  *listing = NULL;
+  *count = 0;
+  size_t cap = 0;
+  char* buf = malloc(DIRENT_BUFFER_SIZE);
+  if (buf == NULL) {
+    perror("Failed to allocate directory buffer");
+    return -1;
+  }
+
+  bool failed = false;
+  while (!failed) {
+    long len = syscall(SYS_getdents64, dir, buf, DIRENT_BUFFER_SIZE);
+    if (len == -1) {
+      perror("Failed to read directory");
+      failed = true;
+    } else if (len == 0) {
+      break;
+    }
+
+    for (long offset = 0; offset < len && !failed;) {
+      struct dirent64* entry = (struct dirent64*)(buf + offset);
+      offset += entry->d_reclen;
+
+      // Ignore the special files . and ..
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+
+      // Make space in the list of entries, doubling it when it's full
+      if (*count == cap) {
+        cap = cap > 0 ? cap * 2 : 16;
+        listed_t* grown = realloc(*listing, cap * sizeof(listed_t));
+        if (grown == NULL) {
+          perror("Failed to allocate space for entries");
+          failed = true;
+          continue;
+        }
+        *listing = grown;
+      }
+
+      // The name is kept for the entry, so it goes straight into the arena
+      char* name = arena_strdup(arena, entry->d_name);
+      if (name == NULL) {
+        perror("Failed to allocate file name");
+        failed = true;
+        continue;
+      }
+      (*listing)[(*count)++] = (listed_t){name, entry->d_type};
+    }
+  }
+
+  free(buf);
+  if (failed) {
+    free(*listing);
+    *listing = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Read one listed entry of a directory, relative to the directory. Entries
+ * that are directories are only marked as such, to be read once this
+ * directory is closed.
+ *
+ * \param dir    Open directory the entry is in
+ * \param path   Path to that directory, ending in /
+ * \param type   Type of the entry as listed, DT_UNKNOWN if the file system
+ *               doesn't say
+ * \param file   File with its name filled out, to read the entry into
+ * \param opts   Options passed on to read_file
+ * \param arena  Arena to allocate paths from
  * \return       0 if everything went well, -1 on error
  */
-int read_directory(char* path, file_t* file) {
-  DIR* dir = opendir(path);
-  if (dir == NULL) {
-    perror("Failed to open directory");
+static int read_listed(int dir, char* path, unsigned char type, file_t* file,
+                       read_opts_t* opts, arena_t* arena) {
+  // Most file systems say what type each entry is, so directories are only
+  // stat'ed once they are opened, and regular files being read once they are
+  if (type == DT_DIR) {
+    file->type = F_DIR;
+    return 0;
+  } else if (type == DT_REG && !opts->stream) {
+    file->type = F_REG;
+    return read_regular(dir, path, file->name, file, arena);
+  }
+
+  // Symbolic links are followed, like everything else that opens them does
+  struct stat st;
+  if (fstatat(dir, file->name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+      (S_ISLNK(st.st_mode) && fstatat(dir, file->name, &st, 0) == -1)) {
+    perror("Failed to stat file");
+    return -1;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    file->type = F_DIR;
+    return 0;
+  } else if (!S_ISREG(st.st_mode)) {
+    fprintf(stderr, "File %s%s is neither a regular file nor a directory!\n", path, file->name);
+    return -1;
+  }
+  file->type = F_REG;
+
+  // When streaming, the contents stay on disk until they are sent
+  if (opts->stream) {
+    return stream_regular(dir, path, file->name, &st, file, arena);
+  }
+  return read_regular(dir, path, file->name, file, arena);
+}
+
+/**
+ * Read a batch of regular files in a directory all at once through io_uring.
+ * Contents are attached to the files as soon as they are allocated, so they are
+ * freed along with the tree if anything fails. Files that are mostly holes are
+ * left on disk.
+ *
+ * \param ring   Ring to read with
+ * \param dir    Open directory the files are in
+ * \param path   Path to that directory, ending in /
+ * \param batch  Files listed as regular, with their names filled out
+ * \param count  Number of files, at most URING_MAX_FILES
+ * \param arena  Arena to allocate the paths of files left on disk from
+ * \return       0 if everything went well, -1 on error
+ */
+static int read_batch(uring_t* ring, int dir, char* path, file_t** batch, size_t count,
+                      arena_t* arena) {
+  uring_file_t files[URING_MAX_FILES];
+  for (size_t i = 0; i < count; i++) {
+    files[i] = (uring_file_t){.path = batch[i]->name};
+  }
+  if (uring_stat(ring, dir, files, count) == -1) {
+    perror("Failed to stat files");
+    return -1;
+  }
+
+  size_t to_read = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (files[i].error == EINVAL) {
+      fprintf(stderr, "File %s%s is no longer a regular file!\n", path, batch[i]->name);
+      return -1;
+    } else if (files[i].error != 0) {
+      errno = files[i].error;
+      perror("Failed to stat file");
+      return -1;
+    }
+    if (is_sparse(files[i].size, files[i].blocks)) {
+      if (read_regular(dir, path, batch[i]->name, batch[i], arena) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    batch[i]->size = files[i].size;
+    batch[i]->mode = files[i].mode;
+
+    if (reserve_storage(batch[i]->size) == -1) {
+      return -1;
+    }
+    files[i].data = malloc(batch[i]->size);
+    if (files[i].data == NULL && batch[i]->size > 0) {
+      perror("Failed to malloc space for file contents");
+      atomic_fetch_sub(&file_storage_used, batch[i]->size);
+      return -1;
+    }
+    batch[i]->contents.data = files[i].data;
+    files[to_read++] = files[i];
+  }
+
+  if (to_read > 0 && uring_read(ring, dir, files, to_read) == -1) {
+    perror("Failed to read files");
     return -1;
   }
+  for (size_t i = 0; i < to_read; i++) {
+    if (files[i].error != 0) {
+      errno = files[i].error;
+      perror("Failed to read file contents");
+      return -1;
+    }
+  }
+  return 0;
+}
 
+/**
+ * Read a directory into a pointer, and all the files inside recursively.
+ * Everything in it is found relative to the open directory, so its path is
+ * only looked up once.
+ *
+ * \param path   Path to the directory, ending in /
+ * \param file   Struct to read the file into, with its name filled out
+ * \param opts   Options passed on to read_file for each entry
+ * \param arena  Arena to allocate entries, names and paths from
+ * \param walk   Walk to hand directories inside off to, or NULL to read them
+ *               right away
+ * \return       0 if everything went well, -1 on error. When walking,
+ *               directories inside may still fail after this returns.
+ */
+static int read_directory(char* path, file_t* file, read_opts_t* opts, arena_t* arena,
+                          walk_t* walk) {
   // Set the contents and size to defaults
+  file->type = F_DIR;
   file->contents.entries = NULL;
   file->size = 0;
 
+  int dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir == -1) {
+    perror("Failed to open directory");
+    return -1;
+  }
+
   // First, stat the directory so we can get its mode
   struct stat st;
-  if (stat(path, &st) == -1) {
+  if (fstat(dir, &st) == -1) {
     perror("Failed to stat directory");
+    close(dir);
     return -1;
   }
   file->mode = st.st_mode;
 
-  // Prepare to store the paths of all entries
-  char** all_entries = NULL;
-  int num_entries = 0;
+  listed_t* listing;
+  size_t num_entries;
+  if (list_directory(dir, arena, &listing, &num_entries) == -1) {
+    close(dir);
+    return -1;
+  }
+
+  // Sort the entries, so the tree comes out the same no matter what order the
+  // file system lists them in, or how many threads read them
+  qsort(listing, num_entries, sizeof(listed_t), compare_listed);
 
-  // Read all directory entries (except . and ..)
-  struct dirent* entry;
-  while ((entry = readdir(dir)) != NULL) {
-    // Ignore the special files . and ..
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
+  file->contents.entries = arena_alloc(arena, num_entries * sizeof(file_t*));
+  if (file->contents.entries == NULL) {
+    perror("Failed to allocate directory entries");
+    free(listing);
+    close(dir);
+    return -1;
+  }
+  file->size = num_entries;
+
+  // Read everything but the directories inside while this one is open. When
+  // io_uring can be used, regular files are read a batch at a time.
+  uring_t* ring = opts->stream ? NULL : uring_thread();
+  file_t* batch[URING_MAX_FILES];
+  size_t batched = 0;
+  for (size_t i = 0; i <= num_entries; i++) {
+    bool last = i == num_entries;
+    if (batched > 0 && (last || batched == URING_MAX_FILES)) {
+      if (read_batch(ring, dir, path, batch, batched, arena) == -1) {
+        free(listing);
+        close(dir);
+        return -1;
+      }
+      batched = 0;
+    }
+    if (last) {
+      break;
     }
 
-    // Malloc space for the path to the next entry
-    int next_path_len = strlen(path) + strlen(entry->d_name);
-    char* next_path = malloc(sizeof(char) * (next_path_len + 1));
-    if (next_path == NULL) {
-      perror("Failed to allocate space for path");
+    file_t* entry_file = arena_alloc(arena, sizeof(file_t));
+    if (entry_file == NULL) {
+      perror("Failed to allocate directory entry");
+      free(listing);
+      close(dir);
+      return -1;
+    }
+    entry_file->name = listing[i].name;
+    file->contents.entries[i] = entry_file;
+    if (ring != NULL && listing[i].type == DT_REG) {
+      entry_file->type = F_REG;
+      batch[batched++] = entry_file;
+    } else if (read_listed(dir, path, listing[i].type, entry_file, opts, arena) == -1) {
+      free(listing);
+      close(dir);
       return -1;
     }
-
-    // Fill out the path to the next entry
-    strcpy(next_path, path);
-    strcat(next_path, entry->d_name);
-
-    // Realloc the list of entries one larger to make space
-    all_entries = realloc(all_entries, (num_entries + 1) * sizeof(char*));
-
-    // Store that path to be recursed into later
-    all_entries[num_entries] = next_path;
-    num_entries++;
   }
-  file->size = num_entries;
-
-  file->contents.entries = calloc(file->size, sizeof(file_t));
+  free(listing);
 
-  // Close the directory now
-  if (closedir(dir) == -1) {
+  // Close the directory now, so only one is open at a time however deep the
+  // tree goes
+  if (close(dir) == -1) {
     perror("Failed to close directory");
     return -1;
   }
 
-  // Recurse into each entry, storing the data
-  for (int i = 0; i < num_entries; i++) {
-    // Make space for a new file
-    file_t* entry_file = malloc(sizeof(file_t));
-    if (entry_file == NULL) {
-      // Free everything else
-      for (int j = i; j < num_entries; j++) {
-        free(all_entries[j]);
-      }
-      free(all_entries);
+  for (size_t i = 0; i < num_entries; i++) {
+    file_t* entry_file = file->contents.entries[i];
+    if (entry_file->type != F_DIR) {
+      continue;
+    }
+
+    char* next_path = malloc(strlen(path) + strlen(entry_file->name) + strlen("/") + 1);
+    if (next_path == NULL) {
+      perror("Failed to allocate space for path");
       return -1;
     }
+    strcpy(next_path, path);
+    strcat(next_path, entry_file->name);
+    strcat(next_path, "/");
 
-    // Read the entry
-    if (read_file(all_entries[i], entry_file) == -1) {
-      // Free everything else
-      for (int j = i; j < num_entries; j++) {
-        free(all_entries[j]);
+    // When walking, some worker reads the directory later and frees its path
+    if (walk != NULL) {
+      walk_task_t* task = malloc(sizeof(walk_task_t));
+      if (task != NULL) {
+        task->walk = walk;
+        task->path = next_path;
+        task->file = entry_file;
+        task->arena = arena;
       }
-      free(all_entries);
-      return -1;
+      if (task == NULL || pool_submit(walk->pool, walk_directory, task) == -1) {
+        perror("Failed to queue directory");
+        free(task);
+        free(next_path);
+        return -1;
+      }
+      continue;
     }
-    file->contents.entries[i] = entry_file;
 
-    // Also free the path to that entry, we're done w/ it
-    free(all_entries[i]);
+    int rc = read_directory(next_path, entry_file, opts, arena, NULL);
+    free(next_path);
+    if (rc == -1) {
+      return -1;
+    }
   }
 
-  // Free the temp memory we used to store the entries
-  free(all_entries);
-
   // All went well!
   return 0;
 }
 
-int read_file(char* path, file_t* file) {
+/**
+ * Read the file at the top of a tree, of unknown type. See read_file.
+ *
+ * \param walk  Walk to hand directories off to, or NULL to read them right
+ *              away
+ */
+static int read_entry(char* path, file_t* file, read_opts_t* opts, arena_t* arena, walk_t* walk) {
   // Store the name, trimming off the start of the path
-  file->name = strdup(get_shortname(path));
+  file->name = arena_strdup(arena, get_shortname(path));
   if (file->name == NULL) {
     perror("Failed to allocate file name");
     return -1;
@@ -217,16 +836,20 @@ int read_file(char* path, file_t* file) {
   else if (S_ISREG(st.st_mode)) {
     file->type = F_REG;
     file->contents.data = NULL;
+    file->path = NULL;
+    file->same = NULL;
+
+    // When streaming, the contents stay on disk until they are sent
+    if (opts->stream) {
+      return stream_regular(AT_FDCWD, "", path, &st, file, arena);
+    }
 
     // Attempt to read the file contents and return them.
-    if (read_regular(path, file) == -1) {
+    if (read_regular(AT_FDCWD, "", path, file, arena) == -1) {
       return -1;
     }
     return 0;
   } else if (S_ISDIR(st.st_mode)) {
-    file->type = F_DIR;
-    file->contents.entries = NULL;
-
     // The path used may differ from the one provided because user
     // input can be ambiguous.
     char* actual_path = strdup(path);
@@ -244,7 +867,8 @@ int read_file(char* path, file_t* file) {
     }
 
     // Attempt to recursively read the directory contents and return them
-    if (read_directory(actual_path, file) == -1) {
+    if (read_directory(actual_path, file, opts, arena, walk) == -1) {
+      free(actual_path);
       return -1;
     }
 
@@ -259,67 +883,656 @@ int read_file(char* path, file_t* file) {
 }
 
 /**
- * Write a regular file to a spot on disk. Writes to the path specified by
- * strcat(path, file->name).
+ * Collect the regular files in a flat tree that are big enough to check for
+ * having the same contents as others, in the order they are sent. When
+ * contents were read, files left on disk for being mostly holes aren't
+ * checked.
  *
- * \param path  Path to write the file to.
- * \param file  File data to write.
- * \return      0 if everything went well, -1 on error
+ * \param flat     Tree to look through
+ * \param stream   Whether the contents were left on disk
+ * \param entries  Filled out with the files, or NULL to only count them
+ * \return         Number of files
  */
-int write_regular(char* path, file_t* file) {
-  // Construct the path to the file
-  int file_path_len = strlen(path) + strlen(file->name);
-  char* file_path = malloc(sizeof(char) * (file_path_len + 1));
-  if (file_path == NULL) {
-    perror("Failed to allocate space for filename");
+static size_t collect_dedup(flat_t* flat, bool stream, dedup_entry_t* entries) {
+  size_t count = 0;
+  for (size_t i = 0; i < flat->count; i++) {
+    file_t* file = flat->entries[i].file;
+    if (file->type == F_REG && file->size >= DEDUP_MIN_SIZE && (stream || file->path == NULL)) {
+      if (entries != NULL) {
+        entries[count] = (dedup_entry_t){.file = file, .order = count};
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Compare two files by size, then by the order they are sent, for qsort.
+ */
+static int compare_sizes(const void* a, const void* b) {
+  const dedup_entry_t* x = a;
+  const dedup_entry_t* y = b;
+  if (x->file->size != y->file->size) {
+    return x->file->size < y->file->size ? -1 : 1;
+  }
+  return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Compare two files by hash, then by the order they are sent, for qsort.
+ */
+static int compare_hashes(const void* a, const void* b) {
+  const dedup_entry_t* x = a;
+  const dedup_entry_t* y = b;
+  int rc = memcmp(x->hash, y->hash, sizeof(x->hash));
+  if (rc != 0) {
+    return rc;
+  }
+  return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Check whether two regular files of the same size have the same contents,
+ * byte for byte.
+ */
+static bool same_contents(file_t* a, file_t* b) {
+  return memcmp(a->contents.data, b->contents.data, a->size) == 0;
+}
+
+/**
+ * Compare two streamed files by the file on disk they were found at, then by
+ * the order they are sent, for qsort.
+ */
+static int compare_inodes(const void* a, const void* b) {
+  const dedup_entry_t* x = a;
+  const dedup_entry_t* y = b;
+  if (x->file->dev != y->file->dev) {
+    return x->file->dev < y->file->dev ? -1 : 1;
+  } else if (x->file->ino != y->file->ino) {
+    return x->file->ino < y->file->ino ? -1 : 1;
+  }
+  return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Make a later file share the contents of an earlier one that has the same.
+ *
+ * \param first  File sent first
+ * \param later  File with the same contents, sent after it
+ */
+static void share_contents(file_t* first, file_t* later) {
+  first->same = first;
+  later->same = first;
+  if (later->path == NULL) {
+    free(later->contents.data);
+    later->contents.data = first->contents.data;
+    atomic_fetch_sub(&file_storage_used, later->size);
+  }
+}
+
+/**
+ * Find the regular files in a tree with the same contents as others. Only
+ * files of the same size are hashed, and files with the same hash are
+ * compared in full before their contents are shared. Streamed files aren't
+ * read at all, so only hard links to the same file are found. Nothing is
+ * shared if this runs out of memory.
+ *
+ * \param root    Flat tree to look through
+ * \param stream  Whether the contents were left on disk
+ */
+static void dedup_files(file_t* root, bool stream) {
+  size_t num_files = collect_dedup(root->flat, stream, NULL);
+  dedup_entry_t* entries = malloc(num_files * sizeof(dedup_entry_t));
+  if (entries == NULL) {
+    return;
+  }
+  collect_dedup(root->flat, stream, entries);
+
+  // Hard links are the same file, so the first one found is shared with
+  if (stream) {
+    qsort(entries, num_files, sizeof(dedup_entry_t), compare_inodes);
+    size_t first = 0;
+    for (size_t i = 1; i < num_files; i++) {
+      file_t* a = entries[first].file;
+      file_t* b = entries[i].file;
+      if (b->dev == a->dev && b->ino == a->ino && b->size == a->size) {
+        share_contents(a, b);
+      } else {
+        first = i;
+      }
+    }
+    free(entries);
+    return;
+  }
+  qsort(entries, num_files, sizeof(dedup_entry_t), compare_sizes);
+
+  // A file can only have the same contents as another of the same size
+  size_t start = 0;
+  while (start < num_files) {
+    size_t end = start + 1;
+    while (end < num_files && entries[end].file->size == entries[start].file->size) {
+      end++;
+    }
+    if (end - start < 2) {
+      start = end;
+      continue;
+    }
+
+    for (size_t i = start; i < end; i++) {
+      hash128(entries[i].file->contents.data, entries[i].file->size, entries[i].hash);
+    }
+
+    // Within a run of the same hash, the first file sent is the one the
+    // others share with
+    qsort(entries + start, end - start, sizeof(dedup_entry_t), compare_hashes);
+    for (size_t i = start; i < end;) {
+      size_t j = i + 1;
+      while (j < end && memcmp(entries[j].hash, entries[i].hash, sizeof(entries[i].hash)) == 0) {
+        if (same_contents(entries[i].file, entries[j].file)) {
+          share_contents(entries[i].file, entries[j].file);
+        }
+        j++;
+      }
+      i = j;
+    }
+    start = end;
+  }
+  free(entries);
+}
+
+/**
+ * Lay out a tree that has been read in full, and find the files in it with the
+ * same contents.
+ */
+static int finish_read(file_t* file, read_opts_t* opts) {
+  if (flatten_file(file) == -1) {
+    perror("Failed to lay out file tree");
     return -1;
   }
-  strcpy(file_path, path);
-  strcat(file_path, file->name);
+  dedup_files(file, opts->stream);
+  return 0;
+}
+
+int read_file(char* path, file_t* file, read_opts_t* opts) {
+  // Everything in the tree but the contents comes out of one arena, which the
+  // file at the top owns
+  file->arena = arena_create();
+  if (file->arena == NULL) {
+    perror("Failed to create arena");
+    return -1;
+  }
+  arena_t* arena = file->arena;
+
+  // With one thread, everything is read in order right here
+  if (opts->threads <= 1) {
+    if (read_entry(path, file, opts, arena, NULL) == -1) {
+      return -1;
+    }
+    return finish_read(file, opts);
+  }
+
+  // Otherwise, directory entries are spread over a pool of workers. Each one
+  // queues up the entries it finds, and idle workers steal them.
+  walk_t walk = {.opts = opts};
+  atomic_init(&walk.failed, false);
+  atomic_init(&walk.error, 0);
+  walk.pool = pool_create(opts->threads);
+  if (walk.pool == NULL) {
+    perror("Failed to start reader threads");
+    return -1;
+  }
+
+  int rc = read_entry(path, file, opts, arena, &walk);
+
+  // Entries keep getting queued until the whole tree has been read
+  pool_wait(walk.pool);
+  pool_destroy(walk.pool);
+
+  if (rc == -1 || atomic_load(&walk.failed)) {
+    if (rc != -1) {
+      errno = atomic_load(&walk.error);
+    }
+    return -1;
+  }
+  return finish_read(file, opts);
+}
 
+int create_directory(char* path, mode_t mode) {
   // If something exists there, something went wrong
-  if (access(file_path, F_OK) == 0) {
-    fprintf(stderr, "Refusing to overwrite existing file %s\n", file_path);
-    free(file_path);
+  if (access(path, F_OK) == 0) {
+    fprintf(stderr, "Refusing to overwrite existing directory %s\n", path);
+    return -1;
+  }
+
+  if (mkdir(path, mode) == -1) {
+    perror("Failed to create directory");
     return -1;
   }
 
-  // Open that file for writing
-  int fd = open(file_path, O_WRONLY | O_CREAT, file->mode);
+  return 0;
+}
+
+int create_regular(char* path, mode_t mode) {
+  // If something exists there, something went wrong
+  if (access(path, F_OK) == 0) {
+    fprintf(stderr, "Refusing to overwrite existing file %s\n", path);
+    return -1;
+  }
+
+  // O_EXCL makes sure nothing sneaks in between the check and the open
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+  if (fd == -1) {
+    perror("Failed to open file");
+    return -1;
+  }
+
+  return fd;
+}
+
+int reopen_regular(char* path, mode_t mode, size_t offset) {
+  int fd = open(path, O_WRONLY | O_CREAT, mode);
   if (fd == -1) {
     perror("Failed to open file");
-    free(file_path);
     return -1;
   }
 
-  // Write the data into that file
-  if (write(fd, file->contents.data, file->size) != file->size) {
-    perror("Failed to write file contents");
-    free(file_path);
+  // Anything past the offset is thrown away and written again
+  if (ftruncate(fd, offset) == -1 || lseek(fd, offset, SEEK_SET) == -1) {
+    perror("Failed to resume writing file");
+    close(fd);
     return -1;
   }
+  return fd;
+}
 
-  // Close the file
-  if (close(fd)) {
-    perror("Failed to close file");
-    free(file_path);
+int copy_regular(char* from, int fd, size_t size) {
+  int src = open(from, O_RDONLY);
+  if (src == -1) {
     return -1;
   }
+  int rc = copy_open_regular(src, fd, size);
+  int saved_errno = errno;
+  close(src);
+  errno = saved_errno;
+  return rc;
+}
 
-  // All went well!
-  free(file_path);
+/**
+ * Copy part of one open file to the same place in another, having the kernel
+ * do it without passing through here when it can.
+ *
+ * \param src     File descriptor of the file to copy from
+ * \param fd      File descriptor of the file to copy into
+ * \param start   Where the part starts
+ * \param len     Number of bytes in the part
+ * \param kernel  Whether to try copy_file_range. Set to false once it turns out
+ *                it can't copy between the two.
+ * \return        0 if everything went well, -1 on error. errno is set to 0 if
+ *                the file to copy from ended early.
+ */
+static int copy_range(int src, int fd, loff_t start, size_t len, bool* kernel) {
+  loff_t in = start;
+  loff_t out = start;
+  loff_t end = start + len;
+  while (*kernel && in < end) {
+    ssize_t rc = copy_file_range(src, &in, fd, &out, end - in, 0);
+    if (rc == -1 && in == start && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                                     errno == EOPNOTSUPP)) {
+      *kernel = false;
+      break;
+    }
+    if (rc <= 0) {
+      if (rc == 0) {
+        errno = 0;
+      }
+      return -1;
+    }
+  }
+
+  uint8_t buf[0x10000];
+  if (in < end && lseek(fd, in, SEEK_SET) == -1) {
+    return -1;
+  }
+  while (in < end) {
+    size_t want = end - in < sizeof(buf) ? end - in : sizeof(buf);
+    ssize_t rc = pread(src, buf, want, in);
+    if (rc <= 0) {
+      if (rc == 0) {
+        errno = 0;
+      }
+      return -1;
+    }
+    if (write_all(fd, buf, rc) == -1) {
+      return -1;
+    }
+    in += rc;
+  }
+  return 0;
+}
+
+int copy_open_regular(int src, int fd, size_t size) {
+  struct stat st;
+  if (fstat(src, &st) == -1) {
+    return -1;
+  }
+  if (!S_ISREG(st.st_mode) || st.st_size != size) {
+    errno = 0;
+    return -1;
+  }
+
+  // Share the blocks if the file system can, otherwise copy only the parts
+  // with data in them, so holes stay holes
+  if (size == 0 || ioctl(fd, FICLONE, src) == 0) {
+    return 0;
+  }
+  bool kernel = true;
+  loff_t next = 0;
+  while (next < size) {
+    loff_t data = lseek(src, next, SEEK_DATA);
+    if ((data == -1 && errno == ENXIO) || data >= (loff_t)size) {
+      break;  //< nothing but a hole left
+    } else if (data == -1) {
+      data = next;  //< can't tell where the holes are, so copy everything
+    }
+    loff_t hole = lseek(src, data, SEEK_HOLE);
+    if (hole == -1 || hole > size) {
+      hole = size;
+    }
+    if (copy_range(src, fd, data, hole - data, &kernel) == -1) {
+      return -1;
+    }
+    next = hole;
+  }
+  return ftruncate(fd, size);
+}
+
+/**
+ * Remove a single entry visited by nftw. Directories are visited after their
+ * contents, so they are empty by the time they get removed.
+ */
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+  if (remove(path) == -1) {
+    perror("Failed to remove file");
+    return -1;
+  }
   return 0;
 }
 
+int remove_file(char* path) {
+  return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// A regular file waiting to be written by a writer
+typedef struct {
+  writer_t* writer;
+  char* path;  //< malloc'd, freed once written
+  mode_t mode;
+  uint8_t* data;
+  size_t size;
+  bool free_data;  //< data is owned by the job and counts as buffered
+} write_job_t;
+
+struct writer {
+  write_opts_t* opts;
+  pool_t* pool;  //< started on the first file, NULL if writing in order
+  bool started;  //< whether starting the pool has been tried yet
+
+  // When io_uring can be used, files are batched up and written all at once
+  // on the thread adding them instead of on the pool
+  uring_t* ring;
+  write_job_t* batch[URING_MAX_FILES];
+  size_t batched;
+
+  pthread_mutex_t lock;     //< protects everything below
+  pthread_cond_t progress;  //< signalled whenever a file finishes
+  size_t buffered;          //< bytes of owned data waiting to be written
+  size_t queued;            //< files waiting to be written
+  bool failed;
+  write_stats_t stats;
+};
+
+/**
+ * Count a job as done, then free it.
+ *
+ * \param job     Job that has been written, or given up on
+ * \param failed  Whether writing it failed
+ */
+static void finish_job(write_job_t* job, bool failed) {
+  writer_t* writer = job->writer;
+  pthread_mutex_lock(&writer->lock);
+  if (failed) {
+    writer->failed = true;
+  } else {
+    writer->stats.files++;
+    writer->stats.bytes += job->size;
+  }
+  if (job->free_data) {
+    writer->buffered -= job->size;
+  }
+  writer->queued--;
+  pthread_cond_broadcast(&writer->progress);
+  pthread_mutex_unlock(&writer->lock);
+
+  free(job->path);
+  if (job->free_data) {
+    free(job->data);
+  }
+  free(job);
+}
+
+/**
+ * Create a regular file and write its contents, then free the job. Runs on a
+ * pool worker, or right away when writing in order.
+ *
+ * \param arg  Malloc'd write_job_t
+ */
+static void write_job(void* arg) {
+  write_job_t* job = (write_job_t*)arg;
+  writer_t* writer = job->writer;
+
+  // Once anything has failed, the rest of the files are not wanted
+  pthread_mutex_lock(&writer->lock);
+  bool failed = writer->failed;
+  pthread_mutex_unlock(&writer->lock);
+
+  if (!failed) {
+    int fd = create_regular(job->path, job->mode);
+    if (fd == -1) {
+      failed = true;
+    } else {
+      if (write_all(fd, job->data, job->size) == -1) {
+        perror("Failed to write file contents");
+        failed = true;
+      }
+      if (close(fd)) {
+        perror("Failed to close file");
+        failed = true;
+      }
+    }
+  }
+  finish_job(job, failed);
+}
+
+/**
+ * Create and write every file batched up so far, all at once through
+ * io_uring, then free their jobs.
+ *
+ * \param writer  Writer with a ring
+ */
+static void write_batch(writer_t* writer) {
+  if (writer->batched == 0) {
+    return;
+  }
+  pthread_mutex_lock(&writer->lock);
+  bool failed = writer->failed;
+  pthread_mutex_unlock(&writer->lock);
+
+  uring_file_t files[URING_MAX_FILES];
+  for (size_t i = 0; i < writer->batched; i++) {
+    write_job_t* job = writer->batch[i];
+    files[i] = (uring_file_t){.path = job->path, .data = job->data, .size = job->size,
+                              .mode = job->mode};
+  }
+  if (!failed && uring_write(writer->ring, AT_FDCWD, files, writer->batched) == -1) {
+    perror("Failed to write files");
+    failed = true;
+  }
+
+  for (size_t i = 0; i < writer->batched; i++) {
+    bool file_failed = failed;
+    if (!failed && files[i].error == EEXIST) {
+      fprintf(stderr, "Refusing to overwrite existing file %s\n", files[i].path);
+      file_failed = true;
+    } else if (!failed && files[i].error != 0) {
+      errno = files[i].error;
+      perror("Failed to write file");
+      file_failed = true;
+    }
+    finish_job(writer->batch[i], file_failed);
+  }
+  writer->batched = 0;
+}
+
+writer_t* writer_create(write_opts_t* opts) {
+  writer_t* writer = calloc(1, sizeof(writer_t));
+  if (writer == NULL) {
+    perror("Failed to allocate writer");
+    return NULL;
+  }
+  writer->opts = opts;
+  writer->ring = uring_thread();
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->progress, NULL);
+  return writer;
+}
+
+int writer_add(writer_t* writer, char* path, mode_t mode, uint8_t* data, size_t size,
+               bool free_data) {
+  write_job_t* job = malloc(sizeof(write_job_t));
+  if (job == NULL) {
+    perror("Failed to allocate write job");
+    free(path);
+    if (free_data) {
+      free(data);
+    }
+    return -1;
+  }
+  job->writer = writer;
+  job->path = path;
+  job->mode = mode;
+  job->data = data;
+  job->size = size;
+  job->free_data = free_data;
+
+  // Start the pool once there is actually something to do in parallel. If
+  // that fails, files just get written in order instead
+  if (!writer->started && writer->opts->threads > 1 && writer->ring == NULL) {
+    writer->started = true;
+    writer->pool = pool_create(writer->opts->threads);
+  }
+
+  // Batched files are only written once the batch is full, or holding too
+  // much data, or something waits for them
+  if (writer->ring != NULL &&
+      (writer->batched == URING_MAX_FILES ||
+       (free_data && writer->buffered + size > WRITER_MAX_BUFFERED))) {
+    write_batch(writer);
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  // Keep the amount of data held in memory bounded by waiting for some of it
+  // to be written first
+  while (free_data && writer->queued > 0 && writer->buffered + size > WRITER_MAX_BUFFERED) {
+    pthread_cond_wait(&writer->progress, &writer->lock);
+  }
+  if (free_data) {
+    writer->buffered += size;
+  }
+  writer->queued++;
+  pthread_mutex_unlock(&writer->lock);
+
+  if (writer->ring != NULL) {
+    writer->batch[writer->batched++] = job;
+  } else if (writer->pool == NULL || pool_submit(writer->pool, write_job, job) == -1) {
+    write_job(job);
+  }
+  return writer_failed(writer) ? -1 : 0;
+}
+
+int writer_wait(writer_t* writer) {
+  write_batch(writer);
+  pthread_mutex_lock(&writer->lock);
+  while (writer->queued > 0) {
+    pthread_cond_wait(&writer->progress, &writer->lock);
+  }
+  bool failed = writer->failed;
+  pthread_mutex_unlock(&writer->lock);
+  return failed ? -1 : 0;
+}
+
+bool writer_failed(writer_t* writer) {
+  pthread_mutex_lock(&writer->lock);
+  bool failed = writer->failed;
+  pthread_mutex_unlock(&writer->lock);
+  return failed;
+}
+
+int writer_finish(writer_t* writer, write_stats_t* stats) {
+  write_batch(writer);
+  if (writer->pool != NULL) {
+    pool_wait(writer->pool);
+    pool_destroy(writer->pool);
+  }
+
+  if (stats != NULL) {
+    stats->files += writer->stats.files;
+    stats->bytes += writer->stats.bytes;
+  }
+  bool failed = writer->failed;
+
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->progress);
+  free(writer);
+  return failed ? -1 : 0;
+}
+
+/**
+ * Write a regular file to a spot on disk. Writes to the path specified by
+ * strcat(path, file->name).
+ *
+ * \param path    Path to write the file to.
+ * \param file    File data to write.
+ * \param writer  Writer to create the file with. It may be written later.
+ * \return        0 if everything went well, -1 on error
+ */
+int write_regular(char* path, file_t* file, writer_t* writer) {
+  // Construct the path to the file
+  int file_path_len = strlen(path) + strlen(file->name);
+  char* file_path = malloc(sizeof(char) * (file_path_len + 1));
+  if (file_path == NULL) {
+    perror("Failed to allocate space for filename");
+    return -1;
+  }
+  strcpy(file_path, path);
+  strcat(file_path, file->name);
+
+  // The writer takes care of the path from here on
+  return writer_add(writer, file_path, file->mode, file->contents.data, file->size, false);
+}
+
 /**
  * Write a directory to a spot on disk, and all the files inside of it
- * recursively.
+ * recursively. Directories are created right away, in order, so they always
+ * exist before anything inside them is written.
  *
- * \param path  Path to write the directory to.
- * \param file  File data to write.
- * \return      0 if everything went well, -1 on error
+ * \param path    Path to write the directory to.
+ * \param file    File data to write.
+ * \param writer  Writer to create regular files with.
+ * \param stats   Totals to count directories in.
+ * \return        0 if everything went well, -1 on error
  */
-int write_directory(char* path, file_t* file) {
+int write_directory(char* path, file_t* file, writer_t* writer, write_stats_t* stats) {
   // Construct the path to the directory
   int dir_path_len = strlen(path) + strlen(file->name) + strlen("/");
   char* dir_path = malloc(sizeof(char) * (dir_path_len + 1));
@@ -331,22 +1544,22 @@ int write_directory(char* path, file_t* file) {
   strcat(dir_path, file->name);
   strcat(dir_path, "/");
 
-  if (access(dir_path, F_OK) == 0) {
-    fprintf(stderr, "Fefusing to overwrite existing directory %s\n", dir_path);
-    free(dir_path);
-    return -1;
-  }
-
   // Attempt to create that directory
-  if (mkdir(dir_path, file->mode) == -1) {
-    perror("Failed to create directory");
+  if (create_directory(dir_path, file->mode) == -1) {
     free(dir_path);
     return -1;
   }
+  stats->directories++;
 
   // For all the directory entries, attempt to write them as well
   for (int i = 0; i < file->size; i++) {
-    int rc = write_file(dir_path, file->contents.entries[i]);
+    file_t* entry = file->contents.entries[i];
+    int rc;
+    if (entry->type == F_DIR) {
+      rc = write_directory(dir_path, entry, writer, stats);
+    } else {
+      rc = write_regular(dir_path, entry, writer);
+    }
     if (rc == -1) {
       free(dir_path);
       return -1;
@@ -358,19 +1571,32 @@ int write_directory(char* path, file_t* file) {
   return 0;
 }
 
-int write_file(char* path, file_t* file) {
+int write_file(char* path, file_t* file, write_opts_t* opts, write_stats_t* stats) {
+  write_stats_t totals = {0};
+  writer_t* writer = writer_create(opts);
+  if (writer == NULL) {
+    return -1;
+  }
+
+  int rc = 0;
   switch (file->type) {
     case F_REG:
-      if (write_regular(path, file) == -1) {
-        return -1;
-      }
+      rc = write_regular(path, file, writer);
       break;
     case F_DIR:
-      if (write_directory(path, file) == -1) {
-        return -1;
-      }
+      rc = write_directory(path, file, writer, &totals);
       break;
   }
 
-  return 0;
+  // Files may still be being written in the background
+  if (writer_finish(writer, &totals) == -1) {
+    rc = -1;
+  }
+
+  if (stats != NULL) {
+    stats->files += totals.files;
+    stats->directories += totals.directories;
+    stats->bytes += totals.bytes;
+  }
+  return rc;
 }
@@ -6,15 +6,41 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <time.h>
+
+#include "arena.h"
 
 typedef enum {
   F_REG,  //< regular file
   F_DIR   //< directory
 } filetype;
 
+// One entry of a flat tree: everything its header says, and where it is
+typedef struct {
+  struct file* file;  //< the entry itself, for the contents of regular files
+  filetype type;
+  mode_t mode;
+  size_t size;        //< bytes of contents, or number of entries in a directory
+  size_t name;        //< offset of its name in the tree's names
+  size_t name_len;    //< length of its name, not counting the terminator
+  size_t parent;      //< index of the directory it is in. 0 for the top.
+  size_t end;         //< index just past the last entry inside it
+} flat_entry_t;
+
+// Every entry of a tree in one array, in the order they are sent: each
+// directory comes right before everything inside it. Names are packed into
+// one table in the same order, so the headers of the whole tree are one pass
+// over two arrays. The files themselves sit in one array in the same order.
+typedef struct {
+  flat_entry_t* entries;
+  size_t count;
+  char* names;  //< every name, each ending in '\0', one after another
+} flat_t;
+
 // File structure. Can either be a regular file or a directory.
 typedef struct file {
   filetype type;
@@ -29,30 +55,288 @@ typedef struct file {
     uint8_t* data;          //< F_REG only
     struct file** entries;  //< F_DIR only
   } contents;
+
+  // F_REG only: path to read the contents from when they are streamed from
+  // disk at send time. NULL if the contents are held in contents.data.
+  char* path;
+
+  // F_REG only, when streamed: which file was found at path when it was given,
+  // and when it was last modified then. Used to tell whether it has changed
+  // since.
+  struct timespec mtime;
+  dev_t dev;
+  ino_t ino;
+
+  // F_REG only: the first file, in the order they are sent, with the same
+  // contents as this one. Its contents are shared with this one rather than
+  // held twice. Points to the file itself if it is that first one, and NULL if
+  // no other file has the same contents.
+  struct file* same;
+
+  // Only on the file at the top of a tree: the arena every other file in the
+  // tree, and every name, path and list of entries, was allocated from. NULL
+  // everywhere else.
+  arena_t* arena;
+
+  // Only on the file at the top of a tree, once it has been read or received
+  // in full: every entry of the tree laid out flat, allocated from the arena.
+  // NULL everywhere else.
+  flat_t* flat;
 } file_t;
 
+// Files smaller than this are never checked for having the same contents as
+// another. Sending them again costs about as much as saying where they are.
+#define DEDUP_MIN_SIZE 0x200
+
+// Refuse to store more than 256MB of file data, across every tree read or
+// received into memory
+#define MAX_FILE_STORAGE 0x10000000
+
+// Options controlling how read_file loads a file
+typedef struct {
+  // Only capture metadata (names, sizes, modes) and leave file contents on
+  // disk, so they can be streamed when sent. Not subject to the storage limit.
+  // Nothing is read but the directories, so it takes time in proportion to the
+  // number of entries rather than their size, and only hard links to the same
+  // file are found to have the same contents.
+  bool stream;
+
+  // Number of threads to read directories with. With 1, everything is read
+  // in order on the calling thread. Either way, directory entries come out
+  // sorted by name.
+  int threads;
+} read_opts_t;
+
+// Options controlling how files are written to disk
+typedef struct {
+  // Number of threads to create and write regular files with. With 1, files
+  // are written in order on the calling thread.
+  int threads;
+} write_opts_t;
+
+// Totals of what has been written to disk
+typedef struct {
+  size_t files;
+  size_t directories;
+  size_t bytes;
+  size_t local;  //< regular files copied straight from the give's disk
+} write_stats_t;
+
+// Most data a writer holds on to while waiting for it to be written
+#define WRITER_MAX_BUFFERED 0x800000
+
+// Creates regular files, possibly in the background on a pool of threads.
+// Directories are created by the caller, before anything inside them.
+typedef struct writer writer_t;
+
 /**
- * Free an allocated file of unknown type recursively.
+ * Free a tree from read_file or recv_file, along with the malloc'd file at the
+ * top of it. The contents of regular files are freed one by one, and everything
+ * else at once with the arena.
  *
- * \param file  File to free.
+ * \param file  File at the top of the tree to free.
  */
 void free_file(file_t* file);
 
 /**
  * Read a file of unknown type, returning malloc'd memory containing the file
- * info. For directories, this includes any directory entries.
+ * info. For directories, this includes any directory entries. Once everything
+ * is read, the tree is laid out flat, and regular files with the same contents
+ * are found and linked with file->same.
  *
  * \param path  Path to the file.
- * \param file  Pointer to read file into.
- * \return      0 on success, -1 on error
+ * \param file  Zeroed file to read into. The tree under it is allocated from
+ *              an arena it owns, so it must be freed with free_file even if
+ *              this fails.
+ * \param opts  Options controlling how contents are loaded.
+ * \return      0 on success, -1 on error, with errno set by whatever failed
+ *              first (EFBIG if it wouldn't fit in memory)
+ */
+int read_file(char* path, file_t* file, read_opts_t* opts);
+
+/**
+ * Take room for the contents of a file out of the storage limit. Other threads
+ * may be reading files too, so the room is reserved atomically. It's handed
+ * back when the file is freed with free_file.
+ *
+ * \param size  Bytes of contents
+ * \return      0 if they fit, -1 with errno EFBIG if not
+ */
+int reserve_storage(size_t size);
+
+/**
+ * Lay a whole tree out flat, filling out file->flat. Every entry, list of
+ * entries, name and path is copied into a new arena in the order they are
+ * sent, with the names of the copies pointing into the table of names, and the
+ * old arena is freed. Pointers to anything in the tree but the
+ * file at the top and the contents of regular files are no longer valid after.
+ *
+ * \param file  File at the top of a tree with its arena, fully filled out
+ * \return      0 on success, -1 if out of memory, leaving the tree as it was
+ */
+int flatten_file(file_t* file);
+
+/**
+ * Open a streamed regular file to read its contents, making sure it is still
+ * the file that was given: the same one, with the same size and modification
+ * time.
+ *
+ * \param file  Regular file with its path filled out
+ * \return      File descriptor open for reading, or -1 on error. errno is set
+ *              to 0 if the file has changed since it was given.
+ */
+int open_streamed(file_t* file);
+
+/**
+ * Check whether a streamed regular file has changed since it was given, without
+ * opening it.
+ *
+ * \param file  Regular file with its path filled out
+ * \return      true if it has changed or is gone, false if it's the same
+ */
+bool streamed_changed(file_t* file);
+
+/**
+ * Get at part of the contents of a regular file, wherever they are. Contents in
+ * memory are pointed to where they are, and streamed ones are read from disk,
+ * so a file that shrinks while being read is an error rather than a fault.
+ *
+ * \param file    Regular file
+ * \param fd      The file opened with open_streamed, if it's streamed
+ * \param offset  Where in the contents to start
+ * \param len     Number of bytes to get. Must not run past the end of the file.
+ * \param buf     At least len bytes to read streamed contents into
+ * \return        The contents, or NULL on error. errno is set to 0 if the file
+ *                shrank since it was given.
+ */
+const uint8_t* read_contents(file_t* file, int fd, size_t offset, size_t len, uint8_t* buf);
+
+/**
+ * Write a file of unknown type to disk. Directories are created in order, then
+ * regular files are written over a pool of threads.
+ *
+ * \param path   Path to write the file to.
+ * \param file   File data to write.
+ * \param opts   Options controlling how files are written.
+ * \param stats  Totals to add what was written to, or NULL.
+ * \return       0 if everything went well, -1 on error
+ */
+int write_file(char* path, file_t* file, write_opts_t* opts, write_stats_t* stats);
+
+/**
+ * Start writing regular files. When io_uring can be used, files are batched up
+ * and written together on the thread adding them, which must be the one that
+ * created the writer. Otherwise they are written on a pool of threads.
+ *
+ * \param opts  Options controlling how files are written. Must stay valid until
+ *              writer_finish.
+ * \return      A new writer, or NULL on error
+ */
+writer_t* writer_create(write_opts_t* opts);
+
+/**
+ * Create a new regular file and write its contents. With io_uring or more than
+ * one thread this happens later, and if the writer is already holding too much
+ * data, waits for some of it to be written first.
+ *
+ * \param writer     Writer to write with
+ * \param path       Malloc'd path to the file. The writer frees it.
+ * \param mode       Mode to create the file with
+ * \param data       Contents of the file
+ * \param size       Number of bytes of data
+ * \param free_data  Whether the writer should free data once it's written. If
+ *                   not, data must stay valid until writer_finish.
+ * \return           0 if nothing has failed so far, -1 on error
+ */
+int writer_add(writer_t* writer, char* path, mode_t mode, uint8_t* data, size_t size,
+               bool free_data);
+
+/**
+ * Wait for every file added so far to be written.
+ *
+ * \param writer  Writer to wait for
+ * \return        0 if nothing has failed so far, -1 on error
+ */
+int writer_wait(writer_t* writer);
+
+/**
+ * Check whether writing any file has failed so far.
+ *
+ * \param writer  Writer to check
+ * \return        true if something failed
+ */
+bool writer_failed(writer_t* writer);
+
+/**
+ * Wait for every file to be written, then free the writer.
+ *
+ * \param writer  Writer to finish
+ * \param stats   Totals to add the files written to, or NULL.
+ * \return        0 if every file was written, -1 if any failed
+ */
+int writer_finish(writer_t* writer, write_stats_t* stats);
+
+/**
+ * Create a new, empty directory on disk. Refuses to overwrite anything that
+ * already exists at that path.
+ *
+ * \param path  Path to the directory to create.
+ * \param mode  Mode to create the directory with.
+ * \return      0 if everything went well, -1 on error
+ */
+int create_directory(char* path, mode_t mode);
+
+/**
+ * Create a new, empty regular file on disk and open it for writing. Refuses to
+ * overwrite anything that already exists at that path.
+ *
+ * \param path  Path to the file to create.
+ * \param mode  Mode to create the file with.
+ * \return      File descriptor open for writing, or -1 on error
+ */
+int create_regular(char* path, mode_t mode);
+
+/**
+ * Open a regular file that was partly written before, to write the rest of it.
+ * Creates it if it doesn't exist.
+ *
+ * \param path    Path to the file to open.
+ * \param mode    Mode to create the file with, if it doesn't exist.
+ * \param offset  Bytes of the file that were written. Anything after that is
+ *                removed.
+ * \return        File descriptor open for writing at offset, or -1 on error
+ */
+int reopen_regular(char* path, mode_t mode, size_t offset);
+
+/**
+ * Copy the contents of a regular file into another one. On file systems that
+ * can share blocks between files, the copy shares them instead.
+ *
+ * \param from  Path to the file to copy
+ * \param fd    File descriptor of an empty file open for writing
+ * \param size  Size the file to copy is expected to have
+ * \return      0 if everything went well, -1 on error. errno is set to 0 if
+ *              the file didn't have the expected size.
+ */
+int copy_regular(char* from, int fd, size_t size);
+
+/**
+ * Like copy_regular, for a file that is already open. Copies from the start no
+ * matter where its offset is. Holes in it are left as holes in the copy.
+ *
+ * \param src   File descriptor of the regular file to copy, open for reading
+ * \param fd    File descriptor of an empty file open for writing
+ * \param size  Size the file to copy is expected to have
+ * \return      Same as copy_regular. errno is also 0 if src isn't a regular
+ *              file.
  */
-int read_file(char* path, file_t* file);
+int copy_open_regular(int src, int fd, size_t size);
 
 /**
- * Write a file of unknown type to disk.
+ * Remove a file or directory from disk, including everything inside it. Used
+ * to clean up after a write that could not be finished.
  *
- * \param path  Path to write the file to.
- * \param file  File data to write.
+ * \param path  Path to the file to remove.
  * \return      0 if everything went well, -1 on error
  */
-int write_file(char* path, file_t* file);
+int remove_file(char* path);
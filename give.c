@@ -1,17 +1,30 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "broker.h"
+#include "image.h"
 #include "logging.h"
 #include "message.h"
+#include "pool.h"
 #include "socket.h"
+#include "uring.h"
 #include "utils.h"
 
 // Global variables to track this give's info
@@ -19,137 +32,986 @@
 unsigned short give_server_port = 0;
 char give_host[MAX_HOSTNAME_LEN];
 
-// Arguments needed to communicate with a client in a thread
-typedef struct {
-  int client_socket_fd;
-  file_t* data;
+// Most takers connected at once. Anyone past this is hung up on right away,
+// so a flood of connections can't use up the give's file descriptors.
+#define GIVE_MAX_CLIENTS 256
+
+// Most transfers sent at once. Takers past this wait their turn. Enough for
+// one take split across as many connections as it can be.
+#define GIVE_MAX_TRANSFERS (2 * STRIPES_MAX)
+
+// Seconds a taker may go without sending anything while the give waits on it,
+// or without taking anything while it sends, before it is hung up on
+#define GIVE_IDLE_TIMEOUT 60
+
+// Seconds a taker has to send the whole handshake and request once it starts,
+// so one sent a byte at a time can't hold on to a connection
+#define GIVE_REQUEST_TIMEOUT 10
+
+// Connections waiting to be accepted that the kernel holds on to
+#define GIVE_BACKLOG SOMAXCONN
+
+// Most events handled per wakeup of the event loop
+#define MAX_EVENTS 64
+
+// One file being given, and everything needed to send it
+typedef struct give {
+  unsigned int number;  //< what takers ask for it by, 0 for a give with a port
+                        //< of its own
+  uint64_t id;          //< random, so takers only resume transfers from the give
+                        //< they started them with, even if the port gets reused
   char* target_username;
+  file_t* data;
+  compress_cache_t* compressed;  //< compressed chunks, or NULL if it can't be
+                                 //< sent compressed
+  compress_cache_t* checked;     //< checksums of chunks, or NULL if it can't be
+                                 //< sent with them unless compressed
+  image_cache_t* images;         //< whole transfers as they were sent, or NULL
+                                 //< if contents are read from disk when sent
+  size_t users;       //< requests being handled for it, plus one while it's listed
+  struct give* next;  //< in the list of gives takers can ask for
+} give_t;
+
+// Where a taker's connection is at
+typedef enum {
+  CLIENT_HELLO,    //< waiting for the handshake
+  CLIENT_REQUEST,  //< waiting for a request
+  CLIENT_BUSY,     //< handed to a worker, which sends the transfer
+  CLIENT_CLOSED,   //< done with, waiting to be freed by the event loop
+} client_state_t;
+
+typedef struct server server_t;
+
+// A connection from a taker, along with what it's doing
+typedef struct client {
+  conn_t conn;
+  client_state_t state;
+  time_t last_active;    //< last time it sent something, or a transfer to it ended
+  time_t request_start;  //< when what it's sending now started to arrive, or 0
+                         //< if there's nothing partly sent
+  bool control;          //< came in on the broker's control socket
+  request_t* req;        //< request handed to a worker
+  registration_t* reg;   //< same, for a client on the control socket
+  server_t* server;
+  struct client* prev;  //< in the list of every client
+  struct client* next;
+} client_t;
+
+// Everything the event loop keeps track of
+struct server {
+  int listen_fd;
+  int local_fd;     //< Unix socket for takers on this machine, or -1
+  int control_fd;   //< control socket of a broker, or -1 for a give of its own
+  int epoll_fd;
+  int done_fds[2];  //< pipe workers hand clients back to the event loop on
+  pool_t* workers;  //< threads that send transfers and read new gives
+  client_t* clients;
+  size_t num_clients;
+
+  pthread_mutex_t lock;  //< protects everything below
+  give_t* gives;
+  size_t num_gives;          //< listed, still in use, or being read
+  unsigned int next_number;  //< number the next give on a broker gets
   char* owner_username;
-} comm_args_t;
+};
+
+/**
+ * Pick a random ID for a give. 0 means a give has none.
+ */
+static uint64_t new_give_id() {
+  uint64_t id;
+  if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+    id = ((uint64_t)time(NULL) << 32) ^ getpid();
+  }
+  return id != 0 ? id : 1;
+}
 
 /**
- * Receive requests from a client and act on them.
+ * Check whether any regular file in a tree is left on disk to be streamed.
  *
- * \param arg  Pointer to a malloc'd comm_args_t struct filled out with correct
- *             data. Will be free'd before this thread exits to avoid leaks.
- * \return     NULL, only here because threads must return something
+ * \param file  File at the top of a tree from read_file
+ * \return      true if one is
  */
-void* receive_client_requests(void* arg) {
-  // Unpack args struct passed in
-  comm_args_t* args = (comm_args_t*)arg;
-  int client_socket_fd = args->client_socket_fd;
-  file_t* data = args->data;
-  char* target_username = args->target_username;
-  char* owner_username = args->owner_username;
+static bool has_streamed(file_t* file) {
+  for (size_t i = 0; i < file->flat->count; i++) {
+    flat_entry_t* entry = &file->flat->entries[i];
+    if (entry->type == F_REG && entry->file->path != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  while (true) {
-    // Recieve a request that the client sends us
-    request_t* req = recv_request(client_socket_fd);
-    if (req == NULL) {
-      free(args);
+/**
+ * Read a file into memory, and set up the caches it is sent from.
+ *
+ * \param target_username  User to send the file.
+ * \param path             Path to the file or directory.
+ * \param stream           Whether to leave contents on disk until they're sent.
+ * \param threads          Number of threads to read and compress with.
+ * \return                 The give, with no users, or NULL on error
+ */
+static give_t* load_give(char* target_username, char* path, bool stream, int threads) {
+  give_t* give = calloc(1, sizeof(give_t));
+  if (give == NULL) {
+    perror("Failed to allocate give");
+    return NULL;
+  }
+  give->target_username = strdup(target_username);
+  give->data = calloc(1, sizeof(file_t));
+  if (give->target_username == NULL || give->data == NULL) {
+    perror("Failed to allocate file struct");
+    free(give->target_username);
+    free(give->data);
+    free(give);
+    return NULL;
+  }
+
+  read_opts_t opts = {.stream = stream, .threads = threads};
+  if (read_file(path, give->data, &opts) == -1) {
+    int saved_errno = errno;
+    free_file(give->data);
+    free(give->target_username);
+    free(give);
+    errno = saved_errno;
+    return NULL;
+  }
 
-      // Close the client socket--something went wrong
-      close(client_socket_fd);
+  // Takers that ask for compression share one cache of compressed chunks,
+  // and the rest share one of just checksums. Without them, everything is
+  // just sent as it is. Neither starts any threads until it's used.
+  give->compressed =
+      cache_create(give->data, codec_for_features(FEATURE_ZLIB), threads, COMPRESS_CACHE_MAX);
+  give->checked = cache_create(give->data, NULL, threads, 0);
 
-      // Return, stopping this thread
-      return NULL;
-    }
+  // Contents held in memory never change, so every transfer of them can be
+  // kept exactly as it was sent and sent again as it is. Anything left on disk
+  // might change after it's recorded, even in a give that isn't streamed,
+  // since files that are mostly holes are always left there.
+  if (!stream && !has_streamed(give->data)) {
+    give->images = image_cache_create(IMAGE_CACHE_MAX);
+  }
+  give->id = new_give_id();
+  return give;
+}
 
-    // Terminate the server if owner sends CANCEL or target sends DONE
-    if ((req->action == QUIT_SERVER && strcmp(req->username, owner_username) == 0) ||
-        (req->action == QUIT_SERVER && strcmp(req->username, target_username) == 0)) {
-      free(args);
-      free(req->username);
-      free(req);
+/**
+ * Free a give and everything in it.
+ */
+static void free_give(give_t* give) {
+  if (give->compressed != NULL) {
+    cache_destroy(give->compressed);
+  }
+  if (give->checked != NULL) {
+    cache_destroy(give->checked);
+  }
+  if (give->images != NULL) {
+    image_cache_destroy(give->images);
+  }
+  free_file(give->data);
+  free(give->target_username);
+  free(give);
+}
+
+/**
+ * Find a give takers can ask for, and start using it.
+ *
+ * \param server  Server hosting it
+ * \param number  Number of the give
+ * \return        The give, to be released with release_give, or NULL if there
+ *                is none with that number
+ */
+static give_t* find_give(server_t* server, unsigned int number) {
+  pthread_mutex_lock(&server->lock);
+  give_t* give = server->gives;
+  while (give != NULL && give->number != number) {
+    give = give->next;
+  }
+  if (give != NULL) {
+    give->users++;
+  }
+  pthread_mutex_unlock(&server->lock);
+  return give;
+}
+
+/**
+ * Stop using a give. Once nothing uses it it's freed, and once a broker has
+ * no gives left it exits.
+ *
+ * \param server  Server hosting it
+ * \param give    Give from find_give
+ */
+static void release_give(server_t* server, give_t* give) {
+  pthread_mutex_lock(&server->lock);
+  bool last = --give->users == 0;
+  bool done = last && --server->num_gives == 0;
+  pthread_mutex_unlock(&server->lock);
+  if (last) {
+    free_give(give);
+  }
+  if (done) {
+    exit(EXIT_SUCCESS);
+  }
+}
 
-      // Close the client socket
-      close(client_socket_fd);
+/**
+ * Stop takers from asking for a give, and remove it from the status file.
+ * Transfers of it that are going already still finish.
+ *
+ * \param server  Server hosting it
+ * \param give    Give to unlist, which the caller is using
+ */
+static void unlist_give(server_t* server, give_t* give) {
+  pthread_mutex_lock(&server->lock);
+  give_t** link = &server->gives;
+  while (*link != NULL && *link != give) {
+    link = &(*link)->next;
+  }
+  bool listed = *link != NULL;
+  if (listed) {
+    *link = give->next;
 
+    // The status file is rewritten whole, so only one thread at a time may
+    remove_give_status(give_host, give_server_port, give->number);
+  }
+  pthread_mutex_unlock(&server->lock);
+  if (listed) {
+    release_give(server, give);
+  }
+}
+
+// A transfer for write_transfer to send
+typedef struct {
+  file_t* data;
+  compress_cache_t* cache;
+  uint64_t features;
+  resume_t* start;
+} transfer_t;
+
+/**
+ * Send a whole transfer with no changes or splitting, for image_send.
+ */
+static int write_transfer(conn_t* conn, void* arg) {
+  transfer_t* transfer = arg;
+  stripe_t stripe = {0};
+  return send_file(conn, transfer->data, transfer->cache, transfer->features, transfer->start,
+                   NULL, &stripe);
+}
+
+/**
+ * Act on a request from a client. Quitting ends the give, and the whole
+ * server unless it's a broker.
+ *
+ * \param server  Server the client is connected to
+ * \param conn    Connection the request came in on
+ * \param req     Request to act on
+ * \return        0 if the client may send another request, -1 if it should be
+ *                disconnected
+ */
+static int handle_request(server_t* server, conn_t* conn, request_t* req) {
+  give_t* give = find_give(server, req->give);
+  if (give == NULL) {
+    return -1;
+  }
+  int rc = -1;
+
+  // Terminate the give if owner sends CANCEL or target sends DONE
+  if ((req->action == QUIT_SERVER && strcmp(req->username, server->owner_username) == 0) ||
+      (req->action == QUIT_SERVER && strcmp(req->username, give->target_username) == 0)) {
+    // Takes that compared against an old copy send its signatures along with
+    // the quit too. They're read either way, so the taker isn't hung up on
+    // while it's still sending them.
+    recv_request_sigs(conn, req);
+    if (server->control_fd == -1) {
       // Remove this give from the status file
-      remove_give_status(give_host, give_server_port);
+      remove_give_status(give_host, give_server_port, give->number);
 
       // Exit, stopping ALL threads
       exit(EXIT_SUCCESS);
     }
+    unlist_give(server, give);
+  }
 
-    // Send the data if the target sends SEND_DATA
-    else if (req->action == SEND_DATA && strcmp(req->username, target_username) == 0) {
-      int rc = send_file(client_socket_fd, data);
-      if (rc == -1) {
-        free(args);
-        free(req->username);
-        free(req);
+  // Send the data if the target sends SEND_DATA, or RESUME_DATA to pick up
+  // where an earlier transfer stopped
+  else if ((req->action == SEND_DATA || req->action == RESUME_DATA) &&
+           strcmp(req->username, give->target_username) == 0) {
+    // Signatures of an old copy can be big, so they're only read once it's
+    // known that the taker may have the file at all
+    if (recv_request_sigs(conn, req) == -1) {
+      release_give(server, give);
+      return -1;
+    }
 
-        // Close the client socket--something went wrong
-        close(client_socket_fd);
+    // Chunks are shared by every taker that asks for them. Compressed ones
+    // come with checksums too, so those only need a cache of their own
+    // when nothing is compressed.
+    uint64_t features = 0;
+    compress_cache_t* cache = NULL;
+    compress_cache_t* compressed = give->compressed;
+    if (compressed != NULL && (req->features & cache_codec(compressed)->feature)) {
+      cache = compressed;
+      features = cache_codec(compressed)->feature | (req->features & FEATURE_CRC32C);
+    } else if (give->checked != NULL && (req->features & FEATURE_CRC32C)) {
+      cache = give->checked;
+      features = FEATURE_CRC32C;
+    }
 
-        // Return, stopping this thread
-        return NULL;
-      }
+    // Changes are only worth sending if the taker has an old copy to apply
+    // them to
+    if (cache != NULL && req->sigs != NULL && req->sigs->num_files > 0) {
+      features |= FEATURE_DELTA;
+    }
+    if (cache != NULL) {
+      features |= req->features & (FEATURE_DEDUP | FEATURE_STRIPE | FEATURE_SPARSE);
     }
 
-    // Otherwise, disconnect from the client
-    else {
-      free(args);
-      free(req->username);
-      free(req);
+    // Takers on this machine can be passed streamed files to copy themselves
+    if (cache != NULL && conn->local) {
+      features |= req->features & FEATURE_LOCAL;
+    }
 
-      // Close the client socket since they're not authenticated
-      close(client_socket_fd);
+    // Transfers started with a different give can't be resumed
+    resume_t start = {.give_id = give->id};
+    if (req->action == RESUME_DATA && req->resume.give_id == give->id) {
+      start.index = req->resume.index;
+      start.offset = req->resume.offset;
+    }
 
-      // Exit, stopping ALL threads
-      return NULL;
+    // Transfers of the whole file come out the same for everyone who asks the
+    // same way, so those are sent from an image of the first one. File
+    // descriptors can't be kept in one.
+    bool whole = start.index == 0 && start.offset == 0 &&
+                 !(features & (FEATURE_DELTA | FEATURE_LOCAL)) && req->stripe.count < 2;
+    if (give->images != NULL && whole) {
+      transfer_t transfer = {give->data, cache, features & ~FEATURE_STRIPE, &start};
+      rc = image_send(give->images, conn, transfer.features, write_transfer, &transfer);
+    } else {
+      rc = send_file(conn, give->data, cache, features, &start, req->sigs, &req->stripe);
+    }
+  }
+
+  // Otherwise, disconnect from the client since they're not authenticated
+  release_give(server, give);
+  return rc;
+}
+
+/**
+ * Read a give registered with the broker, list it, and answer with the number
+ * takers can ask for it by.
+ *
+ * \param server  The broker
+ * \param client  Client on the control socket
+ */
+static void register_give(server_t* server, client_t* client) {
+  registration_t* reg = client->reg;
+  client->reg = NULL;
+  if (reg == NULL) {
+    reg = recv_registration(&client->conn);
+    if (reg == NULL) {
+      return;
     }
+  }
 
-    // Free the request we got
-    free(req->username);
-    free(req);
+  // Counted from the start, so the broker doesn't exit while it's being read
+  pthread_mutex_lock(&server->lock);
+  server->num_gives++;
+  pthread_mutex_unlock(&server->lock);
+
+  give_t* give = load_give(reg->target_username, reg->path, reg->stream, reg->threads);
+  int error = 0;
+  bool done = false;
+  pthread_mutex_lock(&server->lock);
+  if (give != NULL) {
+    give->number = server->next_number++;
+    give->users = 1;
+    give->next = server->gives;
+    server->gives = give;
+  } else {
+    error = errno != 0 ? errno : EIO;
+    done = --server->num_gives == 0;
+  }
+  pthread_mutex_unlock(&server->lock);
+
+  send_registered(&client->conn, error, give_server_port, give != NULL ? give->number : 0);
+  free_registration(reg);
+  if (done) {
+    exit(EXIT_FAILURE);
   }
 }
 
 /**
- * Give a file to a target user through a network socket.
+ * Handle a client's request on a worker thread, then hand the client back to
+ * the event loop. Runs on the worker pool.
  *
- * \param target_username  User to send the file.
- * \param file             File stored in memory.
- * \param socket_fd        Network socket to send through.
- * \return                 0 if there are no errors, -1 if there are errors.
- *                         Sets errno on failure.
+ * \param arg  The client, in the CLIENT_BUSY state
  */
-int host_file(char* restrict target_username, file_t* file, int socket_fd) {
-  // Accept new connections while the server is running
-  while (true) {
-    int client_socket_fd = server_socket_accept(socket_fd);
-    if (client_socket_fd == -1) {
-      perror("Failed to accept new connection");
+static void serve_client(void* arg) {
+  client_t* client = arg;
+  server_t* server = client->server;
+
+  // A new give is all a client on the control socket sends
+  if (client->control) {
+    register_give(server, client);
+    client->state = CLIENT_CLOSED;
+  } else {
+    request_t* req = client->req;
+    client->req = NULL;
+    if (handle_request(server, &client->conn, req) == 0) {
+      client->state = CLIENT_REQUEST;
+    } else {
+      client->state = CLIENT_CLOSED;
+    }
+    free_request(req);
+  }
+
+  if (write(server->done_fds[1], &client, sizeof(client)) != sizeof(client)) {
+    // The event loop is gone, so nobody else will free the client
+    perror("Failed to hand back client");
+  }
+}
+
+/**
+ * Disconnect a client and free it.
+ *
+ * \param server  Server the client is connected to
+ * \param client  Client to drop. Must not be busy.
+ */
+static void drop_client(server_t* server, client_t* client) {
+  if (client->prev != NULL) {
+    client->prev->next = client->next;
+  } else {
+    server->clients = client->next;
+  }
+  if (client->next != NULL) {
+    client->next->prev = client->prev;
+  }
+  server->num_clients--;
+
+  // Closing the socket takes it out of epoll too
+  conn_free(&client->conn);
+  close(client->conn.fd);
+  free(client);
+}
+
+/**
+ * Hand a client to a worker to send it a transfer. The event loop leaves it
+ * alone until the worker hands it back.
+ *
+ * \param server  Server the client is connected to
+ * \param client  Client to hand off
+ * \param req     Request to act on, or NULL for a client on the control
+ *                socket, whose worker reads the registration itself
+ * \return        0 if the client was handed off, -1 if it couldn't be
+ */
+static int hand_off(server_t* server, client_t* client, request_t* req) {
+  // Workers wait on the socket rather than polling it, but only for so long
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->conn.fd, NULL) == -1 ||
+      socket_set_blocking(client->conn.fd, true) == -1) {
+    return -1;
+  }
+  client->conn.buffered_only = false;
+  client->state = CLIENT_BUSY;
+  client->req = req;
+  if (pool_submit(server->workers, serve_client, client) == -1) {
+    client->req = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Handle as much of what a client on the control socket has sent as is
+ * buffered. A whole registration is handed to a worker to read the give.
+ *
+ * \param server  The broker
+ * \param client  Client whose buffered data to handle. Must not be busy.
+ * \return        0 if the client is still connected, -1 if it was dropped
+ */
+static int advance_control(server_t* server, client_t* client) {
+  conn_t* conn = &client->conn;
+  size_t start = conn->in_start;
+  client->reg = recv_registration(conn);
+  if (client->reg == NULL) {
+    if (errno != EWOULDBLOCK) {
+      drop_client(server, client);
       return -1;
     }
+    conn->in_start = start;
+    if (conn->in_end - start < CONN_BUFFER_SIZE) {
+      return 0;
+    }
+  }
+  if (hand_off(server, client, NULL) == -1) {
+    perror("Failed to hand off client");
+    if (client->reg != NULL) {
+      free_registration(client->reg);
+    }
+    drop_client(server, client);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Check whether the sender of a request may make it: anything for the user the
+ * give it asks for is meant for, and quitting for the owner too.
+ *
+ * \param server  Server the request came in on
+ * \param req     Request to check
+ * \return        true if the give exists and the request may be made
+ */
+static bool may_ask(server_t* server, request_t* req) {
+  give_t* give = find_give(server, req->give);
+  if (give == NULL) {
+    return false;
+  }
+  bool allowed = strcmp(req->username, give->target_username) == 0 ||
+                 (req->action == QUIT_SERVER && strcmp(req->username, server->owner_username) == 0);
+  release_give(server, give);
+  return allowed;
+}
 
-    // Set up args for this thread
-    // They will be freed when the thread exits
-    comm_args_t* args = malloc(sizeof(comm_args_t));
-    args->client_socket_fd = client_socket_fd;
-    args->data = file;
-    args->target_username = target_username;
-    args->owner_username = get_username();
+/**
+ * Handle as much of what a client has sent as is buffered: the handshake, then
+ * a request. Anything that hasn't fully arrived is left buffered for next time.
+ *
+ * \param server  Server the client is connected to
+ * \param client  Client whose buffered data to handle. Must not be busy.
+ * \return        0 if the client is still connected, -1 if it was dropped
+ */
+static int advance_client(server_t* server, client_t* client) {
+  conn_t* conn = &client->conn;
+  if (client->control) {
+    return advance_control(server, client);
+  }
 
-    // Spin up a thread to communicate with this client
-    pthread_t thread;
-    if (pthread_create(&thread, NULL, receive_client_requests, args)) {
-      perror("Failed to create client communication thread");
+  // Agree on a wire format before anything else
+  if (client->state == CLIENT_HELLO) {
+    size_t start = conn->in_start;
+    if (recv_hello(conn) == -1) {
+      if (errno == EWOULDBLOCK && conn->in_end - start < CONN_BUFFER_SIZE) {
+        conn->in_start = start;
+        return 0;
+      }
+      drop_client(server, client);
+      return -1;
+    }
+    client->state = CLIENT_REQUEST;
+  }
+
+  // Nothing sent yet, so wait for it rather than trying to parse nothing
+  if (conn->in_start == conn->in_end) {
+    return 0;
+  }
+  size_t start = conn->in_start;
+  request_t* req = recv_request(conn);
+  if (req == NULL) {
+    if (errno != EWOULDBLOCK) {
+      drop_client(server, client);
       return -1;
     }
+
+    // Anything after the request, like the signatures of an old copy, is only
+    // read once the taker is known to be allowed to take the give. A request
+    // that doesn't fit in the buffer on its own isn't a real one.
+    conn->in_start = start;
+    if (conn->in_end - start < CONN_BUFFER_SIZE) {
+      return 0;
+    }
+    drop_client(server, client);
+    return -1;
   }
+  client->request_start = conn->in_start != conn->in_end ? time(NULL) : 0;
 
-  // Free malloc'd structures
-  free_file(file);
+  // Transfers are sent by workers, which also read any signatures that follow
+  // a request, but only for someone allowed to make it. No worker waits on
+  // anyone else.
+  bool sigs_follow = conn->version >= PROTOCOL_DELTA && (req->features & FEATURE_DELTA);
+  if (req->action == SEND_DATA || req->action == RESUME_DATA || sigs_follow) {
+    if (!may_ask(server, req)) {
+      free_request(req);
+      drop_client(server, client);
+      return -1;
+    }
+    if (hand_off(server, client, req) == -1) {
+      perror("Failed to hand off client");
+      free_request(req);
+      drop_client(server, client);
+      return -1;
+    }
+    return 0;
+  }
+  int rc = handle_request(server, conn, req);
+  free_request(req);
+  if (rc == -1) {
+    drop_client(server, client);
+    return -1;
+  }
   return 0;
 }
 
+/**
+ * Accept every connection that's waiting, hanging up on any past the limit.
+ *
+ * \param server     Server to accept connections on
+ * \param listen_fd  Listening socket of the server to accept them on
+ */
+static void accept_clients(server_t* server, int listen_fd) {
+  bool control = listen_fd == server->control_fd;
+  while (true) {
+    int fd = control ? broker_accept(listen_fd) : server_socket_accept(listen_fd);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Failed to accept new connection");
+      }
+      return;
+    }
+    if (server->num_clients >= GIVE_MAX_CLIENTS) {
+      close(fd);
+      continue;
+    }
+
+    client_t* client = malloc(sizeof(client_t));
+    if (client == NULL || conn_init(&client->conn, fd) == -1) {
+      perror("Failed to set up connection");
+      free(client);
+      close(fd);
+      continue;
+    }
+    client->conn.buffered_only = true;
+    client->state = control ? CLIENT_REQUEST : CLIENT_HELLO;
+    client->last_active = time(NULL);
+    client->request_start = client->last_active;
+    client->control = control;
+    client->req = NULL;
+    client->reg = NULL;
+    client->server = server;
+
+    // The timeout only matters once a worker has it, since until then
+    // nothing waits on the socket
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+    if (socket_set_timeout(fd, GIVE_IDLE_TIMEOUT) == -1 ||
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      perror("Failed to watch connection");
+      conn_free(&client->conn);
+      close(fd);
+      free(client);
+      continue;
+    }
+
+    client->prev = NULL;
+    client->next = server->clients;
+    if (server->clients != NULL) {
+      server->clients->prev = client;
+    }
+    server->clients = client;
+    server->num_clients++;
+  }
+}
+
+/**
+ * Take back clients that workers are done with, and pick up where they left
+ * off. A taker may have sent its next request while its transfer was going.
+ *
+ * \param server  Server to take clients back on
+ */
+static void take_back_clients(server_t* server) {
+  client_t* client;
+  while (read(server->done_fds[0], &client, sizeof(client)) == sizeof(client)) {
+    if (client->state == CLIENT_CLOSED) {
+      drop_client(server, client);
+      continue;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+    if (socket_set_blocking(client->conn.fd, false) == -1 ||
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, client->conn.fd, &event) == -1) {
+      perror("Failed to watch connection");
+      drop_client(server, client);
+      continue;
+    }
+    client->conn.buffered_only = true;
+    client->last_active = time(NULL);
+    client->request_start = client->conn.in_start != client->conn.in_end ? client->last_active : 0;
+    advance_client(server, client);
+  }
+}
+
+/**
+ * Hang up on every client that's waiting and hasn't sent anything for too long,
+ * or is taking too long to send all of something.
+ *
+ * \param server  Server to check the clients of
+ * \param now     The current time
+ */
+static void expire_clients(server_t* server, time_t now) {
+  client_t* client = server->clients;
+  while (client != NULL) {
+    client_t* next = client->next;
+    if (client->state != CLIENT_BUSY &&
+        (now - client->last_active > GIVE_IDLE_TIMEOUT ||
+         (client->request_start != 0 && now - client->request_start > GIVE_REQUEST_TIMEOUT))) {
+      drop_client(server, client);
+    }
+    client = next;
+  }
+}
+
+/**
+ * Give files to takers through a network socket. A single event loop takes
+ * care of accepting connections, handshakes, and reading requests, and
+ * transfers are sent by a pool of workers.
+ *
+ * \param socket_fd   Listening network socket to send through.
+ * \param local_fd    Listening Unix socket to send to takers on this machine
+ *                    through, or -1.
+ * \param control_fd  Listening control socket to take new gives on, for a
+ *                    broker, or -1.
+ * \param give        The one give to host, or NULL for a broker, which starts
+ *                    out with none.
+ * \return            Only returns if there are errors, with -1. Sets errno on
+ *                    failure.
+ */
+static int host_gives(int socket_fd, int local_fd, int control_fd, give_t* give) {
+  server_t server = {
+      .listen_fd = socket_fd,
+      .local_fd = local_fd,
+      .control_fd = control_fd,
+      .gives = give,
+      .num_gives = give != NULL ? 1 : 0,
+      .next_number = 1,
+      .owner_username = get_username(),
+  };
+  pthread_mutex_init(&server.lock, NULL);
+  if (give != NULL) {
+    give->users = 1;
+  }
+
+  // Nothing in the loop may wait, so the workers hand clients back through a
+  // pipe it watches along with the sockets
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server.epoll_fd == -1) {
+    perror("Failed to create event loop");
+    return -1;
+  }
+  if (pipe2(server.done_fds, O_CLOEXEC) == -1 ||
+      socket_set_blocking(server.done_fds[0], false) == -1) {
+    perror("Failed to create pipe");
+    return -1;
+  }
+  if (socket_set_blocking(socket_fd, false) == -1 ||
+      (local_fd != -1 && socket_set_blocking(local_fd, false) == -1) ||
+      (control_fd != -1 && socket_set_blocking(control_fd, false) == -1)) {
+    perror("Failed to set up server socket");
+    return -1;
+  }
+  server.workers = pool_create(GIVE_MAX_TRANSFERS);
+  if (server.workers == NULL) {
+    perror("Failed to start workers");
+    return -1;
+  }
+
+  struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = &server.listen_fd};
+  struct epoll_event local_event = {.events = EPOLLIN, .data.ptr = &server.local_fd};
+  struct epoll_event control_event = {.events = EPOLLIN, .data.ptr = &server.control_fd};
+  struct epoll_event done_event = {.events = EPOLLIN, .data.ptr = server.done_fds};
+  if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, socket_fd, &listen_event) == -1 ||
+      epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.done_fds[0], &done_event) == -1 ||
+      (local_fd != -1 && epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, local_fd, &local_event) == -1) ||
+      (control_fd != -1 &&
+       epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, control_fd, &control_event) == -1)) {
+    perror("Failed to watch server socket");
+    return -1;
+  }
+
+  // Handle connections while the server is running. Waking up every second
+  // is often enough to notice idle clients.
+  time_t last_check = time(NULL);
+  while (true) {
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(server.epoll_fd, events, MAX_EVENTS, 1000);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to wait for connections");
+      return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.ptr == &server.listen_fd) {
+        accept_clients(&server, server.listen_fd);
+      } else if (events[i].data.ptr == &server.local_fd) {
+        accept_clients(&server, server.local_fd);
+      } else if (events[i].data.ptr == &server.control_fd) {
+        accept_clients(&server, server.control_fd);
+      } else if (events[i].data.ptr == server.done_fds) {
+        take_back_clients(&server);
+      } else {
+        // Read everything that's there, then handle as much as possible
+        client_t* client = events[i].data.ptr;
+        client->last_active = time(NULL);
+        if (conn_fill(&client->conn) == -1) {
+          drop_client(&server, client);
+          continue;
+        }
+        if (client->request_start == 0) {
+          client->request_start = client->last_active;
+        }
+        advance_client(&server, client);
+      }
+    }
+
+    time_t now = time(NULL);
+    if (now != last_check) {
+      expire_clients(&server, now);
+      last_check = now;
+    }
+  }
+}
+
+/**
+ * Open the Unix socket that takers on this machine connect to, named after the
+ * port of the network socket. They can always connect over the network
+ * instead, so a give goes on without it if somebody else has the name.
+ *
+ * \return  File descriptor of the listening socket, or -1 if there is none
+ */
+static int open_local_socket() {
+  int fd = local_socket_open(give_server_port);
+  if (fd != -1 && listen(fd, GIVE_BACKLOG) == -1) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+/**
+ * Start a broker for this user, unless somebody just did.
+ *
+ * \return         0 if there is a broker to connect to now, -1 on error
+ */
+static int start_broker() {
+  // Only one broker can listen on the control socket, so whoever gets it
+  // first is the one
+  int control_fd = broker_listen();
+  if (control_fd == -1) {
+    return errno == EADDRINUSE ? 0 : -1;
+  }
+  int server_socket_fd = server_socket_open(&give_server_port);
+  if (server_socket_fd == -1 || listen(server_socket_fd, GIVE_BACKLOG)) {
+    close(control_fd);
+    return -1;
+  }
+  int local_fd = open_local_socket();
+
+  // The control socket is already listening, so the broker can be connected
+  // to as soon as this returns
+  switch (fork()) {
+    case -1:
+      close(control_fd);
+      close(server_socket_fd);
+      if (local_fd != -1) {
+        close(local_fd);
+      }
+      return -1;
+    case 0:
+      break;
+    default:
+      close(control_fd);
+      close(server_socket_fd);
+      if (local_fd != -1) {
+        close(local_fd);
+      }
+      return 0;
+  }
+
+  // Detach like any other give, and host gives until the last one is done.
+  // The broker outlives the give that started it, so it lets go of that one's
+  // terminal too. Errors go back over the control socket instead.
+  if (setsid() == -1) {
+    perror("Failed to create new session");
+    exit(EXIT_FAILURE);
+  }
+  int null_fd = open("/dev/null", O_RDWR);
+  if (null_fd != -1) {
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  host_gives(server_socket_fd, local_fd, control_fd, NULL);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Give a file through this user's broker, starting one if there isn't one yet.
+ *
+ * \param target_username  User to send the file.
+ * \param path             Path to the file or directory.
+ * \param stream           Whether to leave contents on disk until they're sent.
+ * \param threads          Number of threads to read and compress with.
+ * \return                 0 if there are no errors, -1 if there are errors.
+ */
+static int give_with_broker(char* target_username, char* path, bool stream, int threads) {
+  // The broker runs somewhere else, so it needs the whole path
+  char cwd[MAX_PATH_LEN];
+  if (path[0] != '/' && getcwd(cwd, MAX_PATH_LEN) == NULL) {
+    perror("Failed to get current directory");
+    return -1;
+  }
+  char full_path[MAX_PATH_LEN * 2 + 2];
+  snprintf(full_path, sizeof(full_path), "%s%s%s", path[0] != '/' ? cwd : "",
+           path[0] != '/' ? "/" : "", path);
+  registration_t reg = {
+      .target_username = target_username,
+      .path = full_path,
+      .stream = stream,
+      .threads = threads,
+  };
+
+  // A broker that just gave out its last give may hang up as it exits, in
+  // which case another one is started
+  for (int attempt = 0; attempt < 3; attempt++) {
+    conn_t conn;
+    if (broker_connect(&conn) == -1) {
+      if (errno != ECONNREFUSED || start_broker() == -1) {
+        perror("Failed to reach broker");
+        return -1;
+      }
+      continue;
+    }
+
+    unsigned int number = 0;
+    int rc = send_registration(&conn, &reg);
+    if (rc == 0) {
+      rc = recv_registered(&conn, &give_server_port, &number);
+    }
+    int saved_errno = errno;
+    conn_free(&conn);
+    close(conn.fd);
+    if (rc == 0) {
+      printf("Server listening on port %u/%u\n", give_server_port, number);
+      add_give_status(path, target_username, give_host, give_server_port, number);
+      return 0;
+    } else if (saved_errno != 0 && saved_errno != ECONNRESET && saved_errno != EPIPE) {
+      errno = saved_errno;
+      perror("Failed to give");
+      return -1;
+    }
+  }
+  fprintf(stderr, "Failed to reach broker\n");
+  return -1;
+}
+
 void print_usage(char* prog_name) {
-  fprintf(stderr, "Usage: %s USER FILE\n", prog_name);
-  fprintf(stderr, "       %s USER DIRECTORY\n", prog_name);
-  fprintf(stderr, "       %s -c [HOST:]PORT\n", prog_name);
+  fprintf(stderr, "Usage: %s [-s] [-b] [-j THREADS] [-v] USER FILE\n", prog_name);
+  fprintf(stderr, "       %s [-s] [-b] [-j THREADS] [-v] USER DIRECTORY\n", prog_name);
+  fprintf(stderr, "       %s -c [HOST:]PORT[/NUMBER]\n", prog_name);
   fprintf(stderr, "       %s --status\n", prog_name);
 }
 
@@ -165,38 +1027,88 @@ int main(int argc, char** argv) {
   // cancel_host is long enough to hold any hostname
   char* cancel_host = NULL;
   unsigned short cancel_port = 0;
+  unsigned int cancel_number = 0;
 
   // args for give, can be pointers as they come straight from argv
   char* give_user = NULL;
   char* give_path = NULL;
-  if (argc == 2 && strcmp(argv[1], "--status") == 0) {
+  bool stream = false;
+  bool broker = false;
+  bool verbose = false;
+  int threads = pool_default_threads();
+
+  // Flags that may be passed before the positional arguments
+  bool status_flag = false;
+  char* cancel_arg = NULL;
+  struct option long_options[] = {
+      {"status", no_argument, NULL, 'S'},
+      {"stream", no_argument, NULL, 's'},
+      {"broker", no_argument, NULL, 'b'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"verbose", no_argument, NULL, 'v'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:sbj:v", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'S':
+        status_flag = true;
+        break;
+      case 'c':
+        cancel_arg = optarg;
+        break;
+      case 's':
+        stream = true;
+        break;
+      case 'b':
+        broker = true;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1) {
+          fprintf(stderr, "Number of threads must be at least 1\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  int num_positional = argc - optind;
+
+  if (status_flag && cancel_arg == NULL && !stream && !broker && num_positional == 0) {
     // give --status
     mode = STATUS;
   }
-  else if (argc == 3 && strcmp(argv[1], "-c") == 0) {
-    // give -c [HOST]:PORT
+  else if (cancel_arg != NULL && !status_flag && !stream && !broker && num_positional == 0) {
+    // give -c [HOST]:PORT[/NUMBER]
     mode = CANCEL;
 
     // Allocate enough space in cancel_host to hold the hostname
     // (plus some extra space but that waste is okay)
-    cancel_host = malloc(sizeof(char) * (strlen(argv[2]) + strlen(".cs.grinnell.edu") + 1));
+    cancel_host = malloc(sizeof(char) * (strlen(cancel_arg) + strlen(".cs.grinnell.edu") + 1));
     if (cancel_host == NULL) {
       perror("Failed to allocate space for hostname");
       exit(EXIT_FAILURE);
     }
 
-    // Attempt to parse connection info from argv[2]
-    parse_connection_info(argv[2], cancel_host, &cancel_port);
+    // Attempt to parse connection info from the argument
+    parse_connection_info(cancel_arg, cancel_host, &cancel_port, &cancel_number);
     if (cancel_port == 0) {
       fprintf(stderr, "Failed to parse port!\n");
       exit(EXIT_FAILURE);
     }
   }
-  else if (argc == 3) {
-    // give USER PATH
+  else if (!status_flag && cancel_arg == NULL && num_positional == 2) {
+    // give [-s] [-b] [-j THREADS] [-v] USER PATH
     mode = GIVE;
-    give_user = argv[1];
-    give_path = argv[2];
+    give_user = argv[optind];
+    give_path = argv[optind + 1];
 
     // Check give_user is a real user
     // note: we are assuming the same user exists on the taking system. true on mathlan
@@ -244,17 +1156,18 @@ int main(int argc, char** argv) {
   } else if (mode == CANCEL) {
 
     // Connect to the port
-    int socket_fd = socket_connect(cancel_host, cancel_port);
-    if (socket_fd == -1) {
+    conn_t conn;
+    if (connect_to_give(cancel_host, cancel_port, &conn) == -1) {
       perror("Failed to connect");
       exit(EXIT_FAILURE);
     }
 
     // Cancel the give
-    request_t req;
+    request_t req = {0};
     req.username = get_username();
     req.action = QUIT_SERVER;
-    int rc = send_request(socket_fd, &req);
+    req.give = cancel_number;
+    int rc = send_request(&conn, &req);
     if (rc == -1) {
       perror("Failed to send quit request");
       exit(EXIT_FAILURE);
@@ -265,7 +1178,14 @@ int main(int argc, char** argv) {
 
     // Close the socket before we exit
     free(cancel_host);
-    close(socket_fd);
+    conn_free(&conn);
+    close(conn.fd);
+  } else if (mode == GIVE && broker) {
+    // The broker reads the file and hosts it, so there's nothing left to do
+    // here once it has
+    if (give_with_broker(give_user, give_path, stream, threads) == -1) {
+      exit(EXIT_FAILURE);
+    }
   } else if (mode == GIVE) {
     // Open a server, and store the port globally
     int server_socket_fd = server_socket_open(&give_server_port);
@@ -275,20 +1195,29 @@ int main(int argc, char** argv) {
     }
 
     // Start listening for connections on the server
-    if (listen(server_socket_fd, 1)) {
+    if (listen(server_socket_fd, GIVE_BACKLOG)) {
       perror("Failed to listen");
       exit(EXIT_FAILURE);
     }
+    int local_fd = open_local_socket();
 
     // Attempt to read the file into memory now.
     // If there's an error, we want to know before daemonizing
-    file_t* file = malloc(sizeof(file_t));
-    if (file == NULL) {
-      perror("Failed to allocate file struct");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    give_t* give = load_give(give_user, give_path, stream, threads);
+    if (give == NULL) {
       exit(EXIT_FAILURE);
     }
-    if(read_file(give_path, file) == -1) {
-      exit(EXIT_FAILURE);
+    if (verbose) {
+      arena_stats_t arena;
+      arena_stats(give->data->arena, &arena);
+      printf("Read in %.3f s with %d threads\n", seconds_since(&start), threads);
+      printf("Made %zu allocations (%.1f KB) for entries, from %zu arena blocks\n", arena.allocs,
+             arena.bytes / 1e3, arena.blocks);
+      if (!stream && uring_available()) {
+        printf("Read files in batches through io_uring\n");
+      }
     }
 
     // Fork off a child process to do the work
@@ -302,7 +1231,7 @@ int main(int argc, char** argv) {
         break;
       default:
         // Parent does not wait for child
-        free_file(file);
+        free_give(give);
         printf("Server listening on port %u\n", give_server_port);
         exit(0);
     }
@@ -313,12 +1242,16 @@ int main(int argc, char** argv) {
       exit(EXIT_FAILURE);
     }
 
+    // A taker that disconnects partway through a transfer should only end
+    // that transfer, not the whole give
+    signal(SIGPIPE, SIG_IGN);
+
     // Log that we are giving this file
-    add_give_status(give_path, argv[1], give_host, give_server_port);
+    add_give_status(give_path, give_user, give_host, give_server_port, 0);
 
     // Host the file until somebody quits the server
-    // This function does not exit on success, but it cleans up after itself
-    int rc = host_file(argv[1], file, server_socket_fd);
+    // This function does not exit on success
+    int rc = host_gives(server_socket_fd, local_fd, -1, give);
     if (rc == -1) {
       exit(EXIT_FAILURE);
     }
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "transfer.h"
+
+// Where an image is in being written
+typedef enum {
+  IMAGE_EMPTY,    //< the transfer that was being copied into it failed, so the
+                  //< next one to ask writes it instead
+  IMAGE_WRITING,  //< the first transfer is being sent and copied into it
+  IMAGE_READY,    //< complete, and sent from as it is
+  IMAGE_FAILED,   //< couldn't be kept and wouldn't be next time either, so
+                  //< transfers are written every time
+} image_state_t;
+
+// One way of sending the give, and its image
+typedef struct {
+  int version;
+  uint64_t features;
+  image_state_t state;
+  int fd;       //< sealed memfd holding the image, or -1
+  size_t size;  //< bytes in the image
+} image_t;
+
+struct image_cache {
+  pthread_mutex_t lock;  //< protects everything below
+  image_t images[IMAGE_MAX_KINDS];
+  size_t num_images;
+  size_t budget;  //< bytes of images that can still be kept
+};
+
+image_cache_t* image_cache_create(size_t budget) {
+  image_cache_t* cache = malloc(sizeof(image_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->num_images = 0;
+  cache->budget = budget;
+  return cache;
+}
+
+/**
+ * Find the image of one way of sending the give. Must hold the lock.
+ *
+ * \return  The image, or NULL if there is none yet
+ */
+static image_t* find_image(image_cache_t* cache, int version, uint64_t features) {
+  for (size_t i = 0; i < cache->num_images; i++) {
+    image_t* image = &cache->images[i];
+    if (image->version == version && image->features == features) {
+      return image;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Write a transfer to a connection, copying everything sent into a new memfd
+ * as it goes. If all of it fits, the memfd is sealed so it can't change and
+ * kept as the image.
+ *
+ * \param image  Image to fill out the fd and size of, if one is kept
+ * \param room   Most bytes the image may take. Past that, the transfer is still
+ *               sent, but no image is kept.
+ * \param conn   Connection to write to
+ * \param write  Function that writes the transfer
+ * \param arg    Passed to write
+ * \return       0 if the transfer was sent without errors, -1 otherwise
+ */
+static int record_image(image_t* image, size_t room, conn_t* conn, image_write_fn_t write,
+                        void* arg) {
+  // The memfd is as big as it's allowed to get and can't grow past that, so
+  // copying a transfer that doesn't fit stops partway instead of using up
+  // memory
+  int fd = memfd_create("give-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd != -1 && (ftruncate(fd, room) == -1 || fcntl(fd, F_ADD_SEALS, F_SEAL_GROW) == -1)) {
+    close(fd);
+    fd = -1;
+  }
+
+  // Only what's written from here on is part of the transfer
+  if (conn_flush(conn) == -1) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  conn->tee_fd = fd;
+  int rc = write(conn, arg);
+  if (rc == 0) {
+    rc = conn_flush(conn);
+  }
+  bool copied = conn->tee_fd != -1;
+  conn->tee_fd = -1;
+  if (fd == -1) {
+    return rc;
+  }
+
+  off_t size = lseek(fd, 0, SEEK_CUR);
+  if (rc == -1 || !copied || size == -1 || ftruncate(fd, size) == -1 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+    close(fd);
+    return rc;
+  }
+  image->fd = fd;
+  image->size = size;
+  return rc;
+}
+
+int image_send(image_cache_t* cache, conn_t* conn, uint64_t features, image_write_fn_t write,
+               void* arg) {
+  // The first one to ask for a way of sending the give keeps what it sends as
+  // the image. Anyone who asks for the same before that's done has theirs
+  // written too, rather than waiting for all of it to be.
+  pthread_mutex_lock(&cache->lock);
+  image_t* image = find_image(cache, conn->version, features);
+  bool first = false;
+  if (image == NULL && cache->num_images < IMAGE_MAX_KINDS) {
+    image = &cache->images[cache->num_images++];
+    *image = (image_t){conn->version, features, IMAGE_EMPTY, -1, 0};
+  }
+  if (image != NULL && image->state == IMAGE_EMPTY) {
+    image->state = IMAGE_WRITING;
+    first = true;
+  }
+  bool ready = image != NULL && image->state == IMAGE_READY;
+  size_t room = cache->budget;
+  pthread_mutex_unlock(&cache->lock);
+
+  // A ready image never changes again, so it's safe to read without the lock
+  if (ready) {
+    off_t offset = 0;
+    if (conn_flush(conn) == -1) {
+      return -1;
+    }
+    return send_from_file(conn->fd, image->fd, &offset, image->size);
+  } else if (!first) {
+    return write(conn, arg);
+  }
+
+  int rc = record_image(image, room, conn, write, arg);
+
+  // Others may have been kept in the meantime, so check there's still room. A
+  // transfer cut short (the taker hanging up, say) says nothing about the next
+  // one, so that one gets to try again.
+  pthread_mutex_lock(&cache->lock);
+  if (rc == 0 && image->fd != -1 && image->size <= cache->budget) {
+    cache->budget -= image->size;
+    image->state = IMAGE_READY;
+  } else {
+    if (image->fd != -1) {
+      close(image->fd);
+      image->fd = -1;
+    }
+    image->state = rc == -1 ? IMAGE_EMPTY : IMAGE_FAILED;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return rc;
+}
+
+void image_cache_destroy(image_cache_t* cache) {
+  for (size_t i = 0; i < cache->num_images; i++) {
+    if (cache->images[i].fd != -1) {
+      close(cache->images[i].fd);
+    }
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
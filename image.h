@@ -0,0 +1,67 @@
+/**
+ * image.h
+ *
+ * Keep whole transfers exactly as they go on the wire. The first taker to ask
+ * for a give a certain way is sent it as usual, with everything sent copied
+ * into a memfd as it goes. Everyone after that is sent the memfd with
+ * sendfile, without walking the file or encoding any of it again.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "conn.h"
+
+// Most bytes of images one cache keeps, across every way of sending its give
+#define IMAGE_CACHE_MAX 0x10000000
+
+// Most ways of sending one give that get an image of their own
+#define IMAGE_MAX_KINDS 16
+
+/**
+ * Write a whole transfer to a connection.
+ *
+ * \param conn  Connection to write to
+ * \param arg   Whatever was passed along with the function
+ * \return      0 if there were no errors, -1 otherwise
+ */
+typedef int (*image_write_fn_t)(conn_t* conn, void* arg);
+
+// Images of the transfers of one give
+typedef struct image_cache image_cache_t;
+
+/**
+ * Set up an empty cache of images.
+ *
+ * \param budget  Most bytes of images to keep. A transfer that would take it
+ *                past that isn't kept.
+ * \return        The new cache, or NULL on error
+ */
+image_cache_t* image_cache_create(size_t budget);
+
+/**
+ * Send a transfer from its image, or write it to the connection and keep a
+ * copy as the image if it's the first time it's been asked for. Transfers
+ * that are the same for every taker who asks with the same version and
+ * features are the only ones that may be sent this way. Until an image is
+ * ready, or if it can't be kept, transfers are written straight to the
+ * connection.
+ *
+ * \param cache     Cache to keep the image in
+ * \param conn      Connection to send to, with its version set
+ * \param features  Features the transfer is sent with
+ * \param write     Function that writes the transfer
+ * \param arg       Passed to write
+ * \return          0 if there were no errors, -1 otherwise
+ */
+int image_send(image_cache_t* cache, conn_t* conn, uint64_t features, image_write_fn_t write,
+               void* arg);
+
+/**
+ * Free a cache and every image in it. Nothing may be sending from it.
+ *
+ * \param cache  Cache to free
+ */
+void image_cache_destroy(image_cache_t* cache);
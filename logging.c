@@ -27,7 +27,8 @@ char* status_file_path() {
   return status_file_path;
 }
 
-int add_give_status(char* file_name, char* target_user, char* host, unsigned int port) {
+int add_give_status(char* file_name, char* target_user, char* host, unsigned int port,
+                    unsigned int number) {
   char* path = status_file_path();
   if (path == NULL) {
     perror("Failed to allocate space for status file name");
@@ -62,8 +63,18 @@ int add_give_status(char* file_name, char* target_user, char* host, unsigned int
   char time_formatted[time_format_chars];
   strftime(time_formatted, time_format_chars, "%F %T", local_time);
 
+  // Gives on a broker share its port, so they're told apart by number. The
+  // port is written the way take expects it.
+  char port_formatted[32];
+  if (number != 0) {
+    snprintf(port_formatted, sizeof(port_formatted), "%u/%u", port, number);
+  } else {
+    snprintf(port_formatted, sizeof(port_formatted), "%u", port);
+  }
+
   // Write the data to the file, space separated for ease of use
-  fprintf(stream, "%s,%d,%s,%s,%s,%s\n", host, port, file_name, target_user, time_formatted, cwd);
+  fprintf(stream, "%s,%s,%s,%s,%s,%s\n", host, port_formatted, file_name, target_user,
+          time_formatted, cwd);
 
   // Save and close the file
   if (fclose(stream)) {
@@ -74,7 +85,7 @@ int add_give_status(char* file_name, char* target_user, char* host, unsigned int
   return 0;
 }
 
-int remove_give_status(char* host, unsigned int port) {
+int remove_give_status(char* host, unsigned int port, unsigned int number) {
   // Locate and open the original file
   char* path = status_file_path();
   if (path == NULL) {
@@ -126,11 +137,14 @@ int remove_give_status(char* host, unsigned int port) {
       return -1;
     }
 
-    // Convert the port into an integer value
+    // Convert the port (and number, if there is one) into integer values
     unsigned short file_port = atoi(string_port);
+    char* slash = strchr(string_port, '/');
+    unsigned int file_number = slash != NULL ? strtoul(slash + 1, NULL, 10) : 0;
 
     // Do not copy across the target line, effectively deleting it
-    if (file_port == port && strcmp(string_host, host) == 0) {
+    if (file_port == port && file_number == number && strcmp(string_host, host) == 0) {
+      free(to_modify);
       continue;
     }
 
@@ -138,6 +152,7 @@ int remove_give_status(char* host, unsigned int port) {
     fputs(line, copy);
     free(to_modify);
   }
+  free(line);
 
   // Save and close both files
   if (fclose(original)) {
@@ -16,19 +16,24 @@
  * \param target_user  The user the give is intended for.
  * \param host         The machine the give was started from.
  * \param port         The port the give is using.
+ * \param number       The number of the give on a broker, or 0 if it has a
+ *                     port of its own.
  * \return             0 if everything went well, -1 on error
  */
-int add_give_status(char* file_name, char* target_user, char* host, unsigned int port);
+int add_give_status(char* file_name, char* target_user, char* host, unsigned int port,
+                    unsigned int number);
 
 /**
  * Remove a give from the status file.
  *
  * \param host  The hostname of the give to remove.
- * \param port  The port it was hosted on.
- * \return      1 if successfully removed, 0 if not removed but no errors, -1 on
- * error
+ * \param port    The port it was hosted on.
+ * \param number  The number of the give on a broker, or 0 if it had a port of
+ *                its own.
+ * \return        1 if successfully removed, 0 if not removed but no errors, -1
+ *                on error
  */
-int remove_give_status(char* host, unsigned int port);
+int remove_give_status(char* host, unsigned int port, unsigned int number);
 
 /**
  * Print the contents of the status file.
@@ -1,230 +1,2999 @@
 #include "message.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "checksum.h"
+#include "compress.h"
+#include "delta.h"
 #include "filereader.h"
+#include "socket.h"
 
-int send_file(int sock_fd, file_t* file) {
-  // Send the type of the file
-  if (write(sock_fd, &file->type, sizeof(filetype)) != sizeof(filetype)) {
+// Files smaller than this are received whole before being written, so they can
+// be written in the background
+#define BUFFERED_FILE_MAX_SIZE SPLICE_MIN_SIZE
+
+// Sent by both sides at the start of the handshake. The legacy format opens
+// with the length of a username instead, and no name is this long.
+#define PROTOCOL_MAGIC "GIVETAKE"
+#define PROTOCOL_MAGIC_LEN 8
+
+// Longest name accepted in the compact format
+#define MAX_NAME_LEN PATH_MAX
+
+// Most paths of changed files a give lists for a taker. Past that it only says
+// how many there were.
+#define CHANGES_MAX_LISTED 16
+
+// How the contents of a regular file are sent, when the taker asked for
+// features that give a choice. Sent as a varint before the contents.
+#define CONTENTS_WHOLE 0
+#define CONTENTS_DELTA 1  //< as changes to the taker's old copy
+#define CONTENTS_SAME 2   //< as the path of an earlier file with the same contents
+#define CONTENTS_FILE 3   //< as an open file descriptor passed along, to copy
+
+// Smallest regular file passed as a file descriptor. Smaller ones cost less to
+// send than to open, copy and close, and the taker writes them in the
+// background anyway.
+#define LOCAL_MIN_SIZE BUFFERED_FILE_MAX_SIZE
+
+// Steps of rebuilding a file from the taker's old copy. Each one is sent as a
+// varint, followed by the length and bytes of a literal, or the first block and
+// number of blocks to copy.
+#define DELTA_END 0
+#define DELTA_LITERAL 1
+#define DELTA_COPY 2
+
+// Names in the compact format are sent as the number of leading bytes they
+// share with the name sent before them, followed by the rest of the name.
+// Entries are sent in sorted order, so neighbours tend to share a lot.
+typedef struct {
+  char last[MAX_NAME_LEN + 1];  //< previous name sent or received
+  size_t last_len;
+} names_t;
+
+// Where a file that later ones share contents with was sent
+typedef struct {
+  file_t* file;
+  char* rel;     //< malloc'd path relative to the top, or NULL if it's too long
+  size_t index;  //< number the cache knows it by
+} ref_t;
+
+// Files that later ones share contents with, looked up by address
+typedef struct {
+  ref_t* slots;  //< open addressing, with file NULL in empty slots
+  size_t cap;    //< a power of two, or 0 before anything is added
+  size_t count;
+} refs_t;
+
+// Streamed files found to have changed since they were given
+typedef struct {
+  char* paths[CHANGES_MAX_LISTED];  //< malloc'd, relative to above the top
+  size_t listed;
+  size_t count;
+} changes_t;
+
+// State of one file being sent
+typedef struct {
+  conn_t* conn;
+  names_t names;
+  compress_cache_t* cache;  //< where to get compressed chunks, or NULL to send
+                            //< contents as they are
+  size_t next_index;        //< number of the next file to get chunks for
+  size_t ahead;             //< first file not yet queued to be compressed
+  bool check;               //< send a checksum after every chunk
+  uint32_t digest;          //< digest of the checksums sent so far
+  resume_t* start;          //< entries before this have no contents sent
+  delta_sigs_t* sigs;       //< signatures of the taker's old copy, or NULL
+  bool dedup;               //< files may be sent as references to earlier ones
+  refs_t refs;              //< files sent so far that later ones share with
+  bool striped;             //< contents are split across connections, each
+                            //< chunk compressed as it's sent
+  bool sparse;              //< chunks of zeros are sent as holes
+  bool local;               //< streamed files may be passed as file descriptors
+  // Path of the entry being sent relative to the top, which signatures are
+  // looked up by. rel_len is past MAX_NAME_LEN if it's too long to look up.
+  char rel[MAX_NAME_LEN + 1];
+  size_t rel_len;
+} sender_t;
+
+// State of one file being received
+typedef struct {
+  conn_t* conn;
+  names_t names;
+  const codec_t* codec;  //< codec chunks are compressed with, or NULL if
+                         //< contents come as they are
+  uint8_t* wire;         //< space for one compressed chunk
+  uint8_t* raw;          //< space for one decompressed or checked chunk
+  bool check;            //< every chunk is followed by its checksum
+  uint32_t digest;       //< digest of the checksums received so far
+  size_t next_entry;     //< number of the next entry to receive, in preorder
+  resume_t start;        //< entries before this have no contents sent
+  bool delta;            //< regular files may be sent as changes to an old copy
+  bool dedup;            //< regular files may be sent as references to earlier
+                         //< ones
+  char* top;             //< path of the top directory, ending in '/', once it
+                         //< exists. References are relative to it.
+  bool striped;          //< contents come in pieces, split across connections
+  bool sparse;           //< chunks of zeros may come as holes, to skip over
+  bool local;            //< regular files may come as file descriptors
+  uint32_t* crcs;        //< where to keep the checksums received, or NULL
+  uint32_t total;        //< digest including what came before the start
+  resume_t progress;     //< everything before this is on disk, or handed to
+                         //< the writer
+  writer_t* writer;      //< writer for small files, when writing to disk
+  write_stats_t* stats;  //< totals of what was written, when writing to disk
+} receiver_t;
+
+// One entry of a striped transfer, as its header said
+typedef struct {
+  char* path;  //< from the manifest's arena
+  filetype type;
+  mode_t mode;
+  size_t size;
+  size_t same;             //< number of the earlier entry with the same contents
+                           //< plus one, or 0
+  uint32_t* crcs;          //< checksum of every CHUNK_SIZE bytes as they arrive,
+                           //< from the manifest's arena, or NULL if there are none
+  atomic_size_t received;  //< bytes of contents written so far
+} manifest_entry_t;
+
+// Every entry of a striped transfer, in the order they were sent
+typedef struct {
+  manifest_entry_t* entries;
+  size_t count;
+  size_t cap;
+  arena_t* arena;      //< where paths and checksums are allocated from
+  atomic_bool failed;  //< a connection failed, so the others can stop early
+} manifest_t;
+
+// One connection of a striped transfer, received on a thread of its own
+typedef struct {
+  receiver_t* receiver;
+  manifest_t* manifest;
+  size_t bytes;  //< contents written
+  int rc;        //< same as recv_file_to_disk
+  int error;     //< errno, if it failed
+} stripe_recv_t;
+
+/**
+ * Find the slot of a file in a table of references.
+ *
+ * \param refs  Table with at least one empty slot
+ * \param file  File to look for
+ * \return      The slot holding it, or the empty slot where it would go
+ */
+static ref_t* refs_slot(refs_t* refs, file_t* file) {
+  size_t i = ((uintptr_t)file * 0x9e3779b97f4a7c15) >> 32;
+  while (refs->slots[i & (refs->cap - 1)].file != NULL &&
+         refs->slots[i & (refs->cap - 1)].file != file) {
+    i++;
+  }
+  return &refs->slots[i & (refs->cap - 1)];
+}
+
+/**
+ * Remember where a file that later ones share contents with was sent.
+ *
+ * \param refs   Table to add to
+ * \param file   File being sent
+ * \param rel    Its path relative to the top, or NULL if it's too long
+ * \param index  Number the cache knows it by
+ * \return       0 if there were no errors, -1 if out of memory
+ */
+static int refs_add(refs_t* refs, file_t* file, char* rel, size_t index) {
+  // Keep the table at most half full
+  if ((refs->count + 1) * 2 > refs->cap) {
+    refs_t grown = {.cap = refs->cap > 0 ? refs->cap * 2 : 64, .count = refs->count};
+    grown.slots = calloc(grown.cap, sizeof(ref_t));
+    if (grown.slots == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < refs->cap; i++) {
+      if (refs->slots[i].file != NULL) {
+        *refs_slot(&grown, refs->slots[i].file) = refs->slots[i];
+      }
+    }
+    free(refs->slots);
+    *refs = grown;
+  }
+
+  char* copy = NULL;
+  if (rel != NULL && (copy = strdup(rel)) == NULL) {
+    return -1;
+  }
+  *refs_slot(refs, file) = (ref_t){file, copy, index};
+  refs->count++;
+  return 0;
+}
+
+/**
+ * Look up where a file that later ones share contents with was sent.
+ *
+ * \return  Where it was sent, or NULL if it hasn't been
+ */
+static ref_t* refs_find(refs_t* refs, file_t* file) {
+  if (refs->cap == 0) {
+    return NULL;
+  }
+  ref_t* ref = refs_slot(refs, file);
+  return ref->file != NULL ? ref : NULL;
+}
+
+/**
+ * Free a table of references.
+ */
+static void refs_free(refs_t* refs) {
+  for (size_t i = 0; i < refs->cap; i++) {
+    free(refs->slots[i].rel);
+  }
+  free(refs->slots);
+}
+
+/**
+ * Print why the contents of a file couldn't be read to send.
+ *
+ * \param file  Regular file that read_contents failed on
+ * \param msg   What to print if it wasn't because the file shrank
+ */
+static void report_read_failure(file_t* file, char* msg) {
+  if (errno == 0) {
+    fprintf(stderr, "File %s changed while being sent\n", file->path);
+  } else {
+    perror(msg);
+  }
+}
+
+/**
+ * Print why a streamed file couldn't be opened to send.
+ *
+ * \param file  Regular file that open_streamed failed on
+ */
+static void report_open_failure(file_t* file) {
+  report_read_failure(file, "Failed to open file to send");
+}
+
+// A regular file being read for delta_match
+typedef struct {
+  file_t* file;
+  int fd;  //< opened with open_streamed, or -1 if the contents are in memory
+} contents_t;
+
+/**
+ * Get at part of a regular file being compared with the taker's copy. Passed
+ * to delta_match.
+ */
+static const uint8_t* read_window(void* arg, size_t offset, size_t len, uint8_t* buf) {
+  contents_t* contents = arg;
+  return read_contents(contents->file, contents->fd, offset, len, buf);
+}
+
+/**
+ * Stream the contents of a regular file from disk through a connection.
+ * Exactly file->size - from bytes are sent.
+ *
+ * \param conn  Connection to send to
+ * \param file  Regular file with its path filled out
+ * \param from  Where in the file to start
+ * \return      0 if there were no errors, -1 otherwise
+ */
+static int send_regular_from_disk(conn_t* conn, file_t* file, size_t from) {
+  int fd = open_streamed(file);
+  if (fd == -1) {
+    report_open_failure(file);
+    return -1;
+  } else if (lseek(fd, from, SEEK_SET) == -1) {
+    perror("Failed to open file to send");
+    close(fd);
+    return -1;
+  }
+
+  int rc = conn_write_file(conn, fd, file->size - from);
+
+  // The file shrank since it was given, so we can't send what we promised
+  if (rc == -1 && errno == 0) {
+    fprintf(stderr, "File %s changed while being sent\n", file->path);
+  }
+
+  close(fd);
+  return rc;
+}
+
+/**
+ * Send the header of an entry of a flat tree: everything sent before its
+ * contents.
+ *
+ * \param conn   Connection to send to
+ * \param names  Names sent so far, for the compact format
+ * \param flat   Tree the entry is in
+ * \param entry  Entry to send the header of
+ * \return       0 if there were no errors, -1 otherwise
+ */
+static int send_header(conn_t* conn, names_t* names, flat_t* flat, flat_entry_t* entry) {
+  const char* name = flat->names + entry->name;
+  size_t name_len = entry->name_len;
+
+  if (conn->version < PROTOCOL_COMPACT) {
+    // Send the type, length of the name, size (either data size, or number of
+    // entries) and mode, then the name itself
+    if (conn_write(conn, &entry->type, sizeof(filetype)) == -1 ||
+        conn_write(conn, &name_len, sizeof(size_t)) == -1 ||
+        conn_write(conn, &entry->size, sizeof(size_t)) == -1 ||
+        conn_write(conn, &entry->mode, sizeof(mode_t)) == -1 ||
+        conn_write(conn, name, name_len) == -1) {
+      return -1;
+    }
+    return 0;
+  }
+
+  if (name_len > MAX_NAME_LEN) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  // Only send the part of the name that differs from the one before it
+  size_t shared = 0;
+  while (shared < name_len && shared < names->last_len && name[shared] == names->last[shared]) {
+    shared++;
+  }
+  memcpy(names->last + shared, name + shared, name_len - shared + 1);
+  names->last_len = name_len;
+
+  if (conn_write_varint(conn, entry->type) == -1 || conn_write_varint(conn, entry->mode) == -1 ||
+      conn_write_varint(conn, entry->size) == -1 || conn_write_varint(conn, shared) == -1 ||
+      conn_write_varint(conn, name_len - shared) == -1 ||
+      conn_write(conn, name + shared, name_len - shared) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Send the checksum of a chunk, as four bytes in little-endian order, and add
+ * it to the digest of the transfer.
+ *
+ * \param sender  Transfer being sent
+ * \param crc     Checksum to send
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_crc(sender_t* sender, uint32_t crc) {
+  uint8_t bytes[4] = {crc, crc >> 8, crc >> 16, crc >> 24};
+  sender->digest = crc32c_digest(sender->digest, crc);
+  return conn_write(sender->conn, bytes, sizeof(bytes));
+}
+
+/**
+ * Send the checksum of every CHUNK_SIZE bytes of a regular file, if checksums
+ * were asked for. These are the checksums sending the contents in chunks would
+ * have, for contents sent some other way. Streamed contents are read from disk
+ * a chunk at a time.
+ *
+ * \param sender  Transfer being sent
+ * \param file    Regular file
+ * \param fd      The file opened with open_streamed, if it's streamed
+ * \param buf     CHUNK_SIZE bytes to read into
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_file_crcs(sender_t* sender, file_t* file, int fd, uint8_t* buf) {
+  for (size_t offset = 0; offset < file->size && sender->check; offset += CHUNK_SIZE) {
+    size_t len = file->size - offset < CHUNK_SIZE ? file->size - offset : CHUNK_SIZE;
+    const uint8_t* data = read_contents(file, fd, offset, len, buf);
+    if (data == NULL) {
+      report_read_failure(file, "Failed to read file to send");
+      return -1;
+    }
+    if (send_crc(sender, crc32c(0, data, len)) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Send a regular file too small to be in the cache as a single chunk, so it
+ * can be sent with a checksum.
+ *
+ * \param sender  Transfer being sent
+ * \param file    Regular file of less than COMPRESS_MIN_SIZE bytes
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_small_chunk(sender_t* sender, file_t* file) {
+  if (file->size == 0) {
+    return 0;
+  }
+
+  // Streamed files are small enough to read onto the stack
+  uint8_t buf[COMPRESS_MIN_SIZE];
+  uint8_t* data = file->contents.data;
+  if (file->path != NULL) {
+    int fd = open_streamed(file);
+    if (fd == -1) {
+      report_open_failure(file);
+      return -1;
+    }
+    ssize_t rc = pread(fd, buf, file->size, 0);
+    close(fd);
+    if (rc != file->size) {
+      fprintf(stderr, "File %s changed while being sent\n", file->path);
+      return -1;
+    }
+    data = buf;
+  }
+
+  if (conn_write_varint(sender->conn, CODEC_NONE) == -1 ||
+      conn_write_varint(sender->conn, file->size) == -1 ||
+      conn_write(sender->conn, data, file->size) == -1) {
+    return -1;
+  }
+  return send_crc(sender, crc32c(0, data, file->size));
+}
+
+/**
+ * Send one chunk of a regular file, followed by its checksum if those were
+ * asked for. Compressed chunks are sent from the chunk, chunks of zeros as
+ * just their size if the taker leaves holes for them, and the others from
+ * wherever the file is.
+ *
+ * \param sender  Transfer being sent
+ * \param file    Regular file the chunk is from
+ * \param chunk   Chunk to send
+ * \param fd      File descriptor of the file if it's streamed and was opened
+ *                already, otherwise -1. Set to the one opened here.
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_chunk(sender_t* sender, file_t* file, chunk_t* chunk, int* fd) {
+  conn_t* conn = sender->conn;
+  int rc = 0;
+  uint8_t codec = chunk->zero && sender->sparse ? CODEC_ZERO : chunk->codec;
+  if (conn_write_varint(conn, codec) == -1 || conn_write_varint(conn, chunk->raw_len) == -1) {
+    rc = -1;
+  } else if (codec == CODEC_ZERO) {
+    // Holes are sent as nothing but their size
+  } else if (chunk->codec != CODEC_NONE) {
+    // The cache may free the chunk once it's released, so it can't be sent in
+    // place
+    if (conn_write_varint(conn, chunk->wire_len) == -1 ||
+        conn_write(conn, chunk->data, chunk->wire_len) == -1) {
+      rc = -1;
+    }
+  } else if (file->path == NULL) {
+    rc = conn_write_memory(conn, file->contents.data + chunk->offset, chunk->raw_len);
+  } else {
+    if (*fd == -1) {
+      *fd = open_streamed(file);
+    }
+    if (*fd == -1) {
+      report_open_failure(file);
+      rc = -1;
+    } else if (lseek(*fd, chunk->offset, SEEK_SET) == -1) {
+      perror("Failed to open file to send");
+      rc = -1;
+    } else if (conn_write_file(conn, *fd, chunk->raw_len) == -1) {
+      if (errno == 0) {
+        fprintf(stderr, "File %s changed while being sent\n", file->path);
+      }
+      rc = -1;
+    }
+  }
+
+  // The checksum was computed along with the chunk, from the same bytes
+  if (rc == 0 && sender->check) {
+    rc = send_crc(sender, chunk->crc);
+  }
+  return rc;
+}
+
+/**
+ * Report why the chunks of a file couldn't be had from the cache.
+ *
+ * \param file  File that couldn't be read
+ */
+static void chunk_error(file_t* file) {
+  if (errno == 0) {
+    fprintf(stderr, "File %s changed while being sent\n", file->path);
+  } else {
+    perror("Failed to compress file");
+  }
+}
+
+/**
+ * Send the contents of a regular file as a series of chunks, each one either
+ * compressed or as it is. Whole files come from the cache. The one a transfer
+ * resumes in the middle of is compressed as it goes, since most of it won't
+ * be sent, and so is everything in a striped transfer, whose connections
+ * compress in parallel already.
+ *
+ * \param sender  Transfer being sent
+ * \param file    Regular file of at least COMPRESS_MIN_SIZE bytes
+ * \param index   Number the cache knows the file by
+ * \param from    Where in the file to start, a multiple of CHUNK_SIZE
+ * \param to      Where in the file to stop, a multiple of CHUNK_SIZE or the
+ *                end of the file
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_chunks(sender_t* sender, file_t* file, size_t index, size_t from, size_t to) {
+  int fd = -1;
+  int rc = 0;
+  if (from > 0 || to < file->size || sender->striped) {
+    for (size_t offset = from; offset < to && rc == 0; offset += CHUNK_SIZE) {
+      chunk_t chunk;
+      if (cache_get_one(sender->cache, index, offset, &chunk) == -1) {
+        chunk_error(file);
+        rc = -1;
+      } else {
+        rc = send_chunk(sender, file, &chunk, &fd);
+        free(chunk.data);
+      }
+    }
+  } else {
+    size_t num_chunks;
+    chunk_t* chunks = cache_get(sender->cache, index, &sender->ahead, &num_chunks);
+    if (chunks == NULL) {
+      chunk_error(file);
+      return -1;
+    }
+    for (size_t i = 0; i < num_chunks && rc == 0; i++) {
+      rc = send_chunk(sender, file, &chunks[i], &fd);
+    }
+    cache_release(sender->cache, index);
+  }
+
+  if (fd != -1) {
+    close(fd);
+  }
+  return rc;
+}
+
+/**
+ * Send the contents of a regular file as changes to the taker's old copy of it:
+ * the size of the old copy, then the steps to rebuild the new contents from it,
+ * then a checksum for every CHUNK_SIZE bytes of the new contents if those were
+ * asked for. The checksums are the same ones sending it in chunks would have,
+ * so the digest of the transfer doesn't depend on how it was sent.
+ *
+ * \param sender  Transfer being sent
+ * \param file    Regular file of at least one byte
+ * \param sig     Signature of the taker's old copy
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_delta(sender_t* sender, file_t* file, delta_sig_t* sig) {
+  conn_t* conn = sender->conn;
+
+  // Streamed files are read a window at a time rather than mapped, so one that
+  // shrinks while it's being sent fails like any other read
+  contents_t contents = {file, -1};
+  if (file->path != NULL && (contents.fd = open_streamed(file)) == -1) {
+    report_open_failure(file);
+    return -1;
+  }
+  uint8_t* buf = malloc(CHUNK_SIZE > DELTA_MAX_BLOCK ? CHUNK_SIZE : DELTA_MAX_BLOCK);
+  if (buf == NULL) {
+    perror("Failed to compare file with the taker's copy");
+    if (contents.fd != -1) {
+      close(contents.fd);
+    }
+    return -1;
+  }
+
+  size_t num_ops;
+  delta_op_t* ops = delta_match(sig, file->size, read_window, &contents, &num_ops);
+  if (ops == NULL) {
+    report_read_failure(file, "Failed to compare file with the taker's copy");
+    free(buf);
+    if (contents.fd != -1) {
+      close(contents.fd);
+    }
+    return -1;
+  }
+
+  // Literals go through the connection's buffer, since a streamed file could be
+  // truncated under a splice
+  int rc = conn_write_varint(conn, sig->size);
+  for (size_t i = 0; i < num_ops && rc == 0; i++) {
+    delta_op_t* op = &ops[i];
+    if (op->copy) {
+      if (conn_write_varint(conn, DELTA_COPY) == -1 ||
+          conn_write_varint(conn, op->start) == -1 || conn_write_varint(conn, op->len) == -1) {
+        rc = -1;
+      }
+      continue;
+    }
+    const uint8_t* data = read_contents(file, contents.fd, op->start, op->len, buf);
+    if (data == NULL) {
+      report_read_failure(file, "Failed to read file to send");
+      rc = -1;
+    } else if (conn_write_varint(conn, DELTA_LITERAL) == -1 ||
+               conn_write_varint(conn, op->len) == -1 || conn_write(conn, data, op->len) == -1) {
+      rc = -1;
+    }
+  }
+  if (rc == 0) {
+    rc = conn_write_varint(conn, DELTA_END);
+  }
+  if (rc == 0) {
+    rc = send_file_crcs(sender, file, contents.fd, buf);
+  }
+
+  free(ops);
+  free(buf);
+  if (contents.fd != -1) {
+    close(contents.fd);
+  }
+  return rc;
+}
+
+/**
+ * Send a regular file as the path of an earlier file with the same contents,
+ * followed by a checksum for every CHUNK_SIZE bytes of it if those were asked
+ * for.
+ *
+ * \param sender  Transfer being sent
+ * \param file    Regular file of at least one byte
+ * \param rel     Path of the earlier file, relative to the top
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_same(sender_t* sender, file_t* file, char* rel) {
+  size_t rel_len = strlen(rel);
+  if (conn_write_varint(sender->conn, rel_len) == -1 ||
+      conn_write(sender->conn, rel, rel_len) == -1) {
+    return -1;
+  }
+  if (!sender->check) {
+    return 0;
+  }
+
+  // Streamed files are read rather than mapped, so one that shrinks fails like
+  // any other read
+  int fd = -1;
+  if (file->path != NULL && (fd = open_streamed(file)) == -1) {
+    report_open_failure(file);
+    return -1;
+  }
+  uint8_t* buf = file->path != NULL ? malloc(CHUNK_SIZE) : NULL;
+  int rc = -1;
+  if (file->path != NULL && buf == NULL) {
+    perror("Failed to read file to send");
+  } else {
+    rc = send_file_crcs(sender, file, fd, buf);
+  }
+  free(buf);
+  if (fd != -1) {
+    close(fd);
+  }
+  return rc;
+}
+
+/**
+ * Send a regular file streamed from disk as an open file descriptor, passed
+ * along with the varint saying so.
+ *
+ * \param sender  Transfer being sent, over a local connection
+ * \param file    Regular file with its path filled out
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_local(sender_t* sender, file_t* file) {
+  int fd = open_streamed(file);
+  if (fd == -1) {
+    report_open_failure(file);
+    return -1;
+  }
+  int rc = conn_write_fd(sender->conn, fd);
+  close(fd);
+  return rc;
+}
+
+/**
+ * Send one entry of a flat tree through a connection: its header, then its
+ * contents if it's a regular file. The header goes into the connection's buffer
+ * along with the headers and small contents of the entries around it.
+ *
+ * \param sender  Transfer being sent, with rel set to the path of the entry
+ * \param flat    Tree being sent
+ * \param number  Index of the entry
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_entry(sender_t* sender, flat_t* flat, size_t number) {
+  conn_t* conn = sender->conn;
+  flat_entry_t* entry = &flat->entries[number];
+  if (send_header(conn, &sender->names, flat, entry) == -1) {
+    return -1;
+  }
+  if (entry->type == F_DIR) {
+    return 0;
+  }
+
+  // When resuming, headers are sent for every entry so the taker can find its
+  // way around, but contents only from the starting position on
+  file_t* file = entry->file;
+  size_t from = number == sender->start->index ? sender->start->offset : 0;
+  bool chunked = sender->cache != NULL && file->size >= COMPRESS_MIN_SIZE;
+
+  // Files with the same contents as an earlier one use its chunks, and may be
+  // sent as a reference to it. Skipped files count too, since they're on the
+  // taker's side already.
+  size_t index = 0;
+  ref_t* ref = NULL;
+  bool rel_ok = sender->rel_len <= MAX_NAME_LEN;
+  if (file->same != NULL && file->same != file) {
+    ref = refs_find(&sender->refs, file->same);
+    index = ref != NULL ? ref->index : 0;
+  } else if (chunked) {
+    index = sender->next_index++;
+  }
+  if (file->same == file &&
+      refs_add(&sender->refs, file, rel_ok ? sender->rel : NULL, index) == -1) {
+    return -1;
+  }
+  if (number < sender->start->index) {
+    return 0;
+  }
+
+  // When the taker has an old copy or can copy files it has already, or the
+  // give's own, every regular file says how it's sent. The file a transfer
+  // resumes in the middle of is always sent whole.
+  uint64_t how = CONTENTS_WHOLE;
+  delta_sig_t* sig = NULL;
+  if (from == 0 && file->size > 0) {
+    if (sender->dedup && ref != NULL && ref->rel != NULL) {
+      how = CONTENTS_SAME;
+    } else if (sender->local && file->path != NULL && file->size >= LOCAL_MIN_SIZE) {
+      how = CONTENTS_FILE;
+    } else if (sender->sigs != NULL && rel_ok &&
+               (sig = delta_find(sender->sigs, sender->rel)) != NULL) {
+      how = CONTENTS_DELTA;
+    }
+  }
+  if ((sender->sigs != NULL || sender->dedup || sender->local) &&
+      conn_write_varint(conn, how) == -1) {
+    return -1;
+  }
+  if (how == CONTENTS_SAME) {
+    return send_same(sender, file, ref->rel);
+  } else if (how == CONTENTS_FILE) {
+    return send_local(sender, file);
+  } else if (how == CONTENTS_DELTA) {
+    return send_delta(sender, file, sig);
+  }
+
+  if (chunked) {
+    // Compression or checksums were asked for, so contents go in chunks
+    return send_chunks(sender, file, index, from, file->size);
+  } else if (sender->check) {
+    return send_small_chunk(sender, file);
+  } else if (file->path != NULL) {
+    // Streamed files are read from disk as they are sent
+    return send_regular_from_disk(conn, file, from);
+  }
+  // Regular files need only send their data across. The data stays put for as
+  // long as the give runs, so the kernel can read it in place.
+  return conn_write_memory(conn, file->contents.data + from, file->size - from);
+}
+
+/**
+ * Send every entry of a flat tree in order, keeping track of where each one is
+ * relative to the top.
+ *
+ * \param sender  Transfer being sent
+ * \param flat    Tree to send
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_entries(sender_t* sender, flat_t* flat) {
+  // The entry before each one is its directory or inside it, so the path of
+  // the directory is still at the start of rel. Only its length is kept.
+  size_t* rel_lens = malloc(flat->count * sizeof(size_t));
+  if (rel_lens == NULL) {
+    perror("Failed to send file");
+    return -1;
+  }
+
+  int rc = 0;
+  for (size_t i = 0; i < flat->count && rc == 0; i++) {
+    flat_entry_t* entry = &flat->entries[i];
+    if (i > 0) {
+      size_t dir_len = rel_lens[entry->parent];
+      size_t sep = dir_len > 0 ? 1 : 0;
+      sender->rel_len = dir_len + sep + entry->name_len;
+      if (sender->rel_len <= MAX_NAME_LEN) {
+        sender->rel[dir_len] = '/';
+        memcpy(sender->rel + dir_len + sep, flat->names + entry->name, entry->name_len + 1);
+      }
+    }
+    rel_lens[i] = sender->rel_len;
+    rc = send_entry(sender, flat, i);
+  }
+  free(rel_lens);
+  return rc;
+}
+
+/**
+ * Send the headers of every entry of a flat tree, without any contents. Each
+ * regular file is followed by the number of the earlier entry with the same
+ * contents plus one, or 0 if it has contents of its own, if the taker can copy
+ * files.
+ *
+ * \param sender  Transfer being sent
+ * \param flat    Tree to send the headers of
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_manifest(sender_t* sender, flat_t* flat) {
+  for (size_t i = 0; i < flat->count; i++) {
+    flat_entry_t* entry = &flat->entries[i];
+    if (send_header(sender->conn, &sender->names, flat, entry) == -1) {
+      return -1;
+    }
+    if (entry->type != F_REG || !sender->dedup) {
+      continue;
+    }
+
+    // Files are numbered by entry here, rather than the way the cache does
+    file_t* file = entry->file;
+    uint64_t same = 0;
+    if (file->same == file && refs_add(&sender->refs, file, NULL, i) == -1) {
+      return -1;
+    } else if (file->same != NULL && file->same != file) {
+      ref_t* ref = refs_find(&sender->refs, file->same);
+      same = ref != NULL ? ref->index + 1 : 0;
+    }
+    if (conn_write_varint(sender->conn, same) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Send one piece of a striped transfer: the number of the entry plus one, where
+ * the piece starts and how long it is, then its contents the same way the file
+ * would be sent whole.
+ *
+ * \param sender  Transfer being sent
+ * \param piece   Piece to send
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_piece(sender_t* sender, stripe_piece_t* piece) {
+  conn_t* conn = sender->conn;
+  file_t* file = piece->file;
+  if (conn_write_varint(conn, piece->entry + 1) == -1 ||
+      conn_write_varint(conn, piece->offset) == -1 || conn_write_varint(conn, piece->len) == -1) {
+    return -1;
+  }
+
+  // Pieces only start partway through files of at least STRIPE_MIN_RANGE bytes
+  if (sender->cache != NULL && file->size >= COMPRESS_MIN_SIZE) {
+    return send_chunks(sender, file, piece->index, piece->offset, piece->offset + piece->len);
+  } else if (sender->check) {
+    return send_small_chunk(sender, file);
+  } else if (file->path != NULL) {
+    return send_regular_from_disk(conn, file, 0);
+  }
+  return conn_write_memory(conn, file->contents.data, file->size);
+}
+
+/**
+ * Send this connection's share of a striped transfer: the headers of every
+ * entry first if it's the first connection, then its pieces, ending with 0.
+ *
+ * \param sender  Transfer being sent
+ * \param file    File being sent
+ * \param stripe  Which connection of the take this is
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int send_stripe(sender_t* sender, file_t* file, stripe_t* stripe) {
+  if (stripe->index == 0 && send_manifest(sender, file->flat) == -1) {
+    return -1;
+  }
+
+  stripe_piece_t* pieces;
+  size_t num_pieces;
+  if (stripe_plan(file, stripe, &pieces, &num_pieces) == -1) {
+    perror("Failed to plan which files to send");
+    return -1;
+  }
+  int rc = 0;
+  for (size_t i = 0; i < num_pieces && rc == 0; i++) {
+    rc = send_piece(sender, &pieces[i]);
+  }
+  free(pieces);
+  if (rc == 0) {
+    rc = conn_write_varint(sender->conn, 0);
+  }
+  return rc;
+}
+
+/**
+ * Get the path of an entry of a flat tree, relative to above the top, by
+ * following its parents up.
+ *
+ * \param flat   Tree the entry is in
+ * \param index  Index of the entry
+ * \return       Malloc'd path, or only the name if the path is longer than
+ *               MAX_NAME_LEN. NULL if out of memory.
+ */
+static char* flat_path(flat_t* flat, size_t index) {
+  size_t len = flat->entries[index].name_len;
+  for (size_t i = index; i != 0;) {
+    i = flat->entries[i].parent;
+    len += flat->entries[i].name_len + 1;
+  }
+  if (len > MAX_NAME_LEN) {
+    return strdup(flat->names + flat->entries[index].name);
+  }
+
+  char* path = malloc(len + 1);
+  if (path == NULL) {
+    return NULL;
+  }
+  path[len] = '\0';
+  for (size_t i = index;; i = flat->entries[i].parent) {
+    flat_entry_t* entry = &flat->entries[i];
+    len -= entry->name_len;
+    memcpy(path + len, flat->names + entry->name, entry->name_len);
+    if (i == 0) {
+      break;
+    }
+    path[--len] = '/';
+  }
+  return path;
+}
+
+/**
+ * Look for streamed files that have changed since they were given.
+ *
+ * \param flat     Tree to look through
+ * \param changes  Changes to add to
+ * \return         0 if there were no errors, -1 if out of memory
+ */
+static int find_changes(flat_t* flat, changes_t* changes) {
+  for (size_t i = 0; i < flat->count; i++) {
+    file_t* file = flat->entries[i].file;
+    if (flat->entries[i].type != F_REG || file->path == NULL || !streamed_changed(file)) {
+      continue;
+    }
+    changes->count++;
+    if (changes->listed < CHANGES_MAX_LISTED) {
+      char* path = flat_path(flat, i);
+      if (path == NULL) {
+        return -1;
+      }
+      changes->paths[changes->listed++] = path;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Tell the taker which streamed files have changed since they were given.
+ *
+ * \param conn     Connection to send to
+ * \param file     File being sent
+ * \param look     Whether to look for changes. If not, none are sent.
+ * \param changed  Set to the number of files that have changed
+ * \return         0 if there were no errors, -1 otherwise
+ */
+static int send_changes(conn_t* conn, file_t* file, bool look, size_t* changed) {
+  changes_t changes = {.listed = 0, .count = 0};
+  int rc = look ? find_changes(file->flat, &changes) : 0;
+  if (rc == -1) {
+    perror("Failed to look for changed files");
+  }
+
+  if (rc == 0 && (conn_write_varint(conn, changes.count) == -1 ||
+                  conn_write_varint(conn, changes.listed) == -1)) {
+    rc = -1;
+  }
+  for (size_t i = 0; i < changes.listed; i++) {
+    size_t len = strlen(changes.paths[i]);
+    if (rc == 0 && (conn_write_varint(conn, len) == -1 ||
+                    conn_write(conn, changes.paths[i], len) == -1)) {
+      rc = -1;
+    }
+    free(changes.paths[i]);
+  }
+  *changed = changes.count;
+  return rc;
+}
+
+/**
+ * Receive the list of files that have changed since they were given, printing
+ * any there are.
+ *
+ * \param conn  Connection to read from
+ * \return      0 if none have changed, -1 otherwise. errno is ECANCELED if some
+ *              have.
+ */
+static int recv_changes(conn_t* conn) {
+  uint64_t count, listed;
+  if (conn_read_varint(conn, &count) == -1 || conn_read_varint(conn, &listed) == -1) {
+    return -1;
+  }
+  if (listed > count || listed > CHANGES_MAX_LISTED) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  for (size_t i = 0; i < listed; i++) {
+    uint64_t len;
+    if (conn_read_varint(conn, &len) == -1) {
+      return -1;
+    }
+    if (len == 0 || len > MAX_NAME_LEN) {
+      errno = EPROTO;
+      return -1;
+    }
+    char path[MAX_NAME_LEN + 1];
+    if (conn_read(conn, path, len) == -1) {
+      return -1;
+    }
+    path[len] = '\0';
+    fprintf(stderr, "File %s has changed since it was given\n", path);
+  }
+  if (count > listed) {
+    fprintf(stderr, "...and %zu more\n", (size_t)(count - listed));
+  }
+  if (count > 0) {
+    errno = ECANCELED;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Check that a transfer can start from a position: either at an entry, at a
+ * chunk boundary if it's a regular file, or right after the last entry.
+ *
+ * \param file   File being sent, laid out flat
+ * \param start  Position to check
+ * \return       true if the transfer can start there
+ */
+static bool valid_start(file_t* file, resume_t* start) {
+  if (start->offset % CHUNK_SIZE != 0 || start->index > file->flat->count) {
+    return false;
+  } else if (start->index == file->flat->count) {
+    return start->offset == 0;
+  }
+  flat_entry_t* entry = &file->flat->entries[start->index];
+  if (entry->type == F_REG) {
+    return start->offset <= entry->size;
+  }
+  return start->offset == 0;
+}
+
+int send_file(conn_t* conn, file_t* file, compress_cache_t* cache, uint64_t features,
+              resume_t* start, delta_sigs_t* sigs, stripe_t* stripe) {
+  // Older takers can't have asked for any features, or to resume
+  if (conn->version < PROTOCOL_FEATURES || cache == NULL) {
+    cache = NULL;
+    features = 0;
+  }
+  if (conn->version < PROTOCOL_DELTA || sigs == NULL) {
+    features &= ~FEATURE_DELTA;
+  }
+  if (conn->version < PROTOCOL_DEDUP) {
+    features &= ~FEATURE_DEDUP;
+  }
+  if (conn->version < PROTOCOL_SPARSE) {
+    features &= ~FEATURE_SPARSE;
+  }
+  if (conn->version < PROTOCOL_LOCAL || !conn->local) {
+    features &= ~FEATURE_LOCAL;
+  }
+  if (conn->version < PROTOCOL_STRIPE || stripe->count < 2 || stripe->count > STRIPES_MAX ||
+      stripe->index >= stripe->count) {
+    features &= ~FEATURE_STRIPE;
+  }
+
+  // Changes to an old copy and files passed along come whole, and pieces can't
+  // be resumed
+  if (features & FEATURE_STRIPE) {
+    features &= ~(FEATURE_DELTA | FEATURE_LOCAL);
+    start->index = 0;
+    start->offset = 0;
+  }
+  if (conn->version < PROTOCOL_RESUME || !valid_start(file, start)) {
+    start->index = 0;
+    start->offset = 0;
+  }
+  sender_t sender = {
+      .conn = conn,
+      .cache = cache,
+      .check = features & FEATURE_CRC32C,
+      .start = start,
+      .sigs = features & FEATURE_DELTA ? sigs : NULL,
+      .dedup = features & FEATURE_DEDUP,
+      .striped = features & FEATURE_STRIPE,
+      .sparse = features & FEATURE_SPARSE,
+      .local = features & FEATURE_LOCAL,
+  };
+
+  // Say which features the contents are sent with, and where they start
+  int rc = 0;
+  if (conn->version >= PROTOCOL_FEATURES) {
+    rc = conn_write_varint(conn, features);
+  }
+  if (rc == 0 && conn->version >= PROTOCOL_RESUME &&
+      (conn_write_varint(conn, start->give_id) == -1 ||
+       conn_write_varint(conn, start->index) == -1 ||
+       conn_write_varint(conn, start->offset) == -1)) {
+    rc = -1;
+  }
+
+  // Streamed files must still be what they were when the give started, or
+  // the taker would get a mix of old and new. The first connection of a
+  // striped take is the one that looks.
+  size_t changed = 0;
+  if (rc == 0 && conn->version >= PROTOCOL_CHANGES) {
+    bool look = !sender.striped || stripe->index == 0;
+    rc = send_changes(conn, file, look, &changed);
+  }
+  if (rc == 0 && changed > 0) {
+    rc = conn_flush(conn);
+  } else if (rc == 0 && sender.striped) {
+    rc = send_stripe(&sender, file, stripe);
+  } else if (rc == 0) {
+    rc = send_entries(&sender, file->flat);
+  }
+  refs_free(&sender.refs);
+  if (cache != NULL) {
+    cache_abandon(cache, sender.next_index, sender.ahead);
+  }
+
+  // Finish with the digest, so a taker can tell that nothing went missing
+  if (rc == 0 && changed == 0 && sender.check) {
+    rc = send_crc(&sender, sender.digest);
+  }
+  if (rc == 0) {
+    rc = conn_flush(conn);
+  }
+
+  // Don't return until the kernel no longer needs any of the file data, or has
+  // been made to let go of it because the taker stopped taking it
+  if (conn_wait(conn) == -1) {
+    return -1;
+  }
+  return rc;
+}
+
+/**
+ * Start receiving a file: find out which features its contents are sent with,
+ * and make space for them.
+ *
+ * \param receiver  Receiver to set up. Everything but the connection is reset.
+ * \param conn      Connection to read from
+ * \param resume    Position the transfer was asked to start from, or NULL to
+ *                  start from the beginning
+ * \return          0 if there were no errors, -1 if the connection failed
+ *                  (errno is ESTALE if the give started over instead of
+ *                  resuming, or ECANCELED if files changed since they were
+ *                  given), -2 if there was no memory for the chunk buffers
+ */
+static int receiver_init(receiver_t* receiver, conn_t* conn, resume_t* resume) {
+  receiver->conn = conn;
+  receiver->names.last_len = 0;
+  receiver->codec = NULL;
+  receiver->wire = NULL;
+  receiver->raw = NULL;
+  receiver->check = false;
+  receiver->digest = 0;
+  receiver->next_entry = 0;
+  receiver->start = (resume_t){0};
+  receiver->delta = false;
+  receiver->dedup = false;
+  receiver->top = NULL;
+  receiver->striped = false;
+  receiver->sparse = false;
+  receiver->local = false;
+  receiver->crcs = NULL;
+  receiver->total = 0;
+  receiver->progress = (resume_t){0};
+  receiver->writer = NULL;
+  receiver->stats = NULL;
+
+  if (conn->version < PROTOCOL_FEATURES) {
+    return 0;
+  }
+  uint64_t features;
+  if (conn_read_varint(conn, &features) == -1) {
+    return -1;
+  }
+  if (features & ~(codec_all_features() | FEATURE_CRC32C | FEATURE_DELTA | FEATURE_DEDUP |
+                   FEATURE_STRIPE | FEATURE_SPARSE | FEATURE_LOCAL) ||
+      ((features & FEATURE_LOCAL) && !conn->local)) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  // The give starts where it was asked to, or from the beginning if it can't
+  if (conn->version >= PROTOCOL_RESUME) {
+    uint64_t give_id, index, offset;
+    if (conn_read_varint(conn, &give_id) == -1 || conn_read_varint(conn, &index) == -1 ||
+        conn_read_varint(conn, &offset) == -1) {
+      return -1;
+    }
+    bool asked = resume != NULL && (resume->index > 0 || resume->offset > 0);
+    if (asked && index == 0 && offset == 0) {
+      errno = ESTALE;
+      return -1;
+    }
+    if ((index > 0 || offset > 0) &&
+        (!asked || give_id != resume->give_id || index != resume->index ||
+         offset != resume->offset)) {
+      errno = EPROTO;
+      return -1;
+    }
+    receiver->start = (resume_t){give_id, index, offset, asked ? resume->digest : 0};
+    receiver->total = receiver->start.digest;
+    receiver->progress = receiver->start;
+  }
+  if (conn->version >= PROTOCOL_CHANGES && recv_changes(conn) == -1) {
+    return -1;
+  }
+
+  receiver->codec = codec_for_features(features);
+  receiver->check = features & FEATURE_CRC32C;
+  receiver->delta = features & FEATURE_DELTA;
+  receiver->dedup = features & FEATURE_DEDUP;
+  receiver->striped = features & FEATURE_STRIPE;
+  receiver->sparse = features & FEATURE_SPARSE;
+  receiver->local = features & FEATURE_LOCAL;
+  if (receiver->codec != NULL) {
+    receiver->wire = malloc(receiver->codec->bound(CHUNK_SIZE));
+    if (receiver->wire == NULL) {
+      return -2;
+    }
+  }
+  if (receiver->codec != NULL || receiver->check || receiver->delta) {
+    receiver->raw = malloc(CHUNK_SIZE);
+    if (receiver->raw == NULL) {
+      free(receiver->wire);
+      return -2;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Free the chunk buffers of a receiver.
+ *
+ * \param receiver  Receiver to free
+ */
+static void receiver_free(receiver_t* receiver) {
+  free(receiver->wire);
+  free(receiver->raw);
+  free(receiver->top);
+}
+
+/**
+ * Receive the header of one chunk and check that it makes sense.
+ *
+ * \param receiver   Transfer being received
+ * \param remaining  Bytes of the file not received yet
+ * \param chunk      Chunk to fill out the codec, raw_len and wire_len of
+ * \return           0 if there were no errors, -1 otherwise. errno is set to
+ *                   EPROTO if the header made no sense.
+ */
+static int recv_chunk_header(receiver_t* receiver, size_t remaining, chunk_t* chunk) {
+  conn_t* conn = receiver->conn;
+  uint64_t codec, raw_len, wire_len = 0;
+  if (conn_read_varint(conn, &codec) == -1 || conn_read_varint(conn, &raw_len) == -1) {
+    return -1;
+  }
+
+  // Only the codec agreed on can show up, and compressed chunks say how big
+  // they are on the wire. Holes have nothing on the wire.
+  bool hole = codec == CODEC_ZERO && receiver->sparse;
+  bool compressed = codec != CODEC_NONE && !hole;
+  if (compressed && (receiver->codec == NULL || codec != receiver->codec->id)) {
+    errno = EPROTO;
+    return -1;
+  }
+  if (compressed && conn_read_varint(conn, &wire_len) == -1) {
+    return -1;
+  }
+  if (raw_len == 0 || raw_len > CHUNK_SIZE || raw_len > remaining ||
+      (compressed && wire_len > receiver->codec->bound(CHUNK_SIZE))) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  chunk->codec = codec;
+  chunk->raw_len = raw_len;
+  chunk->wire_len = compressed ? wire_len : hole ? 0 : raw_len;
+  return 0;
+}
+
+/**
+ * Receive a compressed chunk and decompress it.
+ *
+ * \param receiver  Transfer being received
+ * \param chunk     Chunk with its header filled out
+ * \param dst       Space for chunk->raw_len decompressed bytes
+ * \return          0 if there were no errors, -1 otherwise. errno is set to
+ *                  EPROTO if the chunk didn't decompress.
+ */
+static int recv_compressed(receiver_t* receiver, chunk_t* chunk, uint8_t* dst) {
+  if (conn_read(receiver->conn, receiver->wire, chunk->wire_len) == -1) {
+    return -1;
+  }
+  if (receiver->codec->decompress(receiver->wire, chunk->wire_len, dst, chunk->raw_len) == -1) {
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Receive a checksum and compare it with the one computed here.
+ *
+ * \param receiver  Transfer being received
+ * \param crc       Checksum of what was received
+ * \return          0 if they match, -1 otherwise. errno is set to EBADMSG if
+ *                  they don't.
+ */
+static int recv_crc(receiver_t* receiver, uint32_t crc) {
+  uint8_t bytes[4];
+  if (conn_read(receiver->conn, bytes, sizeof(bytes)) == -1) {
+    return -1;
+  }
+  uint32_t sent = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+  if (sent != crc) {
+    errno = EBADMSG;
+    return -1;
+  }
+  receiver->digest = crc32c_digest(receiver->digest, crc);
+  receiver->total = crc32c_digest(receiver->total, crc);
+  if (receiver->crcs != NULL) {
+    *receiver->crcs++ = crc;
+  }
+  return 0;
+}
+
+/**
+ * Receive the digest a transfer ends with, and compare it with the one
+ * computed here.
+ *
+ * \param receiver  Transfer being received
+ * \return          0 if they match, -1 otherwise. errno is set to EBADMSG if
+ *                  they don't.
+ */
+static int recv_digest(receiver_t* receiver) {
+  uint32_t digest = receiver->digest;
+  uint32_t total = receiver->total;
+  int rc = recv_crc(receiver, digest);
+  receiver->digest = digest;
+  receiver->total = total;
+  return rc;
+}
+
+/**
+ * Record that everything before a position is on disk, or handed to the
+ * writer.
+ *
+ * \param receiver  Transfer being received
+ * \param index     Number of entries received in full
+ * \param offset    Bytes of the next entry received
+ */
+static void set_progress(receiver_t* receiver, size_t index, size_t offset) {
+  receiver->progress.index = index;
+  receiver->progress.offset = offset;
+  receiver->progress.digest = receiver->total;
+}
+
+/**
+ * Check whether the contents of regular files come in chunks.
+ *
+ * \param receiver  Transfer being received
+ * \param size      Size of the file
+ * \return          true if they do
+ */
+static bool chunked(receiver_t* receiver, size_t size) {
+  return receiver->check || (receiver->codec != NULL && size >= COMPRESS_MIN_SIZE);
+}
+
+/**
+ * Receive the contents of a regular file into memory.
+ *
+ * \param receiver  Transfer being received
+ * \param data      Space for the contents
+ * \param size      Size of the file
+ * \return          0 if there were no errors, -1 otherwise
+ */
+static int recv_contents(receiver_t* receiver, uint8_t* data, size_t size) {
+  if (!chunked(receiver, size)) {
+    return conn_read(receiver->conn, data, size);
+  }
+
+  size_t offset = 0;
+  while (offset < size) {
+    chunk_t chunk;
+    if (recv_chunk_header(receiver, size - offset, &chunk) == -1) {
+      return -1;
+    }
+    if (chunk.codec == CODEC_ZERO) {
+      memset(data + offset, 0, chunk.raw_len);
+    } else if (chunk.codec == CODEC_NONE) {
+      if (conn_read(receiver->conn, data + offset, chunk.raw_len) == -1) {
+        return -1;
+      }
+    } else if (recv_compressed(receiver, &chunk, data + offset) == -1) {
+      return -1;
+    }
+    if (receiver->check && recv_crc(receiver, crc32c(0, data + offset, chunk.raw_len)) == -1) {
+      return -1;
+    }
+    offset += chunk.raw_len;
+  }
+  return 0;
+}
+
+/**
+ * Receive the contents of a regular file into an open file, recording progress
+ * after every chunk. Holes are skipped over rather than written, so a file
+ * that ends in one must be extended to its size afterwards.
+ *
+ * \param receiver  Transfer being received
+ * \param fd        File descriptor of the file to write to, at offset
+ * \param number    Number of the entry the file is
+ * \param size      Size of the file
+ * \param offset    Where in the file the contents start
+ * \return          Same as recv_to_file
+ */
+static int recv_contents_to_file(receiver_t* receiver, int fd, size_t number, size_t size,
+                                 size_t offset) {
+  if (!chunked(receiver, size)) {
+    return conn_read_file(receiver->conn, fd, size - offset);
+  }
+
+  while (offset < size) {
+    chunk_t chunk;
+    if (recv_chunk_header(receiver, size - offset, &chunk) == -1) {
+      return -1;
+    }
+    if (chunk.codec == CODEC_ZERO) {
+      // Nothing is written where the file has a hole, so it stays one
+      if (receiver->check && recv_crc(receiver, zero_crc(chunk.raw_len)) == -1) {
+        return -1;
+      }
+      if (lseek(fd, chunk.raw_len, SEEK_CUR) == -1) {
+        return -2;
+      }
+      offset += chunk.raw_len;
+      if (offset % CHUNK_SIZE == 0) {
+        set_progress(receiver, number, offset);
+      }
+      continue;
+    } else if (chunk.codec == CODEC_NONE && !receiver->check) {
+      // Chunks that weren't compressed can still skip user space
+      int rc = conn_read_file(receiver->conn, fd, chunk.raw_len);
+      if (rc != 0) {
+        return rc;
+      }
+      offset += chunk.raw_len;
+      if (offset % CHUNK_SIZE == 0) {
+        set_progress(receiver, number, offset);
+      }
+      continue;
+    }
+
+    // Everything else passes through memory, and is checked before it's written
+    if (chunk.codec == CODEC_NONE) {
+      if (conn_read(receiver->conn, receiver->raw, chunk.raw_len) == -1) {
+        return -1;
+      }
+    } else if (recv_compressed(receiver, &chunk, receiver->raw) == -1) {
+      return -1;
+    }
+    if (receiver->check && recv_crc(receiver, crc32c(0, receiver->raw, chunk.raw_len)) == -1) {
+      return -1;
+    }
+    if (write_all(fd, receiver->raw, chunk.raw_len) == -1) {
+      return -2;
+    }
+    offset += chunk.raw_len;
+
+    // Transfers can only resume from the start of a chunk
+    if (offset % CHUNK_SIZE == 0) {
+      set_progress(receiver, number, offset);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Add bytes written to a file to the checksums of the chunks they fall in.
+ *
+ * \param crcs    Checksum of every CHUNK_SIZE bytes of the file
+ * \param offset  Where in the file the bytes were written
+ * \param data    Bytes written
+ * \param len     Number of bytes
+ */
+static void add_crcs(uint32_t* crcs, size_t offset, const uint8_t* data, size_t len) {
+  while (len > 0) {
+    size_t n = CHUNK_SIZE - offset % CHUNK_SIZE;
+    if (n > len) {
+      n = len;
+    }
+    crcs[offset / CHUNK_SIZE] = crc32c(crcs[offset / CHUNK_SIZE], data, n);
+    offset += n;
+    data += n;
+    len -= n;
+  }
+}
+
+/**
+ * Receive the contents of a regular file as changes to an old copy of it, and
+ * write them into an open file. The checksums sent after the changes are of
+ * the new contents in chunks, as if they had been sent that way.
+ *
+ * \param receiver  Transfer being received
+ * \param fd        File descriptor of the file to write to, which is empty
+ * \param basis     Path of the old copy
+ * \param size      Size of the file
+ * \return          Same as recv_to_file, except that an error message has
+ *                  already been printed for -2
+ */
+static int recv_delta_to_file(receiver_t* receiver, int fd, char* basis, size_t size) {
+  conn_t* conn = receiver->conn;
+  uint64_t basis_size;
+  if (conn_read_varint(conn, &basis_size) == -1) {
+    return -1;
+  }
+
+  // The old copy must be the one the signatures were made from
+  int basis_fd = open(basis, O_RDONLY);
+  struct stat st;
+  if (basis_fd == -1 || fstat(basis_fd, &st) == -1) {
+    perror("Failed to open file to update");
+    if (basis_fd != -1) {
+      close(basis_fd);
+    }
+    return -2;
+  }
+  if (st.st_size != basis_size) {
+    fprintf(stderr, "File %s changed while being updated\n", basis);
+    close(basis_fd);
+    return -2;
+  }
+  size_t block_len = delta_block_len(basis_size);
+  size_t num_blocks = (basis_size + block_len - 1) / block_len;
+
+  uint32_t* crcs = NULL;
+  if (receiver->check) {
+    crcs = calloc(size / CHUNK_SIZE + 1, sizeof(uint32_t));
+    if (crcs == NULL) {
+      perror("Failed to allocate space for checksums");
+      close(basis_fd);
+      return -2;
+    }
+  }
+
+  int rc = 0;
+  size_t offset = 0;
+  while (rc == 0) {
+    uint64_t op, start, len;
+    if (conn_read_varint(conn, &op) == -1) {
+      rc = -1;
+      break;
+    }
+    if (op == DELTA_END) {
+      break;
+    }
+
+    if (op == DELTA_LITERAL) {
+      if (conn_read_varint(conn, &len) == -1) {
+        rc = -1;
+      } else if (len > CHUNK_SIZE || len > size - offset) {
+        errno = EPROTO;
+        rc = -1;
+      } else if (conn_read(conn, receiver->raw, len) == -1) {
+        rc = -1;
+      } else if (write_all(fd, receiver->raw, len) == -1) {
+        perror("Failed to write file contents");
+        rc = -2;
+      } else {
+        if (crcs != NULL) {
+          add_crcs(crcs, offset, receiver->raw, len);
+        }
+        offset += len;
+      }
+      continue;
+    }
+
+    // Copies must stay inside the old copy, and the new contents
+    if (op != DELTA_COPY) {
+      errno = EPROTO;
+      rc = -1;
+      break;
+    }
+    if (conn_read_varint(conn, &start) == -1 || conn_read_varint(conn, &len) == -1) {
+      rc = -1;
+      break;
+    }
+    if (len == 0 || start >= num_blocks || len > num_blocks - start) {
+      errno = EPROTO;
+      rc = -1;
+      break;
+    }
+    size_t from = start * block_len;
+    size_t end = (start + len) * block_len < basis_size ? (start + len) * block_len : basis_size;
+    if (end - from > size - offset) {
+      errno = EPROTO;
+      rc = -1;
+      break;
+    }
+    while (from < end && rc == 0) {
+      size_t n = end - from < CHUNK_SIZE ? end - from : CHUNK_SIZE;
+      if (pread(basis_fd, receiver->raw, n, from) != n) {
+        fprintf(stderr, "File %s changed while being updated\n", basis);
+        rc = -2;
+      } else if (write_all(fd, receiver->raw, n) == -1) {
+        perror("Failed to write file contents");
+        rc = -2;
+      } else {
+        if (crcs != NULL) {
+          add_crcs(crcs, offset, receiver->raw, n);
+        }
+        from += n;
+        offset += n;
+      }
+    }
+  }
+  close(basis_fd);
+
+  if (rc == 0 && offset != size) {
+    errno = EPROTO;
+    rc = -1;
+  }
+  for (size_t i = 0; rc == 0 && crcs != NULL && i * CHUNK_SIZE < size; i++) {
+    rc = recv_crc(receiver, crcs[i]);
+  }
+  free(crcs);
+  return rc;
+}
+
+/**
+ * Receive the header of a file: everything sent before its contents.
+ *
+ * \param conn   Connection to read from
+ * \param names  Names received so far, for the compact format
+ * \param file   File struct to fill out. Contents are not touched.
+ * \param arena  Arena to allocate the name from, or NULL to malloc it
+ * \return       0 if there were no errors, -1 otherwise. errno is set to
+ *               EPROTO if the header made no sense.
+ */
+static int recv_header(conn_t* conn, names_t* names, file_t* file, arena_t* arena) {
+  if (conn->version >= PROTOCOL_COMPACT) {
+    uint64_t type, mode, size, shared, suffix_len;
+    if (conn_read_varint(conn, &type) == -1 || conn_read_varint(conn, &mode) == -1 ||
+        conn_read_varint(conn, &size) == -1 || conn_read_varint(conn, &shared) == -1 ||
+        conn_read_varint(conn, &suffix_len) == -1) {
+      return -1;
+    }
+    if ((type != F_REG && type != F_DIR) || shared > names->last_len ||
+        suffix_len > MAX_NAME_LEN - shared) {
+      errno = EPROTO;
+      return -1;
+    }
+
+    // The name starts the same as the last one, so only the rest is sent
+    if (conn_read(conn, names->last + shared, suffix_len) == -1) {
+      return -1;
+    }
+    names->last_len = shared + suffix_len;
+    names->last[names->last_len] = '\0';
+
+    file->name = arena != NULL ? arena_strdup(arena, names->last) : strdup(names->last);
+    if (file->name == NULL) {
+      return -1;
+    }
+    file->type = type;
+    file->mode = mode;
+    file->size = size;
+    return 0;
+  }
+
+  // Read the type, length of the filename, size and mode of the file
+  size_t filename_len;
+  if (conn_read(conn, &file->type, sizeof(filetype)) == -1 ||
+      conn_read(conn, &filename_len, sizeof(size_t)) == -1 ||
+      conn_read(conn, &file->size, sizeof(size_t)) == -1 ||
+      conn_read(conn, &file->mode, sizeof(mode_t)) == -1) {
+    return -1;
+  }
+
+  // Make space to store the filename
+  file->name = arena != NULL ? arena_string(arena, filename_len) : malloc(filename_len + 1);
+  if (file->name == NULL) {
+    return -1;
+  }
+
+  // Read the filename of the file
+  if (conn_read(conn, file->name, filename_len) == -1) {
+    if (arena == NULL) {
+      free(file->name);
+    }
+    file->name = NULL;
+    return -1;
+  }
+  file->name[filename_len] = '\0';
+
+  return 0;
+}
+
+/**
+ * Receive one file into memory, recursing into directory entries. If this
+ * fails, the file is left so that free_file on the top can still free it.
+ *
+ * \param receiver  Transfer being received
+ * \param file      Zeroed file to fill out
+ * \param arena     Arena to allocate entries and names from
+ * \return          0 if there were no errors, -1 otherwise
+ */
+static int recv_entry(receiver_t* receiver, file_t* file, arena_t* arena) {
+  // Read everything up to the contents
+  if (recv_header(receiver->conn, &receiver->names, file, arena) == -1) {
+    return -1;
+  }
+
+  // Read the contents of the file
+  if (file->type == F_REG) {
+    // For a regular file, read into file->contents.data
+
+    // Make space to store the file contents. It counts against the same
+    // limit as a file that was read, since free_file hands it back the same way.
+    file->contents.data = malloc(file->size);
+    if (file->contents.data == NULL) {
+      return -1;
+    }
+    if (reserve_storage(file->size) == -1) {
+      free(file->contents.data);
+      file->contents.data = NULL;
+      return -1;
+    }
+
+    // Read the contents into our file struct
+    return recv_contents(receiver, file->contents.data, file->size);
+  }
+
+  // For a directory, make space for file->size number of entries. Entries
+  // that haven't arrived yet stay NULL.
+  if (file->size > SIZE_MAX / sizeof(file_t*)) {
+    errno = EPROTO;
+    file->size = 0;
+    return -1;
+  }
+  file->contents.entries = arena_alloc(arena, file->size * sizeof(file_t*));
+  if (file->contents.entries == NULL) {
+    file->size = 0;
     return -1;
   }
 
-  // Send the length of the name
-  size_t name_len = sizeof(char) * strlen(file->name);
-  if (write(sock_fd, &name_len, sizeof(size_t)) != sizeof(size_t)) {
-    return -1;
+  // Then recursively receive each of those entries
+  for (size_t i = 0; i < file->size; i++) {
+    file->contents.entries[i] = arena_alloc(arena, sizeof(file_t));
+    if (file->contents.entries[i] == NULL ||
+        recv_entry(receiver, file->contents.entries[i], arena) == -1) {
+      return -1;
+    }
+  }
+
+  // All went well!
+  return 0;
+}
+
+file_t* recv_file(conn_t* conn) {
+  receiver_t receiver;
+  if (receiver_init(&receiver, conn, NULL) != 0) {
+    return NULL;
+  }
+  file_t* file = calloc(1, sizeof(file_t));
+  if (file != NULL) {
+    file->arena = arena_create();
+  }
+  if (file != NULL &&
+      (file->arena == NULL || recv_entry(&receiver, file, file->arena) == -1 ||
+       (receiver.check && recv_digest(&receiver) == -1) || flatten_file(file) == -1)) {
+    free_file(file);
+    file = NULL;
+  }
+  receiver_free(&receiver);
+  return file;
+}
+
+/**
+ * Check that a name sent over the network refers to a single entry inside the
+ * directory being written to, and can't escape it.
+ *
+ * \param name  Name to check
+ * \return      true if the name is safe to write to
+ */
+static bool valid_name(char* name) {
+  return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 &&
+         strcmp(name, "..") != 0;
+}
+
+/**
+ * Receive a regular file as an open file descriptor passed by a give on the
+ * same machine, and copy it into an open file.
+ *
+ * \param receiver  Transfer being received, over a local connection
+ * \param fd        File descriptor of the file to write to, which is empty
+ * \param size      Size of the file
+ * \return          Same as recv_to_file, except that an error message has
+ *                  already been printed for -2
+ */
+static int recv_local_to_file(receiver_t* receiver, int fd, size_t size) {
+  // The file descriptor came in with the varint before it, if not earlier
+  int src = conn_read_fd(receiver->conn);
+  if (src == -1) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  int rc = 0;
+  if (copy_open_regular(src, fd, size) == -1) {
+    // The give only passes regular files, at the size it sent them
+    if (errno == 0) {
+      errno = EPROTO;
+      rc = -1;
+    } else {
+      perror("Failed to copy file contents");
+      rc = -2;
+    }
+  }
+  close(src);
+  return rc;
+}
+
+/**
+ * Receive a regular file as the path of an earlier file with the same contents,
+ * and copy that into an open file. The checksums sent after the path are of
+ * the contents in chunks, as if they had been sent that way.
+ *
+ * \param receiver  Transfer being received, with a top directory
+ * \param fd        File descriptor of the file to write to, which is empty
+ * \param path      Path of the file being written
+ * \param size      Size of the file
+ * \return          Same as recv_to_file, except that an error message has
+ *                  already been printed for -2
+ */
+static int recv_same_to_file(receiver_t* receiver, int fd, char* path, size_t size) {
+  conn_t* conn = receiver->conn;
+  uint64_t rel_len;
+  if (conn_read_varint(conn, &rel_len) == -1) {
+    return -1;
+  }
+  if (rel_len == 0 || rel_len > MAX_NAME_LEN) {
+    errno = EPROTO;
+    return -1;
+  }
+  size_t top_len = strlen(receiver->top);
+  char* from = malloc(top_len + rel_len + 1);
+  if (from == NULL) {
+    perror("Failed to allocate space for filename");
+    return -2;
+  }
+  strcpy(from, receiver->top);
+  if (conn_read(conn, from + top_len, rel_len) == -1) {
+    free(from);
+    return -1;
+  }
+  from[top_len + rel_len] = '\0';
+
+  // Like names, the path can't lead outside the top directory
+  char* name = from + top_len;
+  bool valid = strlen(name) == rel_len;
+  while (valid) {
+    char* end = strchr(name, '/');
+    if (end != NULL) {
+      *end = '\0';
+    }
+    valid = valid_name(name);
+    if (end == NULL) {
+      break;
+    }
+    *end = '/';
+    name = end + 1;
+  }
+  if (!valid) {
+    free(from);
+    errno = EPROTO;
+    return -1;
+  }
+
+  // Small files are written in the background, so the earlier one may not be
+  // on disk yet
+  int rc = 0;
+  if (writer_wait(receiver->writer) == -1) {
+    rc = -2;
+  } else if (copy_regular(from, fd, size) == -1) {
+    // The give can only refer to files it has sent, at the size it sent them
+    if (errno == 0 || errno == ENOENT) {
+      errno = EPROTO;
+      rc = -1;
+    } else {
+      perror("Failed to copy file contents");
+      rc = -2;
+    }
+  }
+  free(from);
+
+  // Check the copy against what the give has
+  if (rc == 0 && receiver->check) {
+    int copy_fd = open(path, O_RDONLY);
+    if (copy_fd == -1) {
+      perror("Failed to open copied file");
+      return -2;
+    }
+    for (size_t offset = 0; offset < size && rc == 0; offset += CHUNK_SIZE) {
+      size_t len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+      if (pread(copy_fd, receiver->raw, len, offset) != len) {
+        perror("Failed to read copied file");
+        rc = -2;
+      } else {
+        rc = recv_crc(receiver, crc32c(0, receiver->raw, len));
+      }
+    }
+    close(copy_fd);
+  }
+  return rc;
+}
+
+/**
+ * Receive one file and write it to disk as it arrives, recursing into
+ * directory entries.
+ *
+ * \param receiver   Transfer being received, with a writer and stats
+ * \param dir        Directory to write into, ending in '/'
+ * \param save_name  Name to save under instead of the one sent, or NULL
+ * \param basis      Path of the old copy of the file, or NULL if there is none.
+ *                   For entries inside a directory, the old copy of the
+ *                   directory instead, ending in '/'.
+ * \param created    Set to the malloc'd path of the file once it exists on disk.
+ *                   Only passed for the top-level file, NULL for entries inside
+ *                   a directory.
+ * \return           0 if there were no errors, -1 if the connection failed or a
+ *                   checksum didn't match, -2 if writing failed
+ */
+static int recv_entry_to_disk(receiver_t* receiver, char* dir, char* save_name, char* basis,
+                              char** created) {
+  writer_t* writer = receiver->writer;
+  write_stats_t* stats = receiver->stats;
+  file_t file;
+  if (recv_header(receiver->conn, &receiver->names, &file, NULL) == -1) {
+    return -1;
+  }
+
+  // Don't let the sender write anywhere outside the directory
+  if (save_name == NULL && !valid_name(file.name)) {
+    fprintf(stderr, "Refusing to write file with invalid name %s\n", file.name);
+    free(file.name);
+    return -2;
+  }
+  char* name = save_name != NULL ? save_name : file.name;
+
+  // Construct the path to the file. Directories get a trailing /
+  char* path = malloc(strlen(dir) + strlen(name) + strlen("/") + 1);
+  if (path == NULL) {
+    perror("Failed to allocate space for filename");
+    free(file.name);
+    return -2;
+  }
+  strcpy(path, dir);
+  strcat(path, name);
+
+  // The old copy of an entry has the same name as it, inside the old copy of
+  // its directory
+  char* old = NULL;
+  if (basis != NULL) {
+    old = malloc(strlen(basis) + strlen(file.name) + strlen("/") + 1);
+    if (old == NULL) {
+      perror("Failed to allocate space for filename");
+      free(file.name);
+      free(path);
+      return -2;
+    }
+    strcpy(old, basis);
+    if (created == NULL) {
+      strcat(old, file.name);
+    }
+  }
+  free(file.name);
+
+  // Entries before the one the transfer resumes at are on disk already, and
+  // only their headers are sent again. The one it resumes at may be partly
+  // written.
+  size_t number = receiver->next_entry++;
+  bool done = number < receiver->start.index;
+  bool partial = number == receiver->start.index &&
+                 (receiver->start.index > 0 || receiver->start.offset > 0);
+  size_t offset = partial ? receiver->start.offset : 0;
+
+  // Regular files may be sent as changes to the old copy, if there is one, as
+  // a reference to an earlier file in the top directory, or as the give's own
+  uint64_t how = CONTENTS_WHOLE;
+  if (file.type == F_REG && !done && (receiver->delta || receiver->dedup || receiver->local)) {
+    if (conn_read_varint(receiver->conn, &how) == -1) {
+      free(old);
+      free(path);
+      return -1;
+    }
+    bool valid = how == CONTENTS_WHOLE ||
+                 (how == CONTENTS_DELTA && receiver->delta && old != NULL && offset == 0) ||
+                 (how == CONTENTS_SAME && receiver->dedup && receiver->top != NULL &&
+                  offset == 0) ||
+                 (how == CONTENTS_FILE && receiver->local && offset == 0);
+    if (!valid) {
+      errno = EPROTO;
+      free(old);
+      free(path);
+      return -1;
+    }
+  }
+
+  int rc = 0;
+  if (file.type == F_REG && done) {
+    if (created != NULL) {
+      *created = strdup(path);
+    }
+  } else if (file.type == F_REG && created == NULL && !partial && how == CONTENTS_WHOLE &&
+             file.size < BUFFERED_FILE_MAX_SIZE) {
+    // Small files inside a directory are read whole and handed to the writer,
+    // so creating them overlaps with receiving the ones after
+    uint8_t* data = malloc(file.size);
+    if (data == NULL && file.size > 0) {
+      perror("Failed to allocate space for file contents");
+      free(old);
+      free(path);
+      return -2;
+    }
+    if (recv_contents(receiver, data, file.size) == -1) {
+      if (errno == EBADMSG) {
+        fprintf(stderr, "Checksum mismatch in %s\n", path);
+      }
+      free(data);
+      free(old);
+      free(path);
+      return -1;
+    }
+
+    // The writer frees the path and data
+    free(old);
+    if (writer_add(writer, path, file.mode, data, file.size, true) == -1) {
+      return -2;
+    }
+    set_progress(receiver, number + 1, 0);
+    return 0;
+  } else if (file.type == F_REG) {
+    // Bigger files are written right here as they arrive
+    int fd = partial ? reopen_regular(path, file.mode, offset) : create_regular(path, file.mode);
+    if (fd == -1) {
+      free(old);
+      free(path);
+      return -2;
+    }
+    if (created != NULL) {
+      *created = strdup(path);
+    }
+
+    if (how == CONTENTS_DELTA) {
+      rc = recv_delta_to_file(receiver, fd, old, file.size);
+    } else if (how == CONTENTS_SAME) {
+      rc = recv_same_to_file(receiver, fd, path, file.size);
+    } else if (how == CONTENTS_FILE) {
+      rc = recv_local_to_file(receiver, fd, file.size);
+      stats->local += rc == 0 ? 1 : 0;
+    } else {
+      rc = recv_contents_to_file(receiver, fd, number, file.size, offset);
+      if (rc == 0 && receiver->sparse && ftruncate(fd, file.size) == -1) {
+        rc = -2;
+      }
+    }
+    int saved_errno = errno;
+    if (rc == -2 && how == CONTENTS_WHOLE) {
+      perror("Failed to write file contents");
+    } else if (rc == -1 && errno == EBADMSG) {
+      fprintf(stderr, "Checksum mismatch in %s\n", path);
+    }
+    if (close(fd) == -1 && rc == 0) {
+      perror("Failed to close file");
+      rc = -2;
+    }
+    if (rc == 0) {
+      stats->files++;
+      stats->bytes += file.size - offset;
+      set_progress(receiver, number + 1, 0);
+    }
+    errno = saved_errno;
+  } else {
+    if (!done && create_directory(path, file.mode) == -1) {
+      free(old);
+      free(path);
+      return -2;
+    }
+    if (created != NULL) {
+      *created = strdup(path);
+    }
+    strcat(path, "/");
+    if (old != NULL) {
+      strcat(old, "/");
+    }
+    if (created != NULL && receiver->dedup && (receiver->top = strdup(path)) == NULL) {
+      perror("Failed to allocate space for filename");
+      free(old);
+      free(path);
+      return -2;
+    }
+    if (!done) {
+      stats->directories++;
+      set_progress(receiver, number + 1, 0);
+    }
+
+    // Entries are written as soon as each one arrives. Stop early if one
+    // of the files in the background couldn't be written.
+    for (size_t i = 0; i < file.size && rc == 0; i++) {
+      rc = recv_entry_to_disk(receiver, path, NULL, old, NULL);
+      if (rc == 0 && writer_failed(writer)) {
+        rc = -2;
+      }
+    }
   }
 
-  // Send file->size (either data size, or number of entries
-  if (write(sock_fd, &file->size, sizeof(size_t)) != sizeof(size_t)) {
+  free(old);
+  free(path);
+  return rc;
+}
+
+/**
+ * Receive the headers of a striped transfer, creating directories as they
+ * arrive. Regular files are created once their contents do.
+ *
+ * \param receiver   First connection of the transfer
+ * \param manifest   Where to add the entries
+ * \param dir        Directory to write into, ending in '/'
+ * \param save_name  Name to save under instead of the one sent, or NULL
+ * \param created    Set to the malloc'd path of the top-level file. NULL for
+ *                   entries inside a directory.
+ * \return           Same as recv_entry_to_disk
+ */
+static int recv_manifest(receiver_t* receiver, manifest_t* manifest, char* dir, char* save_name,
+                         char** created) {
+  file_t file;
+  if (recv_header(receiver->conn, &receiver->names, &file, NULL) == -1) {
     return -1;
   }
 
-  // Send the mode too while we're at it
-  if (write(sock_fd, &file->mode, sizeof(mode_t)) != sizeof(mode_t)) {
+  // Don't let the sender write anywhere outside the directory
+  if (save_name == NULL && !valid_name(file.name)) {
+    fprintf(stderr, "Refusing to write file with invalid name %s\n", file.name);
+    free(file.name);
+    return -2;
+  }
+  char* name = save_name != NULL ? save_name : file.name;
+  char* path = arena_string(manifest->arena, strlen(dir) + strlen(name) + strlen("/"));
+  if (path == NULL) {
+    perror("Failed to allocate space for filename");
+    free(file.name);
+    return -2;
+  }
+  strcpy(path, dir);
+  strcat(path, name);
+  free(file.name);
+
+  // Files can only have the same contents as an earlier one that has its own
+  uint64_t same = 0;
+  if (file.type == F_REG && receiver->dedup &&
+      conn_read_varint(receiver->conn, &same) == -1) {
+    return -1;
+  }
+  manifest_entry_t* original =
+      same > 0 && same <= manifest->count ? &manifest->entries[same - 1] : NULL;
+  if (same > 0 && (original == NULL || original->type != F_REG || original->same != 0 ||
+                   original->size != file.size || file.size == 0)) {
+    errno = EPROTO;
     return -1;
   }
 
-  // Send the actual name
-  size_t bytes_written = 0;
-  while (bytes_written < name_len) {
-    // Write the remaining message
-    ssize_t rc = write(sock_fd, file->name + bytes_written, name_len - bytes_written);
+  if (manifest->count == manifest->cap) {
+    size_t cap = manifest->cap > 0 ? manifest->cap * 2 : 64;
+    manifest_entry_t* grown = realloc(manifest->entries, cap * sizeof(manifest_entry_t));
+    if (grown == NULL) {
+      perror("Failed to allocate space for entries");
+      return -2;
+    }
+    manifest->entries = grown;
+    manifest->cap = cap;
+  }
+  manifest_entry_t* entry = &manifest->entries[manifest->count];
+  *entry = (manifest_entry_t){path, file.type, file.mode, file.size, same, NULL};
+  atomic_init(&entry->received, 0);
+  manifest->count++;
+  if (file.type == F_REG && receiver->check && file.size > 0 && same == 0) {
+    size_t num_chunks = (file.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    entry->crcs = arena_alloc(manifest->arena, num_chunks * sizeof(uint32_t));
+    if (entry->crcs == NULL) {
+      perror("Failed to allocate space for checksums");
+      return -2;
+    }
+  }
 
-    // if the write failed, there was an error
-    if (rc <= 0) {
-      return -1;
+  if (file.type == F_REG) {
+    if (created != NULL) {
+      *created = strdup(path);
     }
+    return 0;
+  }
+  if (create_directory(path, file.mode) == -1) {
+    return -2;
+  }
+  if (created != NULL) {
+    *created = strdup(path);
+  }
 
-    bytes_written += rc;
+  // The entries array may move, but the path stays put
+  size_t path_len = strlen(path);
+  strcat(path, "/");
+  int rc = 0;
+  for (size_t i = 0; i < file.size && rc == 0; i++) {
+    rc = recv_manifest(receiver, manifest, path, NULL, NULL);
   }
+  path[path_len] = '\0';
+  return rc;
+}
 
-  // Send the file contents over the network, depending on type
-  if (file->type == F_REG) {
-    // Regular files need only send their data across
+/**
+ * Receive the pieces sent on one connection of a striped transfer, and write
+ * each one where it goes in its file. Run on a thread of its own for every
+ * connection but the first.
+ *
+ * \param arg  stripe_recv_t for the connection. Its rc and error are set once
+ *             the connection ends, and its receiver's checksums are kept in
+ *             the manifest.
+ * \return     NULL, only here because threads must return something
+ */
+static void* recv_pieces(void* arg) {
+  stripe_recv_t* part = (stripe_recv_t*)arg;
+  receiver_t* receiver = part->receiver;
+  manifest_t* manifest = part->manifest;
+  int rc = 0;
+  while (rc == 0) {
+    uint64_t number, offset, len;
+    if (conn_read_varint(receiver->conn, &number) == -1) {
+      rc = -1;
+      break;
+    }
+    if (number == 0) {
+      break;
+    }
+    if (atomic_load(&manifest->failed)) {
+      errno = ECANCELED;
+      rc = -1;
+      break;
+    }
+    if (conn_read_varint(receiver->conn, &offset) == -1 ||
+        conn_read_varint(receiver->conn, &len) == -1) {
+      rc = -1;
+      break;
+    }
+
+    // Pieces must be of a file with contents of its own, and start and end on
+    // chunks
+    manifest_entry_t* entry = number <= manifest->count ? &manifest->entries[number - 1] : NULL;
+    if (entry == NULL || entry->type != F_REG || entry->same != 0 || len == 0 ||
+        offset % CHUNK_SIZE != 0 || offset > entry->size || len > entry->size - offset ||
+        ((offset + len) % CHUNK_SIZE != 0 && offset + len != entry->size)) {
+      errno = EPROTO;
+      rc = -1;
+      break;
+    }
 
-    bytes_written = 0;
-    while (bytes_written < file->size) {
-      // write the remaining message
-      ssize_t rc = write(sock_fd, file->contents.data + bytes_written, file->size - bytes_written);
+    // Other pieces of the same file may be written at the same time, so it's
+    // never truncated. It's kept writable until everything is in.
+    int fd = open(entry->path, O_WRONLY | O_CREAT, entry->mode | S_IWUSR);
+    if (fd == -1 || lseek(fd, offset, SEEK_SET) == -1) {
+      perror("Failed to open file");
+      if (fd != -1) {
+        close(fd);
+      }
+      rc = -2;
+      break;
+    }
+    receiver->crcs = entry->crcs != NULL ? entry->crcs + offset / CHUNK_SIZE : NULL;
+    rc = recv_contents_to_file(receiver, fd, number - 1, offset + len, offset);
+    receiver->crcs = NULL;
+    int saved_errno = errno;
+    if (rc == -2) {
+      perror("Failed to write file contents");
+    } else if (rc == -1 && errno == EBADMSG) {
+      fprintf(stderr, "Checksum mismatch in %s\n", entry->path);
+    }
+    if (close(fd) == -1 && rc == 0) {
+      perror("Failed to close file");
+      rc = -2;
+    }
+    errno = saved_errno;
+    if (rc == 0) {
+      atomic_fetch_add(&entry->received, len);
+      part->bytes += len;
+    }
+  }
 
-      // if the write failed, there was an error
-      if (rc <= 0) return -1;
+  // Every connection ends with the digest of its own pieces
+  if (rc == 0 && receiver->check && recv_digest(receiver) == -1) {
+    rc = -1;
+    if (errno == EBADMSG) {
+      fprintf(stderr, "Transfer checksum mismatch\n");
+      rc = -2;
+    }
+  }
+  part->rc = rc;
+  part->error = errno;
+  if (rc != 0) {
+    atomic_store(&manifest->failed, true);
+  }
+  splice_pipe_close();
+  return NULL;
+}
 
-      bytes_written += rc;
+/**
+ * Finish a striped transfer once every piece is in: make the files that had
+ * no pieces, give files their modes, and total up what was written.
+ *
+ * \param receiver  First connection of the transfer. Its total is set to the
+ *                  digest of every chunk, in the order a transfer that wasn't
+ *                  striped would have had them.
+ * \param manifest  Every entry of the transfer
+ * \return          Same as recv_entry_to_disk
+ */
+static int finish_manifest(receiver_t* receiver, manifest_t* manifest) {
+  write_stats_t* stats = receiver->stats;
+  uint32_t digest = 0;
+  for (size_t i = 0; i < manifest->count; i++) {
+    manifest_entry_t* entry = &manifest->entries[i];
+    if (entry->type == F_DIR) {
+      stats->directories++;
+      continue;
     }
-  } else {
-    // For directories, recursively call send_file on each entry
-    for (int i = 0; i < file->size; i++) {
-      if (send_file(sock_fd, file->contents.entries[i]) == -1) {
-        return -1;
+
+    // Copies of earlier files and empty files had no pieces
+    manifest_entry_t* original = entry->same > 0 ? &manifest->entries[entry->same - 1] : entry;
+    if (entry->same > 0 || entry->size == 0) {
+      int fd = open(entry->path, O_WRONLY | O_CREAT | O_EXCL, entry->mode | S_IWUSR);
+      if (fd == -1) {
+        perror("Failed to open file");
+        return -2;
       }
+      int rc = copy_regular(original->path, fd, entry->size);
+      close(fd);
+      if (rc == -1 && errno == 0) {
+        fprintf(stderr, "File %s changed while being copied\n", original->path);
+        return -2;
+      } else if (rc == -1) {
+        perror("Failed to copy file contents");
+        return -2;
+      }
+    } else if (atomic_load(&entry->received) != entry->size) {
+      // The give left some of it out
+      errno = EPROTO;
+      return -1;
+    } else if (receiver->sparse && truncate(entry->path, entry->size) == -1) {
+      // A hole at the end was skipped over, and it's only safe to extend the
+      // file now that no other connection is writing it
+      perror("Failed to write file contents");
+      return -2;
     }
-  }
+    if (!(entry->mode & S_IWUSR) && chmod(entry->path, entry->mode & 07777) == -1) {
+      perror("Failed to set file mode");
+      return -2;
+    }
+    stats->files++;
+    stats->bytes += entry->size;
 
+    for (size_t j = 0; original->crcs != NULL && j * CHUNK_SIZE < entry->size; j++) {
+      digest = crc32c_digest(digest, original->crcs[j]);
+    }
+  }
+  receiver->total = digest;
   return 0;
 }
 
-file_t* recv_file(int sock_fd) {
-  // Read the type of the file
-  filetype type;
-  if (read(sock_fd, &type, sizeof(filetype)) != sizeof(filetype)) {
-    return NULL;
+/**
+ * Receive a transfer whose contents are split across several connections. The
+ * headers of every entry come first on the first connection, then every
+ * connection is read on a thread of its own.
+ *
+ * \param receiver   First connection of the transfer, whose answer said the
+ *                   contents are striped
+ * \param dir        Directory to write into, ending in '/'
+ * \param save_name  Name to save under instead of the one sent, or NULL
+ * \param created    Set to the malloc'd path of the top-level file
+ * \param stripes    The other connections
+ * \return           Same as recv_file_to_disk
+ */
+static int recv_stripes_to_disk(receiver_t* receiver, char* dir, char* save_name, char** created,
+                                stripe_conns_t* stripes) {
+  // Now that the give has agreed, ask for the rest of the contents on the other
+  // connections, so it can start sending them right away
+  size_t count = stripes->count + 1;
+  for (size_t i = 0; i < stripes->count; i++) {
+    request_t req = *stripes->req;
+    req.stripe = (stripe_t){i + 1, count};
+    if (send_request(&stripes->conns[i], &req) == -1) {
+      return -1;
+    }
   }
 
-  // Read the length of the filename
-  size_t filename_len;
-  if (read(sock_fd, &filename_len, sizeof(size_t)) != sizeof(size_t)) {
-    return NULL;
+  manifest_t manifest = {0};
+  atomic_init(&manifest.failed, false);
+  manifest.arena = arena_create();
+  if (manifest.arena == NULL) {
+    perror("Failed to create arena");
+    return -2;
   }
+  int rc = recv_manifest(receiver, &manifest, dir, save_name, created);
 
-  // Read the size of the file
-  size_t size;
-  if (read(sock_fd, &size, sizeof(size_t)) != sizeof(size_t)) {
-    return NULL;
+  // Every connection should be answered by the same give, splitting the same
+  // way
+  receiver_t receivers[STRIPES_MAX];
+  stripe_recv_t parts[STRIPES_MAX];
+  pthread_t threads[STRIPES_MAX];
+  bool started[STRIPES_MAX] = {false};
+  size_t ready = 1;
+  parts[0] = (stripe_recv_t){receiver, &manifest};
+  for (; ready < count && rc == 0; ready++) {
+    rc = receiver_init(&receivers[ready], &stripes->conns[ready - 1], NULL);
+    if (rc == -2) {
+      perror("Failed to allocate space for chunks");
+    } else if (rc == 0 && (!receivers[ready].striped ||
+                           receivers[ready].start.give_id != receiver->start.give_id)) {
+      errno = EPROTO;
+      rc = -1;
+    }
+    parts[ready] = (stripe_recv_t){&receivers[ready], &manifest};
   }
 
-  // Then read the mode of the file
-  mode_t mode;
-  if (read(sock_fd, &mode, sizeof(mode_t)) != sizeof(mode_t)) {
-    return NULL;
+  if (rc == 0) {
+    // A connection without a thread of its own is read after the first one
+    for (size_t i = 1; i < count; i++) {
+      started[i] = pthread_create(&threads[i], NULL, recv_pieces, &parts[i]) == 0;
+    }
+    recv_pieces(&parts[0]);
+    for (size_t i = 1; i < count; i++) {
+      if (started[i]) {
+        pthread_join(threads[i], NULL);
+      } else {
+        recv_pieces(&parts[i]);
+      }
+    }
+
+    // Report the connection that failed first, rather than ones that stopped
+    // because of it
+    for (size_t i = 0; i < count && rc == 0; i++) {
+      if (parts[i].rc != 0 && parts[i].error != ECANCELED) {
+        rc = parts[i].rc;
+        errno = parts[i].error;
+      }
+    }
+    for (size_t i = 0; i < count && rc == 0; i++) {
+      rc = parts[i].rc;
+      errno = parts[i].error;
+    }
+  }
+  for (size_t i = 1; i < ready; i++) {
+    receiver_free(&receivers[i]);
   }
 
-  // Create space to store the received file
-  file_t* file = malloc(sizeof(file_t));
-  file->size = size;
-  file->type = type;
-  file->mode = mode;
+  if (rc == 0) {
+    rc = finish_manifest(receiver, &manifest);
+  }
+  int saved_errno = errno;
+  free(manifest.entries);
+  arena_destroy(manifest.arena);
+  errno = saved_errno;
+  return rc;
+}
 
-  // Make space to store the filename
-  file->name = malloc(filename_len + 1);
-  if (file->name == NULL) {
-    free_file(file);
-    return NULL;
+int recv_file_to_disk(conn_t* conn, char* dir, char* save_name, write_opts_t* opts,
+                      write_stats_t* stats, char** created, char* basis, verify_t* verify,
+                      resume_t* resume, stripe_conns_t* stripes) {
+  *created = NULL;
+  receiver_t receiver;
+  int rc = receiver_init(&receiver, conn, resume);
+  if (rc == -2) {
+    perror("Failed to allocate space for chunks");
+  }
+  if (rc == 0 && receiver.striped && stripes == NULL) {
+    errno = EPROTO;
+    rc = -1;
+  }
+  if (rc != 0) {
+    return rc;
   }
 
-  // Read the filename of the file
-  size_t bytes_read = 0;
-  while (bytes_read < filename_len) {
-    ssize_t rc = read(sock_fd, file->name + bytes_read, filename_len - bytes_read);
+  receiver.writer = writer_create(opts);
+  if (receiver.writer == NULL) {
+    receiver_free(&receiver);
+    return -2;
+  }
 
-    if (rc <= 0) {
-      free_file(file);
-      return NULL;
+  write_stats_t totals = {0};
+  receiver.stats = &totals;
+  if (receiver.striped) {
+    // Pieces arrive in any order, so there's nothing to resume from
+    resume_t start = receiver.progress;
+    rc = recv_stripes_to_disk(&receiver, dir, save_name, created, stripes);
+    receiver.progress = start;
+  } else {
+    rc = recv_entry_to_disk(&receiver, dir, save_name, basis, created);
+  }
+
+  // The digest at the end covers every chunk, so nothing went missing either.
+  // Each connection of a striped transfer has checked its own already.
+  if (rc == 0 && receiver.check && !receiver.striped && recv_digest(&receiver) == -1) {
+    rc = -1;
+    if (errno == EBADMSG) {
+      fprintf(stderr, "Transfer checksum mismatch\n");
+      rc = -2;
     }
+  }
+  int saved_errno = errno;
 
-    bytes_read += rc;
+  // Wait for the files still being written even if something failed, so that
+  // nothing shows up after the caller has cleaned up. If any of them couldn't
+  // be written, the progress made can't be trusted either.
+  if (writer_finish(receiver.writer, &totals) == -1) {
+    rc = -2;
   }
-  file->name[filename_len] = '\0';
+  receiver_free(&receiver);
+  errno = saved_errno;
 
-  // Read the contents of the file
-  if (file->type == F_REG) {
-    // For a regular file, read into file->contents.data
+  if (stats != NULL) {
+    stats->files += totals.files;
+    stats->directories += totals.directories;
+    stats->bytes += totals.bytes;
+    stats->local += totals.local;
+  }
+  if (verify != NULL) {
+    verify->checked = rc == 0 && receiver.check;
+    verify->digest = receiver.total;
+  }
+  *resume = receiver.progress;
+  return rc;
+}
 
-    // Make space to store the file contents
-    file->contents.data = malloc(size);
-    if (file->contents.data == NULL) {
-      free_file(file);
-      return NULL;
+int send_hello(conn_t* conn) {
+  // Say which version we speak, and wait to hear which one to use
+  if (conn_write(conn, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LEN) == -1 ||
+      conn_write_varint(conn, PROTOCOL_VERSION) == -1 || conn_flush(conn) == -1) {
+    return -1;
+  }
+
+  uint8_t magic[PROTOCOL_MAGIC_LEN];
+  uint64_t version;
+  if (conn_read(conn, magic, PROTOCOL_MAGIC_LEN) == -1) {
+    return -1;
+  }
+  if (memcmp(magic, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LEN) != 0) {
+    errno = EPROTO;
+    return -1;
+  }
+  if (conn_read_varint(conn, &version) == -1) {
+    return -1;
+  }
+  if (version < PROTOCOL_COMPACT || version > PROTOCOL_VERSION) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  conn->version = version;
+  return 0;
+}
+
+int recv_hello(conn_t* conn) {
+  // Takers from before the handshake existed go straight to their request
+  uint8_t* magic = conn_peek(conn, PROTOCOL_MAGIC_LEN);
+  if (magic == NULL) {
+    return -1;
+  }
+  if (memcmp(magic, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LEN) != 0) {
+    conn->version = PROTOCOL_LEGACY;
+    return 0;
+  }
+
+  // Both sides speak the older of the two versions
+  uint8_t skip[PROTOCOL_MAGIC_LEN];
+  uint64_t version;
+  if (conn_read(conn, skip, PROTOCOL_MAGIC_LEN) == -1 || conn_read_varint(conn, &version) == -1) {
+    return -1;
+  }
+  if (version > PROTOCOL_VERSION) {
+    version = PROTOCOL_VERSION;
+  } else if (version < PROTOCOL_COMPACT) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  if (conn_write(conn, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LEN) == -1 ||
+      conn_write_varint(conn, version) == -1 || conn_flush(conn) == -1) {
+    return -1;
+  }
+  conn->version = version;
+  return 0;
+}
+
+/**
+ * Connect to a give, through its Unix socket if it's on this machine. Gives
+ * from before they had one are connected to over the network.
+ *
+ * \param host  Hostname of the give
+ * \param port  Port of the give
+ * \return      File descriptor of the connected socket, or -1 on error
+ */
+static int open_give_socket(char* host, unsigned short port) {
+  if (socket_is_local_host(host)) {
+    int fd = local_socket_connect(port);
+    if (fd != -1) {
+      return fd;
     }
+  }
+  return socket_connect(host, port);
+}
 
-    // Read the contents into our file struct
-    bytes_read = 0;
-    while (bytes_read < size) {
-      ssize_t rc = read(sock_fd, file->contents.data + bytes_read, size - bytes_read);
+int connect_to_give(char* host, unsigned short port, conn_t* conn) {
+  int fd = open_give_socket(host, port);
+  if (fd == -1) {
+    return -1;
+  }
+  if (conn_init(conn, fd) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (send_hello(conn) == 0) {
+    return 0;
+  }
 
-      if (rc <= 0) {
-        free_file(file);
-        return NULL;
-      }
+  int saved_errno = errno;
+  conn_free(conn);
+  close(fd);
+  if (saved_errno != 0 && saved_errno != ECONNRESET) {
+    errno = saved_errno;
+    return -1;
+  }
+
+  // Gives from before the handshake existed hang up on it (resetting the
+  // connection if the rest of it was never read), so connect again and speak
+  // the legacy format
+  fd = open_give_socket(host, port);
+  if (fd == -1) {
+    return -1;
+  }
+  if (conn_init(conn, fd) == -1) {
+    close(fd);
+    return -1;
+  }
+  conn->version = PROTOCOL_LEGACY;
+  return 0;
+}
 
-      bytes_read += rc;
+/**
+ * Send the signatures of the taker's old copy: the number of files, then the
+ * path and size of each, followed by the signature of each of its blocks as a
+ * four byte rolling checksum and an eight byte hash, both little-endian. The
+ * number of blocks follows from the size.
+ *
+ * \param conn  Connection to send to
+ * \param sigs  Signatures to send, or NULL to send none
+ * \return      0 if there were no errors, -1 otherwise
+ */
+static int send_sigs(conn_t* conn, delta_sigs_t* sigs) {
+  size_t num_files = sigs != NULL ? sigs->num_files : 0;
+  if (conn_write_varint(conn, num_files) == -1) {
+    return -1;
+  }
+  for (size_t i = 0; i < num_files; i++) {
+    delta_sig_t* sig = &sigs->files[i];
+    size_t path_len = strlen(sig->path);
+    if (conn_write_varint(conn, path_len) == -1 || conn_write(conn, sig->path, path_len) == -1 ||
+        conn_write_varint(conn, sig->size) == -1) {
+      return -1;
     }
-  } else {
-    // For a directory, make space for file->size number of entries
-    file->contents.entries = malloc(sizeof(file_t*) * file->size);
+    for (size_t j = 0; j < sig->num_blocks; j++) {
+      uint8_t bytes[12];
+      for (int k = 0; k < 4; k++) {
+        bytes[k] = sig->blocks[j].weak >> (8 * k);
+      }
+      for (int k = 0; k < 8; k++) {
+        bytes[4 + k] = sig->blocks[j].strong >> (8 * k);
+      }
+      if (conn_write(conn, bytes, sizeof(bytes)) == -1) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Receive the signature of one file sent by send_sigs, keeping it if it fits
+ * under the limits on what a taker's signatures can hold and reading past it
+ * otherwise.
+ *
+ * \param conn        Connection to read from
+ * \param sigs        Signatures to add it to
+ * \param cap         Number of files there is room for in sigs->files
+ * \param path_bytes  Bytes of paths kept so far
+ * \return            0 if there were no errors, -1 otherwise. errno is set to
+ *                    EPROTO if it made no sense.
+ */
+static int recv_sig(conn_t* conn, delta_sigs_t* sigs, size_t* cap, size_t* path_bytes) {
+  uint64_t path_len, size;
+  char path[MAX_NAME_LEN + 1];
+  if (conn_read_varint(conn, &path_len) == -1) {
+    return -1;
+  }
+  if (path_len > MAX_NAME_LEN) {
+    errno = EPROTO;
+    return -1;
+  }
+  if (conn_read(conn, path, path_len) == -1 || conn_read_varint(conn, &size) == -1) {
+    return -1;
+  }
+  path[path_len] = '\0';
+  if (size < DELTA_MIN_SIZE) {
+    errno = EPROTO;
+    return -1;
+  }
 
-    // Then recursively receive each of those entries
-    for (int i = 0; i < file->size; i++) {
-      file->contents.entries[i] = recv_file(sock_fd);
-      if (file->contents.entries[i] == NULL) {
-        free_file(file);
-        return NULL;
+  // Every signature is held in memory, so files past the limits are sent
+  // whole, just like the ones a taker doesn't sign
+  size_t block_len = delta_block_len(size);
+  size_t num_blocks = size / block_len + (size % block_len != 0);
+  delta_sig_t* sig = NULL;
+  if (sigs->num_files < DELTA_MAX_FILES && num_blocks <= DELTA_MAX_BLOCKS - sigs->num_blocks &&
+      path_len < DELTA_MAX_PATH_BYTES - *path_bytes) {
+    if (sigs->num_files == *cap) {
+      size_t new_cap = *cap * 2 + 16;
+      delta_sig_t* files = realloc(sigs->files, new_cap * sizeof(delta_sig_t));
+      if (files == NULL) {
+        return -1;
       }
+      sigs->files = files;
+      *cap = new_cap;
     }
+    sig = &sigs->files[sigs->num_files];
+    sig->path = strdup(path);
+    sig->blocks = malloc(num_blocks * sizeof(delta_block_t));
+    if (sig->path == NULL || sig->blocks == NULL) {
+      free(sig->path);
+      free(sig->blocks);
+      return -1;
+    }
+    sig->size = size;
+    sig->num_blocks = num_blocks;
+    sigs->num_files++;
+    sigs->num_blocks += num_blocks;
+    *path_bytes += path_len + 1;
   }
 
-  // All went well? Return that file.
-  return file;
+  for (size_t i = 0; i < num_blocks; i++) {
+    uint8_t bytes[12];
+    if (conn_read(conn, bytes, sizeof(bytes)) == -1) {
+      return -1;
+    }
+    if (sig == NULL) {
+      continue;
+    }
+    sig->blocks[i].weak = 0;
+    sig->blocks[i].strong = 0;
+    for (int k = 0; k < 4; k++) {
+      sig->blocks[i].weak |= (uint32_t)bytes[k] << (8 * k);
+    }
+    for (int k = 0; k < 8; k++) {
+      sig->blocks[i].strong |= (uint64_t)bytes[4 + k] << (8 * k);
+    }
+  }
+  return 0;
 }
 
-int send_request(int sock_fd, request_t* req) {
-  // Send how long the name is
-  size_t name_len = sizeof(char) * strlen(req->username);
-  if (write(sock_fd, &name_len, sizeof(size_t)) != sizeof(size_t)) {
-    return -1;
+/**
+ * Receive the signatures sent by send_sigs. Memory grows with what actually
+ * arrives, up to DELTA_MAX_FILES files, DELTA_MAX_BLOCKS blocks and
+ * DELTA_MAX_PATH_BYTES of paths, whatever number of files the taker claims.
+ *
+ * \param conn  Connection to read from
+ * \return      The malloc'd signatures, sorted, or NULL if something went
+ *              wrong. errno is set to EPROTO if they made no sense.
+ */
+static delta_sigs_t* recv_sigs(conn_t* conn) {
+  uint64_t num_files;
+  if (conn_read_varint(conn, &num_files) == -1) {
+    return NULL;
+  }
+  delta_sigs_t* sigs = calloc(1, sizeof(delta_sigs_t));
+  if (sigs == NULL) {
+    return NULL;
+  }
+
+  size_t cap = 0;
+  size_t path_bytes = 0;
+  for (uint64_t i = 0; i < num_files; i++) {
+    if (recv_sig(conn, sigs, &cap, &path_bytes) == -1) {
+      int saved_errno = errno;
+      delta_free(sigs);
+      errno = saved_errno;
+      return NULL;
+    }
   }
 
-  // Send the name over
-  size_t bytes_written = 0;
-  while (bytes_written < name_len) {
-    // write the remaining message
-    ssize_t rc = write(sock_fd, req->username + bytes_written, name_len - bytes_written);
+  // Repeated paths make no sense either
+  if (delta_sort(sigs) == -1) {
+    delta_free(sigs);
+    errno = EPROTO;
+    return NULL;
+  }
+  return sigs;
+}
 
-    // if the write failed, there was an error
-    if (rc <= 0) return -1;
+int send_request(conn_t* conn, request_t* req) {
+  size_t name_len = sizeof(char) * strlen(req->username);
 
-    bytes_written += rc;
+  if (conn->version >= PROTOCOL_COMPACT) {
+    if (conn_write_varint(conn, req->action) == -1 || conn_write_varint(conn, name_len) == -1 ||
+        conn_write(conn, req->username, name_len) == -1) {
+      return -1;
+    }
+    if (conn->version >= PROTOCOL_FEATURES && conn_write_varint(conn, req->features) == -1) {
+      return -1;
+    }
+    if (conn->version >= PROTOCOL_BROKER && conn_write_varint(conn, req->give) == -1) {
+      return -1;
+    }
+    if (req->action == RESUME_DATA &&
+        (conn_write_varint(conn, req->resume.give_id) == -1 ||
+         conn_write_varint(conn, req->resume.index) == -1 ||
+         conn_write_varint(conn, req->resume.offset) == -1)) {
+      return -1;
+    }
+    if (conn->version >= PROTOCOL_STRIPE && (req->features & FEATURE_STRIPE) &&
+        (conn_write_varint(conn, req->stripe.index) == -1 ||
+         conn_write_varint(conn, req->stripe.count) == -1)) {
+      return -1;
+    }
+    if (conn->version >= PROTOCOL_DELTA && (req->features & FEATURE_DELTA) &&
+        send_sigs(conn, req->sigs) == -1) {
+      return -1;
+    }
+    return conn_flush(conn);
   }
 
-  // Send the request value
-  if (write(sock_fd, &req->action, sizeof(action_t)) != sizeof(action_t)) {
+  // Send how long the name is, the name and the request value all at once
+  if (conn_write(conn, &name_len, sizeof(size_t)) == -1 ||
+      conn_write(conn, req->username, name_len) == -1 ||
+      conn_write(conn, &req->action, sizeof(action_t)) == -1) {
     return -1;
   }
-
-  return 0;
+  return conn_flush(conn);
 }
 
-request_t* recv_request(int sock_fd) {
-  // Read the length of the name
+request_t* recv_request(conn_t* conn) {
+  // Read the requested action and the length of the name
+  uint64_t action = 0;
   size_t name_len;
-  if (read(sock_fd, &name_len, sizeof(size_t)) != sizeof(size_t)) {
+  if (conn->version >= PROTOCOL_COMPACT) {
+    uint64_t len;
+    if (conn_read_varint(conn, &action) == -1 || conn_read_varint(conn, &len) == -1) {
+      return NULL;
+    }
+    if (len > MAX_NAME_LEN) {
+      errno = EPROTO;
+      return NULL;
+    }
+    name_len = len;
+  } else if (conn_read(conn, &name_len, sizeof(size_t)) == -1) {
+    return NULL;
+  } else if (name_len > MAX_NAME_LEN) {
+    errno = EPROTO;
     return NULL;
   }
 
   // Create a struct to store the values we'll receive
   request_t* req = malloc(sizeof(request_t));
+  if (req == NULL) {
+    return NULL;
+  }
   req->username = malloc(name_len + 1);
+  if (req->username == NULL) {
+    free(req);
+    return NULL;
+  }
+  req->action = action;
+  req->features = 0;
+  req->resume = (resume_t){0};
+  req->sigs = NULL;
+  req->stripe = (stripe_t){0};
+  req->give = 0;
+
+  // Read the name, then the action in the legacy format or any features asked
+  // for in newer ones
+  if (conn_read(conn, req->username, name_len) == -1 ||
+      (conn->version < PROTOCOL_COMPACT &&
+       conn_read(conn, &req->action, sizeof(action_t)) == -1) ||
+      (conn->version >= PROTOCOL_FEATURES && conn_read_varint(conn, &req->features) == -1)) {
+    free(req->username);
+    free(req);
+    return NULL;
+  }
 
-  // Read the name
-  size_t bytes_read = 0;
-  while (bytes_read < name_len) {
-    ssize_t rc = read(sock_fd, req->username + bytes_read, name_len - bytes_read);
+  // Gives hosted by a broker are asked for by number
+  uint64_t give;
+  if (conn->version >= PROTOCOL_BROKER) {
+    if (conn_read_varint(conn, &give) == -1) {
+      free(req->username);
+      free(req);
+      return NULL;
+    }
+    if (give > UINT_MAX) {
+      free(req->username);
+      free(req);
+      errno = EPROTO;
+      return NULL;
+    }
+    req->give = give;
+  }
 
-    if (rc <= 0) {
+  // Requests to resume say where from
+  uint64_t index, offset;
+  if (conn->version >= PROTOCOL_RESUME && req->action == RESUME_DATA) {
+    if (conn_read_varint(conn, &req->resume.give_id) == -1 ||
+        conn_read_varint(conn, &index) == -1 || conn_read_varint(conn, &offset) == -1) {
       free(req->username);
       free(req);
       return NULL;
     }
+    req->resume.index = index;
+    req->resume.offset = offset;
+  }
 
-    bytes_read += rc;
+  // Requests for a share of the contents say which connection of the take
+  // they're on
+  if (conn->version >= PROTOCOL_STRIPE && (req->features & FEATURE_STRIPE)) {
+    uint64_t stripe, count;
+    if (conn_read_varint(conn, &stripe) == -1 || conn_read_varint(conn, &count) == -1) {
+      free(req->username);
+      free(req);
+      return NULL;
+    }
+    req->stripe.index = stripe;
+    req->stripe.count = count;
   }
 
   // Null terminate the name
   req->username[name_len] = '\0';
 
-  // Read the requested action
-  if (read(sock_fd, &req->action, sizeof(action_t)) != sizeof(action_t)) {
-    free(req->username);
-    free(req);
-    return NULL;
-  }
-
   // Return the request now that we've read all its data
   return req;
 }
+
+int recv_request_sigs(conn_t* conn, request_t* req) {
+  if (conn->version < PROTOCOL_DELTA || !(req->features & FEATURE_DELTA) || req->sigs != NULL) {
+    return 0;
+  }
+  req->sigs = recv_sigs(conn);
+  return req->sigs != NULL ? 0 : -1;
+}
+
+void free_request(request_t* req) {
+  delta_free(req->sigs);
+  free(req->username);
+  free(req);
+}
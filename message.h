@@ -7,52 +7,262 @@
 
 #pragma once
 
+#include "compress.h"
+#include "conn.h"
+#include "delta.h"
 #include "filereader.h"
+#include "stripe.h"
+
+// Versions of the wire format. The legacy format has no handshake and sends
+// raw integers in host byte order. The compact format starts with a handshake
+// and sends varints, with each name compressed against the one before it.
+#define PROTOCOL_LEGACY 1
+#define PROTOCOL_COMPACT 2
+
+// Adds feature bits to requests, which the give answers with the features it
+// sends the file with.
+#define PROTOCOL_FEATURES 3
+
+// Adds resuming a transfer part of the way through. The give answers every
+// request for data with its ID and the position it starts sending from.
+#define PROTOCOL_RESUME 4
+
+// Adds sending only the changes to files the taker has an older copy of. The
+// taker sends signatures of its copy along with the request.
+#define PROTOCOL_DELTA 5
+
+// Adds sending regular files with the same contents as an earlier one as a
+// reference to it.
+#define PROTOCOL_DEDUP 6
+
+// Adds receiving one file over several connections at once. The first one
+// gets the headers of every entry, and each one gets its share of the contents.
+#define PROTOCOL_STRIPE 7
+
+// Adds the number of the give to every request, so one broker can host many
+// gives on the same port
+#define PROTOCOL_BROKER 8
+
+// Adds a list of the files streamed from disk that have changed since the give
+// started, sent in answer to every request for data. If any have, nothing else
+// is sent.
+#define PROTOCOL_CHANGES 9
+
+// Adds sending chunks of nothing but zeros as holes, with no data
+#define PROTOCOL_SPARSE 10
+
+// Adds passing regular files to takers on the same machine as open file
+// descriptors, over the give's Unix socket
+#define PROTOCOL_LOCAL 11
+
+// Newest version this build speaks
+#define PROTOCOL_VERSION PROTOCOL_LOCAL
+
+// Every chunk of contents is followed by its CRC32C, and the file by a digest
+// of all of them. Small files are sent as single chunks so they're covered too.
+#define FEATURE_CRC32C (1 << 8)
+
+// Regular files the taker sent signatures for may be sent as blocks to copy
+// from its old copy, and the bytes in between
+#define FEATURE_DELTA (1 << 9)
+
+// Regular files with the same contents as one sent before them may be sent as
+// its path, for the taker to copy
+#define FEATURE_DEDUP (1 << 10)
+
+// Contents are split across every connection of the take, as pieces of files
+// sent in any order
+#define FEATURE_STRIPE (1 << 11)
+
+// Chunks of nothing but zeros are sent as CODEC_ZERO and their size, and the
+// taker leaves holes in their place
+#define FEATURE_SPARSE (1 << 12)
+
+// Regular files streamed from disk may be passed as open file descriptors, for
+// the taker to copy. Only over a Unix socket. Their contents never cross the
+// connection, so no checksums are sent for them.
+#define FEATURE_LOCAL (1 << 13)
 
 // Possible actions for a request
 typedef enum {
   SEND_DATA,
   QUIT_SERVER,
+  RESUME_DATA,  //< like SEND_DATA, starting from where an earlier one stopped
 } action_t;
 
+// Position in a transfer, for picking it up again after it was cut off.
+// Entries are counted in the order they are sent, directories before what's in
+// them.
+typedef struct {
+  uint64_t give_id;  //< ID of the give sending it, so a resume goes to the same one
+  size_t index;      //< number of entries received in full
+  size_t offset;     //< bytes of the next entry received, a multiple of CHUNK_SIZE
+  uint32_t digest;   //< digest of the checksums of every chunk before this point
+} resume_t;
+
 // Action request, including requester username
 typedef struct {
   char* username;
   action_t action;
+  uint64_t features;   //< features asked for, such as FEATURE_ZLIB
+  resume_t resume;     //< where to start from, for RESUME_DATA
+  delta_sigs_t* sigs;  //< signatures of the taker's old copy, for FEATURE_DELTA.
+                       //< Filled out by recv_request_sigs.
+  stripe_t stripe;     //< which connection of the take this is, for FEATURE_STRIPE
+  unsigned int give;   //< number of the give on a broker, 0 for one with a port
+                       //< of its own
 } request_t;
 
+// Connections besides the first one that a take can receive contents over
+typedef struct {
+  conn_t* conns;   //< connected to the same give, and past the handshake
+  size_t count;
+  request_t* req;  //< request to send on each of them once the give agrees to
+                   //< split the contents. Its stripe is filled out for each.
+} stripe_conns_t;
+
+// How a received file was checked against the checksums sent with it
+typedef struct {
+  bool checked;     //< checksums were sent, and every one of them matched
+  uint32_t digest;  //< CRC32C of the checksums of every chunk, in order
+} verify_t;
+
 /**
- * Send a file through a socket
+ * Send a file through a connection. Headers and small files are batched into
+ * large writes, and everything has been sent by the time this returns.
  *
- * \param   sock_fd File descriptor of the socket to send to
- * \param   file_data Filled out file data struct to be transferred
+ * \param   conn Connection to send to
+ * \param   file_data Filled out file data struct to be transferred, laid out
+ *          flat as read_file leaves it
+ * \param   cache Chunks of file_data to send its contents as, or NULL to send
+ *          them as they are
+ * \param   features Features to send with, out of those the taker asked for.
+ *          Either the cache's codec or FEATURE_CRC32C means contents are sent
+ *          from the cache, so it must not be NULL for those.
+ * \param   start Position to start sending from, along with the ID of this
+ *          give. Reset to the start of the file if it isn't a valid position.
+ * \param   sigs Sorted signatures of the taker's old copy, used if features
+ *          has FEATURE_DELTA
+ * \param   stripe Which connection of the take this is, used if features has
+ *          FEATURE_STRIPE. Striped transfers always start from the beginning.
  * \return  0 if there were no errors, -1 otherwise
  */
-int send_file(int sock_fd, file_t* file_data);
+int send_file(conn_t* conn, file_t* file_data, compress_cache_t* cache, uint64_t features,
+              resume_t* start, delta_sigs_t* sigs, stripe_t* stripe);
 
 /**
- * Receive a file through a socket
+ * Receive a file through a connection
  *
- * \param   sock_fd File descriptor of the socket to read from
- * \return  A malloc'd filedata struct of the message if transfer was completed,
- *          NULL if something went wrong.
+ * \param   conn Connection to read from
+ * \return  A malloc'd filedata struct of the message, laid out flat, if transfer
+ *          was completed. NULL if something went wrong.
+ */
+file_t* recv_file(conn_t* conn);
+
+/**
+ * Receive a file through a connection, writing it to disk as it arrives instead of
+ * building it in memory. Directories are created as soon as they arrive, and
+ * small files inside them are written over a pool of threads. Memory use does
+ * not depend on the size of the file.
+ *
+ * \param   conn      Connection to read from
+ * \param   dir       Directory to write the file into, ending in '/'
+ * \param   save_name Name to save the file under, or NULL to use the name it
+ *                    was sent with
+ * \param   opts      Options controlling how files are written
+ * \param   stats     Totals to add what was written to, or NULL
+ * \param   created   Set to the malloc'd path of the file as soon as it exists
+ *                    on disk, so a partial copy can be cleaned up. Left NULL if
+ *                    nothing was created.
+ * \param   basis     Path of the old copy the give may send changes to, or
+ *                    NULL if there is none
+ * \param   verify    Set to how the file was checked, or NULL
+ * \param   resume    Position the transfer was asked to start from, which
+ *                    must already be on disk in dir. Set to the position
+ *                    reached, everything before which is on disk when this
+ *                    returns, and the ID of the give. Transfers split across
+ *                    connections never get past the start.
+ * \param   stripes   More connections to the give to split the contents
+ *                    across if it agrees to, or NULL
+ * \return  0 if there were no errors, -1 if the connection failed (errno is 0
+ *          if the host closed it, EBADMSG if a checksum didn't match,
+ *          ESTALE if the give started from the beginning instead of resuming,
+ *          or ECANCELED if files changed since they were given, which have
+ *          been printed),
+ *          -2 if writing to disk failed (an error message has already been
+ *          printed)
+ */
+int recv_file_to_disk(conn_t* conn, char* dir, char* save_name, write_opts_t* opts,
+                      write_stats_t* stats, char** created, char* basis, verify_t* verify,
+                      resume_t* resume, stripe_conns_t* stripes);
+
+/**
+ * Start the handshake from the taking side, agreeing on a wire format version
+ * with the give. Sets conn->version.
+ *
+ * \param   conn Connection to the give
+ * \return  0 if there were no errors, -1 otherwise. errno is set to 0 or
+ *          ECONNRESET if the give hung up, which gives that don't know the
+ *          handshake do.
  */
-file_t* recv_file(int sock_fd);
+int send_hello(conn_t* conn);
 
 /**
- * Send a request through a socket
+ * Answer the handshake on the giving side. Takers that don't start with one
+ * are spoken to in the legacy format. Sets conn->version.
  *
- * \param   sock_fd File descriptor of the socket to send to
+ * \param   conn Connection to the taker
+ * \return  0 if there were no errors, -1 otherwise
+ */
+int recv_hello(conn_t* conn);
+
+/**
+ * Connect to a give and agree on a wire format version, falling back to the
+ * legacy format for gives that don't know the handshake. Gives on this machine
+ * are connected to through their Unix socket, when they have one.
+ *
+ * \param   host Hostname of the give
+ * \param   port Port of the give
+ * \param   conn Connection to set up. The caller frees it and closes its
+ *          socket when done.
+ * \return  0 if there were no errors, -1 otherwise
+ */
+int connect_to_give(char* host, unsigned short port, conn_t* conn);
+
+/**
+ * Send a request through a connection, flushing it right away
+ *
+ * \param   conn Connection to send to
  * \param   req Fiilled out request struct to be transferred
  * \return  0 if there were no errors, -1 otherwise
  */
-int send_request(int sock_fd, request_t* req);
+int send_request(conn_t* conn, request_t* req);
 
 /**
- * Receive a request through a socket
+ * Receive a request through a connection. The signatures a request to be sent
+ * changes comes with are left on the connection for recv_request_sigs, so
+ * nothing big is read before the sender is known to be allowed to ask.
  *
- * \param   sock_fd File descriptor of the socket to read from
+ * \param   conn Connection to read from
  * \return  A malloc'd request struct of the message if transfer was completed,
  *          NULL if something went wrong.
  */
-request_t* recv_request(int sock_fd);
+request_t* recv_request(conn_t* conn);
+
+/**
+ * Receive the signatures of the taker's old copy that follow a request with
+ * FEATURE_DELTA, filling out req->sigs. Does nothing for other requests.
+ *
+ * \param   conn Connection the request came in on
+ * \param   req Request from recv_request, from someone allowed to make it
+ * \return  0 if there were no errors, -1 otherwise (errno is EPROTO if the
+ *          signatures made no sense)
+ */
+int recv_request_sigs(conn_t* conn, request_t* req);
+
+/**
+ * Free a request from recv_request, along with everything in it
+ *
+ * \param   req Request to free
+ */
+void free_request(request_t* req);
@@ -0,0 +1,292 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Most of what the pool runs waits on the file system rather than the CPU, so
+// it pays to have a few more threads than cores
+#define THREADS_PER_CORE 2
+#define MAX_DEFAULT_THREADS 64
+
+// Initial number of tasks each worker's queue has room for
+#define INITIAL_DEQUE_CAPACITY 64
+
+typedef struct {
+  task_fn_t fn;
+  void* arg;
+} task_t;
+
+// Double-ended queue of tasks belonging to one worker. The owner pushes and
+// pops at the tail, thieves take from the head so they get the oldest work.
+typedef struct {
+  pthread_mutex_t lock;
+  task_t* tasks;    //< ring buffer
+  size_t capacity;  //< always a power of two
+  size_t head;      //< index of the oldest task
+  size_t count;     //< number of tasks in the ring
+} deque_t;
+
+struct pool {
+  int num_threads;
+  int num_started;  //< threads actually running, in case creating one failed
+  pthread_t* threads;
+  deque_t* deques;  //< one per worker
+
+  atomic_size_t queued;   //< tasks sitting in any deque
+  atomic_size_t pending;  //< tasks submitted but not yet finished
+  atomic_int sleepers;    //< workers waiting for work
+  atomic_uint next;       //< where the next task from outside the pool goes
+
+  pthread_mutex_t lock;       //< protects the condition variables and stopping
+  pthread_cond_t work_cond;   //< signalled when a task is queued
+  pthread_cond_t done_cond;   //< signalled when pending drops to zero
+  bool stopping;
+};
+
+// Which worker (if any) the current thread is
+static __thread pool_t* current_pool = NULL;
+static __thread int current_worker = -1;
+
+typedef struct {
+  pool_t* pool;
+  int index;
+} worker_args_t;
+
+/**
+ * Add a task at the tail of a deque, growing it if needed.
+ *
+ * \return  0 on success, -1 if there was no room and growing failed
+ */
+static int deque_push(deque_t* dq, task_t task) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->count == dq->capacity) {
+    // Unroll the ring into a buffer twice the size
+    task_t* tasks = malloc(sizeof(task_t) * dq->capacity * 2);
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&dq->lock);
+      return -1;
+    }
+    for (size_t i = 0; i < dq->count; i++) {
+      tasks[i] = dq->tasks[(dq->head + i) & (dq->capacity - 1)];
+    }
+    free(dq->tasks);
+    dq->tasks = tasks;
+    dq->capacity *= 2;
+    dq->head = 0;
+  }
+  dq->tasks[(dq->head + dq->count) & (dq->capacity - 1)] = task;
+  dq->count++;
+  pthread_mutex_unlock(&dq->lock);
+  return 0;
+}
+
+/**
+ * Take a task from one end of a deque.
+ *
+ * \param dq     Deque to take from
+ * \param steal  true to take the oldest task (head), false for the newest (tail)
+ * \param task   Output for the task taken
+ * \return       true if a task was taken
+ */
+static bool deque_take(deque_t* dq, bool steal, task_t* task) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->count == 0) {
+    pthread_mutex_unlock(&dq->lock);
+    return false;
+  }
+  if (steal) {
+    *task = dq->tasks[dq->head];
+    dq->head = (dq->head + 1) & (dq->capacity - 1);
+  } else {
+    *task = dq->tasks[(dq->head + dq->count - 1) & (dq->capacity - 1)];
+  }
+  dq->count--;
+  pthread_mutex_unlock(&dq->lock);
+  return true;
+}
+
+/**
+ * Find a task for a worker: its own newest task first, then the oldest task of
+ * any other worker.
+ */
+static bool find_task(pool_t* pool, int self, task_t* task) {
+  if (deque_take(&pool->deques[self], false, task)) {
+    return true;
+  }
+  for (int i = 1; i < pool->num_threads; i++) {
+    int victim = (self + i) % pool->num_threads;
+    if (deque_take(&pool->deques[victim], true, task)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Main loop of a worker thread.
+ *
+ * \param arg  Malloc'd worker_args_t, freed by this thread
+ * \return     NULL, only here because threads must return something
+ */
+static void* worker(void* arg) {
+  worker_args_t* args = (worker_args_t*)arg;
+  pool_t* pool = args->pool;
+  int self = args->index;
+  free(args);
+
+  current_pool = pool;
+  current_worker = self;
+
+  while (true) {
+    task_t task;
+    if (find_task(pool, self, &task)) {
+      atomic_fetch_sub(&pool->queued, 1);
+      task.fn(task.arg);
+
+      // Wake anyone in pool_wait once the last task is done
+      if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      continue;
+    }
+
+    // Nothing to do anywhere, so sleep until a task shows up
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->sleepers, 1);
+    while (atomic_load(&pool->queued) == 0 && !pool->stopping) {
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+    }
+    atomic_fetch_sub(&pool->sleepers, 1);
+    bool stopping = pool->stopping;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (stopping) {
+      return NULL;
+    }
+  }
+}
+
+int pool_default_threads() {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    cores = 1;
+  }
+  long threads = cores * THREADS_PER_CORE;
+  return threads > MAX_DEFAULT_THREADS ? MAX_DEFAULT_THREADS : threads;
+}
+
+pool_t* pool_create(int num_threads) {
+  pool_t* pool = calloc(1, sizeof(pool_t));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->num_threads = num_threads;
+  atomic_init(&pool->queued, 0);
+  atomic_init(&pool->pending, 0);
+  atomic_init(&pool->sleepers, 0);
+  atomic_init(&pool->next, 0);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  pool->threads = calloc(num_threads, sizeof(pthread_t));
+  pool->deques = calloc(num_threads, sizeof(deque_t));
+  if (pool->threads == NULL || pool->deques == NULL) {
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+    return NULL;
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    deque_t* dq = &pool->deques[i];
+    pthread_mutex_init(&dq->lock, NULL);
+    dq->capacity = INITIAL_DEQUE_CAPACITY;
+    dq->tasks = malloc(sizeof(task_t) * dq->capacity);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    if (pool->deques[i].tasks == NULL) {
+      pool_destroy(pool);
+      return NULL;
+    }
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    worker_args_t* args = malloc(sizeof(worker_args_t));
+    if (args == NULL) {
+      pool_destroy(pool);
+      return NULL;
+    }
+    args->pool = pool;
+    args->index = i;
+    if (pthread_create(&pool->threads[i], NULL, worker, args)) {
+      free(args);
+      pool_destroy(pool);
+      return NULL;
+    }
+    pool->num_started++;
+  }
+
+  return pool;
+}
+
+int pool_submit(pool_t* pool, task_fn_t fn, void* arg) {
+  // Workers keep their own tasks, everyone else spreads tasks around
+  int target;
+  if (current_pool == pool) {
+    target = current_worker;
+  } else {
+    target = atomic_fetch_add(&pool->next, 1) % pool->num_threads;
+  }
+
+  atomic_fetch_add(&pool->pending, 1);
+  task_t task = {.fn = fn, .arg = arg};
+  if (deque_push(&pool->deques[target], task) == -1) {
+    atomic_fetch_sub(&pool->pending, 1);
+    return -1;
+  }
+  atomic_fetch_add(&pool->queued, 1);
+
+  // Only bother with the lock if somebody might be asleep
+  if (atomic_load(&pool->sleepers) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return 0;
+}
+
+void pool_wait(pool_t* pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (atomic_load(&pool->pending) > 0) {
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(pool_t* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->num_started; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  for (int i = 0; i < pool->num_threads; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_cond_destroy(&pool->done_cond);
+  free(pool->threads);
+  free(pool->deques);
+  free(pool);
+}
@@ -0,0 +1,56 @@
+/**
+ * pool.h
+ *
+ * A pool of worker threads that run small tasks. Each worker has its own queue
+ * of tasks, and idle workers steal from the others, so tasks that spawn more
+ * tasks (like walking a directory tree) spread out over every thread.
+ */
+
+#pragma once
+
+// A task run by the pool. Receives the argument it was submitted with.
+typedef void (*task_fn_t)(void* arg);
+
+typedef struct pool pool_t;
+
+/**
+ * Pick a number of worker threads based on how many cores this machine has.
+ *
+ * \return  A sensible default thread count, at least 1
+ */
+int pool_default_threads();
+
+/**
+ * Start a pool of worker threads.
+ *
+ * \param num_threads  Number of workers to start.
+ * \return             The new pool, or NULL on error
+ */
+pool_t* pool_create(int num_threads);
+
+/**
+ * Queue a task to be run by some worker. Tasks submitted by a worker go on that
+ * worker's own queue, so related work stays together until somebody steals it.
+ *
+ * \param pool  Pool to run the task in
+ * \param fn    Function to run
+ * \param arg   Argument passed to fn
+ * \return      0 if the task was queued, -1 on error
+ */
+int pool_submit(pool_t* pool, task_fn_t fn, void* arg);
+
+/**
+ * Wait until every submitted task has finished, including tasks submitted by
+ * other tasks while waiting. Must not be called from a worker.
+ *
+ * \param pool  Pool to wait on
+ */
+void pool_wait(pool_t* pool);
+
+/**
+ * Stop all the workers and free the pool. Any tasks still queued are dropped,
+ * so call pool_wait first.
+ *
+ * \param pool  Pool to destroy
+ */
+void pool_destroy(pool_t* pool);
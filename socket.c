@@ -1,12 +1,19 @@
+#define _GNU_SOURCE
 #include "socket.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 int socket_connect(char* server_name, unsigned short port) {
@@ -82,8 +89,9 @@ int server_socket_accept(int server_socket_fd) {
   struct sockaddr_in client_addr;
   socklen_t client_addr_len = sizeof(struct sockaddr_in);
 
-  // Block until we receive a connection or failure
-  int client_socket_fd = accept(server_socket_fd, (struct sockaddr*)&client_addr, &client_addr_len);
+  // Take a connection if one is waiting, without blocking for one
+  int client_socket_fd = accept4(server_socket_fd, (struct sockaddr*)&client_addr,
+                                 &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
   // Did something go wrong?
   if (client_socket_fd == -1) {
@@ -92,3 +100,139 @@ int server_socket_accept(int server_socket_fd) {
 
   return client_socket_fd;
 }
+
+int socket_set_blocking(int fd, bool blocking) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1) {
+    return -1;
+  }
+  flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+  return fcntl(fd, F_SETFL, flags);
+}
+
+int socket_set_timeout(int fd, int seconds) {
+  struct timeval timeout = {.tv_sec = seconds, .tv_usec = 0};
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Fill out the address of the Unix socket of the give on a port. The name
+ * starts with a NUL byte, which puts it in the abstract namespace.
+ *
+ * \param addr  Address to fill out
+ * \param port  Port the give listens on over the network
+ * \return      Length of the address
+ */
+static socklen_t local_address(struct sockaddr_un* addr, unsigned short port) {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, LOCAL_SOCKET_NAME "%u",
+                     (unsigned int)port);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/**
+ * Find the user a listening network socket belongs to, from the kernel's table
+ * of TCP sockets.
+ *
+ * \param port  Port the socket listens on
+ * \param uid   Set to the user it belongs to
+ * \return      0 if it was found, -1 otherwise
+ */
+static int port_owner(unsigned short port, uid_t* uid) {
+  FILE* table = fopen("/proc/net/tcp", "r");
+  if (table == NULL) {
+    return -1;
+  }
+
+  // Skip the heading, then look at the local port and state of every socket
+  char line[256];
+  int rc = -1;
+  if (fgets(line, sizeof(line), table) != NULL) {
+    while (rc == -1 && fgets(line, sizeof(line), table) != NULL) {
+      unsigned int local_port, state, owner;
+      if (sscanf(line, "%*d: %*x:%x %*x:%*x %x %*x:%*x %*x:%*x %*x %u", &local_port, &state,
+                 &owner) == 3 &&
+          local_port == port && state == 0x0a) {  //< TCP_LISTEN
+        *uid = owner;
+        rc = 0;
+      }
+    }
+  }
+  fclose(table);
+  return rc;
+}
+
+int local_socket_open(unsigned short port) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t len = local_address(&addr, port);
+  if (bind(fd, (struct sockaddr*)&addr, len) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+int local_socket_connect(unsigned short port) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t len = local_address(&addr, port);
+  if (connect(fd, (struct sockaddr*)&addr, len) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+
+  // Whoever is on the other end has to be the one that owns the port
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  uid_t owner;
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+      port_owner(port, &owner) == -1 || cred.uid != owner) {
+    close(fd);
+    errno = EACCES;
+    return -1;
+  }
+  return fd;
+}
+
+bool socket_is_local_host(char* server_name) {
+  struct hostent* server = gethostbyname(server_name);
+  if (server == NULL || server->h_addrtype != AF_INET) {
+    return false;
+  }
+  struct ifaddrs* interfaces;
+  if (getifaddrs(&interfaces) == -1) {
+    interfaces = NULL;
+  }
+
+  bool local = false;
+  for (char** entry = server->h_addr_list; *entry != NULL && !local; entry++) {
+    struct in_addr addr;
+    memcpy(&addr, *entry, sizeof(addr));
+    local = (ntohl(addr.s_addr) >> 24) == 127;
+    for (struct ifaddrs* i = interfaces; i != NULL && !local; i = i->ifa_next) {
+      if (i->ifa_addr != NULL && i->ifa_addr->sa_family == AF_INET) {
+        local = ((struct sockaddr_in*)i->ifa_addr)->sin_addr.s_addr == addr.s_addr;
+      }
+    }
+  }
+  if (interfaces != NULL) {
+    freeifaddrs(interfaces);
+  }
+  return local;
+}
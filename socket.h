@@ -7,6 +7,12 @@
 
 #pragma once
 
+#include <stdbool.h>
+
+// Name of the Unix socket a give listens on for takers on the same machine, in
+// the abstract namespace, followed by the port it listens on over the network
+#define LOCAL_SOCKET_NAME "give-port-"
+
 /**
  * Create a new socket and connect to a server.
  *
@@ -35,11 +41,69 @@ int socket_connect(char* server_name, unsigned short port);
 int server_socket_open(unsigned short* port);
 
 /**
- * Accept an incoming connection on a server socket.
+ * Accept an incoming connection on a server socket, without waiting for one.
  *
  * \param server_socket_fd  The server socket that should accept the connection.
  *
- * \returns   The file descriptor for the newly-connected client socket. In case
- *            of failure, returns -1 with errno set by the failed accept call.
+ * \returns   The file descriptor for the newly-connected client socket, which
+ *            is non-blocking. In case of failure, returns -1 with errno set by
+ *            the failed accept call, which is EAGAIN if nobody was waiting.
  */
 int server_socket_accept(int server_socket_fd);
+
+/**
+ * Make reads and writes on a socket wait, or fail with EAGAIN instead.
+ *
+ * \param fd        The socket to change.
+ * \param blocking  Whether reads and writes should wait.
+ *
+ * \returns   0 on success, or -1 with errno set by fcntl.
+ */
+int socket_set_blocking(int fd, bool blocking);
+
+/**
+ * Limit how long a blocking read or write on a socket waits before failing
+ * with EAGAIN.
+ *
+ * \param fd       The socket to change.
+ * \param seconds  Longest a read or write may wait.
+ *
+ * \returns   0 on success, or -1 with errno set by setsockopt.
+ */
+int socket_set_timeout(int fd, int seconds);
+
+/**
+ * Open a Unix socket for takers on this machine, named after the port of the
+ * give's network socket. The name is in the abstract namespace, so there's no
+ * file to clean up after a give that died.
+ *
+ * \param port    The port of the give's network socket.
+ *
+ * \returns       A file descriptor for the socket, which has been bound but is
+ *                not listening. In case of failure, returns -1 with errno set
+ *                by the failed call, which is EADDRINUSE if the name is taken.
+ */
+int local_socket_open(unsigned short port);
+
+/**
+ * Connect to the Unix socket of a give on this machine. Anyone can take a name
+ * in the abstract namespace, so the other end must be run by the same user as
+ * the network socket listening on the port.
+ *
+ * \param port  The port the give listens on over the network.
+ *
+ * \returns     A file descriptor for the connected socket, or -1 if there is
+ *              an error. errno is ECONNREFUSED if nobody is listening, or
+ *              EACCES if somebody other than the owner of the port is.
+ */
+int local_socket_connect(unsigned short port);
+
+/**
+ * Check whether a host name refers to this machine.
+ *
+ * \param server_name  The host name or IP address to look up.
+ *
+ * \returns            true if it resolves to a loopback address, or to an
+ *                     address of one of this machine's interfaces.
+ */
+bool socket_is_local_host(char* server_name);
@@ -0,0 +1,191 @@
+#include "stripe.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+// Pieces that always go on the same connection: one range of a large file, or
+// every file of a small subtree
+typedef struct {
+  size_t first;   //< first piece
+  size_t end;     //< one past the last piece
+  size_t weight;  //< bytes, plus STRIPE_ENTRY_COST for every entry
+  size_t stripe;  //< connection it goes on
+} unit_t;
+
+// Everything stripe_plan builds up as it goes through the file
+typedef struct {
+  stripe_piece_t* pieces;
+  size_t num_pieces;
+  size_t pieces_cap;
+  unit_t* units;
+  size_t num_units;
+  size_t units_cap;
+  size_t next_entry;  //< number of the next entry, in the order they are sent
+  size_t next_index;  //< number the cache knows the next file by
+  size_t unit_max;    //< heaviest a subtree can be and still be kept whole
+  size_t range_len;   //< size of the ranges large files are cut into
+  bool failed;        //< ran out of memory
+} plan_t;
+
+/**
+ * Check whether a file is sent with contents of its own.
+ */
+static bool has_contents(file_t* file) {
+  return file->type == F_REG && file->size > 0 && (file->same == NULL || file->same == file);
+}
+
+/**
+ * Get the weight of a whole flat tree.
+ */
+static size_t weigh(flat_t* flat) {
+  size_t weight = flat->count * STRIPE_ENTRY_COST;
+  for (size_t i = 0; i < flat->count; i++) {
+    if (has_contents(flat->entries[i].file)) {
+      weight += flat->entries[i].file->size;
+    }
+  }
+  return weight;
+}
+
+/**
+ * Add a piece, and a unit of its own for it.
+ */
+static void add_piece(plan_t* plan, stripe_piece_t* piece, size_t weight) {
+  if (plan->num_pieces == plan->pieces_cap) {
+    size_t cap = plan->pieces_cap > 0 ? plan->pieces_cap * 2 : 64;
+    stripe_piece_t* grown = realloc(plan->pieces, cap * sizeof(stripe_piece_t));
+    if (grown == NULL) {
+      plan->failed = true;
+      return;
+    }
+    plan->pieces = grown;
+    plan->pieces_cap = cap;
+  }
+  if (plan->num_units == plan->units_cap) {
+    size_t cap = plan->units_cap > 0 ? plan->units_cap * 2 : 64;
+    unit_t* grown = realloc(plan->units, cap * sizeof(unit_t));
+    if (grown == NULL) {
+      plan->failed = true;
+      return;
+    }
+    plan->units = grown;
+    plan->units_cap = cap;
+  }
+  plan->pieces[plan->num_pieces] = *piece;
+  plan->units[plan->num_units] = (unit_t){plan->num_pieces, plan->num_pieces + 1, weight};
+  plan->num_pieces++;
+  plan->num_units++;
+}
+
+/**
+ * Cut a file and everything in it into pieces and units.
+ *
+ * \param plan  Plan to add to
+ * \param file  File to add
+ * \return      Weight of the file and everything in it
+ */
+static size_t plan_entry(plan_t* plan, file_t* file) {
+  size_t entry = plan->next_entry++;
+  if (file->type == F_REG) {
+    // Numbered the same way as in the cache
+    size_t index = 0;
+    if (file->size >= COMPRESS_MIN_SIZE && (file->same == NULL || file->same == file)) {
+      index = plan->next_index++;
+    }
+    if (!has_contents(file)) {
+      return STRIPE_ENTRY_COST;
+    }
+    for (size_t offset = 0; offset < file->size && !plan->failed; offset += plan->range_len) {
+      size_t len = file->size - offset < plan->range_len ? file->size - offset : plan->range_len;
+      stripe_piece_t piece = {file, entry, index, offset, len};
+      add_piece(plan, &piece, len + (offset == 0 ? STRIPE_ENTRY_COST : 0));
+    }
+    return STRIPE_ENTRY_COST + file->size;
+  }
+
+  size_t first_piece = plan->num_pieces;
+  size_t first_unit = plan->num_units;
+  size_t weight = STRIPE_ENTRY_COST;
+  for (size_t i = 0; i < file->size; i++) {
+    weight += plan_entry(plan, file->contents.entries[i]);
+  }
+
+  // A light enough subtree goes on one connection, so its files are written
+  // together
+  if (weight <= plan->unit_max && plan->num_pieces > first_piece && !plan->failed) {
+    plan->units[first_unit] = (unit_t){first_piece, plan->num_pieces, weight};
+    plan->num_units = first_unit + 1;
+  }
+  return weight;
+}
+
+/**
+ * Order units heaviest first, and by where they start when they weigh the same,
+ * so every connection sorts them the same way.
+ */
+static int compare_units(const void* a, const void* b) {
+  const unit_t* x = *(const unit_t**)a;
+  const unit_t* y = *(const unit_t**)b;
+  if (x->weight != y->weight) {
+    return x->weight > y->weight ? -1 : 1;
+  }
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+int stripe_plan(file_t* root, stripe_t* stripe, stripe_piece_t** pieces, size_t* num_pieces) {
+  size_t count = stripe->count > 0 ? stripe->count : 1;
+
+  // Aim for a few units per connection, so that there's room to even them out
+  plan_t plan = {0};
+  plan.unit_max = weigh(root->flat) / (count * 4);
+  plan.range_len = (plan.unit_max + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+  if (plan.range_len < STRIPE_MIN_RANGE) {
+    plan.range_len = STRIPE_MIN_RANGE;
+  }
+  plan_entry(&plan, root);
+  unit_t** order = malloc(plan.num_units * sizeof(unit_t*));
+  if (plan.failed || (order == NULL && plan.num_units > 0)) {
+    free(plan.pieces);
+    free(plan.units);
+    free(order);
+    return -1;
+  }
+
+  // Hand out the heaviest units first, each to the connection with the least
+  // so far
+  size_t loads[STRIPES_MAX] = {0};
+  for (size_t i = 0; i < plan.num_units; i++) {
+    order[i] = &plan.units[i];
+  }
+  qsort(order, plan.num_units, sizeof(unit_t*), compare_units);
+  for (size_t i = 0; i < plan.num_units; i++) {
+    size_t lightest = 0;
+    for (size_t j = 1; j < count && j < STRIPES_MAX; j++) {
+      if (loads[j] < loads[lightest]) {
+        lightest = j;
+      }
+    }
+    order[i]->stripe = lightest;
+    loads[lightest] += order[i]->weight;
+  }
+  free(order);
+
+  // Keep this connection's pieces in the order entries are sent, which the
+  // units already are
+  size_t kept = 0;
+  for (size_t i = 0; i < plan.num_units; i++) {
+    unit_t* unit = &plan.units[i];
+    if (unit->stripe == stripe->index) {
+      memmove(&plan.pieces[kept], &plan.pieces[unit->first],
+              (unit->end - unit->first) * sizeof(stripe_piece_t));
+      kept += unit->end - unit->first;
+    }
+  }
+  free(plan.units);
+  *pieces = plan.pieces;
+  *num_pieces = kept;
+  return 0;
+}
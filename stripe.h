@@ -0,0 +1,57 @@
+/**
+ * stripe.h
+ *
+ * Split the contents of a give across several connections to one taker, so a
+ * single TCP stream doesn't limit how fast it goes. Large files are cut into
+ * byte ranges, and small subtrees are kept whole. These are handed out largest
+ * first to whichever connection has the least so far, so that every connection
+ * finishes at about the same time.
+ */
+
+#pragma once
+
+#include <stdlib.h>
+
+#include "filereader.h"
+
+// Most connections one take can receive over
+#define STRIPES_MAX 16
+
+// Large files are cut into ranges of at least this many bytes. Ranges are
+// always a multiple of CHUNK_SIZE.
+#define STRIPE_MIN_RANGE 0x100000
+
+// What each entry costs on top of its contents when balancing connections.
+// Creating a file takes about as long as writing this many bytes.
+#define STRIPE_ENTRY_COST 0x4000
+
+// Which of the connections of one take a request is for
+typedef struct {
+  size_t index;  //< 0 for the one the headers of every entry are sent on
+  size_t count;  //< number of connections, or 0 if the take only has one
+} stripe_t;
+
+// A byte range of one regular file, sent on one connection
+typedef struct {
+  file_t* file;
+  size_t entry;   //< number of the file in the order entries are sent
+  size_t index;   //< number the cache knows the file by
+  size_t offset;  //< where the range starts, a multiple of CHUNK_SIZE
+  size_t len;
+} stripe_piece_t;
+
+/**
+ * Work out which contents go on one connection. Every connection works it out
+ * the same way on its own, so between them they send every byte exactly once.
+ * Files with the same contents as an earlier one (see file_t.same) and empty
+ * files have no pieces.
+ *
+ * \param root        File being sent, laid out flat
+ * \param stripe      Connection to plan for
+ * \param pieces      Set to the malloc'd pieces for the connection, in the
+ *                    order entries are sent. May be NULL if there are none.
+ * \param num_pieces  Set to the number of pieces
+ * \return            0 if there were no errors, -1 if out of memory, leaving
+ *                    pieces and num_pieces as they were
+ */
+int stripe_plan(file_t* root, stripe_t* stripe, stripe_piece_t** pieces, size_t* num_pieces);
@@ -1,78 +1,366 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "checksum.h"
 #include "message.h"
+#include "pool.h"
 #include "socket.h"
+#include "uring.h"
 #include "utils.h"
 
 /**
- * Take a file through a network socket.
+ * Read the position an interrupted take got to.
+ *
+ * \param path    Checkpoint file to read
+ * \param resume  Set to the position
+ * \return        0 if there was a checkpoint to resume from, -1 otherwise
+ */
+int load_checkpoint(char* path, resume_t* resume) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return -1;
+  }
+  int rc = fscanf(file, "give %" SCNx64 "\nentry %zu\noffset %zu\ndigest %" SCNx32 "\n",
+                  &resume->give_id, &resume->index, &resume->offset, &resume->digest);
+  fclose(file);
+
+  // A take that never got past the start has nothing to resume
+  if (rc != 4 || (resume->index == 0 && resume->offset == 0)) {
+    *resume = (resume_t){0};
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Save the position an interrupted take got to, so running it again can pick
+ * up from there.
+ *
+ * \param path    Checkpoint file to write. Replaced all at once, so it's never
+ *                left half written.
+ * \param resume  Position to save
+ * \return        0 if there were no errors, -1 otherwise
+ */
+int save_checkpoint(char* path, resume_t* resume) {
+  char tmp_path[strlen(path) + strlen(".tmp") + 1];
+  strcpy(tmp_path, path);
+  strcat(tmp_path, ".tmp");
+
+  FILE* file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    perror("Failed to save progress");
+    return -1;
+  }
+  fprintf(file, "give %016" PRIx64 "\nentry %zu\noffset %zu\ndigest %08" PRIx32 "\n",
+          resume->give_id, resume->index, resume->offset, resume->digest);
+  if (fclose(file) == EOF || rename(tmp_path, path) == -1) {
+    perror("Failed to save progress");
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Remove everything an interrupted take left behind.
+ *
+ * \param staging     Directory the file was being received into
+ * \param checkpoint  Checkpoint file saved next to it
+ */
+void discard_partial(char* staging, char* checkpoint) {
+  if (access(staging, F_OK) == 0) {
+    remove_file(staging);
+  }
+  unlink(checkpoint);
+}
+
+/**
+ * Take a file through a network connection. It is received into a staging
+ * directory and moved into place once it's all there. If the connection drops
+ * partway through, what was received is kept along with a checkpoint, and
+ * taking from the same give again resumes from there.
  *
- * \param socket_fd  File descriptor of the open network socket.
- * \param save_name  Name to save the file under, or NULL if the default name
- *                   should be used.
+ * \param conn        Connection to the host.
+ * \param number      Number of the give on a broker, or 0 if it has a port of
+ *                    its own.
+ * \param save_name   Name to save the file under, or NULL if the default name
+ *                    should be used.
+ * \param staging     Directory to receive into, ending in '/'.
+ * \param checkpoint  Where to save the position reached if the take is cut off.
+ * \param opts        Options controlling how files are written.
+ * \param compress    Whether to ask for the file to be sent compressed.
+ * \param update      Whether to replace save_name if it exists.
+ * \param sigs        Signatures of the copy at save_name, to be sent only the
+ *                    changes to it, or NULL.
+ * \param stripes     More connections to the host to split the contents across,
+ *                    or NULL. Not used to send changes, or to resume.
+ * \param verbose     Whether to report how long writing took, and how
+ *                    checksums were computed.
+ * \return            0 once the file is taken, or -1 if the give couldn't
+ *                    resume and the take should start over on a new connection.
+ *                    Exits on any other error.
  */
-void take_file(int socket_fd, char* save_name) {
+int take_file(conn_t* conn, unsigned int number, char* save_name, char* staging,
+              char* checkpoint, write_opts_t* opts, bool compress, bool update, delta_sigs_t* sigs,
+              stripe_conns_t* stripes, bool verbose) {
+  // Pick up where an earlier take from the same give stopped, if it can.
+  // Otherwise anything left from one is stale.
+  resume_t resume = {0};
+  bool resuming = conn->version >= PROTOCOL_RESUME && load_checkpoint(checkpoint, &resume) == 0;
+  if (!resuming) {
+    discard_partial(staging, checkpoint);
+  } else {
+    printf("Resuming an earlier transfer\n");
+  }
+  if (mkdir(staging, 0700) == -1 && errno != EEXIST) {
+    perror("Failed to create staging directory");
+    exit(EXIT_FAILURE);
+  }
+
   // Send a request for the data to the server side
   request_t req;
   req.username = get_username();
-  req.action = SEND_DATA;
-  int rc = send_request(socket_fd, &req);
+  req.action = resuming ? RESUME_DATA : SEND_DATA;
+  req.features = FEATURE_CRC32C | (compress ? codec_all_features() : 0);
+  req.features |= FEATURE_DEDUP | FEATURE_SPARSE | (sigs != NULL ? FEATURE_DELTA : 0);
+  req.features |= conn->local ? FEATURE_LOCAL : 0;
+  req.resume = resume;
+  req.sigs = sigs;
+  req.stripe = (stripe_t){0};
+  req.give = number;
+  if (stripes != NULL && !resuming && sigs == NULL) {
+    req.features |= FEATURE_STRIPE;
+    req.stripe.count = stripes->count + 1;
+    stripes->req = &req;
+  } else {
+    stripes = NULL;
+  }
+  int rc = send_request(conn, &req);
   if (rc == -1) {
     perror("Failed to send file request");
     exit(EXIT_FAILURE);
   }
 
-  // Try to receive the data now
-  file_t* file = recv_file(socket_fd);
-  if (file == NULL) {
-    if (errno == 0) { //< host called close on our socket
+  // Receive the data, writing it to the staging directory as it arrives
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  write_stats_t stats = {0};
+  char* created = NULL;
+  verify_t verify;
+  char* basis = sigs != NULL ? save_name : NULL;
+  rc = recv_file_to_disk(conn, staging, NULL, opts, &stats, &created, basis, &verify, &resume,
+                         stripes);
+  double elapsed = seconds_since(&start);
+  if (rc == -1 && errno == ESTALE) {
+    fprintf(stderr, "The give has changed since the earlier transfer, starting over\n");
+    discard_partial(staging, checkpoint);
+    free(created);
+    return -1;
+  } else if (rc == -1 && errno == ECANCELED) {
+    // Nothing was sent, and won't be until the files are given again
+    fprintf(stderr, "Ask for the files to be given again to take them as they are now\n");
+    discard_partial(staging, checkpoint);
+    free(created);
+    exit(EXIT_FAILURE);
+  } else if (rc != 0) {
+    if (rc == -1 && errno == 0 && created == NULL) {  //< host called close on our socket
       fprintf(stderr, "You don't have permission to take that file!\n");
-    } else {
+    } else if (rc == -1 && errno == 0) {
+      fprintf(stderr, "Connection closed before the transfer finished\n");
+    } else if (rc == -1 && errno != EBADMSG) {
       perror("Failed to receive file");
     }
-    exit(EXIT_FAILURE);
-  }
 
-  // If a save name was provided, overwrite the default it was sent with
-  char* original_name = file->name;
-  if (save_name != NULL) {
-    file->name = save_name;
+    // Keep what arrived if the give can resume from it. Otherwise don't leave
+    // a partial copy behind, unless it's from an earlier take that can still
+    // be resumed.
+    bool progress = resume.index > 0 || resume.offset > 0;
+    if (rc == -1 && created != NULL && resume.give_id != 0 && progress &&
+        save_checkpoint(checkpoint, &resume) == 0) {
+      fprintf(stderr, "Run the same command again to resume\n");
+    } else if (created != NULL || !resuming) {
+      discard_partial(staging, checkpoint);
+    }
+    free(created);
+    exit(EXIT_FAILURE);
   }
 
-  // Attempt to write the file to the current directory
-  if (write_file("./", file) == -1) {
-    free_file(file);
-    return;
+  // Move the file into place. If something's in the way, keep the finished
+  // copy so it can be taken again under another name without sending it again.
+  char* name = save_name != NULL ? save_name : get_shortname(created);
+  if (update && access(name, F_OK) == 0) {
+    // Swap the new copy in for the old one all at once, so nothing ever sees
+    // it half updated. The old one ends up in the staging directory, which is
+    // removed below. Filesystems that can't swap get it moved out of the way
+    // first.
+    char old[strlen(staging) + strlen("old") + 1];
+    sprintf(old, "%.*s.old", (int)strlen(staging) - 1, staging);
+    if (renameat2(AT_FDCWD, created, AT_FDCWD, name, RENAME_EXCHANGE) == -1 &&
+        (rename(name, old) == -1 || rename(created, name) == -1)) {
+      perror("Failed to move file into place");
+      free(created);
+      exit(EXIT_FAILURE);
+    }
+    if (access(old, F_OK) == 0) {
+      remove_file(old);
+    }
+  } else if (access(name, F_OK) == 0) {
+    fprintf(stderr, "Refusing to overwrite existing file ./%s\n", name);
+    if (resume.give_id != 0 && save_checkpoint(checkpoint, &resume) == 0) {
+      fprintf(stderr, "Run the same command again with a different NAME to save it\n");
+    } else {
+      discard_partial(staging, checkpoint);
+    }
+    free(created);
+    exit(EXIT_FAILURE);
+  } else if (rename(created, name) == -1) {
+    perror("Failed to move file into place");
+    free(created);
+    exit(EXIT_FAILURE);
   }
+  discard_partial(staging, checkpoint);
 
-  // Once we successfully save the file, tell the server to quit
+  // Once we successfully save the file, tell the server to quit. The
+  // signatures were only needed for the transfer.
   req.action = QUIT_SERVER;
-  rc = send_request(socket_fd, &req);
+  req.features &= ~FEATURE_DELTA;
+  req.sigs = NULL;
+  rc = send_request(conn, &req);
   if (rc == -1) {
     perror("Failed to send quit request");
-    free_file(file);
+    free(created);
     exit(EXIT_FAILURE);
   }
 
   // Announce that we got the transfer across
-  printf("Successfully took %s\n", file->name);
+  printf("Successfully took %s\n", name);
+  free(created);
+
+  // Gives from before checksums were added can't be checked
+  if (verify.checked) {
+    printf("Verified with CRC32C digest %08x\n", verify.digest);
+  } else {
+    printf("Not verified: the give didn't send checksums\n");
+  }
 
-  // Swap the file name back to original
-  // This just makes sure it gets freed nicely when we free the file
-  file->name = original_name;
+  if (verbose) {
+    double megabytes = stats.bytes / 1e6;
+    printf("Wrote %zu files and %zu directories (%.1f MB) in %.3f s with %d threads\n",
+           stats.files, stats.directories, megabytes, elapsed, opts->threads);
+    printf("%.0f files/s, %.1f MB/s\n", stats.files / elapsed, megabytes / elapsed);
 
-  // Free malloc'd structures
-  free_file(file);
+    // Splicing large files takes a few more reads, which aren't counted here
+    // A resumed transfer may have had nothing left to write
+    size_t entries = stats.files + stats.directories;
+    size_t received = conn->received;
+    size_t reads = conn->reads;
+    for (size_t i = 0; stripes != NULL && i < stripes->count; i++) {
+      received += stripes->conns[i].received;
+      reads += stripes->conns[i].reads;
+    }
+    printf("Received %.1f MB in %zu socket reads, %.3f per file\n", received / 1e6, reads,
+           entries > 0 ? (double)reads / entries : 0);
+
+    // Only transfers split across connections keep a list of entries
+    arena_stats_t arena;
+    arena_totals(&arena);
+    if (arena.allocs > 0) {
+      printf("Made %zu allocations (%.1f KB) for entries, from %zu arena blocks\n", arena.allocs,
+             arena.bytes / 1e3, arena.blocks);
+    }
+    if (stripes != NULL) {
+      printf("Split across %zu connections\n", stripes->count + 1);
+    }
+    if (conn->local) {
+      printf("Connected over a local socket, copied %zu files straight from the give's disk\n",
+             stats.local);
+    }
+    if (verify.checked) {
+      printf("Checksums computed with %s\n", crc32c_impl());
+    }
+    if (uring_available()) {
+      printf("Wrote small files in batches through io_uring\n");
+    }
+  }
+  return 0;
+}
+
+void print_usage(char* prog_name) {
+  fprintf(stderr, "Usage: %s [-j THREADS] [-n CONNECTIONS] [-z] [-v] [HOST:]PORT[/NUMBER] [NAME]\n",
+          prog_name);
+  fprintf(stderr, "       %s [-j THREADS] [-z] [-v] -u [HOST:]PORT[/NUMBER] NAME\n", prog_name);
 }
 
 int main(int argc, char** argv) {
+  write_opts_t opts = {.threads = pool_default_threads()};
+  bool compress = false;
+  bool update = false;
+  bool verbose = false;
+  int connections = 1;
+
+  struct option long_options[] = {
+      {"jobs", required_argument, NULL, 'j'},
+      {"connections", required_argument, NULL, 'n'},
+      {"compress", no_argument, NULL, 'z'},
+      {"update", no_argument, NULL, 'u'},
+      {"verbose", no_argument, NULL, 'v'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:n:zuv", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'j':
+        opts.threads = atoi(optarg);
+        if (opts.threads < 1) {
+          fprintf(stderr, "Number of threads must be at least 1\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'n':
+        connections = atoi(optarg);
+        if (connections < 1 || connections > STRIPES_MAX) {
+          fprintf(stderr, "Number of connections must be between 1 and %d\n", STRIPES_MAX);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'z':
+        compress = true;
+        break;
+      case 'u':
+        update = true;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
   // Make sure there are the right number of parameters
-  if (argc != 2 && argc != 3) {
-    printf("Usage: %s [HOST:]PORT [NAME]\n", argv[0]);
+  int num_positional = argc - optind;
+  if (num_positional != 1 && num_positional != 2) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  char* connection_info = argv[optind];
+  char* save_name = num_positional == 2 ? argv[optind + 1] : NULL;
+  if (update && save_name == NULL) {
+    print_usage(argv[0]);
     exit(EXIT_FAILURE);
   }
 
@@ -84,32 +372,85 @@ int main(int argc, char** argv) {
   }
 
   // Make enough space to hold the hostname, plus some extra. The waste is tolerable
-  char hostname[strlen(argv[1]) + strlen(".cs.grinnell.edu") + 1];
+  char hostname[strlen(connection_info) + strlen(".cs.grinnell.edu") + 1];
 
-  // Attempt to parse connecting info from argv[1]
+  // Attempt to parse connecting info from the argument
   unsigned short port = 0;
-  parse_connection_info(argv[1], hostname, &port);
+  unsigned int number = 0;
+  parse_connection_info(connection_info, hostname, &port, &number);
   if (port == 0) {
     fprintf(stderr, "Failed to parse port!\n");
     exit(EXIT_FAILURE);
   }
 
-  // Attempt to connect to that socket
-  int socket_fd = socket_connect(hostname, port);
-  if (socket_fd == -1) {
-    perror("Failed to connect");
+  // Don't bother with the transfer if there's nowhere to put it
+  if (!update && save_name != NULL && access(save_name, F_OK) == 0) {
+    fprintf(stderr, "Refusing to overwrite existing file ./%s\n", save_name);
     exit(EXIT_FAILURE);
   }
 
-  // Take the file from that socket
-  // If a 3rd arg was provided, save under that name
-  if (argc == 3) {
-    take_file(socket_fd, argv[2]);
+  // When updating a copy that's already here, only the changes to it need to
+  // be sent
+  delta_sigs_t* sigs = NULL;
+  if (update && access(save_name, F_OK) == 0) {
+    sigs = delta_sign(save_name);
+    if (sigs == NULL) {
+      fprintf(stderr, "Failed to compare against existing file ./%s\n", save_name);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Transfers from this give are received next to where they'll end up, in a
+  // hidden directory named after it. Gives on a broker share its port, so
+  // their number goes in the name too.
+  char give_name[strlen("--") + strlen(hostname) + 5 + 10 + 1];
+  if (number != 0) {
+    sprintf(give_name, "%s-%u-%u", hostname, port, number);
   } else {
-    take_file(socket_fd, NULL);
+    sprintf(give_name, "%s-%u", hostname, port);
   }
+  char staging[strlen(".take-/") + strlen(give_name) + 1];
+  sprintf(staging, ".take-%s/", give_name);
+  char checkpoint[sizeof(staging) + strlen("checkpoint")];
+  sprintf(checkpoint, ".take-%s.checkpoint", give_name);
 
-  // Close the socket before we exit
-  close(socket_fd);
-  return 0;
+  // Attempt to connect to that socket, and take the file from it under the
+  // given name if there was one. If an earlier transfer couldn't be resumed
+  // after all, start over on a fresh connection.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    conn_t conn;
+    if (connect_to_give(hostname, port, &conn) == -1) {
+      perror("Failed to connect");
+      exit(EXIT_FAILURE);
+    }
+
+    // Gives that can split the contents get the other connections opened up
+    // front, each one past the handshake so none is left waiting to be
+    // accepted. Gives on this machine pass files to copy instead.
+    conn_t extra[STRIPES_MAX];
+    stripe_conns_t stripes = {.conns = extra, .count = 0};
+    bool copying = conn.local && conn.version >= PROTOCOL_LOCAL;
+    while (conn.version >= PROTOCOL_STRIPE && !copying && stripes.count + 1 < connections) {
+      if (connect_to_give(hostname, port, &extra[stripes.count]) == -1) {
+        perror("Failed to connect");
+        exit(EXIT_FAILURE);
+      }
+      stripes.count++;
+    }
+    int rc = take_file(&conn, number, save_name, staging, checkpoint, &opts, compress, update, sigs,
+                       stripes.count > 0 ? &stripes : NULL, verbose);
+
+    // Close the sockets before we exit
+    conn_free(&conn);
+    close(conn.fd);
+    for (size_t i = 0; i < stripes.count; i++) {
+      conn_free(&extra[i]);
+      close(extra[i].fd);
+    }
+    if (rc == 0) {
+      delta_free(sigs);
+      return 0;
+    }
+  }
+  exit(EXIT_FAILURE);
 }
@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include "transfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Size of the buffer used when data has to be copied through user space
+#define COPY_CHUNK_SIZE 0x10000
+
+// Size to ask for the splice pipe to be. Bigger pipes need fewer syscalls.
+#define SPLICE_PIPE_SIZE 0x100000
+
+// Pipe that received data is spliced through, created on first use. Every
+// thread has its own, since striped transfers receive on several at once.
+static _Thread_local int splice_pipe[2] = {-1, -1};
+static _Thread_local size_t splice_pipe_size = 0;
+
+int write_all(int fd, const uint8_t* buf, size_t len) {
+  size_t bytes_written = 0;
+  while (bytes_written < len) {
+    ssize_t rc = write(fd, buf + bytes_written, len - bytes_written);
+    if (rc <= 0) {
+      return -1;
+    }
+    bytes_written += rc;
+  }
+  return 0;
+}
+
+void zerocopy_init(int sock_fd, zerocopy_t* zc) {
+  zc->issued = 0;
+  zc->done = 0;
+
+  int one = 1;
+  zc->enabled = setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+/**
+ * Get how long a send on a socket may wait, as set with SO_SNDTIMEO.
+ *
+ * \param sock_fd  File descriptor of the socket
+ * \return         Milliseconds, or -1 if there is no limit
+ */
+static int send_timeout_ms(int sock_fd) {
+  struct timeval timeout;
+  socklen_t len = sizeof(timeout);
+  if (getsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, &len) == -1 ||
+      (timeout.tv_sec == 0 && timeout.tv_usec == 0)) {
+    return -1;
+  }
+  return timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
+}
+
+/**
+ * Give up on the zero-copy sends the kernel hasn't finished with. Later sends
+ * copy, and closing the socket resets the connection rather than waiting to
+ * send what's left, so the kernel lets go of the buffers right away.
+ *
+ * \param sock_fd  File descriptor of the socket
+ * \param zc       Zero-copy state of the socket
+ */
+static void zerocopy_abandon(int sock_fd, zerocopy_t* zc) {
+  zc->enabled = false;
+  zc->done = zc->issued;
+  struct linger linger = {.l_onoff = 1, .l_linger = 0};
+  setsockopt(sock_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+}
+
+/**
+ * Read completion notifications for zero-copy sends off the socket's error
+ * queue.
+ *
+ * \param sock_fd  File descriptor of the socket
+ * \param zc       Zero-copy state to update
+ * \param block    Whether to wait for at least one notification, for no longer
+ *                 than a send on the socket may take
+ * \return         0 if there were no errors, -1 otherwise. errno is set to
+ *                 ETIMEDOUT if the wait ran out, and the sends are abandoned.
+ */
+static int zerocopy_reap(int sock_fd, zerocopy_t* zc, bool block) {
+  while (zc->done != zc->issued) {
+    char control[128];
+    struct msghdr msg = {
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    if (recvmsg(sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+      }
+      if (!block) {
+        return 0;
+      }
+
+      // The error queue shows up as POLLERR once something is on it. A taker
+      // that stops reading never lets the kernel finish, so waiting is bounded
+      // like any other send.
+      struct pollfd pfd = {.fd = sock_fd, .events = 0};
+      int rc = poll(&pfd, 1, send_timeout_ms(sock_fd));
+      if (rc == 0) {
+        zerocopy_abandon(sock_fd, zc);
+        errno = ETIMEDOUT;
+        return -1;
+      } else if (rc == -1 && errno != EINTR) {
+        return -1;
+      }
+      continue;
+    }
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+        continue;
+      }
+
+      // Each notification covers the inclusive range of send ids [info, data]
+      zc->done += err->ee_data - err->ee_info + 1;
+
+      // The kernel had to copy anyway (loopback does this, for one). Pinning
+      // pages is then pure overhead, so stop asking for it.
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        zc->enabled = false;
+      }
+    }
+    block = false;
+  }
+  return 0;
+}
+
+int zerocopy_wait(int sock_fd, zerocopy_t* zc) {
+  return zerocopy_reap(sock_fd, zc, true);
+}
+
+int send_from_memory(int sock_fd, zerocopy_t* zc, const uint8_t* data, size_t len) {
+  size_t bytes_sent = 0;
+  while (bytes_sent < len) {
+    // Small or leftover pieces are not worth pinning
+    if (zc == NULL || !zc->enabled || len - bytes_sent < ZEROCOPY_MIN_SIZE) {
+      return write_all(sock_fd, data + bytes_sent, len - bytes_sent);
+    }
+
+    ssize_t rc = send(sock_fd, data + bytes_sent, len - bytes_sent, MSG_ZEROCOPY);
+    if (rc == -1 && errno == ENOBUFS) {
+      // Too many notifications are waiting to be read. Collect some, then retry
+      if (zerocopy_reap(sock_fd, zc, true) == -1) {
+        return -1;
+      }
+      continue;
+    } else if (rc <= 0) {
+      return -1;
+    }
+    bytes_sent += rc;
+    zc->issued++;
+
+    // Keep the error queue short without ever waiting on it here
+    if (zerocopy_reap(sock_fd, zc, false) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Send bytes from an open file by copying them through a buffer. Used when
+ * sendfile is not available.
+ *
+ * \param out_fd  File descriptor of the socket or file to send to
+ * \param fd      File descriptor of the file to read from
+ * \param offset  Where in the file to start, as for send_from_file
+ * \param len     Number of bytes to send
+ * \return        0 if there were no errors, -1 otherwise
+ */
+static int copy_from_file(int out_fd, int fd, off_t* offset, size_t len) {
+  uint8_t buf[COPY_CHUNK_SIZE];
+  size_t remaining = len;
+  while (remaining > 0) {
+    size_t want = remaining < sizeof(buf) ? remaining : sizeof(buf);
+    ssize_t rc = offset != NULL ? pread(fd, buf, want, *offset) : read(fd, buf, want);
+    if (rc == 0) {
+      errno = 0;
+      return -1;
+    } else if (rc < 0) {
+      return -1;
+    }
+
+    if (write_all(out_fd, buf, rc) == -1) {
+      return -1;
+    }
+    if (offset != NULL) {
+      *offset += rc;
+    }
+    remaining -= rc;
+  }
+  return 0;
+}
+
+int send_from_file(int out_fd, int fd, off_t* offset, size_t len) {
+  size_t remaining = len;
+  while (remaining > 0) {
+    ssize_t rc = sendfile(out_fd, fd, offset, remaining);
+    if (rc == -1 && (errno == EINVAL || errno == ENOSYS) && remaining == len) {
+      // This kind of file can't be used with sendfile, so copy it instead
+      return copy_from_file(out_fd, fd, offset, remaining);
+    } else if (rc == 0) {
+      errno = 0;
+      return -1;
+    } else if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    remaining -= rc;
+  }
+  return 0;
+}
+
+/**
+ * Receive bytes from a socket into an open file by copying them through a
+ * buffer. Used for small files, and when splice is not available.
+ *
+ * \param sock_fd  File descriptor of the socket to read from
+ * \param fd       File descriptor of the file to write to
+ * \param len      Number of bytes to receive
+ * \return         Same as recv_to_file
+ */
+static int copy_to_file(int sock_fd, int fd, size_t len) {
+  uint8_t buf[COPY_CHUNK_SIZE];
+  size_t remaining = len;
+  while (remaining > 0) {
+    size_t want = remaining < sizeof(buf) ? remaining : sizeof(buf);
+    ssize_t rc = read(sock_fd, buf, want);
+    if (rc == 0) {
+      errno = 0;
+      return -1;
+    } else if (rc < 0) {
+      return -1;
+    }
+
+    if (write_all(fd, buf, rc) == -1) {
+      return -2;
+    }
+    remaining -= rc;
+  }
+  return 0;
+}
+
+/**
+ * Throw away the splice pipe, so a fresh one is made next time. Used when
+ * data may have been left behind in it.
+ */
+static void splice_pipe_reset() {
+  close(splice_pipe[0]);
+  close(splice_pipe[1]);
+  splice_pipe[0] = -1;
+  splice_pipe[1] = -1;
+}
+
+void splice_pipe_close() {
+  if (splice_pipe[0] != -1) {
+    splice_pipe_reset();
+  }
+}
+
+/**
+ * Move bytes that are sitting in the splice pipe into a file.
+ *
+ * \param fd   File descriptor of the file to write to
+ * \param len  Number of bytes in the pipe
+ * \return     0 if there were no errors, -2 if writing to the file failed
+ */
+static int drain_pipe_to_file(int fd, size_t len) {
+  while (len > 0) {
+    ssize_t rc = splice(splice_pipe[0], NULL, fd, NULL, len, SPLICE_F_MOVE);
+    if (rc == -1 && errno == EINVAL) {
+      // The file can't be spliced into, so read the pipe out by hand instead
+      uint8_t buf[COPY_CHUNK_SIZE];
+      while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        rc = read(splice_pipe[0], buf, want);
+        if (rc <= 0 || write_all(fd, buf, rc) == -1) {
+          return -2;
+        }
+        len -= rc;
+      }
+      return 0;
+    } else if (rc <= 0) {
+      return -2;
+    }
+    len -= rc;
+  }
+  return 0;
+}
+
+int recv_to_file(int sock_fd, int fd, size_t len) {
+  if (len < SPLICE_MIN_SIZE) {
+    return copy_to_file(sock_fd, fd, len);
+  }
+
+  // Set up the pipe the first time it's needed
+  if (splice_pipe[0] == -1) {
+    if (pipe(splice_pipe) == -1) {
+      return copy_to_file(sock_fd, fd, len);
+    }
+    fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    splice_pipe_size = fcntl(splice_pipe[1], F_GETPIPE_SZ);
+  }
+
+  size_t remaining = len;
+  while (remaining > 0) {
+    size_t want = remaining < splice_pipe_size ? remaining : splice_pipe_size;
+    ssize_t rc = splice(sock_fd, NULL, splice_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (rc == -1 && errno == EINVAL && remaining == len) {
+      // This socket can't be spliced from, so copy it instead
+      return copy_to_file(sock_fd, fd, len);
+    } else if (rc == 0) {
+      errno = 0;
+      return -1;
+    } else if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    if (drain_pipe_to_file(fd, rc) == -2) {
+      splice_pipe_reset();
+      return -2;
+    }
+    remaining -= rc;
+  }
+  return 0;
+}
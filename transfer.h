@@ -0,0 +1,109 @@
+/**
+ * transfer.h
+ *
+ * Move file contents between sockets, memory and files on disk while copying
+ * them as little as possible. Every function falls back to a plain read/write
+ * loop when the kernel can't do better.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Buffers smaller than this are cheaper to copy than to pin for zero-copy
+#define ZEROCOPY_MIN_SIZE 0x4000
+
+// Files smaller than this are cheaper to copy than to splice through a pipe
+#define SPLICE_MIN_SIZE 0x10000
+
+// State of MSG_ZEROCOPY sends on one socket
+typedef struct {
+  bool enabled;     //< zero-copy sends are turned on for the socket
+  uint32_t issued;  //< number of zero-copy send calls made so far
+  uint32_t done;    //< number of those the kernel has reported complete
+} zerocopy_t;
+
+/**
+ * Write an entire buffer to a file descriptor, retrying short writes.
+ *
+ * \param fd   File descriptor to write to
+ * \param buf  Data to write
+ * \param len  Number of bytes to write
+ * \return     0 if everything was written, -1 otherwise
+ */
+int write_all(int fd, const uint8_t* buf, size_t len);
+
+/**
+ * Turn on zero-copy sends for a socket, if the kernel supports them.
+ *
+ * \param sock_fd  File descriptor of the socket
+ * \param zc       State to initialize. Zero-copy stays disabled on failure.
+ */
+void zerocopy_init(int sock_fd, zerocopy_t* zc);
+
+/**
+ * Wait until the kernel is done with every buffer passed to a zero-copy send,
+ * so they can safely be modified or freed. Waits no longer than a send on the
+ * socket may (its SO_SNDTIMEO). If that runs out, the sends are abandoned:
+ * zero-copy is turned off, and closing the socket resets the connection so the
+ * kernel lets go of the buffers.
+ *
+ * \param sock_fd  File descriptor of the socket
+ * \param zc       Zero-copy state of the socket
+ * \return         0 if there were no errors, -1 otherwise. errno is set to
+ *                 ETIMEDOUT if the wait ran out.
+ */
+int zerocopy_wait(int sock_fd, zerocopy_t* zc);
+
+/**
+ * Send a buffer through a socket. Large buffers are sent with MSG_ZEROCOPY so
+ * the kernel reads them in place, which means the buffer must not change until
+ * zerocopy_wait returns.
+ *
+ * \param sock_fd  File descriptor of the socket to send to
+ * \param zc       Zero-copy state of the socket, or NULL to always copy
+ * \param data     Data to send
+ * \param len      Number of bytes to send
+ * \return         0 if there were no errors, -1 otherwise
+ */
+int send_from_memory(int sock_fd, zerocopy_t* zc, const uint8_t* data, size_t len);
+
+/**
+ * Send bytes from an open file through a socket, or into another file. Uses
+ * sendfile so the data never passes through user space.
+ *
+ * \param out_fd  File descriptor of the socket or file to send to
+ * \param fd      File descriptor of the file to read from
+ * \param offset  Where in the file to start, moved past what was sent. The
+ *                file's own offset is left alone, so other threads can send
+ *                from the same file at once. NULL to start at the file's
+ *                offset and move that instead.
+ * \param len     Number of bytes to send
+ * \return        0 if there were no errors, -1 otherwise. errno is set to 0
+ *                if the file ended before len bytes were sent.
+ */
+int send_from_file(int out_fd, int fd, off_t* offset, size_t len);
+
+/**
+ * Receive bytes from a socket into an open file, starting at the file's current
+ * offset. Large amounts are spliced from the socket through a pipe into the
+ * file, so the data never passes through user space. Each thread has a pipe of
+ * its own.
+ *
+ * \param sock_fd  File descriptor of the socket to read from
+ * \param fd       File descriptor of the file to write to
+ * \param len      Number of bytes to receive
+ * \return         0 if there were no errors, -1 if the connection failed (errno
+ *                 is 0 if it closed before len bytes arrived), -2 if writing to
+ *                 the file failed
+ */
+int recv_to_file(int sock_fd, int fd, size_t len);
+
+/**
+ * Close the calling thread's splice pipe, if recv_to_file made one. Threads
+ * that receive into files call this before they exit.
+ */
+void splice_pipe_close();
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Entries of the submission queue. Each file takes up to three.
+#define URING_ENTRIES (URING_MAX_FILES * 4)
+
+// Steps of the chain of requests for one file
+typedef enum {
+  STEP_OPEN,   //< open into the file's slot, or stat
+  STEP_DATA,   //< read or write the contents
+  STEP_CLOSE,  //< close the slot
+  NUM_STEPS
+} step_t;
+
+struct uring {
+  int fd;
+  pid_t pid;    //< process that set it up. A forked child sets up its own.
+  bool broken;  //< a call failed in a way that leaves the queues unknown
+
+  void* queues;  //< mapping of both queues
+  size_t queues_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned pending;  //< requests filled out but not submitted yet
+
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static bool available = false;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+/**
+ * Tear down a ring and free it.
+ */
+static void uring_destroy(void* arg) {
+  uring_t* ring = (uring_t*)arg;
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->queues != NULL) {
+    munmap(ring->queues, ring->queues_size);
+  }
+  close(ring->fd);
+  free(ring);
+}
+
+/**
+ * Check that the kernel supports every operation used here. Opening straight
+ * into a slot of the ring came in along with linkat, so that stands in for it.
+ *
+ * \param fd  File descriptor of a ring
+ * \return    true if everything is supported
+ */
+static bool supports_ops(int fd) {
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, size);
+  if (probe == NULL) {
+    return false;
+  }
+  bool supported = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  uint8_t needed[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                      IORING_OP_WRITE,  IORING_OP_CLOSE, IORING_OP_LINKAT};
+  for (size_t i = 0; i < sizeof(needed) && supported; i++) {
+    supported =
+        needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return supported;
+}
+
+/**
+ * Set up a ring, with an empty slot for every file it can have in flight.
+ *
+ * \return  The new ring, or NULL if io_uring can't be used
+ */
+static uring_t* uring_create() {
+  uring_t* ring = calloc(1, sizeof(uring_t));
+  if (ring == NULL) {
+    return NULL;
+  }
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+  if (ring->fd == -1) {
+    free(ring);
+    return NULL;
+  }
+  ring->pid = getpid();
+
+  // Both queues share one mapping on every kernel new enough to be used here
+  ring->queues_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > ring->queues_size) {
+    ring->queues_size = cq_size;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ||
+      !supports_ops(ring->fd)) {
+    uring_destroy(ring);
+    return NULL;
+  }
+  ring->queues = mmap(NULL, ring->queues_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->queues == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    ring->queues = ring->queues == MAP_FAILED ? NULL : ring->queues;
+    ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+    uring_destroy(ring);
+    return NULL;
+  }
+
+  uint8_t* queues = ring->queues;
+  ring->sq_tail = (unsigned*)(queues + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(queues + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(queues + params.sq_off.array);
+  ring->cq_head = (unsigned*)(queues + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(queues + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(queues + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(queues + params.cq_off.cqes);
+
+  // Files are opened straight into these slots, so they never get a file
+  // descriptor of their own
+  int slots[URING_MAX_FILES];
+  for (size_t i = 0; i < URING_MAX_FILES; i++) {
+    slots[i] = -1;
+  }
+  if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES, slots, URING_MAX_FILES) ==
+      -1) {
+    uring_destroy(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+/**
+ * Set up a ring to see whether it works, for uring_available.
+ */
+static void probe_uring() {
+  uring_t* ring = uring_create();
+  if (ring != NULL) {
+    available = true;
+    uring_destroy(ring);
+  }
+}
+
+bool uring_available() {
+  pthread_once(&probe_once, probe_uring);
+  return available;
+}
+
+/**
+ * Create the key each thread's ring is kept under, for uring_thread.
+ */
+static void create_key() {
+  pthread_key_create(&ring_key, uring_destroy);
+}
+
+uring_t* uring_thread() {
+  if (!uring_available()) {
+    return NULL;
+  }
+  pthread_once(&key_once, create_key);
+  uring_t* ring = pthread_getspecific(ring_key);
+
+  // A ring inherited across fork is still in use by the parent, so the child
+  // only lets go of its own references to it
+  if (ring != NULL && ring->pid != getpid()) {
+    uring_destroy(ring);
+    ring = NULL;
+  }
+  if (ring != NULL && ring->broken) {
+    return NULL;
+  }
+  if (ring == NULL) {
+    ring = uring_create();
+    if (ring != NULL && pthread_setspecific(ring_key, ring) != 0) {
+      uring_destroy(ring);
+      ring = NULL;
+    }
+  }
+  return ring;
+}
+
+/**
+ * Fill out the next request of the submission queue.
+ *
+ * \param ring    Ring to queue it on
+ * \param opcode  Operation to do
+ * \param file    Index of the file in its batch
+ * \param step    Step of the file's chain this is
+ * \return        The zeroed request, with its opcode and user data set
+ */
+static struct io_uring_sqe* queue_request(uring_t* ring, uint8_t opcode, size_t file,
+                                          step_t step) {
+  unsigned index = (*ring->sq_tail + ring->pending) & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = file * NUM_STEPS + step;
+  ring->sq_array[index] = index;
+  ring->pending++;
+  return sqe;
+}
+
+/**
+ * Submit every queued request and wait for all of them to complete.
+ *
+ * \param ring     Ring to submit on
+ * \param results  Set to the result of each request, by its user data
+ * \return         0 if everything completed, even with errors. -1 if the ring
+ *                 failed, and is marked broken.
+ */
+static int run_requests(uring_t* ring, int* results) {
+  unsigned count = ring->pending;
+  if (ring->broken) {
+    ring->pending = 0;
+    errno = EIO;
+    return -1;
+  }
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+  ring->pending = 0;
+
+  unsigned to_submit = count;
+  unsigned done = 0;
+  while (done < count) {
+    // The kernel only waits if it managed to submit everything, so this never
+    // waits for more than are in flight
+    long submitted = syscall(SYS_io_uring_enter, ring->fd, to_submit, count - done,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      ring->broken = true;
+      return -1;
+    }
+    if (submitted > 0) {
+      to_submit -= submitted;
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      results[cqe->user_data] = cqe->res;
+      done++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+int uring_stat(uring_t* ring, int dir, uring_file_t* files, size_t count) {
+  struct statx stats[URING_MAX_FILES];
+  for (size_t i = 0; i < count; i++) {
+    struct io_uring_sqe* sqe = queue_request(ring, IORING_OP_STATX, i, STEP_OPEN);
+    sqe->fd = dir;
+    sqe->addr = (uintptr_t)files[i].path;
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_BLOCKS;
+    sqe->off = (uintptr_t)&stats[i];
+  }
+
+  int results[URING_MAX_FILES * NUM_STEPS];
+  if (run_requests(ring, results) == -1) {
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    int rc = results[i * NUM_STEPS + STEP_OPEN];
+    files[i].error = rc < 0 ? -rc : S_ISREG(stats[i].stx_mode) ? 0 : EINVAL;
+    if (files[i].error == 0) {
+      files[i].size = stats[i].stx_size;
+      files[i].mode = stats[i].stx_mode;
+      files[i].blocks = stats[i].stx_blocks;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Open, read or write, and close a batch of files. The requests for each file
+ * are hard linked, so the slot is closed whatever happens before.
+ *
+ * \param write  Whether to create and write the files, rather than read them
+ */
+static int run_files(uring_t* ring, int dir, uring_file_t* files, size_t count, bool write) {
+  for (size_t i = 0; i < count; i++) {
+    struct io_uring_sqe* sqe = queue_request(ring, IORING_OP_OPENAT, i, STEP_OPEN);
+    sqe->fd = dir;
+    sqe->addr = (uintptr_t)files[i].path;
+    // Slots never become file descriptors, so they don't take O_CLOEXEC
+    sqe->open_flags = write ? O_WRONLY | O_CREAT | O_EXCL : O_RDONLY;
+    sqe->len = write ? files[i].mode : 0;
+    sqe->file_index = i + 1;
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = queue_request(ring, write ? IORING_OP_WRITE : IORING_OP_READ, i, STEP_DATA);
+    sqe->fd = i;
+    sqe->addr = (uintptr_t)files[i].data;
+    sqe->len = files[i].size;
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+    sqe = queue_request(ring, IORING_OP_CLOSE, i, STEP_CLOSE);
+    sqe->file_index = i + 1;
+  }
+
+  int results[URING_MAX_FILES * NUM_STEPS];
+  if (run_requests(ring, results) == -1) {
+    return -1;
+  }
+
+  // The first step to fail is the one that counts
+  for (size_t i = 0; i < count; i++) {
+    int* steps = &results[i * NUM_STEPS];
+    if (steps[STEP_OPEN] < 0) {
+      files[i].error = -steps[STEP_OPEN];
+    } else if (steps[STEP_DATA] < 0) {
+      files[i].error = -steps[STEP_DATA];
+    } else if ((size_t)steps[STEP_DATA] != files[i].size) {
+      files[i].error = EIO;
+    } else if (steps[STEP_CLOSE] < 0) {
+      files[i].error = -steps[STEP_CLOSE];
+    } else {
+      files[i].error = 0;
+    }
+  }
+  return 0;
+}
+
+int uring_read(uring_t* ring, int dir, uring_file_t* files, size_t count) {
+  return run_files(ring, dir, files, count, false);
+}
+
+int uring_write(uring_t* ring, int dir, uring_file_t* files, size_t count) {
+  return run_files(ring, dir, files, count, true);
+}
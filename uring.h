@@ -0,0 +1,88 @@
+/**
+ * uring.h
+ *
+ * Open, read or write, and close many small files at once through io_uring,
+ * set up with raw system calls. Each file is one chain of linked requests, and
+ * a whole batch of chains is in flight at a time, so the kernel overlaps them
+ * instead of waiting on each call in turn. Whether io_uring can be used is found
+ * out at runtime, and callers fall back to one file at a time when it can't.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Most files a ring has in flight at once
+#define URING_MAX_FILES 64
+
+typedef struct uring uring_t;
+
+// One file of a batch
+typedef struct {
+  const char* path;  //< path to the file, relative to the directory of the batch
+  uint8_t* data;     //< contents to write, or space to read them into
+  size_t size;       //< bytes of data, less than 4 GB
+  mode_t mode;       //< set to the mode when stat'ing, used to create it when writing
+  size_t blocks;     //< set to the 512-byte blocks it takes up on disk when stat'ing
+  int error;         //< set to 0 if everything went well, or errno of what failed
+} uring_file_t;
+
+/**
+ * Check whether io_uring can be used. Only asks the kernel the first time.
+ *
+ * \return  true if rings can be set up, and do everything this needs
+ */
+bool uring_available();
+
+/**
+ * Get the ring of the calling thread, setting it up the first time. It's torn
+ * down when the thread exits.
+ *
+ * \return  The ring, or NULL if io_uring can't be used
+ */
+uring_t* uring_thread();
+
+/**
+ * Stat a batch of files, following symbolic links. Sizes, modes and blocks are
+ * filled out for files that are regular, and others get error EINVAL.
+ *
+ * \param ring   Ring to use
+ * \param dir    Directory the paths are relative to, or AT_FDCWD
+ * \param files  Files to stat, with their paths filled out
+ * \param count  Number of files, at most URING_MAX_FILES
+ * \return       0 if the batch went through, even if some files failed. -1 if
+ *               the ring itself failed, in which case nothing is filled out.
+ */
+int uring_stat(uring_t* ring, int dir, uring_file_t* files, size_t count);
+
+/**
+ * Read the whole contents of a batch of files.
+ *
+ * \param ring   Ring to use
+ * \param dir    Directory the paths are relative to, or AT_FDCWD
+ * \param files  Files to read, with their paths, sizes and space for the data
+ *               filled out. A file that is shorter than expected gets error
+ *               EIO.
+ * \param count  Number of files, at most URING_MAX_FILES
+ * \return       0 if the batch went through, even if some files failed. -1 if
+ *               the ring itself failed.
+ */
+int uring_read(uring_t* ring, int dir, uring_file_t* files, size_t count);
+
+/**
+ * Create a batch of new files and write their contents. Like create_regular,
+ * nothing that already exists is overwritten: those files get error EEXIST.
+ *
+ * \param ring   Ring to use
+ * \param dir    Directory the paths are relative to, or AT_FDCWD
+ * \param files  Files to write, with everything but the error filled out
+ * \param count  Number of files, at most URING_MAX_FILES
+ * \return       0 if the batch went through, even if some files failed. -1 if
+ *               the ring itself failed, in which case some of the files may
+ *               have been created already.
+ */
+int uring_write(uring_t* ring, int dir, uring_file_t* files, size_t count);
@@ -20,7 +20,15 @@ char* get_shortname(char* path) {
   }
 }
 
-void parse_connection_info(char* in, char* hostname, unsigned short* port) {
+void parse_connection_info(char* in, char* hostname, unsigned short* port, unsigned int* number) {
+  // Split off the number of the give, if there is one
+  char* slash = strchr(in, '/');
+  *number = 0;
+  if (slash != NULL) {
+    *slash = '\0';
+    *number = strtoul(slash + 1, NULL, 10);
+  }
+
   // Determine if there is a : in the input string
 
   // Hold up to two substrings - to the hostname, and to the port
@@ -64,3 +72,9 @@ char* get_username() {
 
   return pw->pw_name;
 }
+
+double seconds_since(struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
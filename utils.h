@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <time.h>
+
 /**
  * Shorten a pathname to just the name of a file.
  * Essentially turns "/path/to/file" into "file".
@@ -16,15 +18,18 @@
 char* get_shortname(char* path);
 
 /**
- * Parse connection info in the form server:port or port.
+ * Parse connection info in the form server:port or port, optionally followed by
+ * /number for a give hosted by a broker.
  *
  * \param in        Input string. Assumed to have the form server:port or port,
  *                  where port is an unsigned short integer value.
  * \param hostname  Output pointer to hostname. Must have enough space to hold
  *                  hostname, either "localhost" or whatever the user inputs
  * \param port      Output pointer to connection port.
+ * \param number    Output pointer to the number of the give, or 0 if there was
+ *                  none.
  */
-void parse_connection_info(char* in, char* hostname, unsigned short* port);
+void parse_connection_info(char* in, char* hostname, unsigned short* port, unsigned int* number);
 
 /**
  * Determine the username from the euid of the running process.
@@ -32,3 +37,11 @@ void parse_connection_info(char* in, char* hostname, unsigned short* port);
  * \return Pointer to username if it exists, or NULL if it does not.
  */
 char* get_username();
+
+/**
+ * Get the time elapsed since a starting point.
+ *
+ * \param start  Starting point, from clock_gettime with CLOCK_MONOTONIC
+ * \return       Seconds elapsed
+ */
+double seconds_since(struct timespec* start);